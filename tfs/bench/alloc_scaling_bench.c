@@ -0,0 +1,74 @@
+#include "fs/state.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ROUNDS 20000
+#define BATCH 8
+
+/**
+   This benchmark measures block and i-node allocations per second with 1 to
+   16 threads. Each round a thread takes BATCH blocks and an i-node one at a
+   time and gives them back, so that with per-thread magazines almost no
+   round touches the global maps.
+ */
+
+static double elapsed_s(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *alloc_and_free(void *arg) {
+    int rounds = *(int *)arg;
+    int blocks[BATCH];
+
+    for (int i = 0; i < rounds; i++) {
+        for (int j = 0; j < BATCH; j++) {
+            blocks[j] = data_block_alloc();
+            assert(blocks[j] != -1);
+        }
+        int inumber = inode_create(T_FILE);
+        assert(inumber != -1);
+        for (int j = 0; j < BATCH; j++) {
+            assert(data_block_free(blocks[j]) == 0);
+        }
+        assert(inode_delete(inumber) == 0);
+    }
+    return NULL;
+}
+
+static void bench_threads(int threads) {
+    pthread_t tid[16];
+    int rounds = ROUNDS / threads;
+
+    tfs_params_t params;
+    state_default_params(&params);
+    params.data_blocks = 16 * 1024;
+    params.inode_table_size = 4096;
+    assert(state_init(&params) != -1);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; i++) {
+        assert(pthread_create(&tid[i], NULL, alloc_and_free, &rounds) == 0);
+    }
+    for (int i = 0; i < threads; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("%2d threads: %10.0f allocations/s\n", threads,
+           rounds * threads * (BATCH + 1) / elapsed_s(&start, &end));
+
+    state_destroy();
+}
+
+int main() {
+    int threads[] = {1, 2, 4, 8, 16};
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        bench_threads(threads[i]);
+    }
+    return 0;
+}
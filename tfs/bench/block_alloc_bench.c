@@ -0,0 +1,64 @@
+#include "fs/state.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ROUNDS 20000
+
+/**
+   This benchmark measures the cost of data_block_alloc() when the volume is
+   10%, 50% and 95% full. The volume is first filled completely and then a
+   random subset of the blocks is freed, so the free blocks are scattered the
+   way they would be on a volume in use.
+ */
+
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) * 1e9 +
+           (double)(end->tv_nsec - start->tv_nsec);
+}
+
+static void bench_fill_level(int percent) {
+    static int blocks[DATA_BLOCKS];
+    int taken = DATA_BLOCKS * percent / 100;
+
+    assert(state_init(NULL) != -1);
+
+    /* Fill the whole volume, then free random blocks until 'taken' remain */
+    for (int i = 0; i < DATA_BLOCKS; i++) {
+        blocks[i] = data_block_alloc();
+        assert(blocks[i] != -1);
+    }
+    for (int i = DATA_BLOCKS - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        int tmp = blocks[i];
+        blocks[i] = blocks[j];
+        blocks[j] = tmp;
+    }
+    for (int i = taken; i < DATA_BLOCKS; i++) {
+        assert(data_block_free(blocks[i]) == 0);
+    }
+
+    /* Each round takes one block and gives it back, keeping the fill level */
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < ROUNDS; i++) {
+        int b = data_block_alloc();
+        assert(b != -1);
+        assert(data_block_free(b) == 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("%3d%% full: %8.0f ns per alloc+free\n", percent,
+           elapsed_ns(&start, &end) / ROUNDS);
+
+    state_destroy();
+}
+
+int main() {
+    srand(0);
+    bench_fill_level(10);
+    bench_fill_level(50);
+    bench_fill_level(95);
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HOT_FILES (64)
+#define HOT_SIZE (16 * BLOCK_SIZE)
+#define SCAN_BLOCKS (4 * BLOCK_CACHE_SLOTS)
+#define SCAN_CHUNK (2 * BLOCK_CACHE_SLOTS)
+#define HOT_PASSES (4)
+#define ROUNDS (8)
+
+/**
+   This benchmark reads a hot set of small files a few times over, then
+   scans on through a file four times the default block cache size, twice
+   the default cache size at a time, round after round, on an image through
+   the io_uring device. For several cache sizes it reports the share of
+   block accesses served from the cache and the throughput of the hot
+   reads (block accesses of the hot reads only): the hot set is far smaller
+   than the volume, and scans should not push it out.
+ */
+
+static double elapsed_s(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void read_file(char const *path, char *buffer, size_t len) {
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    while (tfs_read(f, buffer, len) > 0) {
+    }
+    assert(tfs_close(f) != -1);
+}
+
+static void read_hot_set(char *buffer) {
+    char path[32];
+    for (int i = 0; i < HOT_FILES; i++) {
+        snprintf(path, sizeof(path), "/hot%d", i);
+        read_file(path, buffer, BLOCK_SIZE);
+    }
+}
+
+static void bench(size_t cache_blocks) {
+    static char buffer[HOT_SIZE];
+    char const *image = "tfs_block_cache_bench.img";
+    char path[32];
+
+    unlink(image);
+    tfs_params_t params = tfs_default_params();
+    params.image_path = image;
+    params.device = TFS_DEVICE_URING;
+    params.data_blocks = SCAN_BLOCKS + HOT_FILES * HOT_SIZE / BLOCK_SIZE + 64;
+    params.inode_table_size = HOT_FILES + 2;
+    params.cache_blocks = cache_blocks;
+    params.read_ahead = false;
+    assert(tfs_init_params(&params) != -1);
+
+    for (int i = 0; i < HOT_FILES; i++) {
+        snprintf(path, sizeof(path), "/hot%d", i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, buffer, HOT_SIZE) == HOT_SIZE);
+        assert(tfs_close(f) != -1);
+    }
+    int f = tfs_open("/scan", TFS_O_CREAT);
+    assert(f != -1);
+    for (int i = 0; i < SCAN_BLOCKS; i++) {
+        assert(tfs_write(f, buffer, BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    assert(tfs_close(f) != -1);
+
+    double hot_s = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    int scan = tfs_open("/scan", 0);
+    assert(scan != -1);
+    for (int round = 0; round < ROUNDS; round++) {
+        struct timespec start, end;
+        block_cache_stats_t before, after;
+        block_cache_stats(&before);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int pass = 0; pass < HOT_PASSES; pass++) {
+            read_hot_set(buffer);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        block_cache_stats(&after);
+        hot_s += elapsed_s(&start, &end);
+        hits += after.bc_hits - before.bc_hits;
+        misses += after.bc_misses - before.bc_misses;
+        evictions += after.bc_evictions - before.bc_evictions;
+
+        off_t from = (off_t)round * SCAN_CHUNK % SCAN_BLOCKS * BLOCK_SIZE;
+        assert(tfs_lseek(scan, from, SEEK_SET) == from);
+        for (int i = 0; i < SCAN_CHUNK * BLOCK_SIZE / HOT_SIZE; i++) {
+            assert(tfs_read(scan, buffer, HOT_SIZE) == HOT_SIZE);
+        }
+    }
+    assert(tfs_close(scan) != -1);
+
+    printf("%5zu blocks: hot hit rate %5.1f%%  hot evictions %6lu  hot reads "
+           "%8.1f MB/s\n",
+           cache_blocks, 100.0 * (double)hits / (double)(hits + misses),
+           (unsigned long)evictions,
+           (double)ROUNDS * HOT_PASSES * HOT_FILES * HOT_SIZE / (1 << 20) /
+               hot_s);
+
+    assert(tfs_destroy() != -1);
+    unlink(image);
+}
+
+int main() {
+    size_t sizes[] = {512, 1024, 2048, 4096};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        bench(sizes[i]);
+    }
+    return 0;
+}
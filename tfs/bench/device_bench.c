@@ -0,0 +1,90 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FILE_BLOCKS (4 * BLOCK_CACHE_SLOTS)
+#define WRITE_SIZE (64 * BLOCK_SIZE)
+#define READ_SIZE (4 * BLOCK_SIZE)
+
+/**
+   This benchmark runs the same workload on each block device: it writes a
+   file four times the size of the block cache, then scans it (cold) in
+   small reads, without and with read-ahead, reporting the throughput of
+   each. Every device but RAM stores the volume in an image file.
+ */
+
+static double elapsed_s(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static double mb_per_s(struct timespec *start, struct timespec *end) {
+    return (double)FILE_BLOCKS * BLOCK_SIZE / (1 << 20) /
+           elapsed_s(start, end);
+}
+
+/* Writes the file and scans it on a new volume, returning the throughput
+ * of each */
+static void run(tfs_device_t device, bool read_ahead, double *write,
+                double *read) {
+    static char buffer[WRITE_SIZE];
+    char const *image =
+        device == TFS_DEVICE_RAM ? NULL : "tfs_device_bench.img";
+    if (image != NULL) {
+        unlink(image);
+    }
+    tfs_params_t params = tfs_default_params();
+    params.image_path = image;
+    params.device = device;
+    params.data_blocks = FILE_BLOCKS + 64;
+    params.read_ahead = read_ahead;
+    assert(tfs_init_params(&params) != -1);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    for (int i = 0; i < FILE_BLOCKS * BLOCK_SIZE / WRITE_SIZE; i++) {
+        assert(tfs_write(f, buffer, WRITE_SIZE) == WRITE_SIZE);
+    }
+    assert(tfs_close(f) != -1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *write = mb_per_s(&start, &end);
+
+    /* The last blocks written have turned the cache over, so the scan
+     * starts cold */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    f = tfs_open("/f", 0);
+    assert(f != -1);
+    ssize_t r;
+    while ((r = tfs_read(f, buffer, READ_SIZE)) > 0) {
+    }
+    assert(r == 0);
+    assert(tfs_close(f) != -1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *read = mb_per_s(&start, &end);
+
+    assert(tfs_destroy() != -1);
+    if (image != NULL) {
+        unlink(image);
+    }
+}
+
+static void bench(char const *name, tfs_device_t device) {
+    double write, read, read_ahead;
+    run(device, false, &write, &read);
+    run(device, true, &write, &read_ahead);
+    printf("%-7s write %8.1f MB/s  read %8.1f MB/s  read-ahead %8.1f MB/s\n",
+           name, write, read, read_ahead);
+}
+
+int main() {
+    bench("ram", TFS_DEVICE_RAM);
+    bench("file", TFS_DEVICE_FILE);
+    bench("direct", TFS_DEVICE_DIRECT);
+    bench("uring", TFS_DEVICE_URING);
+    return 0;
+}
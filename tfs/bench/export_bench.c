@@ -0,0 +1,57 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define FILE_SIZE (256 << 20)
+#define BLOCK (4096)
+
+/**
+   This benchmark exports a 256 MiB file with tfs_copy_to_external_fs, from
+   a volume in memory and from one backed by an image (where the kernel
+   copies it), and reports the throughput of each.
+ */
+
+static double elapsed_s(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void bench(char const *name, char const *image) {
+    static char chunk[1 << 20];
+    tfs_params_t params = tfs_default_params();
+    params.image_path = image;
+    params.block_size = BLOCK;
+    params.data_blocks = FILE_SIZE / BLOCK + 16;
+    if (image != NULL) {
+        unlink(image);
+    }
+    assert(tfs_init_params(&params) != -1);
+
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    for (size_t done = 0; done < FILE_SIZE; done += sizeof(chunk)) {
+        assert(tfs_write(f, chunk, sizeof(chunk)) == sizeof(chunk));
+    }
+    assert(tfs_close(f) != -1);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    assert(tfs_copy_to_external_fs("/f", "export_bench.out") != -1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%-7s %8.1f MB/s\n", name,
+           (double)FILE_SIZE / (1 << 20) / elapsed_s(&start, &end));
+
+    unlink("export_bench.out");
+    assert(tfs_destroy() != -1);
+    if (image != NULL) {
+        unlink(image);
+    }
+}
+
+int main() {
+    bench("memory", NULL);
+    bench("image", "export_bench.img");
+    return 0;
+}
@@ -0,0 +1,110 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SYNCS 2000
+#define RECORD 100
+#define MAX_SESSIONS 20
+
+/**
+   This benchmark has 1, 8 and 20 threads (as the server's sessions would)
+   each append RECORD bytes to its own file on a volume image, with
+   write-back, and call tfs_fsync after every append, with and without
+   group commit. It reports the fsyncs per second, their mean and 99th
+   percentile latency, and how many fsyncs shared each device flush.
+ */
+
+static double latency[SYNCS];
+
+typedef struct {
+    int session;
+    int rounds;
+} session_t;
+
+static double elapsed_us(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) * 1e6 +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static int compare_doubles(void const *a, void const *b) {
+    double x = *(double const *)a;
+    double y = *(double const *)b;
+    return (x > y) - (x < y);
+}
+
+static void *append_and_sync(void *arg) {
+    session_t const *session = arg;
+    char path[16];
+    static char record[RECORD];
+    snprintf(path, sizeof(path), "/log%d", session->session);
+
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_APPEND);
+    assert(f != -1);
+    for (int i = 0; i < session->rounds; i++) {
+        assert(tfs_write(f, record, RECORD) == RECORD);
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        assert(tfs_fsync(f) == 0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        latency[session->session * session->rounds + i] =
+            elapsed_us(&start, &end);
+    }
+    assert(tfs_close(f) != -1);
+    return NULL;
+}
+
+static void run(int sessions, bool group_commit) {
+    pthread_t tid[MAX_SESSIONS];
+    session_t args[MAX_SESSIONS];
+    char const *image = "tfs_fsync_bench.img";
+    unlink(image);
+    tfs_params_t params = tfs_default_params();
+    params.image_path = image;
+    params.write_back = true;
+    assert(tfs_init_params(&params) != -1);
+    journal_set_group_commit(group_commit);
+
+    int rounds = SYNCS / sessions;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < sessions; i++) {
+        args[i] = (session_t){i, rounds};
+        assert(pthread_create(&tid[i], NULL, append_and_sync, &args[i]) == 0);
+    }
+    for (int i = 0; i < sessions; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    sync_stats_t stats;
+    state_sync_stats(&stats);
+    int count = rounds * sessions;
+    double total = 0;
+    for (int i = 0; i < count; i++) {
+        total += latency[i];
+    }
+    qsort(latency, (size_t)count, sizeof(latency[0]), compare_doubles);
+    printf("%2d sessions, group commit %-3s: %8.0f fsyncs/s  mean %8.1f us  "
+           "p99 %8.1f us  %5.2f fsyncs/flush\n",
+           sessions, group_commit ? "on" : "off",
+           count / elapsed_us(&start, &end) * 1e6, total / count,
+           latency[count * 99 / 100],
+           (double)stats.ss_requests / (double)stats.ss_syncs);
+
+    journal_set_group_commit(true);
+    assert(tfs_destroy() != -1);
+    unlink(image);
+}
+
+int main() {
+    int sessions[] = {1, 8, 20};
+    for (size_t i = 0; i < sizeof(sessions) / sizeof(sessions[0]); i++) {
+        run(sessions[i], false);
+        run(sessions[i], true);
+    }
+    return 0;
+}
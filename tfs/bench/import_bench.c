@@ -0,0 +1,86 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define FILES 2000
+#define FILE_SIZE 2000
+
+/**
+   This benchmark loads a tree of 2000 small files from the external fs
+   into a volume image, one tfs_open and tfs_write per file (each made
+   durable on its own) and with tfs_copy_tree_from_external_fs (whose
+   metadata is committed in batches), and reports the files loaded per
+   second each way.
+ */
+
+static char const *tree = "import_bench_tree";
+
+static double elapsed_s(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void mount_empty() {
+    tfs_params_t params = tfs_default_params();
+    params.image_path = "import_bench.img";
+    params.data_blocks = 2 * FILES * (FILE_SIZE / BLOCK_SIZE + 1);
+    params.inode_table_size = FILES + 2;
+    params.journal_blocks = 1024;
+    unlink(params.image_path);
+    assert(tfs_init_params(&params) != -1);
+}
+
+static void load_each(char const *data) {
+    char path[64];
+    assert(tfs_mkdir("/tree") != -1);
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "/tree/f%d", i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, data, FILE_SIZE) == FILE_SIZE);
+        assert(tfs_close(f) != -1);
+    }
+}
+
+static void load_tree(char const *data) {
+    (void)data;
+    assert(tfs_copy_tree_from_external_fs(tree, "/tree") != -1);
+}
+
+static void bench(char const *name, void (*load)(char const *),
+                  char const *data) {
+    mount_empty();
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    load(data);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%-10s %8.0f files/s\n", name, FILES / elapsed_s(&start, &end));
+    assert(tfs_destroy() != -1);
+    unlink("import_bench.img");
+}
+
+int main() {
+    static char data[FILE_SIZE];
+    char path[64];
+
+    assert(mkdir(tree, 0700) == 0);
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "%s/f%d", tree, i);
+        FILE *fp = fopen(path, "w");
+        assert(fp != NULL);
+        assert(fwrite(data, 1, FILE_SIZE, fp) == FILE_SIZE);
+        assert(fclose(fp) != -1);
+    }
+
+    bench("each", load_each, data);
+    bench("tree", load_tree, data);
+
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "%s/f%d", tree, i);
+        unlink(path);
+    }
+    rmdir(tree);
+    return 0;
+}
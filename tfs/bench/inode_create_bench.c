@@ -0,0 +1,40 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define INODES (1 << 20)
+#define STEP (INODES / 8)
+
+/**
+   This benchmark fills an in-memory i-node table of a million entries and
+   reports the i-node creation rate for each eighth of it, which should stay
+   flat as the table fills up.
+ */
+
+static double elapsed_s(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main() {
+    tfs_params_t params = tfs_default_params();
+    params.inode_table_size = INODES + 1;
+    assert(tfs_init_params(&params) != -1);
+
+    /* The root directory takes one more i-node */
+    for (int filled = 1; filled < INODES; filled += STEP) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < STEP; i++) {
+            assert(inode_create(T_FILE) != -1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("%8d -> %8d i-nodes: %10.0f creates/s\n", filled,
+               filled + STEP, STEP / elapsed_s(&start, &end));
+    }
+
+    assert(tfs_destroy() != -1);
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define CREATES 400
+
+/**
+   This benchmark measures file creations per second on a volume image with
+   1, 4 and 16 threads, with and without group commit. Each creation (a new
+   i-node plus its directory entry) is one journal transaction, and so is the
+   removal that follows it, which keeps the directory from filling up.
+ */
+
+static char const *image = "journal_bench.img";
+
+static double elapsed_s(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *create_files(void *arg) {
+    int creates = *(int *)arg;
+    char name[MAX_FILE_NAME];
+    snprintf(name, sizeof(name), "t%lu", (unsigned long)pthread_self());
+
+    for (int i = 0; i < creates; i++) {
+        journal_begin();
+        int inum = inode_create(T_FILE);
+        assert(inum != -1);
+        assert(add_dir_entry(ROOT_DIR_INUM, inum, name) != -1);
+        assert(journal_commit() != -1);
+
+        journal_begin();
+        assert(clear_dir_entry(ROOT_DIR_INUM, name) != -1);
+        assert(inode_delete(inum) != -1);
+        assert(journal_commit() != -1);
+    }
+    return NULL;
+}
+
+static void bench_threads(int threads, bool group_commit) {
+    pthread_t tid[16];
+    int creates = CREATES / threads;
+
+    unlink(image);
+    assert(tfs_init_image(image) != -1);
+    journal_set_group_commit(group_commit);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; i++) {
+        assert(pthread_create(&tid[i], NULL, create_files, &creates) == 0);
+    }
+    for (int i = 0; i < threads; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("%2d threads, group commit %-3s: %8.0f creates/s\n", threads,
+           group_commit ? "on" : "off",
+           creates * threads / elapsed_s(&start, &end));
+
+    assert(tfs_destroy() != -1);
+    unlink(image);
+}
+
+int main() {
+    int threads[] = {1, 4, 16};
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        bench_threads(threads[i], false);
+        bench_threads(threads[i], true);
+    }
+    return 0;
+}
@@ -0,0 +1,64 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ROUNDS 200000
+
+/**
+   This benchmark measures open/close pairs per second on one file with 1 to
+   16 threads, which only meet in the open file table (and the dentry cache,
+   which they only read).
+ */
+
+static double elapsed_s(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *open_and_close(void *arg) {
+    int rounds = *(int *)arg;
+    for (int i = 0; i < rounds; i++) {
+        int f = tfs_open("/f", 0);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    return NULL;
+}
+
+static void bench_threads(int threads) {
+    pthread_t tid[16];
+    int rounds = ROUNDS / threads;
+
+    tfs_params_t params = tfs_default_params();
+    params.max_open_files = 1024;
+    assert(tfs_init_params(&params) != -1);
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; i++) {
+        assert(pthread_create(&tid[i], NULL, open_and_close, &rounds) == 0);
+    }
+    for (int i = 0; i < threads; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("%2d threads: %10.0f open/close pairs/s\n", threads,
+           rounds * threads / elapsed_s(&start, &end));
+
+    assert(tfs_destroy() != -1);
+}
+
+int main() {
+    int threads[] = {1, 2, 4, 8, 16};
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        bench_threads(threads[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define ROUNDS 2000
+#define MAX_DEPTH 32
+
+/**
+   This benchmark measures tfs_open + tfs_close latency of a file by the
+   depth of its path, with a cold dentry cache (emptied before every open,
+   so every directory is walked) and a warm one.
+ */
+
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) * 1e9 +
+           (double)(end->tv_nsec - start->tv_nsec);
+}
+
+static double bench_open(char const *path, bool cold) {
+    struct timespec start, end;
+    double total = 0;
+    for (int i = 0; i < ROUNDS; i++) {
+        if (cold) {
+            dentry_cache_clear();
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int f = tfs_open(path, 0);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        total += elapsed_ns(&start, &end);
+    }
+    return total / ROUNDS;
+}
+
+int main() {
+    tfs_params_t params = tfs_default_params();
+    params.inode_table_size = 2 * MAX_DEPTH;
+    params.data_blocks = 4 * MAX_DEPTH;
+    assert(tfs_init_params(&params) != -1);
+
+    char path[MAX_DEPTH * 3 + 3] = "";
+    printf("depth   cold ns   warm ns\n");
+    for (int depth = 1; depth <= MAX_DEPTH; depth *= 2) {
+        /* Extends the directory chain to depth - 1 directories */
+        while (strlen(path) / 3 < (size_t)depth - 1) {
+            strcat(path, "/dd");
+            assert(tfs_mkdir(path) != -1);
+        }
+        char file[sizeof(path) + 2];
+        snprintf(file, sizeof(file), "%s/f", path);
+        int f = tfs_open(file, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+
+        double cold = bench_open(file, true);
+        double warm = bench_open(file, false);
+        printf("%5d %9.0f %9.0f\n", depth, cold, warm);
+    }
+
+    assert(tfs_destroy() != -1);
+    return 0;
+}
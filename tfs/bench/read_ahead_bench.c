@@ -0,0 +1,62 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define FILE_BLOCKS (4 * BLOCK_CACHE_SLOTS)
+#define READ_SIZE (4 * BLOCK_SIZE)
+#define CONSUME_NS (20 * 1000)
+
+/**
+   This benchmark scans a file four times the size of the block cache (so
+   every scan starts cold), under the emulated storage delay, with and
+   without read-ahead, and reports the scan throughput of each. After each
+   read the reader blocks for CONSUME_NS, as when passing the data on to a
+   socket or pipe: that is the time read-ahead can overlap with.
+ */
+
+static double elapsed_s(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void bench(bool read_ahead) {
+    static char buffer[READ_SIZE];
+    tfs_params_t params = tfs_default_params();
+    params.data_blocks = FILE_BLOCKS + 64;
+    params.read_ahead = read_ahead;
+    assert(tfs_init_params(&params) != -1);
+
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    for (int i = 0; i < FILE_BLOCKS * BLOCK_SIZE / READ_SIZE; i++) {
+        assert(tfs_write(f, buffer, READ_SIZE) == READ_SIZE);
+    }
+    assert(tfs_close(f) != -1);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    f = tfs_open("/f", 0);
+    assert(f != -1);
+    struct timespec consume = {0, CONSUME_NS};
+    ssize_t r;
+    while ((r = tfs_read(f, buffer, READ_SIZE)) > 0) {
+        nanosleep(&consume, NULL);
+    }
+    assert(r == 0);
+    assert(tfs_close(f) != -1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("read-ahead %-3s %8.1f MB/s\n", read_ahead ? "on" : "off",
+           (double)FILE_BLOCKS * BLOCK_SIZE / (1 << 20) /
+               elapsed_s(&start, &end));
+
+    assert(tfs_destroy() != -1);
+}
+
+int main() {
+    bench(false);
+    bench(true);
+    return 0;
+}
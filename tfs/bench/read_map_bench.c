@@ -0,0 +1,97 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FILE_SIZE (64 << 20)
+#define READ_SIZE (1 << 20)
+#define PASSES 8
+
+/**
+   This benchmark scans a 64 MiB file, summing its bytes, with tfs_read into
+   a buffer and with tfs_read_map straight from block memory, and reports
+   the throughput of each.
+ */
+
+static double elapsed_s(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static uint64_t sum(void const *data, size_t len) {
+    uint64_t total = 0;
+    for (size_t i = 0; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, (char const *)data + i, sizeof(word));
+        total += word;
+    }
+    return total;
+}
+
+static uint64_t scan_read() {
+    static char buffer[READ_SIZE];
+    uint64_t total = 0;
+    int f = tfs_open("/f", 0);
+    assert(f != -1);
+    ssize_t r;
+    while ((r = tfs_read(f, buffer, READ_SIZE)) > 0) {
+        total += sum(buffer, (size_t)r);
+    }
+    assert(tfs_close(f) != -1);
+    return total;
+}
+
+static uint64_t scan_map() {
+    uint64_t total = 0;
+    int f = tfs_open("/f", 0);
+    assert(f != -1);
+    tfs_map_t map;
+    while (tfs_read_map(f, READ_SIZE, &map) > 0) {
+        for (size_t i = 0; i < map.tm_count; i++) {
+            total += sum(map.tm_segments[i].ts_data, map.tm_segments[i].ts_len);
+        }
+        assert(tfs_read_unmap(&map) == 0);
+    }
+    assert(tfs_read_unmap(&map) == 0);
+    assert(tfs_close(f) != -1);
+    return total;
+}
+
+static void bench(char const *name, uint64_t (*scan)(), uint64_t expected) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int p = 0; p < PASSES; p++) {
+        assert(scan() == expected);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%-13s %8.1f MB/s\n", name,
+           (double)PASSES * FILE_SIZE / (1 << 20) / elapsed_s(&start, &end));
+}
+
+int main() {
+    tfs_params_t params = tfs_default_params();
+    params.block_size = 4096;
+    params.data_blocks = 2 * FILE_SIZE / 4096;
+    assert(tfs_init_params(&params) != -1);
+
+    char *data = malloc(FILE_SIZE);
+    assert(data != NULL);
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        data[i] = (char)(i * 7);
+    }
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, data, FILE_SIZE) == FILE_SIZE);
+    assert(tfs_close(f) != -1);
+    uint64_t expected = sum(data, FILE_SIZE);
+    free(data);
+
+    bench("tfs_read", scan_read, expected);
+    bench("tfs_read_map", scan_map, expected);
+
+    assert(tfs_destroy() != -1);
+    return 0;
+}
@@ -0,0 +1,106 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define FILE_SIZE (1 << 20)
+#define READ_SIZE 4096
+#define PASSES 64
+
+/**
+   This benchmark measures the read throughput of 1 to 16 threads reading
+   one file, each through a handle of its own and all through one shared
+   handle (where each read takes the next part of the file).
+ */
+
+static int shared = -1;
+
+static double elapsed_s(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *read_file(void *arg) {
+    int passes = *(int *)arg;
+    static _Thread_local char buffer[READ_SIZE];
+
+    for (int p = 0; p < passes; p++) {
+        int f = shared;
+        if (f == -1) {
+            f = tfs_open("/f", 0);
+            assert(f != -1);
+        }
+        for (int i = 0; i < FILE_SIZE / READ_SIZE; i++) {
+            assert(tfs_read(f, buffer, READ_SIZE) != -1);
+        }
+        if (shared == -1) {
+            assert(tfs_close(f) != -1);
+        }
+    }
+    return NULL;
+}
+
+static void bench_threads(int threads, bool shared_handle) {
+    pthread_t tid[16];
+    int passes = PASSES / threads;
+
+    if (shared_handle) {
+        /* Enough file for every pass of every thread */
+        shared = tfs_open("/f", TFS_O_APPEND);
+        assert(shared != -1);
+        for (int p = 1; p < PASSES; p++) {
+            int f = tfs_open("/f", 0);
+            static char chunk[FILE_SIZE];
+            assert(tfs_read(f, chunk, FILE_SIZE) == FILE_SIZE);
+            assert(tfs_write(shared, chunk, FILE_SIZE) == FILE_SIZE);
+            assert(tfs_close(f) != -1);
+        }
+        assert(tfs_close(shared) != -1);
+        shared = tfs_open("/f", 0);
+        assert(shared != -1);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; i++) {
+        assert(pthread_create(&tid[i], NULL, read_file, &passes) == 0);
+    }
+    for (int i = 0; i < threads; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("%2d threads, %-7s handles: %8.1f MB/s\n", threads,
+           shared_handle ? "shared" : "own",
+           (double)passes * threads * FILE_SIZE / (1 << 20) /
+               elapsed_s(&start, &end));
+
+    if (shared_handle) {
+        assert(tfs_close(shared) != -1);
+        shared = -1;
+    }
+}
+
+int main() {
+    static char data[FILE_SIZE];
+    int threads[] = {1, 2, 4, 8, 16};
+
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        for (int shared_handle = 0; shared_handle < 2; shared_handle++) {
+            tfs_params_t params = tfs_default_params();
+            params.data_blocks = 2 * PASSES * FILE_SIZE / BLOCK_SIZE;
+            params.max_open_files = 64;
+            assert(tfs_init_params(&params) != -1);
+            int f = tfs_open("/f", TFS_O_CREAT);
+            assert(f != -1);
+            assert(tfs_write(f, data, FILE_SIZE) == FILE_SIZE);
+            assert(tfs_close(f) != -1);
+
+            bench_threads(threads[i], shared_handle);
+            assert(tfs_destroy() != -1);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define APPENDS 2000
+#define APPEND_SIZE 100
+
+/**
+   This benchmark appends APPEND_SIZE bytes at a time to a file on a volume
+   image, with each block device that stores one, written through and with
+   write-back, and reports the mean and 99th percentile latency of an
+   append, then the time tfs_fsync takes to make the file durable.
+ */
+
+static double elapsed_us(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) * 1e6 +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static int compare_doubles(void const *a, void const *b) {
+    double x = *(double const *)a;
+    double y = *(double const *)b;
+    return (x > y) - (x < y);
+}
+
+static void run(char const *name, tfs_device_t device, bool write_back) {
+    static double latency[APPENDS];
+    static char buffer[APPEND_SIZE];
+    char const *image = "tfs_write_back_bench.img";
+    unlink(image);
+    tfs_params_t params = tfs_default_params();
+    params.image_path = image;
+    params.device = device;
+    params.write_back = write_back;
+    assert(tfs_init_params(&params) != -1);
+
+    int f = tfs_open("/log", TFS_O_CREAT | TFS_O_APPEND);
+    assert(f != -1);
+    double total = 0;
+    for (int i = 0; i < APPENDS; i++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        assert(tfs_write(f, buffer, APPEND_SIZE) == APPEND_SIZE);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        latency[i] = elapsed_us(&start, &end);
+        total += latency[i];
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    assert(tfs_fsync(f) != -1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assert(tfs_close(f) != -1);
+
+    qsort(latency, APPENDS, sizeof(latency[0]), compare_doubles);
+    printf("%-7s %-13s append mean %9.1f us  p99 %9.1f us  fsync %9.1f us\n",
+           name, write_back ? "write-back" : "write-through", total / APPENDS,
+           latency[APPENDS * 99 / 100], elapsed_us(&start, &end));
+
+    assert(tfs_destroy() != -1);
+    unlink(image);
+}
+
+int main() {
+    char const *names[] = {"file", "direct", "uring"};
+    tfs_device_t devices[] = {TFS_DEVICE_FILE, TFS_DEVICE_DIRECT,
+                              TFS_DEVICE_URING};
+    for (size_t i = 0; i < sizeof(devices) / sizeof(devices[0]); i++) {
+        run(names[i], devices[i], false);
+        run(names[i], devices[i], true);
+    }
+    return 0;
+}
@@ -3,67 +3,194 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <pthread.h>
+#include <dirent.h>
+#include <sys/mman.h>
 
-int tfs_init() {
-    state_init();
+static pthread_mutex_t destroy_lock;
+static pthread_cond_t destroy_cond;
 
-    /* create root inode */
-    int root = inode_create(T_DIRECTORY);
-    if (root != ROOT_DIR_INUM) {
+tfs_params_t tfs_default_params() {
+    tfs_params_t params;
+    state_default_params(&params);
+    return params;
+}
+
+int tfs_init() { return tfs_init_params(NULL); }
+
+int tfs_init_image(char const *image_path) {
+    tfs_params_t params = tfs_default_params();
+    params.image_path = image_path;
+    return tfs_init_params(&params);
+}
+
+int tfs_init_params(tfs_params_t const *params) {
+    int format = state_init(params);
+    if (format == -1) {
         return -1;
     }
 
+    if (pthread_mutex_init(&destroy_lock, NULL) != 0 ||
+        pthread_cond_init(&destroy_cond, NULL) != 0) {
+        state_destroy();
+        return -1;
+    }
+
+    if (format) {
+        /* create root inode */
+        journal_begin();
+        int root = inode_create(T_DIRECTORY);
+        if (journal_commit() == -1 || root != ROOT_DIR_INUM) {
+            state_destroy();
+            return -1;
+        }
+    }
+
     return 0;
 }
 
 int tfs_destroy() {
     state_destroy();
+    if (pthread_mutex_destroy(&destroy_lock) != 0 ||
+        pthread_cond_destroy(&destroy_cond) != 0) {
+        return -1;
+    }
     return 0;
 }
 
+int tfs_destroy_after_all_closed() {
+    if (pthread_mutex_lock(&destroy_lock) != 0) {
+        return -1;
+    }
+    set_state_closing();
+    while (get_open_files_number() != 0) {
+        pthread_cond_wait(&destroy_cond, &destroy_lock);
+    }
+    if (pthread_mutex_unlock(&destroy_lock) != 0) {
+        return -1;
+    }
+
+    return tfs_destroy();
+}
+
+/*
+ * Wakes up tfs_destroy_after_all_closed once the last file is closed. Only
+ * takes destroy_lock while closing, so opens and closes do not contend on it
+ */
+static void destroy_wake() {
+    if (state_closing_status() && get_open_files_number() == 0) {
+        pthread_mutex_lock(&destroy_lock);
+        pthread_cond_broadcast(&destroy_cond);
+        pthread_mutex_unlock(&destroy_lock);
+    }
+}
+
 static bool valid_pathname(char const *name) {
     return name != NULL && strlen(name) > 1 && name[0] == '/';
 }
 
 
-int tfs_lookup(char const *name) {
-    if (!valid_pathname(name)) {
+/*
+ * Walks a path down to the directory holding its last component, one
+ * directory at a time (each step usually served by the dentry cache).
+ * Input:
+ *  - path: absolute path name
+ *  - name: filled with the last component
+ * Returns the inumber of the parent directory, or -1 if the path is invalid
+ * (empty or too long components) or a directory along it does not exist
+ */
+static int tfs_walk_parent(char const *path, char name[MAX_FILE_NAME]) {
+    if (!valid_pathname(path)) {
         return -1;
     }
 
-    // skip the initial '/' character
-    name++;
+    int parent = ROOT_DIR_INUM;
+    char const *component = path + 1;
+    for (;;) {
+        char const *end = strchr(component, '/');
+        size_t len = end == NULL ? strlen(component) : (size_t)(end - component);
+        if (len == 0 || len > MAX_FILE_NAME - 1) {
+            return -1;
+        }
+        memcpy(name, component, len);
+        name[len] = '\0';
+        if (end == NULL) {
+            return parent;
+        }
+        parent = find_in_dir(parent, name);
+        if (parent == -1) {
+            return -1;
+        }
+        component = end + 1;
+    }
+}
 
-    return find_in_dir(ROOT_DIR_INUM, name);
+int tfs_lookup(char const *name) {
+    char last[MAX_FILE_NAME];
+    int parent = tfs_walk_parent(name, last);
+    if (parent == -1) {
+        return -1;
+    }
+    return find_in_dir(parent, last);
 }
 
-int tfs_open(char const *name, int flags) {
+int tfs_mkdir(char const *path) {
+    char name[MAX_FILE_NAME];
+    journal_begin();
+    int parent = tfs_walk_parent(path, name);
+    int ret = -1;
+    if (parent != -1 && find_in_dir(parent, name) == -1) {
+        int inum = inode_create(T_DIRECTORY);
+        if (inum != -1) {
+            if (add_dir_entry(parent, inum, name) == -1) {
+                inode_delete(inum);
+            } else {
+                ret = 0;
+            }
+        }
+    }
+    if (journal_commit() == -1) {
+        return -1;
+    }
+    return ret;
+}
+
+/*
+ * Opens a file (see tfs_open), inside the caller's journal transaction
+ */
+static int tfs_open_logged(char const *name, int flags) {
     int inum;
     size_t offset;
     int append_flag = 0;
+    char last[MAX_FILE_NAME];
 
-    /* Checks if the path name is valid */
-    if (!valid_pathname(name)) {
+    /* Finds the directory the file is in */
+    int parent = tfs_walk_parent(name, last);
+    if (parent == -1) {
         return -1;
     }
 
-    inum = tfs_lookup(name);
+    inum = find_in_dir(parent, last);
     if (inum >= 0) {
         /* The file already exists */
         pthread_rwlock_wrlock(inode_lock_get(inum));   
         inode_t *inode = inode_get(inum);
-        if (inode == NULL) {
+        if (inode == NULL || inode->i_node_type != T_FILE) {
+            pthread_rwlock_unlock(inode_lock_get(inum));
             return -1;
         }
-        /* Trucate (if requested) */
+        /* Trucate (if requested), once no read mapping pins the blocks */
         if (flags & TFS_O_TRUNC) {
             if (inode->i_size > 0) {
-                if (inode_datablocks_erase(*inode) == -1) {
+                range_lock_t whole;
+                inode_range_lock(inum, &whole, 0, SIZE_MAX, true);
+                int erased = inode_datablocks_erase(inode);
+                inode_range_unlock(inum, &whole);
+                if (erased == -1) {
                     pthread_rwlock_unlock(inode_lock_get(inum));
                     return -1;
                 }
-                inode->i_size = 0;
             }
         }
         /* Determine initial offset */
@@ -77,14 +204,14 @@ int tfs_open(char const *name, int flags) {
         /* The file doesn't exist; the flags specify that it should be created*/
         /* Create inode */
         inum = inode_create(T_FILE);
-        pthread_rwlock_wrlock(inode_lock_get(inum));
         if (inum == -1) {
             return -1;
         }
-        /* Add entry in the root directory */
-        if (add_dir_entry(ROOT_DIR_INUM, inum, name + 1) == -1) {
-            inode_delete(inum);
+        pthread_rwlock_wrlock(inode_lock_get(inum));
+        /* Add entry in the parent directory */
+        if (add_dir_entry(parent, inum, last) == -1) {
             pthread_rwlock_unlock(inode_lock_get(inum));
+            inode_delete(inum);
             return -1;
         }
         offset = 0;
@@ -94,243 +221,999 @@ int tfs_open(char const *name, int flags) {
     pthread_rwlock_unlock(inode_lock_get(inum));
     /* Finally, add entry to the open file table and
      * return the corresponding handle */
-    return add_to_open_file_table(inum, offset, append_flag);
+    int fhandle = add_to_open_file_table(inum, offset, append_flag);
+    if (fhandle == -1) {
+        /* A refused open may have counted itself as the last one */
+        destroy_wake();
+    }
+    return fhandle;
 
     /* Note: for simplification, if file was created with TFS_O_CREAT and there
      * is an error adding an entry to the open file table, the file is not
      * opened but it remains created */
 }
 
+int tfs_open(char const *name, int flags) {
+    /* Creating or truncating the file is made durable before it is used */
+    journal_begin();
+    int fhandle = tfs_open_logged(name, flags);
+    if (journal_commit() == -1 && fhandle != -1) {
+        tfs_close(fhandle);
+        return -1;
+    }
+    return fhandle;
+}
 
-int tfs_close(int fhandle) { return remove_from_open_file_table(fhandle); }
 
-ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
-    /* Get the open file entry */
-    open_file_entry_t *file = get_open_file_entry(fhandle);
-    if (file == NULL) {
+int tfs_close(int fhandle) {
+    if (remove_from_open_file_table(fhandle) == -1) {
         return -1;
     }
 
-    /* Checking if the amount to write is valid */
-    if ((int)to_write < 0){
+    /* The data written is on its way to the device, without waiting */
+    writeback_kick();
+    destroy_wake();
+    return 0;
+}
+
+int tfs_fsync(int fhandle) {
+    if (get_open_file_entry(fhandle) == NULL) {
         return -1;
     }
+    return state_sync();
+}
 
-    /* From the open file table entry, we get the inode */
-    inode_t *inode = inode_get(file->of_inumber);
-    if (inode == NULL) {
+int tfs_syncfs() { return state_sync(); }
+
+/*
+ * Copies bytes between a list of buffers and a file's data blocks, one
+ * contiguous run of blocks at a time, with a memcpy for each buffer the run
+ * spans. The range must be mapped, or, for a file keeping its bytes inline,
+ * within INODE_INLINE_SIZE (bytes copied there are made durable when the
+ * i-node is logged).
+ * Input:
+ *  - inode: the file's i-node
+ *  - offset: position in the file where the copy starts
+ *  - iov, iovcnt: the buffers to copy from or to, in order
+ *  - len: number of bytes to copy, at most the buffers' total length
+ *  - to_file: true to copy from the buffers into the file, false otherwise
+ * Returns the number of bytes copied
+ */
+static size_t inode_data_copyv(inode_t const *inode, size_t offset,
+                               struct iovec const *iov, int iovcnt,
+                               size_t len, bool to_file) {
+    size_t copied = 0;
+    int v = 0;
+    size_t in_v = 0;
+    bool in_inode = inode_inline(inode);
+    while (copied < len) {
+        char *data;
+        size_t in_block;
+        size_t in_run;
+        if (in_inode) {
+            /* A tiny file's bytes are all in its i-node */
+            if (offset >= INODE_INLINE_SIZE) {
+                break;
+            }
+            data = (char *)inode->i_inline;
+            in_block = offset;
+            in_run = INODE_INLINE_SIZE - offset;
+            if (in_run > len - copied) {
+                in_run = len - copied;
+            }
+        } else {
+            /* Getting the run of blocks that holds the current offset */
+            extent_t run;
+            if (inode_extent_lookup(inode, block_index(offset), &run) == -1) {
+                break;
+            }
+            in_block = block_offset(offset);
+            in_run = (size_t)run.e_length * fs_geometry.g_block_size - in_block;
+            if (in_run > len - copied) {
+                in_run = len - copied;
+            }
+            /* Blocks stay in the cache while copied, and those written
+             * until marked written */
+            size_t blocks = blocks_for(in_block + in_run);
+            data = data_blocks_pin(run.e_start, blocks);
+            if (data == NULL) {
+                break;
+            }
+        }
+        for (size_t done = 0; done < in_run;) {
+            /* Skipping the buffers used up (or empty) */
+            while (v < iovcnt && in_v == iov[v].iov_len) {
+                v++;
+                in_v = 0;
+            }
+            size_t n = iov[v].iov_len - in_v;
+            if (n > in_run - done) {
+                n = in_run - done;
+            }
+            char *buffer = (char *)iov[v].iov_base + in_v;
+            if (to_file) {
+                memcpy(data + in_block + done, buffer, n);
+            } else {
+                memcpy(buffer, data + in_block + done, n);
+            }
+            done += n;
+            in_v += n;
+        }
+        if (!in_inode) {
+            int persisted =
+                to_file ? data_blocks_persist(data + in_block, in_run) : 0;
+            data_blocks_unpin(data + in_block, in_run);
+            if (persisted == -1) {
+                break;
+            }
+        }
+        copied += in_run;
+        offset += in_run;
+    }
+    return copied;
+}
+
+/*
+ * Copies bytes between a buffer and a file's data blocks, as
+ * inode_data_copyv with a single buffer
+ */
+static size_t inode_data_copy(inode_t const *inode, size_t offset,
+                              void *buffer, size_t len, bool to_file) {
+    struct iovec v = {.iov_base = buffer, .iov_len = len};
+    return inode_data_copyv(inode, offset, &v, 1, len, to_file);
+}
+
+/*
+ * Total length of a list of buffers
+ * Returns 0 if successful, -1 if the list or the total are invalid (more
+ * than SSIZE_MAX bytes)
+ */
+static int iovec_total(struct iovec const *iov, int iovcnt, size_t *total) {
+    if (iovcnt < 0 || (iovcnt > 0 && iov == NULL)) {
         return -1;
     }
+    *total = 0;
+    for (int v = 0; v < iovcnt; v++) {
+        if (iov[v].iov_len > SSIZE_MAX - *total) {
+            return -1;
+        }
+        *total += iov[v].iov_len;
+    }
+    return 0;
+}
 
-    /* 
-    Ensuring we write in the end of the file if it was opened with the TSF_O_APPEND 
-    flag, in case another thread also opened the file with different flag
-    */
-    if (file->of_append_flag == 1){
-        file->of_offset = inode->i_size;
+/*
+ * Range of whole blocks covering [offset, offset + len), which is what
+ * writers to the same file must not share
+ */
+static void block_range(size_t offset, size_t len, size_t *start,
+                        size_t *end) {
+    *start = offset - block_offset(offset);
+    *end = blocks_for(offset + len) * fs_geometry.g_block_size;
+}
+
+/*
+ * Writes to a file in place, with the i-node's lock held shared and the
+ * blocks written locked exclusive, so writers to other parts of the file
+ * (and readers of them) carry on. The range must be mapped and within the
+ * file's size.
+ * Returns the number of bytes written
+ */
+static size_t tfs_write_in_place(int inumber, inode_t const *inode,
+                                 size_t offset, struct iovec const *iov,
+                                 int iovcnt, size_t to_write) {
+    range_lock_t range;
+    size_t start, end;
+    block_range(offset, to_write, &start, &end);
+    inode_range_lock(inumber, &range, start, end, true);
+    size_t writen =
+        inode_data_copyv(inode, offset, iov, iovcnt, to_write, true);
+    inode_range_unlock(inumber, &range);
+    return writen;
+}
+
+/*
+ * Maps the blocks a file needs to hold its first 'end' bytes, unless it can
+ * keep them in its i-node. A file outgrowing its i-node moves the bytes it
+ * kept there to its first block.
+ * Must be called with the i-node's lock held exclusive.
+ * Returns 0 if successful, -1 otherwise (as inode_grow; the file keeps its
+ * bytes in the i-node if no block could be mapped)
+ */
+static int inode_make_room(inode_t *inode, size_t end) {
+    if (!inode_inline(inode)) {
+        return inode_grow(inode, blocks_for(end));
+    }
+    if (end <= INODE_INLINE_SIZE) {
+        return 0;
     }
 
-    /* Locking the inode */
-    pthread_rwlock_t *lock = inode_lock_get(file->of_inumber);
-    pthread_rwlock_wrlock(lock);
+    /* The extents take the place of the bytes, which reach the first block
+     * before the rest are mapped (which may be committed in pieces) */
+    char kept[INODE_INLINE_SIZE];
+    memcpy(kept, inode->i_inline, inode->i_size);
+    if (inode_grow(inode, 1) == -1) {
+        memcpy(inode->i_inline, kept, inode->i_size);
+        return -1;
+    }
+    if (inode_data_copy(inode, 0, kept, inode->i_size, true) != inode->i_size) {
+        return -1;
+    }
+    return inode_grow(inode, blocks_for(end));
+}
+
+/*
+ * Writes to a file at the given offset, the common part of tfs_write,
+ * tfs_writev and tfs_pwrite: a single hold of the i-node's lock and a single
+ * walk of its blocks, however many buffers the contents come in
+ * Input:
+ *  - inumber: the file's i-number
+ *  - inode: the file's i-node
+ *  - offset: where the write starts; past the bytes written on return (at
+ *    the end of the file they were appended to, in append mode)
+ *  - append: true to write at the end of the file instead
+ *  - iov, iovcnt, to_write: the buffers holding the contents to write and
+ *    their total length
+ * Returns the number of bytes written, or -1 in case of error
+ */
+static ssize_t inode_write(int inumber, inode_t *inode, size_t *offset,
+                           bool append, struct iovec const *iov, int iovcnt,
+                           size_t to_write) {
+    pthread_rwlock_t *lock = inode_lock_get(inumber);
 
-    size_t writen = 0;
-    /* Getting the index of the inode data blocks to start writing */
-    int index = ((int)file->of_offset)/BLOCK_SIZE;
-
-    for(; index < DIRECT_BLOCKS_QUANTITY && writen < to_write; index++){
-        /* Checking the remaining space to write in the block */
-        size_t to_write_in_block = BLOCK_SIZE - (file->of_offset%BLOCK_SIZE);
-        if(to_write_in_block > to_write - writen)
-            to_write_in_block = to_write - writen;
-        /* Allocing and writing in the block */
-        if (inode->i_data_block[index] == -1) {
-            inode->i_data_block[index] = data_block_alloc();
-        }
-        void *block = data_block_get(inode->i_data_block[index]);
-        if (block == NULL) {
-            /* Return how much we have already written in case of error*/
+    /* A write that neither moves the end of the file nor needs new blocks
+     * only takes the i-node's lock shared */
+    if (!append) {
+        pthread_rwlock_rdlock(lock);
+        /* Bytes kept in the i-node are logged with it, under the exclusive
+         * lock */
+        if (*offset + to_write <= inode->i_size && !inode_inline(inode)) {
+            size_t writen = tfs_write_in_place(inumber, inode, *offset, iov,
+                                               iovcnt, to_write);
+            *offset += writen;
             pthread_rwlock_unlock(lock);
             return (ssize_t)writen;
         }
-        memcpy(block + file->of_offset%BLOCK_SIZE, buffer + writen, to_write_in_block);
-        /* Updating offset and how much we have already writen*/
-        writen += to_write_in_block;
-        file->of_offset += writen;
+        pthread_rwlock_unlock(lock);
     }
 
-    /* Getting the index block */
-    int *index_block = data_block_get(inode->i_index_block);
-    if (index_block == NULL) {
-        pthread_rwlock_unlock(lock);
-        return -1;
+    /* Locking the inode */
+    pthread_rwlock_wrlock(lock);
+
+    /* 
+    Ensuring we write in the end of the file if it was opened with the TSF_O_APPEND 
+    flag, in case another thread also opened the file with different flag
+    */
+    if (append) {
+        *offset = inode->i_size;
     }
 
-    /* Updating index for indirect blocks */
-    if (index > DIRECT_BLOCKS_QUANTITY){
-        index -= DIRECT_BLOCKS_QUANTITY;
-    } else {
-        index = 0;
+    if (to_write == 0) {
+        pthread_rwlock_unlock(lock);
+        return 0;
     }
 
-    for(; index < BLOCK_SIZE/sizeof(int) && writen < to_write; index++){
-        /* Checking the remaining space to write in the block */
-        size_t to_write_in_block = BLOCK_SIZE - (file->of_offset%BLOCK_SIZE);
-        if(to_write_in_block > to_write - writen)
-            to_write_in_block = to_write - writen;
-        /* Allocing and writing in the block */
-        if (index_block[index] == -1) {
-            index_block[index] = data_block_alloc();
+    journal_begin();
+
+    /* Mapping every missing block of the write in a single allocation; if
+     * the volume fills up, the write is cut short at the last mapped block */
+    size_t end = *offset + to_write;
+    if (inode_make_room(inode, end) == -1) {
+        if (inode->i_blocks * fs_geometry.g_block_size <= *offset) {
+            journal_commit();
+            pthread_rwlock_unlock(lock);
+            return -1;
         }
-        void *block = data_block_get(index_block[index]);
-        if (block == NULL) {
-            /* Return how much we have already written in case of error*/
+        to_write = inode->i_blocks * fs_geometry.g_block_size - *offset;
+    }
+
+    /* A write past the end of the file (after a seek or at an explicit
+     * offset) leaves a gap that reads as zeroes; if it cannot be zeroed, the
+     * file keeps its size and nothing is written */
+    static char const zeroes[1024];
+    for (size_t gap = inode->i_size; gap < *offset;) {
+        size_t len = *offset - gap < sizeof(zeroes) ? *offset - gap
+                                                    : sizeof(zeroes);
+        size_t zeroed = inode_data_copy(inode, gap, (void *)zeroes, len, true);
+        if (zeroed == 0) {
+            journal_commit();
             pthread_rwlock_unlock(lock);
-            return (ssize_t)writen;
+            return -1;
         }
-        memcpy(block + file->of_offset%BLOCK_SIZE, buffer + writen, to_write_in_block);
-        /* Updating offset and how much we have already writen*/
-        writen += to_write_in_block;
-        file->of_offset += writen;
+        gap += zeroed;
     }
 
+    size_t writen =
+        inode_data_copyv(inode, *offset, iov, iovcnt, to_write, true);
+    *offset += writen;
+
     /* If we wrote a bigger file than what was previously written update the size */
-    if (inode->i_size < file->of_offset){
-        inode->i_size = file->of_offset;
+    if (inode->i_size < *offset) {
+        inode->i_size = *offset;
     }
+    journal_log(inode, sizeof(*inode));
+
+    /* Making the new data and size durable before anyone else can see them */
+    int ret = journal_commit();
 
     /* Unlocking the inode*/
     pthread_rwlock_unlock(lock);
-    return (ssize_t)writen;
+    return ret == -1 ? -1 : (ssize_t)writen;
+}
+
+ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
+    struct iovec v = {.iov_base = (void *)buffer, .iov_len = to_write};
+    return tfs_writev(fhandle, &v, 1);
+}
+
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt) {
+    /* Get the open file entry */
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    /* Checking if the amount to write is valid */
+    size_t to_write;
+    if (iovec_total(iov, iovcnt, &to_write) == -1) {
+        return -1;
+    }
+
+    /* From the open file table entry, we get the inode */
+    inode_t *inode = inode_get(file->of_inumber);
+    if (inode == NULL) {
+        return -1;
+    }
+
+    /* Writes through the same handle go one at a time, each moving the
+     * offset past its bytes */
+    pthread_mutex_lock(&file->of_lock);
+    size_t offset = atomic_load(&file->of_offset);
+    ssize_t writen = inode_write(file->of_inumber, inode, &offset,
+                                 file->of_append_flag == 1, iov, iovcnt,
+                                 to_write);
+    atomic_store(&file->of_offset, offset);
+    pthread_mutex_unlock(&file->of_lock);
+    return writen;
+}
+
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t to_write,
+                   off_t offset) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+    if (to_write > SSIZE_MAX || offset < 0) {
+        return -1;
+    }
+    inode_t *inode = inode_get(file->of_inumber);
+    if (inode == NULL) {
+        return -1;
+    }
+
+    /* The handle's offset and append mode are left alone */
+    size_t at = (size_t)offset;
+    struct iovec v = {.iov_base = (void *)buffer, .iov_len = to_write};
+    return inode_write(file->of_inumber, inode, &at, false, &v, 1, to_write);
+}
+
+/*
+ * Reads from a file at the given offset, with the i-node's lock held shared
+ * Input:
+ *  - inumber: the file's i-number
+ *  - inode: the file's i-node
+ *  - from: where the read starts, at most the file's size
+ *  - iov, iovcnt: the buffers to copy the contents to
+ *  - to_read: how many bytes, within the file's size and the buffers' total
+ *    length
+ * Returns the number of bytes read
+ */
+static size_t inode_read(int inumber, inode_t const *inode, size_t from,
+                         struct iovec const *iov, int iovcnt,
+                         size_t to_read) {
+    /* The blocks read are locked shared against writers in place */
+    range_lock_t range;
+    size_t start, end;
+    block_range(from, to_read, &start, &end);
+    inode_range_lock(inumber, &range, start, end, false);
+    size_t read = inode_data_copyv(inode, from, iov, iovcnt, to_read, false);
+    inode_range_unlock(inumber, &range);
+    return read;
+}
+
+/*
+ * Reserves bytes to read through a handle by moving its offset past them,
+ * so that reads through the same handle take consecutive parts of the file
+ * without serializing. An offset past the end (the file may have been
+ * truncated through another handle) reads from the end.
+ * Must be called with the i-node's lock held.
+ * Input:
+ *  - file: the handle's entry
+ *  - inode: the file's i-node
+ *  - len: how many bytes the read wants
+ *  - from: where the bytes reserved start
+ * Returns how many bytes were reserved
+ */
+static size_t offset_reserve(open_file_entry_t *file, inode_t const *inode,
+                             size_t len, size_t *from) {
+    size_t offset = atomic_load(&file->of_offset);
+    size_t to_read;
+    do {
+        *from = offset < inode->i_size ? offset : inode->i_size;
+        to_read = inode->i_size - *from;
+        if (len < to_read) {
+            to_read = len;
+        }
+    } while (!atomic_compare_exchange_weak(&file->of_offset, &offset,
+                                           *from + to_read));
+    return to_read;
 }
 
+/*
+ * Detects sequential reads through a handle and keeps the blocks ahead of
+ * them being fetched in the background. The first read that starts where
+ * the last one ended opens a window of READ_AHEAD_MIN blocks past it; each
+ * time the reader gets within half a window of the end of the blocks asked
+ * for, the window doubles (up to READ_AHEAD_MAX) and the blocks up to its
+ * end are asked for. A read elsewhere closes the window.
+ * Must be called with the i-node's lock held.
+ * Input:
+ *  - file: the handle's entry
+ *  - inode: the file's i-node
+ *  - from, len: the bytes just reserved for a read
+ */
+static void read_ahead(open_file_entry_t *file, inode_t const *inode,
+                       size_t from, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    size_t expected = atomic_exchange(&file->of_ra_next, from + len);
+    if (from != expected) {
+        atomic_store(&file->of_ra_window, 0);
+        atomic_store(&file->of_ra_end, 0);
+        return;
+    }
+
+    size_t next = blocks_for(from + len);
+    size_t window = atomic_load(&file->of_ra_window);
+    size_t asked = atomic_load(&file->of_ra_end);
+    if (window != 0 && asked > next + window / 2) {
+        return;
+    }
+    window = window == 0 ? READ_AHEAD_MIN : 2 * window;
+    if (window > READ_AHEAD_MAX) {
+        window = READ_AHEAD_MAX;
+    }
+    atomic_store(&file->of_ra_window, window);
+
+    size_t first = asked > next ? asked : next;
+    size_t end = next + window;
+    if (end > blocks_for(inode->i_size)) {
+        end = blocks_for(inode->i_size);
+    }
+    if (first < end) {
+        atomic_store(&file->of_ra_end, end);
+        inode_read_ahead(file->of_inumber, first, end - first);
+    }
+}
 
 ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+    struct iovec v = {.iov_base = buffer, .iov_len = len};
+    return tfs_readv(fhandle, &v, 1);
+}
+
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt) {
     /* Getting the file entry */
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) {
         return -1;
     }
 
+    /* Getting the length of the buffers */
+    size_t len;
+    if (iovec_total(iov, iovcnt, &len) == -1) {
+        return -1;
+    }
+
     /* Getting the inode*/
     inode_t *inode = inode_get(file->of_inumber);
     if (inode == NULL) {
         return -1;
     }
 
-    /* Locking the inode*/
+    /* Locking the inode shared: the size and the blocks stay put */
     pthread_rwlock_t *lock = inode_lock_get(file->of_inumber);
-    pthread_rwlock_wrlock(lock);
+    pthread_rwlock_rdlock(lock);
 
-    /* Ensuring we are not reading stuff off the file */
-    if (inode->i_size < file->of_offset){
-        file->of_offset = inode->i_size;
-    }
+    size_t from;
+    size_t to_read = offset_reserve(file, inode, len, &from);
+    read_ahead(file, inode, from, to_read);
+    size_t read =
+        inode_read(file->of_inumber, inode, from, iov, iovcnt, to_read);
+
+    /* Unlocking the inode and returning how much we have read */
+    pthread_rwlock_unlock(lock);
+    return (ssize_t)read;
+}
 
-    /* Determine how many bytes to read */
-    size_t to_read = inode->i_size - file->of_offset;
-    if (len < to_read){
-        to_read = len;
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, off_t offset) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL || offset < 0) {
+        return -1;
+    }
+    inode_t *inode = inode_get(file->of_inumber);
+    if (inode == NULL) {
+        return -1;
     }
 
-    size_t read = 0;
+    pthread_rwlock_t *lock = inode_lock_get(file->of_inumber);
+    pthread_rwlock_rdlock(lock);
 
-    /* Getting the index of the inode data blocks to start reading */
-    int index = (int)file->of_offset/BLOCK_SIZE;
-
-    for(; index < DIRECT_BLOCKS_QUANTITY && read < to_read; index++){
-        /* Checking the remaining space to read in the block */
-        size_t to_read_in_block = BLOCK_SIZE - (file->of_offset%BLOCK_SIZE);
-        if(to_read_in_block > to_read-read)
-            to_read_in_block = to_read-read;
-        /* Getting and reading the data block */
-        void *block = data_block_get(inode->i_data_block[index]);
-        if (block == NULL) {
-            /* Return how much we have already written in case of error*/
-            pthread_rwlock_unlock(lock);
-            return (ssize_t)read;
+    /* Nothing to read at or past the end of the file */
+    size_t read = 0;
+    if ((size_t)offset < inode->i_size) {
+        size_t to_read = inode->i_size - (size_t)offset;
+        if (len < to_read) {
+            to_read = len;
         }
-        memcpy(buffer + read, block + file->of_offset%BLOCK_SIZE, to_read_in_block);
-        /* Updating how much we have read */
-        read += to_read_in_block;
-        file->of_offset += read;
+        struct iovec v = {.iov_base = buffer, .iov_len = to_read};
+        read = inode_read(file->of_inumber, inode, (size_t)offset, &v, 1,
+                          to_read);
     }
 
-    /* Getting the indirect block */
-    int *index_block = data_block_get(inode->i_index_block);
-    if (index_block == NULL) {
-        pthread_rwlock_unlock(lock);
+    pthread_rwlock_unlock(lock);
+    return (ssize_t)read;
+}
+
+ssize_t tfs_read_map(int fhandle, size_t len, tfs_map_t *map) {
+    map->tm_segments = NULL;
+    map->tm_count = 0;
+    map->tm_inumber = -1;
+    map->tm_inline = false;
+
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL || len > SSIZE_MAX) {
+        return -1;
+    }
+    inode_t *inode = inode_get(file->of_inumber);
+    if (inode == NULL) {
         return -1;
     }
 
-    /* Updating index for indirect blocks */
-    if (index > DIRECT_BLOCKS_QUANTITY){
-        index -= DIRECT_BLOCKS_QUANTITY;
-    } else {
-        index = 0;
-    }
-    for(; index < BLOCK_SIZE/sizeof(int) && read < to_read; index++){
-        /* Checking the remaining space to read in the block */
-        size_t to_read_in_block = BLOCK_SIZE - (file->of_offset%BLOCK_SIZE);
-        if(to_read_in_block > to_read)
-            to_read_in_block = to_read;
-        /* Getting and reading the data block */
-        void *block = data_block_get(index_block[index]);
-        if (block == NULL) {
-            /* Return how much we have already read in case of error*/
-            pthread_rwlock_unlock(lock);
-            return (ssize_t)read;
+    pthread_rwlock_t *lock = inode_lock_get(file->of_inumber);
+    pthread_rwlock_rdlock(lock);
+
+    size_t from;
+    size_t to_read = offset_reserve(file, inode, len, &from);
+    read_ahead(file, inode, from, to_read);
+
+    /* Pinning the blocks: the shared range stays held after the i-node's
+     * lock is let go, until tfs_read_unmap */
+    size_t start, end;
+    block_range(from, to_read, &start, &end);
+    map->tm_inumber = file->of_inumber;
+    inode_range_lock(map->tm_inumber, &map->tm_pin, start, end, false);
+
+    if (inode_inline(inode)) {
+        /* A tiny file's bytes are copied out of its i-node, where they do
+         * not stay put as the file grows */
+        map->tm_inline = true;
+        if (to_read > 0) {
+            map->tm_segments = malloc(sizeof(*map->tm_segments) + to_read);
+            if (map->tm_segments == NULL) {
+                to_read = 0;
+            } else {
+                char *copy = (char *)(map->tm_segments + 1);
+                memcpy(copy, inode->i_inline + from, to_read);
+                map->tm_segments[0].ts_data = copy;
+                map->tm_segments[0].ts_len = to_read;
+                map->tm_count = 1;
+            }
+        }
+        pthread_rwlock_unlock(lock);
+        return (ssize_t)to_read;
+    }
+
+    /* One segment per contiguous run of blocks, kept in the block cache
+     * until tfs_read_unmap */
+    size_t mapped = 0;
+    size_t capacity = 0;
+    while (mapped < to_read) {
+        extent_t run;
+        if (inode_extent_lookup(inode, block_index(from), &run) == -1) {
+            break;
+        }
+        size_t in_block = block_offset(from);
+        size_t in_run =
+            (size_t)run.e_length * fs_geometry.g_block_size - in_block;
+        if (in_run > to_read - mapped) {
+            in_run = to_read - mapped;
+        }
+        char *data = data_blocks_pin(run.e_start, blocks_for(in_block + in_run));
+        if (data == NULL) {
+            break;
         }
-        memcpy(buffer + read, block + file->of_offset%BLOCK_SIZE, to_read_in_block);
-        /* Updating how much we have read */
-        read += to_read_in_block;
-        file->of_offset += read;
+        if (map->tm_count == capacity) {
+            size_t grown = capacity == 0 ? 4 : 2 * capacity;
+            tfs_segment_t *segments =
+                realloc(map->tm_segments, grown * sizeof(*segments));
+            if (segments == NULL) {
+                data_blocks_unpin(data + in_block, in_run);
+                break;
+            }
+            map->tm_segments = segments;
+            capacity = grown;
+        }
+        map->tm_segments[map->tm_count].ts_data = data + in_block;
+        map->tm_segments[map->tm_count].ts_len = in_run;
+        map->tm_count++;
+        mapped += in_run;
+        from += in_run;
     }
-    /* Unlocking the inode and returning how much we have read */
+
     pthread_rwlock_unlock(lock);
-    return (ssize_t)read;
+    return (ssize_t)mapped;
+}
+
+int tfs_read_unmap(tfs_map_t *map) {
+    if (map->tm_inumber == -1) {
+        return -1;
+    }
+    inode_range_unlock(map->tm_inumber, &map->tm_pin);
+    for (size_t i = 0; i < map->tm_count && !map->tm_inline; i++) {
+        data_blocks_unpin(map->tm_segments[i].ts_data,
+                          map->tm_segments[i].ts_len);
+    }
+    free(map->tm_segments);
+    map->tm_segments = NULL;
+    map->tm_count = 0;
+    map->tm_inumber = -1;
+    return 0;
+}
+
+off_t tfs_lseek(int fhandle, off_t offset, int whence) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    /* Holding off writes through the handle, which move the offset from
+     * where they found it; reads move it with a compare-and-swap */
+    pthread_mutex_lock(&file->of_lock);
+
+    size_t base = 0;
+    if (whence == SEEK_END) {
+        inode_t *inode = inode_get(file->of_inumber);
+        if (inode == NULL) {
+            pthread_mutex_unlock(&file->of_lock);
+            return -1;
+        }
+        pthread_rwlock_t *lock = inode_lock_get(file->of_inumber);
+        pthread_rwlock_rdlock(lock);
+        base = inode->i_size;
+        pthread_rwlock_unlock(lock);
+    } else if (whence != SEEK_SET && whence != SEEK_CUR) {
+        pthread_mutex_unlock(&file->of_lock);
+        return -1;
+    }
+
+    size_t current = atomic_load(&file->of_offset);
+    off_t moved;
+    do {
+        if (whence == SEEK_CUR) {
+            base = current;
+        }
+        /* The offset may go past the end of the file, but not before its
+         * start. Negating the base rather than the offset, which may be the
+         * lowest off_t */
+        if (base > (size_t)SSIZE_MAX || offset < -(off_t)base ||
+            (offset > 0 && (size_t)offset > (size_t)SSIZE_MAX - base)) {
+            pthread_mutex_unlock(&file->of_lock);
+            return -1;
+        }
+        moved = (off_t)base + offset;
+    } while (!atomic_compare_exchange_weak(&file->of_offset, &current,
+                                           (size_t)moved));
+
+    pthread_mutex_unlock(&file->of_lock);
+    return moved;
 }
 
+/*
+ * Writes part of a file, in place in its blocks, to a file outside the FS:
+ * in the kernel if it can copy it from the image, from block memory
+ * otherwise
+ * Returns 0 if successful, -1 otherwise
+ */
+static int segment_export(tfs_segment_t const *segment, int fd) {
+    ssize_t copied = data_blocks_export(segment->ts_data, segment->ts_len, fd);
+    if (copied == -1) {
+        return -1;
+    }
+    size_t done = (size_t)copied;
+    while (done < segment->ts_len) {
+        ssize_t written = write(fd, (char const *)segment->ts_data + done,
+                                segment->ts_len - done);
+        if (written == -1) {
+            return -1;
+        }
+        done += (size_t)written;
+    }
+    return 0;
+}
 
 int tfs_copy_to_external_fs(char const *source_path, char const *dest_path){
     /* Checks if the path name is valid */
     if (tfs_lookup(source_path) < 0) {
         return -1;
     }
-    /* Getting the inumber and inode */
-    int source_inumber = tfs_open(source_path, 0);
-    if (source_inumber == -1){
+    /* Getting the file handle */
+    int source_file = tfs_open(source_path, 0);
+    if (source_file == -1){
         return -1;
     }
-    inode_t *inode = inode_get(source_inumber);
-    if (inode == NULL){
+    /* Opening the file in the external fs, dropping any old contents */
+    int dest_file =
+        open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if(dest_file < 0){
+        tfs_close(source_file);
         return -1;
     }
-    /* Getting the buffer */
-    size_t source_size = inode->i_size;
-    void *buffer = malloc(source_size);
-    /* Getting the file in the tfs */
-    ssize_t size = tfs_read(source_inumber, buffer, source_size);
-    if (size < 0) {
+
+    /* Streaming the file a block-aligned chunk at a time, each written
+     * straight from where its blocks are, so memory use stays bounded */
+    size_t chunk = EXPORT_CHUNK - EXPORT_CHUNK % fs_geometry.g_block_size;
+    if (chunk == 0) {
+        chunk = fs_geometry.g_block_size;
+    }
+    int ret = 0;
+    tfs_map_t map;
+    ssize_t mapped;
+    while ((mapped = tfs_read_map(source_file, chunk, &map)) > 0) {
+        for (size_t i = 0; i < map.tm_count && ret == 0; i++) {
+            ret = segment_export(&map.tm_segments[i], dest_file);
+        }
+        tfs_read_unmap(&map);
+        if (ret == -1) {
+            break;
+        }
+    }
+    if (mapped == 0) {
+        tfs_read_unmap(&map);
+    } else if (mapped == -1) {
+        ret = -1;
+    }
+
+    /* Close files */
+    if(tfs_close(source_file) < 0){
+        ret = -1;
+    }
+    if(close(dest_file) < 0){
+        ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * Part of a file being imported, filled by one thread
+ */
+typedef struct {
+    inode_t const *ij_inode;
+    char const *ij_data;
+    size_t ij_offset;
+    size_t ij_len;
+    size_t ij_copied;
+} import_job_t;
+
+static void *import_fill(void *arg) {
+    import_job_t *job = arg;
+    job->ij_copied =
+        inode_data_copy(job->ij_inode, job->ij_offset,
+                        (void *)(job->ij_data + job->ij_offset), job->ij_len,
+                        true);
+    return NULL;
+}
+
+/*
+ * Gives an empty file the given contents: maps all of its blocks with a
+ * single allocation and fills them in parallel, each thread a block-aligned
+ * part of at least IMPORT_CHUNK bytes.
+ * Must be called with the i-node's lock held exclusive.
+ * Input:
+ *  - inode: the file's i-node
+ *  - data, size: the contents
+ * Returns 0 if successful, -1 otherwise
+ */
+static int inode_import(inode_t *inode, char const *data, size_t size) {
+    if (size <= INODE_INLINE_SIZE) {
+        /* A tiny file's bytes go in its i-node */
+        memcpy(inode->i_inline, data, size);
+        inode->i_size = size;
+        journal_log(inode, sizeof(*inode));
+        return 0;
+    }
+    if (inode_grow(inode, blocks_for(size)) == -1) {
         return -1;
     }
-    /* Writing the file in the external fs*/
-    int dest_file = open(dest_path, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
-    if(dest_file < 0){
+
+    size_t parts = size / IMPORT_CHUNK;
+    if (parts > IMPORT_THREADS) {
+        parts = IMPORT_THREADS;
+    } else if (parts == 0) {
+        parts = 1;
+    }
+    size_t part = blocks_for((size + parts - 1) / parts) *
+                  fs_geometry.g_block_size;
+
+    import_job_t jobs[IMPORT_THREADS];
+    pthread_t tid[IMPORT_THREADS];
+    bool started[IMPORT_THREADS] = {false};
+    for (size_t i = 0; i < parts; i++) {
+        jobs[i].ij_inode = inode;
+        jobs[i].ij_data = data;
+        jobs[i].ij_offset = i * part < size ? i * part : size;
+        jobs[i].ij_len = size - jobs[i].ij_offset < part
+                             ? size - jobs[i].ij_offset
+                             : part;
+        jobs[i].ij_copied = 0;
+        /* The calling thread fills the first part, and any other whose
+         * thread could not be started */
+        if (i > 0) {
+            started[i] =
+                pthread_create(&tid[i], NULL, import_fill, &jobs[i]) == 0;
+        }
+    }
+    import_fill(&jobs[0]);
+    size_t copied = jobs[0].ij_copied;
+    for (size_t i = 1; i < parts; i++) {
+        if (started[i]) {
+            pthread_join(tid[i], NULL);
+        } else {
+            import_fill(&jobs[i]);
+        }
+        copied += jobs[i].ij_copied;
+    }
+    if (copied != size) {
         return -1;
     }
-    if (write(dest_file, buffer, (size_t)size) != size){
+
+    inode->i_size = size;
+    journal_log(inode, sizeof(*inode));
+    return 0;
+}
+
+int tfs_copy_from_external_fs(char const *source_path, char const *dest_path) {
+    /* Mapping the file in the external fs */
+    int source_file = open(source_path, O_RDONLY);
+    if (source_file == -1) {
         return -1;
     }
-    /* Close file */
-    if(tfs_close(source_inumber) < 0){
+    struct stat st;
+    if (fstat(source_file, &st) == -1 || !S_ISREG(st.st_mode) ||
+        (uintmax_t)st.st_size > SSIZE_MAX) {
+        close(source_file);
         return -1;
     }
-    if(close(dest_file) < 0){
+    size_t size = (size_t)st.st_size;
+    char *data = NULL;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, source_file, 0);
+        if (data == MAP_FAILED) {
+            close(source_file);
+            return -1;
+        }
+    }
+
+    /* Creating (or emptying) the file and filling it, made durable
+     * together */
+    int ret = -1;
+    journal_begin();
+    int dest_file = tfs_open(dest_path, TFS_O_CREAT | TFS_O_TRUNC);
+    if (dest_file != -1) {
+        int inumber = get_open_file_entry(dest_file)->of_inumber;
+        inode_t *inode = inode_get(inumber);
+        if (inode != NULL) {
+            pthread_rwlock_wrlock(inode_lock_get(inumber));
+            ret = inode_import(inode, data, size);
+            pthread_rwlock_unlock(inode_lock_get(inumber));
+        }
+        if (tfs_close(dest_file) == -1) {
+            ret = -1;
+        }
+    }
+    if (journal_commit() == -1) {
+        ret = -1;
+    }
+
+    if (data != NULL) {
+        munmap(data, size);
+    }
+    close(source_file);
+    return ret;
+}
+
+/*
+ * Imports the contents of a directory of the external fs, recursively,
+ * into an existing directory, inside the caller's journal transaction,
+ * which is committed (and a new one started) every IMPORT_BATCH files
+ * or when it grows large.
+ * Input:
+ *  - source, dest: the directories' paths, in buffers of PATH_MAX bytes
+ *    that are extended with each entry's name
+ *  - batched: files imported in the current transaction
+ * Returns 0 if successful, -1 otherwise
+ */
+static int import_tree(char *source, char *dest, size_t *batched) {
+    DIR *dir = opendir(source);
+    if (dir == NULL) {
         return -1;
     }
-    /* Free buffer */
-    free(buffer);
+    size_t source_len = strlen(source);
+    size_t dest_len = strlen(dest);
+    /* The root is "/" */
+    char const *sep = dest[dest_len - 1] == '/' ? "" : "/";
 
-    return 0;
-}
\ No newline at end of file
+    int ret = 0;
+    struct dirent *entry;
+    while (ret == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 ||
+            strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (snprintf(source + source_len, PATH_MAX - source_len, "/%s",
+                     entry->d_name) >= (int)(PATH_MAX - source_len) ||
+            snprintf(dest + dest_len, PATH_MAX - dest_len, "%s%s", sep,
+                     entry->d_name) >= (int)(PATH_MAX - dest_len)) {
+            ret = -1;
+            break;
+        }
+
+        struct stat st;
+        if (stat(source, &st) == -1) {
+            ret = -1;
+        } else if (S_ISDIR(st.st_mode)) {
+            if (tfs_lookup(dest) == -1 && tfs_mkdir(dest) == -1) {
+                ret = -1;
+            } else {
+                ret = import_tree(source, dest, batched);
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            ret = tfs_copy_from_external_fs(source, dest);
+            if (++*batched >= IMPORT_BATCH || journal_txn_large()) {
+                if (journal_commit() == -1) {
+                    ret = -1;
+                }
+                journal_begin();
+                *batched = 0;
+            }
+        }
+        /* Anything else (devices, sockets...) is left out */
+    }
+    source[source_len] = '\0';
+    dest[dest_len] = '\0';
+    closedir(dir);
+    return ret;
+}
+
+int tfs_copy_tree_from_external_fs(char const *source_dir,
+                                   char const *dest_dir) {
+    char *source = malloc(PATH_MAX);
+    char *dest = malloc(PATH_MAX);
+    int ret = -1;
+    if (source != NULL && dest != NULL && strlen(source_dir) < PATH_MAX &&
+        strlen(dest_dir) < PATH_MAX) {
+        strcpy(source, source_dir);
+        strcpy(dest, dest_dir);
+        journal_begin();
+        if (tfs_lookup(dest) != -1 || tfs_mkdir(dest) != -1) {
+            size_t batched = 0;
+            ret = import_tree(source, dest, &batched);
+        }
+        if (journal_commit() == -1) {
+            ret = -1;
+        }
+    }
+    free(source);
+    free(dest);
+    return ret;
+}
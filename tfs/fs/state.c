@@ -1,44 +1,198 @@
+/* copy_file_range, O_DIRECT, syscall */
+#define _GNU_SOURCE
+
 #include "state.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/io_uring.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/* Persistent FS state: a volume image laid out as described by the
+ * superblock. It is a memory mapping of an image file when the FS is backed
+ * by one, or plain (lazily zeroed) memory otherwise */
+static char *image;
+static size_t image_size;
+static int image_fd = -1;
+static superblock_t *superblock;
+/* Block device storing the data blocks (see device_open) */
+static block_device_t const *device;
 
-/* Persistent FS state  (in reality, it should be maintained in secondary
- * memory; for simplicity, this project maintains it in primary memory) */
+/* Byte ranges of an i-node's data locked through inode_range_lock. While
+ * no exclusive range is held or wanted (ir_writers), shared ranges are only
+ * counted (ir_readers), without taking ir_lock */
+typedef struct {
+    pthread_mutex_t ir_lock;
+    pthread_cond_t ir_cond;
+    range_lock_t *ir_held;
+    unsigned ir_waiters;
+    atomic_uint ir_writers;
+    atomic_uint ir_readers;
+} inode_ranges_t;
 
-/* I-node table */
-static inode_t inode_table[INODE_TABLE_SIZE];
-static pthread_rwlock_t inode_rwlock_table[INODE_TABLE_SIZE];
-static char freeinode_ts[INODE_TABLE_SIZE];
+/* I-node table. I-nodes are taken into use INODE_CHUNK at a time, as they
+ * are needed; each chunk brings along the i-nodes' locks, range locks and
+ * directory generations. The free i-nodes of the chunks in use are kept in a
+ * stack, so that taking and giving back one is O(1) */
+typedef struct {
+    pthread_rwlock_t ic_locks[INODE_CHUNK];
+    inode_ranges_t ic_ranges[INODE_CHUNK];
+    atomic_uint ic_generation[INODE_CHUNK];
+} inode_chunk_t;
+
+static inode_t *inode_table;
+static char *freeinode_ts;
+static inode_chunk_t **inode_chunks;
+static atomic_size_t inode_chunks_used;
+static int *free_inodes;
+static size_t free_inodes_count;
+static size_t free_inodes_capacity;
 static pthread_mutex_t freeinode_ts_lock;
 
 
 /* Data blocks */
-static char fs_data[BLOCK_SIZE * DATA_BLOCKS];
-static char free_blocks[DATA_BLOCKS];
+static char *fs_data;
+/* Free block bitmap of the volume: bit (i % 64) of word (i / 64) is set when
+ * block i is taken. Its words are guarded by striped locks */
+static uint64_t *free_blocks;
+static pthread_mutex_t free_blocks_stripes[BLOCK_MAP_STRIPES];
+/* Volatile copy of it where blocks held in magazines, and freed blocks not
+ * yet released (see journal_release), are also taken, which the global
+ * allocator works on. The cursor keeps the word of the last allocation
+ * (next-fit) */
+static uint64_t *block_claims;
+static size_t free_blocks_cursor;
 static pthread_mutex_t free_blocks_lock;
 
+/* Allocation magazines: each thread is given one of MAGAZINE_SLOTS slots,
+ * which keeps free blocks it can take, and i-nodes it can take and give
+ * back, without touching the global maps (freed blocks go back to the
+ * global map once durable). A slot is refilled from, and overflows to, the
+ * global maps MAGAZINE_SIZE / 2 at a time. Its lock is only contended when
+ * more threads than slots allocate at once, or when a global map runs out
+ * and every slot is drained */
+typedef struct {
+    _Alignas(64) pthread_mutex_t m_lock;
+    size_t m_block_count;
+    int m_blocks[MAGAZINE_SIZE];
+    size_t m_inode_count;
+    int m_inodes[MAGAZINE_SIZE];
+} magazine_t;
+
+static magazine_t magazines[MAGAZINE_SLOTS];
+static atomic_uint magazine_next;
+static _Thread_local int magazine_slot = -1;
+
 
 /* Volatile FS state */
 
-static open_file_entry_t open_file_table[MAX_OPEN_FILES];
-static pthread_mutex_t open_file_table_lock;
-static char free_open_file_entries[MAX_OPEN_FILES];
+geometry_t fs_geometry;
+
+/* Open file table: segments of OPEN_FILE_SEGMENT entries, allocated as the
+ * table fills and never moved, so it grows while in use. A slot is claimed
+ * by setting its bit in its segment's bitmap with a CAS, and freed by
+ * clearing it. Each slot has a generation, bumped when it is freed, which
+ * the file handle carries: a stale handle no longer matches its slot */
+#define OPEN_FILE_SEGMENT (BITMAP_WORD_BITS)
+#define HANDLE_INDEX_MASK ((1u << OPEN_FILE_INDEX_BITS) - 1)
+#define HANDLE_GENERATION_MASK ((1u << (31 - OPEN_FILE_INDEX_BITS)) - 1)
+
+typedef struct {
+    _Atomic uint64_t os_taken;
+    atomic_uint os_generation[OPEN_FILE_SEGMENT];
+    open_file_entry_t os_entries[OPEN_FILE_SEGMENT];
+} open_file_segment_t;
+
+static open_file_segment_t *_Atomic *open_file_segments;
+static size_t open_file_segments_count;
+static _Thread_local size_t open_file_segment_hint;
+static atomic_int open_files_number;
+static atomic_bool state_closing;
+
+/*
+ * The ThreadSanitizer runtime is always linked in, but the sources are only
+ * compiled for it with FSANITIZE=yes: otherwise it sees locks and the C
+ * library, not atomics, and an object published with a release store looks
+ * unordered with its use by the thread that found it. Its annotations tell
+ * it of such a release and acquire, when it is linked in.
+ */
+void __tsan_acquire(void *addr) __attribute__((weak));
+void __tsan_release(void *addr) __attribute__((weak));
+
+static void sanitizer_acquire(void *addr) {
+    if (__tsan_acquire != NULL) {
+        __tsan_acquire(addr);
+    }
+}
+
+static void sanitizer_release(void *addr) {
+    if (__tsan_release != NULL) {
+        __tsan_release(addr);
+    }
+}
+
+static void open_file_segment_free(open_file_segment_t *segment) {
+    for (size_t i = 0; i < OPEN_FILE_SEGMENT; i++) {
+        pthread_mutex_destroy(&segment->os_entries[i].of_lock);
+    }
+    free(segment);
+}
+
+/* Dentry cache: (parent directory, name) -> i-node, set-associative. An
+ * entry only matches while the parent keeps the generation it was cached
+ * under (ic_generation), which changes whenever the parent's i-node is
+ * reused */
+static dentry_t dentry_cache[DENTRY_CACHE_BUCKETS][DENTRY_CACHE_WAYS];
+static unsigned dentry_cache_hand[DENTRY_CACHE_BUCKETS];
+static pthread_rwlock_t dentry_cache_locks[DENTRY_CACHE_BUCKETS];
 
+/* Only the i-nodes of the chunks in use are valid */
 static inline bool valid_inumber(int inumber) {
-    return inumber >= 0 && inumber < INODE_TABLE_SIZE;
+    return inumber >= 0 &&
+           (size_t)inumber < fs_geometry.g_inode_table_size &&
+           (size_t)inumber / INODE_CHUNK <
+               atomic_load_explicit(&inode_chunks_used, memory_order_acquire);
+}
+
+static inline inode_chunk_t *inode_chunk(int inumber) {
+    return inode_chunks[(size_t)inumber / INODE_CHUNK];
+}
+
+/* Generation of a directory, for the dentry cache */
+static inline atomic_uint *dir_generation(int inumber) {
+    return &inode_chunk(inumber)->ic_generation[(size_t)inumber % INODE_CHUNK];
 }
 
 static inline bool valid_block_number(int block_number) {
-    return block_number >= 0 && block_number < DATA_BLOCKS;
+    return block_number >= 0 && block_number < fs_geometry.g_data_blocks;
 }
 
 static inline bool valid_file_handle(int file_handle) {
-    return file_handle >= 0 && file_handle < MAX_OPEN_FILES;
+    return file_handle >= 0 &&
+           ((unsigned)file_handle & HANDLE_INDEX_MASK) <
+               fs_geometry.g_max_open_files;
+}
+
+/* The calling thread's magazine */
+static inline magazine_t *magazine_get() {
+    if (magazine_slot == -1) {
+        magazine_slot = (int)(atomic_fetch_add(&magazine_next, 1) %
+                              MAGAZINE_SLOTS);
+    }
+    return &magazines[magazine_slot];
 }
 
 /**
@@ -69,108 +223,3917 @@ static void insert_delay() {
 }
 
 /*
- * Initializes FS state
+ * Block cache: the data blocks whose contents are in memory, so accessing
+ * them pays no device latency. Blocks are fetched when accessed and ahead
+ * of sequential reads (see inode_read_ahead); while a block is fetched it
+ * is marked loading, and whoever needs it waits for that fetch to end
+ * instead of paying for another.
+ *
+ * It is split into BLOCK_CACHE_SHARDS shards by block number (by page,
+ * with an image), each with its own lock and hash table, and each
+ * replacing blocks with 2Q: a block that misses enters the in queue (FIFO).
+ * Blocks pushed out of it are remembered in the ghost queue, and one that
+ * misses again while remembered there enters the main queue (LRU). So does
+ * one used again while still in the in queue, once the shard has seen more
+ * accesses since it entered than half the in queue holds: small reads one
+ * after another of the same block are one use. A scan thus only turns the
+ * in queue over, leaving the blocks used again and again in the main queue
+ * alone. Pinned blocks (being fetched, or mapped by data_blocks_pin) and
+ * dirty ones (see write-back) are never evicted; a shard whose blocks are
+ * all pinned or dirty holds more than its share until they are unpinned or
+ * written back.
+ *
+ * A fetch reads blocks from the device into their place in the volume
+ * image in memory, and a failed read fails the access. A block that is not
+ * cached holds there what the device holds: metadata blocks, which run
+ * ahead of their home location until the journal is checkpointed, are
+ * never evicted (see meta_block_get). The RAM device holds no copy of the
+ * blocks but that one, so reading from it only pays its latency.
+ *
+ * The cache owns the memory of the blocks it holds: with an image, a page
+ * of the data region whose blocks are all evicted is given back (see
+ * cache_release), so the memory taken by file data is bounded by the cache
+ * size rather than by the bytes read and written.
+ */
+#define CACHE_NONE (-1)
+#define CACHE_IN (0)
+#define CACHE_MAIN (1)
+#define CACHE_GHOST (2)
+#define CACHE_QUEUES (3)
+
+/* A block in a shard, linked in its hash chain and in its queue (or, when
+ * unused, in the shard's free list) by index */
+typedef struct {
+    int ce_block;
+    int ce_queue;
+    /* Accesses to the shard when it entered the cache */
+    uint64_t ce_entered;
+    bool ce_loading;
+    /* Whether its last fetch failed, so the next access fetches it again */
+    bool ce_failed;
+    unsigned ce_pins;
+    /* Whether it holds metadata (see meta_block_get), kept until freed */
+    bool ce_meta;
+    /* Whether it was written and not written back yet, and when (in ms) it
+     * was first written since */
+    bool ce_dirty;
+    uint64_t ce_dirtied;
+    int ce_hash_next;
+    int ce_prev;
+    int ce_next;
+} cache_entry_t;
+
+/* Queue of entries, most recently queued at the head */
+typedef struct {
+    int cq_head;
+    int cq_tail;
+    size_t cq_len;
+} cache_queue_t;
+
+typedef struct {
+    _Alignas(64) pthread_mutex_t cs_lock;
+    cache_entry_t *cs_entries;
+    size_t cs_entries_count;
+    int cs_free;
+    int *cs_buckets;
+    size_t cs_bucket_mask;
+    cache_queue_t cs_queues[CACHE_QUEUES];
+    /* Blocks held, in the in queue and remembered in the ghost queue, at
+     * most */
+    size_t cs_capacity;
+    size_t cs_in_max;
+    size_t cs_ghost_max;
+    uint64_t cs_accesses;
+    uint64_t cs_hits;
+    uint64_t cs_misses;
+    uint64_t cs_evictions;
+} cache_shard_t;
+
+static cache_shard_t block_cache[BLOCK_CACHE_SHARDS];
+
+/* With an image, the blocks sharing a page of memory (1 << shift of them,
+ * the first page of the data region starting skew blocks in), which are
+ * kept in one shard; otherwise each block on its own, and no memory to give
+ * back */
+static bool cache_releases;
+static unsigned cache_page_shift;
+static size_t cache_page_skew;
+
+/*
+ * Write-back: with params.write_back, data_blocks_persist leaves written
+ * blocks dirty in the block cache instead of writing them through.
+ * WRITEBACK_THREADS flusher threads, each covering an equal range of the
+ * data blocks, wake up every WRITEBACK_INTERVAL_MS and write back the
+ * blocks dirty for WRITEBACK_AGE_MS, or every dirty block when kicked (by
+ * tfs_close) or when over WRITEBACK_DIRTY_PERCENT of the cache is dirty.
+ * Past WRITEBACK_DIRTY_MAX_PERCENT, writers write the dirty blocks back
+ * themselves, which bounds the memory held by dirty blocks.
+ *
+ * Metadata commits are deferred too: they join the pending journal batch
+ * and return, and the batch is written when it fills up, when the flushers
+ * find it old, or on state_sync. Data is ordered before the metadata that
+ * makes it reachable: the journal leader writes back every dirty block,
+ * behind the write-backs already under way, before it writes a record.
  */
-void state_init() {
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        freeinode_ts[i] = FREE;
+static bool writeback_enabled;
+static bool writeback_stopping;
+static pthread_t writeback_threads[WRITEBACK_THREADS];
+static size_t writeback_started;
+static pthread_mutex_t writeback_lock;
+static pthread_cond_t writeback_cond;
+static uint64_t writeback_kicks;
+/* Held shared by each write-back, and exclusively by those that must
+ * follow all the others */
+static pthread_rwlock_t writeback_barrier;
+static size_t dirty_soft_limit;
+static size_t dirty_hard_limit;
+static atomic_size_t dirty_blocks;
+static atomic_uint_least64_t written_back_blocks;
+static atomic_uint_least64_t writeback_requests;
+/* Set once a write-back fails: data taken as written may not be */
+static atomic_bool writeback_failed;
+
+/* Outcome of looking a block up (see block_lookup) */
+typedef enum {
+    BLOCK_CACHED,
+    BLOCK_LOADING,
+    BLOCK_CLAIMED,
+    BLOCK_UNCACHED
+} block_lookup_t;
+
+static inline cache_shard_t *cache_shard(int block_number) {
+    size_t page = ((size_t)block_number + cache_page_skew) >> cache_page_shift;
+    return &block_cache[page % BLOCK_CACHE_SHARDS];
+}
+
+static inline int *cache_bucket(cache_shard_t *shard, int block_number) {
+    size_t b = (size_t)block_number + cache_page_skew;
+    size_t page = b >> cache_page_shift;
+    size_t in_page = b & (((size_t)1 << cache_page_shift) - 1);
+    size_t key = ((page / BLOCK_CACHE_SHARDS) << cache_page_shift) | in_page;
+    return &shard->cs_buckets[key & shard->cs_bucket_mask];
+}
+
+static int cache_lookup(cache_shard_t *shard, int block_number) {
+    int i = *cache_bucket(shard, block_number);
+    while (i != CACHE_NONE && shard->cs_entries[i].ce_block != block_number) {
+        i = shard->cs_entries[i].ce_hash_next;
     }
+    return i;
+}
 
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        free_blocks[i] = FREE;
+static void cache_queue_remove(cache_shard_t *shard, int i) {
+    cache_entry_t *entry = &shard->cs_entries[i];
+    cache_queue_t *queue = &shard->cs_queues[entry->ce_queue];
+    if (entry->ce_prev != CACHE_NONE) {
+        shard->cs_entries[entry->ce_prev].ce_next = entry->ce_next;
+    } else {
+        queue->cq_head = entry->ce_next;
+    }
+    if (entry->ce_next != CACHE_NONE) {
+        shard->cs_entries[entry->ce_next].ce_prev = entry->ce_prev;
+    } else {
+        queue->cq_tail = entry->ce_prev;
     }
+    queue->cq_len--;
+}
 
-    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        free_open_file_entries[i] = FREE;
+static void cache_queue_push(cache_shard_t *shard, int i, int queue_id) {
+    cache_entry_t *entry = &shard->cs_entries[i];
+    cache_queue_t *queue = &shard->cs_queues[queue_id];
+    entry->ce_queue = queue_id;
+    entry->ce_prev = CACHE_NONE;
+    entry->ce_next = queue->cq_head;
+    if (queue->cq_head != CACHE_NONE) {
+        shard->cs_entries[queue->cq_head].ce_prev = i;
+    } else {
+        queue->cq_tail = i;
     }
+    queue->cq_head = i;
+    queue->cq_len++;
+}
 
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        pthread_rwlock_init(inode_lock_get(i), NULL);
+/* Takes an unused entry, growing the shard's entries when there is none.
+ * Returns: its index, CACHE_NONE if out of memory */
+static int cache_entry_alloc(cache_shard_t *shard) {
+    if (shard->cs_free == CACHE_NONE) {
+        size_t grown = 2 * shard->cs_entries_count;
+        cache_entry_t *entries =
+            realloc(shard->cs_entries, grown * sizeof(*entries));
+        if (entries == NULL || grown > INT_MAX) {
+            if (entries != NULL) {
+                shard->cs_entries = entries;
+            }
+            return CACHE_NONE;
+        }
+        for (size_t i = shard->cs_entries_count; i < grown; i++) {
+            entries[i].ce_next = i + 1 < grown ? (int)i + 1 : CACHE_NONE;
+        }
+        shard->cs_free = (int)shard->cs_entries_count;
+        shard->cs_entries = entries;
+        shard->cs_entries_count = grown;
     }
+    int i = shard->cs_free;
+    shard->cs_free = shard->cs_entries[i].ce_next;
+    return i;
+}
 
-    pthread_mutex_init(&free_blocks_lock, NULL);
+/* Forgets an entry already out of its queue: unhashes and frees it */
+static void cache_forget(cache_shard_t *shard, int i) {
+    int *link = cache_bucket(shard, shard->cs_entries[i].ce_block);
+    while (*link != i) {
+        link = &shard->cs_entries[*link].ce_hash_next;
+    }
+    *link = shard->cs_entries[i].ce_hash_next;
+    shard->cs_entries[i].ce_next = shard->cs_free;
+    shard->cs_free = i;
+}
 
-    pthread_mutex_init(&freeinode_ts_lock, NULL);
+/*
+ * Gives back the memory of the page holding an evicted block, unless
+ * another block in it is still cached: the private mapping of the page then
+ * reads the image again, which holds what its blocks hold. Called with the
+ * shard's lock held, so that none of them is fetched meanwhile.
+ */
+static void cache_release(cache_shard_t *shard, int block_number) {
+    if (!cache_releases) {
+        return;
+    }
+    size_t blocks = (size_t)1 << cache_page_shift;
+    size_t start = ((size_t)block_number + cache_page_skew) & ~(blocks - 1);
+    if (start < cache_page_skew) {
+        /* The page starts before the data region */
+        return;
+    }
+    size_t first = start - cache_page_skew;
+    for (size_t other = first; other < first + blocks; other++) {
+        if (other >= fs_geometry.g_data_blocks) {
+            break;
+        }
+        int i = cache_lookup(shard, (int)other);
+        if (i != CACHE_NONE && shard->cs_entries[i].ce_queue != CACHE_GHOST) {
+            return;
+        }
+    }
+    size_t len = blocks * fs_geometry.g_block_size;
+    madvise(&fs_data[first * fs_geometry.g_block_size], len, MADV_DONTNEED);
+}
 
-    pthread_mutex_init(&open_file_table_lock, NULL);
+/*
+ * Evicts the least recently queued unpinned block of a queue. Blocks
+ * evicted from the in queue are remembered in the ghost queue.
+ * Returns: true if a block was evicted, false if all are pinned
+ */
+static bool cache_evict(cache_shard_t *shard, int queue_id) {
+    for (int i = shard->cs_queues[queue_id].cq_tail; i != CACHE_NONE;
+         i = shard->cs_entries[i].ce_prev) {
+        if (shard->cs_entries[i].ce_pins > 0 || shard->cs_entries[i].ce_dirty ||
+            shard->cs_entries[i].ce_meta) {
+            continue;
+        }
+        cache_queue_remove(shard, i);
+        shard->cs_evictions++;
+        int block_number = shard->cs_entries[i].ce_block;
+        if (queue_id != CACHE_IN) {
+            cache_forget(shard, i);
+            cache_release(shard, block_number);
+            return true;
+        }
+        cache_queue_t *ghosts = &shard->cs_queues[CACHE_GHOST];
+        if (ghosts->cq_len >= shard->cs_ghost_max) {
+            int oldest = ghosts->cq_tail;
+            cache_queue_remove(shard, oldest);
+            cache_forget(shard, oldest);
+        }
+        cache_queue_push(shard, i, CACHE_GHOST);
+        cache_release(shard, block_number);
+        return true;
+    }
+    return false;
 }
 
-void state_destroy() {
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        pthread_rwlock_destroy(inode_lock_get(i));
+/* Makes room for one more block in a full shard (or one holding more than
+ * its share, after pinned blocks are unpinned), as far as it can */
+static void cache_make_room(cache_shard_t *shard) {
+    while (shard->cs_queues[CACHE_IN].cq_len +
+               shard->cs_queues[CACHE_MAIN].cq_len >=
+           shard->cs_capacity) {
+        if (shard->cs_queues[CACHE_IN].cq_len > shard->cs_in_max &&
+            cache_evict(shard, CACHE_IN)) {
+            continue;
+        }
+        if (!cache_evict(shard, CACHE_MAIN) && !cache_evict(shard, CACHE_IN)) {
+            return;
+        }
     }
+}
 
-    pthread_mutex_destroy(&free_blocks_lock);
+/*
+ * Looks a block up for an access, counting a hit or a miss unless the
+ * access is ahead of the block's use.
+ * Input:
+ *  - block_number: the block
+ *  - ahead: whether it is fetched ahead of its use
+ *  - pin: whether to pin it (until data_blocks_unpin)
+ *  - meta: whether it holds metadata, and so is kept until freed
+ * Returns: BLOCK_CACHED if it is in memory, BLOCK_LOADING if someone else
+ * is fetching it, BLOCK_CLAIMED if the caller is to fetch it (and then
+ * call block_loaded), BLOCK_UNCACHED if it cannot be kept (out of memory)
+ */
+static block_lookup_t block_lookup(int block_number, bool ahead, bool pin,
+                                   bool meta) {
+    cache_shard_t *shard = cache_shard(block_number);
+    pthread_mutex_lock(&shard->cs_lock);
+    int i = cache_lookup(shard, block_number);
+    block_lookup_t ret;
+    if (i != CACHE_NONE && shard->cs_entries[i].ce_queue != CACHE_GHOST &&
+        shard->cs_entries[i].ce_failed) {
+        /* Fetched again, in place */
+        shard->cs_entries[i].ce_failed = false;
+        shard->cs_entries[i].ce_loading = true;
+        shard->cs_entries[i].ce_pins++;
+        ret = BLOCK_CLAIMED;
+    } else if (i != CACHE_NONE &&
+               shard->cs_entries[i].ce_queue != CACHE_GHOST) {
+        cache_entry_t *entry = &shard->cs_entries[i];
+        if (!ahead) {
+            shard->cs_accesses++;
+            shard->cs_hits++;
+            if (entry->ce_queue == CACHE_MAIN ||
+                shard->cs_accesses - entry->ce_entered >
+                    shard->cs_in_max / 2) {
+                cache_queue_remove(shard, i);
+                cache_queue_push(shard, i, CACHE_MAIN);
+            }
+        }
+        ret = shard->cs_entries[i].ce_loading ? BLOCK_LOADING : BLOCK_CACHED;
+    } else {
+        if (!ahead) {
+            shard->cs_accesses++;
+            shard->cs_misses++;
+        }
+        int queue_id = CACHE_IN;
+        if (i != CACHE_NONE) {
+            /* Remembered: it is used again */
+            cache_queue_remove(shard, i);
+            queue_id = CACHE_MAIN;
+        }
+        cache_make_room(shard);
+        if (i == CACHE_NONE) {
+            i = cache_entry_alloc(shard);
+            if (i == CACHE_NONE) {
+                pthread_mutex_unlock(&shard->cs_lock);
+                return BLOCK_UNCACHED;
+            }
+            shard->cs_entries[i].ce_block = block_number;
+            shard->cs_entries[i].ce_hash_next = *cache_bucket(shard, block_number);
+            *cache_bucket(shard, block_number) = i;
+        }
+        shard->cs_entries[i].ce_entered = shard->cs_accesses;
+        shard->cs_entries[i].ce_loading = true;
+        shard->cs_entries[i].ce_failed = false;
+        shard->cs_entries[i].ce_pins = 1;
+        shard->cs_entries[i].ce_meta = false;
+        shard->cs_entries[i].ce_dirty = false;
+        cache_queue_push(shard, i, queue_id);
+        ret = BLOCK_CLAIMED;
+    }
+    if (pin) {
+        shard->cs_entries[i].ce_pins++;
+    }
+    if (meta) {
+        shard->cs_entries[i].ce_meta = true;
+    }
+    pthread_mutex_unlock(&shard->cs_lock);
+    return ret;
+}
 
-    pthread_mutex_destroy(&freeinode_ts_lock);
+/* Marks a block claimed by block_lookup as fetched, or as failed to be */
+static void block_loaded(int block_number, bool failed) {
+    cache_shard_t *shard = cache_shard(block_number);
+    pthread_mutex_lock(&shard->cs_lock);
+    cache_entry_t *entry = &shard->cs_entries[cache_lookup(shard, block_number)];
+    entry->ce_loading = false;
+    entry->ce_failed = failed;
+    entry->ce_pins--;
+    pthread_mutex_unlock(&shard->cs_lock);
+}
+
+/* Waits for a block being fetched by someone else.
+ * Returns: 0 if it was fetched (or is no longer cached), -1 if it failed */
+static int block_wait(int block_number) {
+    cache_shard_t *shard = cache_shard(block_number);
+    for (;;) {
+        pthread_mutex_lock(&shard->cs_lock);
+        int i = cache_lookup(shard, block_number);
+        bool loading = i != CACHE_NONE && shard->cs_entries[i].ce_loading;
+        bool failed = i != CACHE_NONE && shard->cs_entries[i].ce_failed;
+        pthread_mutex_unlock(&shard->cs_lock);
+        if (!loading) {
+            return failed ? -1 : 0;
+        }
+        sched_yield();
+    }
+}
+
+static void blocks_unpin(int start, size_t count) {
+    for (int b = start; b < start + (int)count; b++) {
+        cache_shard_t *shard = cache_shard(b);
+        pthread_mutex_lock(&shard->cs_lock);
+        shard->cs_entries[cache_lookup(shard, b)].ce_pins--;
+        pthread_mutex_unlock(&shard->cs_lock);
+    }
+}
 
-    pthread_mutex_destroy(&open_file_table_lock);
+/* Lets the cache evict a run of freed blocks that held metadata */
+static void blocks_unkeep(size_t start, size_t count) {
+    for (int b = (int)start; b < (int)(start + count); b++) {
+        cache_shard_t *shard = cache_shard(b);
+        pthread_mutex_lock(&shard->cs_lock);
+        int i = cache_lookup(shard, b);
+        if (i != CACHE_NONE) {
+            shard->cs_entries[i].ce_meta = false;
+        }
+        pthread_mutex_unlock(&shard->cs_lock);
+    }
 }
 
 /*
- * Creates a new i-node in the i-node table.
+ * Fetches the blocks of a run that are not cached, DEVICE_BATCH blocks at a
+ * time, each time with one batch of device reads into their place in
+ * memory.
  * Input:
- *  - n_type: the type of the node (file or directory)
- * Returns:
- *  new i-node's number if successfully created, -1 otherwise
+ *  - start: first block of the run
+ *  - count: number of blocks
+ *  - ahead: whether the blocks are fetched ahead of their use, so those
+ *    being fetched by someone else are not waited for, and a failed read
+ *    is left for the access to retry
+ *  - pin: whether to pin the blocks
+ *  - meta: whether they hold metadata (see meta_block_get)
+ * Returns: 0 if successful, -1 if a block could not be read, pinned or kept
+ * (then none is pinned)
  */
-int inode_create(inode_type n_type) {
-    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * (int) sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
+static int blocks_fetch(int start, size_t count, bool ahead, bool pin,
+                        bool meta) {
+    block_request_t requests[DEVICE_BATCH];
+    int fetched[DEVICE_BATCH];
+    bool claimed[DEVICE_BATCH];
+    int ret = 0;
+    size_t done = 0;
+
+    while (done < count && ret == 0) {
+        size_t batch = count - done < DEVICE_BATCH ? count - done : DEVICE_BATCH;
+        int first = start + (int)done;
+        size_t fetched_count = 0;
+        size_t request_count = 0;
+        for (int b = first; b < first + (int)batch; b++) {
+            block_lookup_t state = block_lookup(b, ahead, pin, meta);
+            if (state == BLOCK_UNCACHED && (pin || meta)) {
+                batch = (size_t)(b - first);
+                ret = -1;
+                break;
+            }
+            if (state == BLOCK_CACHED || state == BLOCK_LOADING) {
+                continue;
+            }
+            if (fetched_count > 0 && fetched[fetched_count - 1] == b - 1) {
+                requests[request_count - 1].br_count++;
+            } else {
+                requests[request_count++] =
+                    (block_request_t){b, 1, NULL, false};
+            }
+            claimed[fetched_count] = state == BLOCK_CLAIMED;
+            fetched[fetched_count++] = b;
         }
-        /* Finds first free entry in i-node table */
-        pthread_mutex_lock(&freeinode_ts_lock);
-        if (freeinode_ts[inumber] == FREE) {
-            /* Found a free entry, so takes it for the new i-node*/
-            freeinode_ts[inumber] = TAKEN;
-            pthread_mutex_unlock(&freeinode_ts_lock);
-            insert_delay(); // simulate storage access delay (to i-node)
-            inode_table[inumber].i_node_type = n_type;
-            if (n_type == T_DIRECTORY) {
-                /* Initializes directory (filling its block with empty entries, labeled with inumber==-1) */
-                for(int i = 0; i < DIRECT_BLOCKS_QUANTITY; i++)
-                    inode_table[inumber].i_data_block[i] = -1;
-                int b = data_block_alloc();
-                if (b == -1) {
-                    freeinode_ts[inumber] = FREE;
-                    return -1;
+        done += batch;
+
+        if (fetched_count > 0) {
+            for (size_t i = 0; i < request_count; i++) {
+                requests[i].br_data =
+                    &fs_data[(size_t)requests[i].br_block *
+                             fs_geometry.g_block_size];
+            }
+            bool failed =
+                device->bd_submit_batch(requests, request_count) == -1;
+            for (size_t i = 0; i < fetched_count; i++) {
+                if (claimed[i]) {
+                    block_loaded(fetched[i], failed);
                 }
-                inode_table[inumber].i_size = BLOCK_SIZE;
-                inode_table[inumber].i_data_block[0] = b;
-                inode_table[inumber].i_index_block = -1;
-                dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
-                if (dir_entry == NULL) {
-                    freeinode_ts[inumber] = FREE;
-                    return -1;
+            }
+        }
+
+        /* Waits for the blocks someone else was fetching, only once the
+         * blocks claimed here are fetched, so no two fetches wait on each
+         * other */
+        for (int b = first; !ahead && b < first + (int)batch; b++) {
+            if (block_wait(b) == -1) {
+                ret = -1;
+            }
+        }
+    }
+    if (ret == -1 && pin) {
+        blocks_unpin(start, done);
+    }
+    return ret;
+}
+
+/* Returns a pointer to the contents of a block holding metadata (a
+ * directory or extent block). Its changes only reach the device when the
+ * journal is checkpointed, so it stays cached until freed
+ * Input:
+ * 	- Block's index
+ * Returns: pointer to the first byte of the block, NULL otherwise
+ */
+static void *meta_block_get(int block_number) {
+    if (!valid_block_number(block_number) ||
+        blocks_fetch(block_number, 1, false, false, true) == -1) {
+        return NULL;
+    }
+    return &fs_data[(size_t)block_number * fs_geometry.g_block_size];
+}
+
+/*
+ * Sets up the block cache, empty, to hold fs_geometry.g_cache_blocks
+ * blocks.
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int block_cache_init() {
+    size_t capacity = (fs_geometry.g_cache_blocks + BLOCK_CACHE_SHARDS - 1) /
+                      BLOCK_CACHE_SHARDS;
+    size_t ghost_max = capacity * BLOCK_CACHE_GHOST_PERCENT / 100 + 1;
+    size_t buckets = 1;
+    while (buckets < capacity + ghost_max) {
+        buckets *= 2;
+    }
+    for (size_t s = 0; s < BLOCK_CACHE_SHARDS; s++) {
+        cache_shard_t *shard = &block_cache[s];
+        shard->cs_capacity = capacity;
+        shard->cs_in_max = capacity * BLOCK_CACHE_IN_PERCENT / 100 + 1;
+        shard->cs_ghost_max = ghost_max;
+        shard->cs_entries_count = capacity + ghost_max;
+        shard->cs_entries =
+            malloc(shard->cs_entries_count * sizeof(*shard->cs_entries));
+        shard->cs_buckets = malloc(buckets * sizeof(*shard->cs_buckets));
+        pthread_mutex_init(&shard->cs_lock, NULL);
+        if (shard->cs_entries == NULL || shard->cs_buckets == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < shard->cs_entries_count; i++) {
+            shard->cs_entries[i].ce_next =
+                i + 1 < shard->cs_entries_count ? (int)i + 1 : CACHE_NONE;
+        }
+        shard->cs_free = 0;
+        for (size_t i = 0; i < buckets; i++) {
+            shard->cs_buckets[i] = CACHE_NONE;
+        }
+        shard->cs_bucket_mask = buckets - 1;
+        for (size_t q = 0; q < CACHE_QUEUES; q++) {
+            shard->cs_queues[q] = (cache_queue_t){CACHE_NONE, CACHE_NONE, 0};
+        }
+        shard->cs_accesses = 0;
+        shard->cs_hits = 0;
+        shard->cs_misses = 0;
+        shard->cs_evictions = 0;
+    }
+    return 0;
+}
+
+/*
+ * Sets up how blocks share pages of memory, for the cache to give back the
+ * memory of those it evicts. That takes an image, mapped privately (see
+ * image_map), and blocks that do not straddle pages.
+ * Input:
+ *  - data_offset: offset of the data region in the image
+ */
+static void block_cache_pages(size_t data_offset) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t block_size = fs_geometry.g_block_size;
+    cache_releases = false;
+    cache_page_shift = 0;
+    cache_page_skew = 0;
+    if (image_fd == -1) {
+        return;
+    }
+    if (block_size % page == 0 && data_offset % page == 0) {
+        cache_releases = true;
+    } else if (page % block_size == 0 && data_offset % block_size == 0) {
+        cache_releases = true;
+        cache_page_shift = (unsigned)__builtin_ctzll(page / block_size);
+        cache_page_skew = (data_offset % page) / block_size;
+    }
+}
+
+static void block_cache_free() {
+    for (size_t s = 0; s < BLOCK_CACHE_SHARDS; s++) {
+        cache_shard_t *shard = &block_cache[s];
+        if (shard->cs_capacity != 0) {
+            pthread_mutex_destroy(&shard->cs_lock);
+        }
+        free(shard->cs_entries);
+        free(shard->cs_buckets);
+        shard->cs_entries = NULL;
+        shard->cs_buckets = NULL;
+        shard->cs_capacity = 0;
+    }
+}
+
+/*
+ * Reads the block cache counters, summed over its shards
+ * Input:
+ *  - stats: where to store them
+ */
+void block_cache_stats(block_cache_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (size_t s = 0; s < BLOCK_CACHE_SHARDS; s++) {
+        cache_shard_t *shard = &block_cache[s];
+        pthread_mutex_lock(&shard->cs_lock);
+        stats->bc_hits += shard->cs_hits;
+        stats->bc_misses += shard->cs_misses;
+        stats->bc_evictions += shard->cs_evictions;
+        stats->bc_resident += shard->cs_queues[CACHE_IN].cq_len +
+                              shard->cs_queues[CACHE_MAIN].cq_len;
+        pthread_mutex_unlock(&shard->cs_lock);
+    }
+    stats->bc_dirty = atomic_load(&dirty_blocks);
+    stats->bc_written_back = atomic_load(&written_back_blocks);
+    stats->bc_writeback_requests = atomic_load(&writeback_requests);
+}
+
+/* Milliseconds on a clock that only moves forward */
+static uint64_t monotonic_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+static int block_number_compare(void const *a, void const *b) {
+    int x = *(int const *)a;
+    int y = *(int const *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Writes back the dirty blocks of a range that have been dirty for long
+ * enough: takes them from the block cache (marking them clean, so a block
+ * written again meanwhile is dirty again and written back once more), sorts
+ * them and writes each run of adjacent ones, up to WRITEBACK_MAX_RUN
+ * blocks, with one request, DEVICE_BATCH requests per batch. The data is
+ * written straight from the volume in memory.
+ * Input:
+ *  - first, end: the range of blocks
+ *  - min_age: how long (in ms) a block must have been dirty
+ *  - barrier: whether to wait for every write-back under way to end first,
+ *    so that all the data dirty until now has reached the device on return
+ * Returns: 0 if successful, -1 if a write failed (see writeback_failed)
+ */
+static int blocks_writeback(size_t first, size_t end, uint64_t min_age,
+                            bool barrier) {
+    if (barrier) {
+        pthread_rwlock_wrlock(&writeback_barrier);
+    } else {
+        pthread_rwlock_rdlock(&writeback_barrier);
+    }
+
+    int *blocks = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    uint64_t now = monotonic_ms();
+    for (size_t s = 0; s < BLOCK_CACHE_SHARDS; s++) {
+        cache_shard_t *shard = &block_cache[s];
+        pthread_mutex_lock(&shard->cs_lock);
+        for (int q = CACHE_IN; q <= CACHE_MAIN; q++) {
+            for (int i = shard->cs_queues[q].cq_head; i != CACHE_NONE;
+                 i = shard->cs_entries[i].ce_next) {
+                cache_entry_t *entry = &shard->cs_entries[i];
+                if (!entry->ce_dirty || (size_t)entry->ce_block < first ||
+                    (size_t)entry->ce_block >= end ||
+                    now - entry->ce_dirtied < min_age) {
+                    continue;
                 }
-                for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-                    dir_entry[i].d_inumber = -1;
+                if (count == cap) {
+                    size_t grown = cap == 0 ? DEVICE_BATCH : 2 * cap;
+                    int *more = realloc(blocks, grown * sizeof(*blocks));
+                    if (more == NULL) {
+                        /* The rest stays dirty, for the next time */
+                        break;
+                    }
+                    blocks = more;
+                    cap = grown;
                 }
-            } else {
-                /* In case of a new file, simply sets its size to 0 */
-                inode_table[inumber].i_size = 0;
-                /* Filling it's empty block with -1*/
-                for(int i = 0; i < DIRECT_BLOCKS_QUANTITY; i++)
-                    inode_table[inumber].i_data_block[i] = -1;
-                /* Allocating index block */
-                inode_table[inumber].i_index_block = data_block_alloc();
-                void *index_block = data_block_get(inode_table[inumber].i_index_block);
-                if (index_block == NULL) {
-                    return -1;
+                entry->ce_dirty = false;
+                atomic_fetch_sub(&dirty_blocks, 1);
+                blocks[count++] = entry->ce_block;
+            }
+        }
+        pthread_mutex_unlock(&shard->cs_lock);
+    }
+    qsort(blocks, count, sizeof(*blocks), block_number_compare);
+
+    int ret = 0;
+    block_request_t requests[DEVICE_BATCH];
+    size_t request_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        block_request_t *last =
+            request_count > 0 ? &requests[request_count - 1] : NULL;
+        if (last != NULL && last->br_block + (int)last->br_count == blocks[i] &&
+            last->br_count < WRITEBACK_MAX_RUN) {
+            last->br_count++;
+        } else {
+            if (request_count == DEVICE_BATCH) {
+                if (device->bd_submit_batch(requests, request_count) == -1) {
+                    ret = -1;
                 }
-                /* Filling index_block blocks with -1 */
-                int *array = (int*) malloc(BLOCK_SIZE);
-                for(int i = 0; i < BLOCK_SIZE/sizeof(int); i++)
-                    array[i] = -1;
-                memcpy(index_block, array, BLOCK_SIZE);
-                free(array);
+                atomic_fetch_add(&writeback_requests, request_count);
+                request_count = 0;
             }
-            return inumber;
+            requests[request_count++] = (block_request_t){
+                blocks[i], 1,
+                &fs_data[(size_t)blocks[i] * fs_geometry.g_block_size], true};
+        }
+    }
+    if (request_count > 0) {
+        if (device->bd_submit_batch(requests, request_count) == -1) {
+            ret = -1;
+        }
+        atomic_fetch_add(&writeback_requests, request_count);
+    }
+    atomic_fetch_add(&written_back_blocks, count);
+    free(blocks);
+
+    if (ret == -1) {
+        /* The blocks are clean in the cache but not on the device: no
+         * commit or sync may claim they are durable from now on */
+        atomic_store(&writeback_failed, true);
+    }
+    pthread_rwlock_unlock(&writeback_barrier);
+    return atomic_load(&writeback_failed) ? -1 : 0;
+}
+
+/*
+ * Read-ahead: blocks of files being read sequentially are fetched into the
+ * block cache by READ_AHEAD_THREADS background threads (as storage serves
+ * several requests at once), ahead of the reader, so that it finds them in
+ * memory. Requests, of at most READ_AHEAD_MIN blocks each, wait in a bounded
+ * queue; when it is full they are dropped, as read-ahead is only a hint.
+ */
+typedef struct {
+    int rr_inumber;
+    size_t rr_first;
+    size_t rr_count;
+} read_ahead_request_t;
+
+static bool read_ahead_enabled;
+static bool read_ahead_stopping;
+static pthread_t read_ahead_threads[READ_AHEAD_THREADS];
+static size_t read_ahead_started;
+static pthread_mutex_t read_ahead_lock;
+static pthread_cond_t read_ahead_cond;
+static read_ahead_request_t read_ahead_queue[READ_AHEAD_QUEUE];
+static size_t read_ahead_head;
+static size_t read_ahead_len;
+
+/* Fetches the blocks of a request, as they are mapped when it is served */
+static void read_ahead_fetch(read_ahead_request_t const *request) {
+    inode_t *inode = inode_get(request->rr_inumber);
+    if (inode == NULL) {
+        return;
+    }
+    pthread_rwlock_t *lock = inode_lock_get(request->rr_inumber);
+    pthread_rwlock_rdlock(lock);
+    size_t block = request->rr_first;
+    size_t end = request->rr_first + request->rr_count;
+    while (block < end) {
+        extent_t run;
+        if (inode->i_node_type != T_FILE ||
+            inode_extent_lookup(inode, block, &run) == -1) {
+            break;
+        }
+        size_t count = (size_t)run.e_length;
+        if (count > end - block) {
+            count = end - block;
+        }
+        blocks_fetch(run.e_start, count, true, false, false);
+        block += count;
+    }
+    pthread_rwlock_unlock(lock);
+}
+
+static void *read_ahead_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&read_ahead_lock);
+    while (true) {
+        while (read_ahead_len == 0 && !read_ahead_stopping) {
+            pthread_cond_wait(&read_ahead_cond, &read_ahead_lock);
+        }
+        if (read_ahead_stopping) {
+            break;
+        }
+        read_ahead_request_t request = read_ahead_queue[read_ahead_head];
+        read_ahead_head = (read_ahead_head + 1) % READ_AHEAD_QUEUE;
+        read_ahead_len--;
+        pthread_mutex_unlock(&read_ahead_lock);
+
+        read_ahead_fetch(&request);
+
+        pthread_mutex_lock(&read_ahead_lock);
+    }
+    pthread_mutex_unlock(&read_ahead_lock);
+    return NULL;
+}
+
+static void read_ahead_stop() {
+    if (!read_ahead_enabled) {
+        return;
+    }
+    pthread_mutex_lock(&read_ahead_lock);
+    read_ahead_stopping = true;
+    pthread_cond_broadcast(&read_ahead_cond);
+    pthread_mutex_unlock(&read_ahead_lock);
+    for (size_t i = 0; i < read_ahead_started; i++) {
+        pthread_join(read_ahead_threads[i], NULL);
+    }
+    pthread_mutex_destroy(&read_ahead_lock);
+    pthread_cond_destroy(&read_ahead_cond);
+    read_ahead_enabled = false;
+}
+
+static void read_ahead_start(bool enabled) {
+    read_ahead_enabled = false;
+    if (!enabled) {
+        return;
+    }
+    pthread_mutex_init(&read_ahead_lock, NULL);
+    pthread_cond_init(&read_ahead_cond, NULL);
+    read_ahead_stopping = false;
+    read_ahead_head = 0;
+    read_ahead_len = 0;
+    for (read_ahead_started = 0; read_ahead_started < READ_AHEAD_THREADS;
+         read_ahead_started++) {
+        if (pthread_create(&read_ahead_threads[read_ahead_started], NULL,
+                           read_ahead_worker, NULL) != 0) {
+            break;
+        }
+    }
+    read_ahead_enabled = true;
+    if (read_ahead_started == 0) {
+        read_ahead_stop();
+    }
+}
+
+/*
+ * Asks for blocks of a file to be fetched into the block cache in the
+ * background, ahead of a sequential reader. Returns at once; nothing
+ * happens if read-ahead is disabled or too many requests are waiting.
+ * Input:
+ *  - inumber: identifier of the file's i-node
+ *  - first: index of the first block within the file
+ *  - count: number of blocks
+ */
+void inode_read_ahead(int inumber, size_t first, size_t count) {
+    if (!read_ahead_enabled) {
+        return;
+    }
+    pthread_mutex_lock(&read_ahead_lock);
+    while (count > 0 && read_ahead_len < READ_AHEAD_QUEUE) {
+        read_ahead_request_t *request =
+            &read_ahead_queue[(read_ahead_head + read_ahead_len) %
+                              READ_AHEAD_QUEUE];
+        request->rr_inumber = inumber;
+        request->rr_first = first;
+        request->rr_count = count < READ_AHEAD_MIN ? count : READ_AHEAD_MIN;
+        first += request->rr_count;
+        count -= request->rr_count;
+        read_ahead_len++;
+        pthread_cond_signal(&read_ahead_cond);
+    }
+    pthread_mutex_unlock(&read_ahead_lock);
+}
+
+/*
+ * Marks every bit of a bitmap as free, except for the padding bits past
+ * 'bits' in the last word, which are marked as taken so they are never handed
+ * out.
+ * Input:
+ *  - map: the bitmap
+ *  - bits: number of valid bits in the bitmap
+ */
+static void bitmap_init(uint64_t *map, size_t bits) {
+    size_t words = BITMAP_WORDS(bits);
+    for (size_t i = 0; i < words; i++) {
+        map[i] = 0;
+    }
+    if (bits % BITMAP_WORD_BITS != 0) {
+        map[words - 1] = ~(uint64_t)0 << (bits % BITMAP_WORD_BITS);
+    }
+}
+
+/*
+ * Finds and takes the first free bit of a bitmap, starting the search at
+ * word 'cursor' and wrapping around.
+ * Input:
+ *  - map: the bitmap
+ *  - words: number of words in the bitmap
+ *  - cursor: pointer to the word where the search starts; updated with the
+ *    word where the bit was found
+ * Returns: index of the taken bit, -1 if the bitmap is full
+ */
+static long bitmap_take_first(uint64_t *map, size_t words, size_t *cursor) {
+    size_t w = *cursor < words ? *cursor : 0;
+    for (size_t n = 0; n < words; n++) {
+        if (n > 0 && (w * sizeof(uint64_t)) % fs_geometry.g_block_size == 0) {
+            insert_delay(); // simulate storage access delay to the next block
+        }
+        if (map[w] != ~(uint64_t)0) {
+            int bit = __builtin_ctzll(~map[w]);
+            map[w] |= (uint64_t)1 << bit;
+            *cursor = w;
+            return (long)(w * BITMAP_WORD_BITS) + bit;
+        }
+        if (++w == words) {
+            w = 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Finds the first bit at or after 'pos' whose state is 'taken'.
+ * Input:
+ *  - map: the bitmap
+ *  - words: number of words in the bitmap
+ *  - pos: bit where the search starts
+ *  - taken: true to look for a taken bit, false to look for a free one
+ * Returns: index of the bit, or words * 64 if there is none
+ */
+static size_t bitmap_next(uint64_t const *map, size_t words, size_t pos,
+                          bool taken) {
+    size_t w = pos / BITMAP_WORD_BITS;
+    if (w >= words) {
+        return words * BITMAP_WORD_BITS;
+    }
+    uint64_t word = taken ? map[w] : ~map[w];
+    word &= ~(uint64_t)0 << (pos % BITMAP_WORD_BITS);
+    while (word == 0) {
+        if (++w == words) {
+            return words * BITMAP_WORD_BITS;
+        }
+        word = taken ? map[w] : ~map[w];
+    }
+    return w * BITMAP_WORD_BITS + (size_t)__builtin_ctzll(word);
+}
+
+/*
+ * Marks a run of bits as taken.
+ * Input:
+ *  - map: the bitmap
+ *  - start: first bit of the run
+ *  - len: length of the run
+ */
+static void bitmap_set_run(uint64_t *map, size_t start, size_t len) {
+    while (len > 0) {
+        size_t bit = start % BITMAP_WORD_BITS;
+        size_t n = BITMAP_WORD_BITS - bit;
+        if (n > len) {
+            n = len;
+        }
+        uint64_t mask = n == BITMAP_WORD_BITS ? ~(uint64_t)0
+                                              : (((uint64_t)1 << n) - 1) << bit;
+        map[start / BITMAP_WORD_BITS] |= mask;
+        start += n;
+        len -= n;
+    }
+}
+
+/*
+ * Marks a run of bits as free.
+ * Input:
+ *  - map: the bitmap
+ *  - start: first bit of the run
+ *  - len: length of the run
+ */
+static void bitmap_clear_run(uint64_t *map, size_t start, size_t len) {
+    while (len > 0) {
+        size_t bit = start % BITMAP_WORD_BITS;
+        size_t n = BITMAP_WORD_BITS - bit;
+        if (n > len) {
+            n = len;
+        }
+        uint64_t mask = n == BITMAP_WORD_BITS ? ~(uint64_t)0
+                                              : (((uint64_t)1 << n) - 1) << bit;
+        map[start / BITMAP_WORD_BITS] &= ~mask;
+        start += n;
+        len -= n;
+    }
+}
+
+/*
+ * Counts the free bits of a bitmap.
+ * Input:
+ *  - map: the bitmap
+ *  - words: number of words in the bitmap
+ * Returns: number of free bits
+ */
+static size_t bitmap_count_free(uint64_t const *map, size_t words) {
+    size_t count = 0;
+    for (size_t w = 0; w < words; w++) {
+        count += (size_t)__builtin_popcountll(~map[w]);
+    }
+    return count;
+}
+
+/*
+ * Finds a run of at least 'len' free bits, first-fit starting at bit 'from'
+ * and wrapping around. When there is no such run, finds the longest free run
+ * instead.
+ * Input:
+ *  - map: the bitmap
+ *  - words: number of words in the bitmap
+ *  - from: bit where the search starts
+ *  - len: wanted run length
+ *  - run_len: filled with the length of the run found (0 if the map is full)
+ * Returns: first bit of the run found
+ */
+static size_t bitmap_find_run(uint64_t const *map, size_t words, size_t from,
+                              size_t len, size_t *run_len) {
+    size_t bits = words * BITMAP_WORD_BITS;
+    size_t best = 0, best_len = 0;
+    size_t pos = from < bits ? from : 0;
+    size_t end = bits;
+    bool wrapped = false;
+
+    for (;;) {
+        size_t start = bitmap_next(map, words, pos, false);
+        if (start >= end) {
+            if (wrapped || from == 0) {
+                break;
+            }
+            /* Search the part before 'from' */
+            wrapped = true;
+            end = from;
+            pos = 0;
+            continue;
+        }
+        size_t stop = bitmap_next(map, words, start, true);
+        if (stop - start >= len) {
+            *run_len = stop - start;
+            return start;
+        }
+        if (stop - start > best_len) {
+            best = start;
+            best_len = stop - start;
+        }
+        pos = stop;
+    }
+    *run_len = best_len;
+    return best;
+}
+
+/*
+ * Computes the volume layout for a geometry: the superblock, the i-node
+ * allocation table, the i-node table, the free block bitmap, the journal and
+ * the data blocks, each starting on a block boundary.
+ * Input:
+ *  - sb: superblock to fill, whose s_block_size, s_data_blocks,
+ *    s_inode_table_size and s_journal_size are already set
+ */
+static void layout_compute(superblock_t *sb) {
+    uint64_t block_size = sb->s_block_size;
+    sb->s_magic = TFS_MAGIC;
+    sb->s_version = TFS_VERSION;
+
+    uint64_t offset = block_size;
+    sb->s_inode_bitmap_offset = offset;
+    offset += ROUND_UP(sb->s_inode_table_size, block_size);
+    sb->s_inode_table_offset = offset;
+    offset += ROUND_UP(sb->s_inode_table_size * sizeof(inode_t), block_size);
+    sb->s_block_bitmap_offset = offset;
+    offset += ROUND_UP(BITMAP_WORDS(sb->s_data_blocks) * sizeof(uint64_t),
+                       block_size);
+    sb->s_journal_offset = offset;
+    offset += sb->s_journal_size;
+    sb->s_data_offset = offset;
+    offset += sb->s_data_blocks * block_size;
+    sb->s_image_size = offset;
+}
+
+/*
+ * Checks that a geometry can be used.
+ * Input:
+ *  - sb: superblock holding the geometry
+ * Returns: true if it can, false otherwise
+ */
+static bool geometry_valid(superblock_t const *sb) {
+    return sb->s_block_size >= MIN_BLOCK_SIZE &&
+           sb->s_block_size % sizeof(uint64_t) == 0 &&
+           sb->s_data_blocks > 0 && sb->s_data_blocks <= INT_MAX &&
+           sb->s_inode_table_size > 0 && sb->s_inode_table_size <= INT_MAX &&
+           sb->s_journal_size >= MIN_JOURNAL_BLOCKS * sb->s_block_size &&
+           sb->s_journal_size % sb->s_block_size == 0;
+}
+
+/*
+ * Checks that an existing image holds a volume: a known superblock with a
+ * usable geometry, laid out as that geometry says.
+ * Input:
+ *  - sb: the image's superblock
+ *  - size: size of the image file
+ * Returns: true if the image can be attached, false otherwise
+ */
+static bool layout_matches(superblock_t const *sb, size_t size) {
+    if (sb->s_magic != TFS_MAGIC || sb->s_version != TFS_VERSION ||
+        !geometry_valid(sb)) {
+        return false;
+    }
+    superblock_t expected = *sb;
+    layout_compute(&expected);
+    return memcmp(&expected, sb, sizeof(expected)) == 0 &&
+           size >= sb->s_image_size &&
+           sb->s_inode_chunks <=
+               (sb->s_inode_table_size + INODE_CHUNK - 1) / INODE_CHUNK;
+}
+
+/*
+ * Sets the geometry in use, precomputing the shift and mask that replace
+ * divisions when the block size is a power of two.
+ * Input:
+ *  - sb: superblock of the volume
+ *  - max_open_files: size of the open file table
+ */
+static void geometry_set(superblock_t const *sb, size_t max_open_files,
+                         size_t cache_blocks) {
+    geometry_t *g = &fs_geometry;
+    g->g_block_size = (size_t)sb->s_block_size;
+    g->g_block_shift = 0;
+    g->g_block_mask = 0;
+    if ((g->g_block_size & (g->g_block_size - 1)) == 0) {
+        g->g_block_shift = (unsigned)__builtin_ctzll(sb->s_block_size);
+        g->g_block_mask = g->g_block_size - 1;
+    }
+    g->g_data_blocks = (size_t)sb->s_data_blocks;
+    g->g_inode_table_size = (size_t)sb->s_inode_table_size;
+    g->g_max_open_files = max_open_files;
+    g->g_cache_blocks = cache_blocks;
+    /* Each directory slot takes an entry and a fingerprint byte; the
+     * fingerprints follow the block header and are padded to the alignment
+     * of the entries */
+    g->g_dir_entries = (g->g_block_size - sizeof(dir_block_t) - sizeof(int)) /
+                       (sizeof(dir_entry_t) + sizeof(uint8_t));
+    g->g_extents_per_block =
+        (g->g_block_size - sizeof(extent_block_t)) / sizeof(extent_t);
+}
+
+/*
+ * Opens the image file, attaching to it if it already holds a volume and
+ * creating it otherwise.
+ * Input:
+ *  - image_path: path of the image file
+ *  - layout: the layout of a new volume; replaced with the layout of the
+ *    existing one, if there is one
+ * Returns: 1 if the volume needs formatting, 0 if an existing volume was
+ * found, -1 otherwise
+ */
+static int image_open(char const *image_path, superblock_t *layout) {
+    image_fd = open(image_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (image_fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(image_fd, &st) == -1) {
+        return -1;
+    }
+
+    if (st.st_size == 0) {
+        /* A new image is a sparse file: its blocks are only backed by disk
+         * once they are written */
+        if (ftruncate(image_fd, (off_t)layout->s_image_size) == -1) {
+            return -1;
+        }
+        return 1;
+    }
+
+    superblock_t sb;
+    if (pread(image_fd, &sb, sizeof(sb), 0) != sizeof(sb) ||
+        !layout_matches(&sb, (size_t)st.st_size)) {
+        return -1;
+    }
+    /* The volume keeps the geometry it was formatted with */
+    *layout = sb;
+    return 0;
+}
+
+/*
+ * Maps the volume: the image file when there is one, or anonymous memory.
+ * The image is mapped privately, so nothing reaches it behind the journal's
+ * back nor the block device's: metadata is written through the journal and
+ * file data by the device, with data_blocks_persist, when write-back says
+ * so. A shared mapping would have the kernel write pages back on its own,
+ * and mix the page cache with the O_DIRECT devices. The memory of the
+ * private pages is bounded by the block cache instead, which gives back
+ * that of the blocks it evicts (see cache_release).
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int image_map() {
+    if (image_fd == -1) {
+        /* Zeroed pages are only backed by memory once they are touched */
+        image = calloc(1, image_size);
+        return image == NULL ? -1 : 0;
+    }
+
+    image = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                 image_fd, 0);
+    if (image == MAP_FAILED) {
+        image = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Writes a freshly formatted volume to the image file. The superblock goes
+ * in last, so a half-formatted image is never attached. The i-node regions
+ * are all zeroes, which the new (sparse) file already holds, so they are
+ * left out and only get disk space as i-node chunks are used.
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int image_format_persist() {
+    off_t bitmap = (off_t)superblock->s_block_bitmap_offset;
+    size_t metadata = superblock->s_journal_offset - (size_t)bitmap;
+    if (pwrite(image_fd, image + bitmap, metadata, bitmap) !=
+            (ssize_t)metadata ||
+        fdatasync(image_fd) == -1) {
+        return -1;
+    }
+    if (pwrite(image_fd, superblock, sizeof(*superblock), 0) !=
+            sizeof(*superblock) ||
+        fdatasync(image_fd) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Block devices: the storage behind the data blocks of a volume. Block n is
+ * stored at s_data_offset + n * block size in the image. The RAM device
+ * keeps blocks in memory only and emulates the storage delay; the others
+ * store them in the image file, through the page cache (pread and pwrite),
+ * bypassing it (O_DIRECT), or bypassing it through io_uring rings, where
+ * the requests of a batch are in flight together.
+ */
+static int device_fd = -1;
+static off_t device_data_offset;
+
+static off_t device_offset(int block_number) {
+    return device_data_offset +
+           (off_t)((size_t)block_number * fs_geometry.g_block_size);
+}
+
+static int ram_read_block(int block_number, void *data) {
+    (void)block_number;
+    (void)data;
+    insert_delay(); // simulate storage access delay to block
+    return 0;
+}
+
+static int ram_write_block(int block_number, void const *data) {
+    (void)block_number;
+    (void)data;
+    return 0;
+}
+
+static int ram_submit_batch(block_request_t const *requests, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = 0; !requests[i].br_write && j < requests[i].br_count;
+             j++) {
+            insert_delay(); // simulate storage access delay to block
+        }
+    }
+    return 0;
+}
+
+static int ram_flush() { return 0; }
+
+static block_device_t const ram_device = {ram_read_block, ram_write_block,
+                                          ram_submit_batch, ram_flush};
+
+/* Carries out a request in full with pread or pwrite on device_fd */
+static int fd_transfer(block_request_t const *request) {
+    char *data = request->br_data;
+    size_t len = request->br_count * fs_geometry.g_block_size;
+    off_t offset = device_offset(request->br_block);
+    while (len > 0) {
+        ssize_t ret = request->br_write ? pwrite(device_fd, data, len, offset)
+                                        : pread(device_fd, data, len, offset);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        data += ret;
+        len -= (size_t)ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+static int fd_read_block(int block_number, void *data) {
+    block_request_t request = {block_number, 1, data, false};
+    return fd_transfer(&request);
+}
+
+static int fd_write_block(int block_number, void const *data) {
+    block_request_t request = {block_number, 1, (void *)data, true};
+    return fd_transfer(&request);
+}
+
+static int fd_submit_batch(block_request_t const *requests, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (fd_transfer(&requests[i]) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int fd_flush() { return fdatasync(device_fd); }
+
+static block_device_t const fd_device = {fd_read_block, fd_write_block,
+                                         fd_submit_batch, fd_flush};
+
+/* An io_uring: its submission and completion rings, shared with the
+ * kernel, used by one thread at a time */
+typedef struct {
+    pthread_mutex_t ur_lock;
+    int ur_fd;
+    void *ur_sq_ring;
+    size_t ur_sq_ring_size;
+    void *ur_cq_ring;
+    size_t ur_cq_ring_size;
+    struct io_uring_sqe *ur_sqes;
+    size_t ur_sqes_size;
+    _Atomic unsigned *ur_sq_tail;
+    unsigned const *ur_sq_mask;
+    unsigned *ur_sq_array;
+    _Atomic unsigned *ur_cq_head;
+    _Atomic unsigned const *ur_cq_tail;
+    unsigned const *ur_cq_mask;
+    struct io_uring_cqe const *ur_cqes;
+} uring_t;
+
+static uring_t urings[URING_RINGS];
+static size_t urings_open;
+static atomic_uint uring_next;
+static _Thread_local int uring_slot = -1;
+
+static void uring_teardown(uring_t *ring) {
+    if (ring->ur_sqes != NULL) {
+        munmap(ring->ur_sqes, ring->ur_sqes_size);
+    }
+    if (ring->ur_cq_ring != NULL) {
+        munmap(ring->ur_cq_ring, ring->ur_cq_ring_size);
+    }
+    if (ring->ur_sq_ring != NULL) {
+        munmap(ring->ur_sq_ring, ring->ur_sq_ring_size);
+    }
+    close(ring->ur_fd);
+    pthread_mutex_destroy(&ring->ur_lock);
+}
+
+/* Maps a region of an io_uring, or returns NULL */
+static void *uring_map(int fd, size_t size, off_t offset) {
+    void *region =
+        mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    return region == MAP_FAILED ? NULL : region;
+}
+
+/*
+ * Sets up an io_uring of URING_ENTRIES entries.
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int uring_setup(uring_t *ring) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+    ring->ur_fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (ring->ur_fd == -1) {
+        return -1;
+    }
+    pthread_mutex_init(&ring->ur_lock, NULL);
+
+    ring->ur_sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->ur_cq_ring_size =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ur_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->ur_sq_ring =
+        uring_map(ring->ur_fd, ring->ur_sq_ring_size, IORING_OFF_SQ_RING);
+    ring->ur_cq_ring =
+        uring_map(ring->ur_fd, ring->ur_cq_ring_size, IORING_OFF_CQ_RING);
+    ring->ur_sqes = uring_map(ring->ur_fd, ring->ur_sqes_size, IORING_OFF_SQES);
+    if (ring->ur_sq_ring == NULL || ring->ur_cq_ring == NULL ||
+        ring->ur_sqes == NULL) {
+        uring_teardown(ring);
+        return -1;
+    }
+
+    char *sq = ring->ur_sq_ring;
+    char *cq = ring->ur_cq_ring;
+    ring->ur_sq_tail = (_Atomic unsigned *)(void *)(sq + p.sq_off.tail);
+    ring->ur_sq_mask = (unsigned *)(void *)(sq + p.sq_off.ring_mask);
+    ring->ur_sq_array = (unsigned *)(void *)(sq + p.sq_off.array);
+    ring->ur_cq_head = (_Atomic unsigned *)(void *)(cq + p.cq_off.head);
+    ring->ur_cq_tail = (_Atomic unsigned *)(void *)(cq + p.cq_off.tail);
+    ring->ur_cq_mask = (unsigned *)(void *)(cq + p.cq_off.ring_mask);
+    ring->ur_cqes = (struct io_uring_cqe *)(void *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+/*
+ * Submits requests to a ring and waits for them to complete.
+ * Input:
+ *  - ring: the ring, held by the caller
+ *  - requests: the requests, URING_ENTRIES at most
+ *  - count: number of requests
+ * Returns: 0 if every request was carried out in full, -1 otherwise
+ */
+static int uring_run(uring_t *ring, block_request_t const *requests,
+                     unsigned count) {
+    unsigned tail = atomic_load_explicit(ring->ur_sq_tail, memory_order_relaxed);
+    for (unsigned i = 0; i < count; i++) {
+        block_request_t const *request = &requests[i];
+        unsigned index = (tail + i) & *ring->ur_sq_mask;
+        struct io_uring_sqe *sqe = &ring->ur_sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = request->br_write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = device_fd;
+        sqe->addr = (uint64_t)(uintptr_t)request->br_data;
+        sqe->len = (uint32_t)(request->br_count * fs_geometry.g_block_size);
+        sqe->off = (uint64_t)device_offset(request->br_block);
+        sqe->user_data = i;
+        ring->ur_sq_array[index] = index;
+    }
+    atomic_store_explicit(ring->ur_sq_tail, tail + count, memory_order_release);
+
+    int ret = 0;
+    unsigned submitted = 0;
+    while (submitted < count) {
+        long n = syscall(__NR_io_uring_enter, ring->ur_fd, count - submitted,
+                         count - submitted, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* Takes back the entries the kernel did not consume, so that a
+             * later call does not submit them */
+            atomic_store_explicit(ring->ur_sq_tail, tail + submitted,
+                                  memory_order_release);
+            ret = -1;
+            break;
+        }
+        submitted += (unsigned)n;
+    }
+
+    /* Every request submitted is reaped, even after an error, as the
+     * device may still be using its buffer */
+    unsigned completed = 0;
+    while (completed < submitted) {
+        unsigned head =
+            atomic_load_explicit(ring->ur_cq_head, memory_order_relaxed);
+        unsigned cq_tail =
+            atomic_load_explicit(ring->ur_cq_tail, memory_order_acquire);
+        if (head == cq_tail) {
+            if (syscall(__NR_io_uring_enter, ring->ur_fd, 0, 1,
+                        IORING_ENTER_GETEVENTS, NULL, 0) == -1 &&
+                errno != EINTR) {
+                ret = -1;
+            }
+            continue;
+        }
+        for (; head != cq_tail; head++, completed++) {
+            struct io_uring_cqe const *cqe =
+                &ring->ur_cqes[head & *ring->ur_cq_mask];
+            block_request_t const *request = &requests[cqe->user_data];
+            if (cqe->res < 0 ||
+                (size_t)cqe->res !=
+                    request->br_count * fs_geometry.g_block_size) {
+                ret = -1;
+            }
+        }
+        atomic_store_explicit(ring->ur_cq_head, head, memory_order_release);
+    }
+    return ret;
+}
+
+static int uring_submit_batch(block_request_t const *requests, size_t count) {
+    if (uring_slot == -1 || (size_t)uring_slot >= urings_open) {
+        uring_slot = (int)(atomic_fetch_add(&uring_next, 1) % urings_open);
+    }
+    uring_t *ring = &urings[uring_slot];
+
+    int ret = 0;
+    pthread_mutex_lock(&ring->ur_lock);
+    for (size_t done = 0; done < count;) {
+        unsigned n = count - done < URING_ENTRIES ? (unsigned)(count - done)
+                                                  : URING_ENTRIES;
+        if (uring_run(ring, requests + done, n) == -1) {
+            ret = -1;
+        }
+        done += n;
+    }
+    pthread_mutex_unlock(&ring->ur_lock);
+    return ret;
+}
+
+static int uring_read_block(int block_number, void *data) {
+    block_request_t request = {block_number, 1, data, false};
+    return uring_submit_batch(&request, 1);
+}
+
+static int uring_write_block(int block_number, void const *data) {
+    block_request_t request = {block_number, 1, (void *)data, true};
+    return uring_submit_batch(&request, 1);
+}
+
+static block_device_t const uring_device = {
+    uring_read_block, uring_write_block, uring_submit_batch, fd_flush};
+
+/*
+ * Opens the block device chosen for a volume, once its image (if any) is
+ * open and its geometry set. The RAM device is for volumes without an
+ * image, the others for volumes with one; O_DIRECT ones need blocks of a
+ * multiple of DIRECT_IO_ALIGN bytes.
+ * Input:
+ *  - params: the FS parameters
+ *  - layout: the volume layout
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int device_open(tfs_params_t const *params,
+                       superblock_t const *layout) {
+    tfs_device_t kind = params->device;
+    if (kind == TFS_DEVICE_DEFAULT) {
+        kind = image_fd == -1 ? TFS_DEVICE_RAM : TFS_DEVICE_FILE;
+    }
+    if ((kind == TFS_DEVICE_RAM) != (image_fd == -1)) {
+        return -1;
+    }
+    device_data_offset = (off_t)layout->s_data_offset;
+
+    switch (kind) {
+    case TFS_DEVICE_RAM:
+        device = &ram_device;
+        return 0;
+    case TFS_DEVICE_FILE:
+        device_fd = image_fd;
+        device = &fd_device;
+        return 0;
+    case TFS_DEVICE_DIRECT:
+    case TFS_DEVICE_URING:
+        break;
+    case TFS_DEVICE_DEFAULT:
+    default:
+        return -1;
+    }
+
+    if (layout->s_block_size % DIRECT_IO_ALIGN != 0) {
+        return -1;
+    }
+    device_fd = open(params->image_path, O_RDWR | O_DIRECT);
+    if (device_fd == -1) {
+        return -1;
+    }
+    if (kind == TFS_DEVICE_DIRECT) {
+        device = &fd_device;
+        return 0;
+    }
+    for (urings_open = 0; urings_open < URING_RINGS; urings_open++) {
+        if (uring_setup(&urings[urings_open]) == -1) {
+            break;
+        }
+    }
+    if (urings_open == 0) {
+        close(device_fd);
+        device_fd = -1;
+        return -1;
+    }
+    device = &uring_device;
+    return 0;
+}
+
+static void device_close() {
+    for (size_t i = 0; i < urings_open; i++) {
+        uring_teardown(&urings[i]);
+    }
+    urings_open = 0;
+    if (device_fd != -1 && device_fd != image_fd) {
+        close(device_fd);
+    }
+    device_fd = -1;
+    device = NULL;
+}
+
+static void image_close() {
+    device_close();
+    if (image_fd == -1) {
+        free(image);
+    } else {
+        if (image != NULL) {
+            munmap(image, image_size);
+        }
+        close(image_fd);
+        image_fd = -1;
+    }
+    image = NULL;
+}
+
+/*
+ * Metadata journal: a redo log, kept in the image, of the after-images of
+ * every metadata change (i-nodes, allocation maps, directory and extent
+ * blocks). A thread collects its changes in a transaction; at commit the
+ * transaction joins the batch being filled, and whichever committer finds
+ * the journal idle writes the whole batch as one record with a single sync
+ * (group commit), while the others wait for it. When the journal fills up,
+ * its records are applied to their home locations and it starts over
+ * (checkpoint). On mount, committed records are replayed in parallel.
+ *
+ * Records carry consecutive sequence numbers and a checksum, so a torn or
+ * stale record ends the log. File data is written through to the image
+ * before the record that makes it reachable (ordered mode).
+ *
+ * Records are in commit order, but a transaction may commit after a later
+ * one that changed the same metadata once the first released its lock. So
+ * each entry is numbered as it is logged, under that lock, and the entries
+ * are applied in that order rather than the order of the records.
+ */
+static bool journal_enabled;
+static bool journal_group_commit = true;
+static bool journal_failed;
+static pthread_mutex_t journal_lock;
+static pthread_cond_t journal_cond;
+/* Batch being filled by committers, and the one being written */
+static char *journal_pending;
+static size_t journal_pending_len;
+static char *journal_flushing_buf;
+static bool journal_flushing;
+static uint64_t journal_pending_batch;
+static uint64_t journal_committed_batch;
+/* When (in ms) the first transaction of the pending batch joined it, with
+ * commits deferred (see write-back) */
+static uint64_t journal_pending_since;
+/* In-memory copy of the journal region, replayed at checkpoints */
+static char *journal_log_copy;
+static size_t journal_head;
+static uint64_t journal_sequence;
+static uint64_t journal_offset;
+static size_t journal_size;
+static uint64_t journal_data_offset;
+/* Largest batch that fits in an empty journal */
+static size_t journal_max_batch;
+/* Sequence number of the next entry logged */
+static atomic_uint_fast64_t journal_next_entry;
+
+/* Run of data blocks freed by a transaction. It goes back to the allocator
+ * only once the transaction is durable: were it reused before, a crash could
+ * replay the block as still in use by its old owner while it already holds
+ * the new one's data */
+typedef struct {
+    size_t jf_start;
+    size_t jf_count;
+} journal_free_t;
+
+/* Runs freed by the transactions of the pending batch, and of the one being
+ * written */
+static journal_free_t *journal_pending_frees;
+static size_t journal_pending_free_count;
+static size_t journal_pending_free_cap;
+static journal_free_t *journal_flushing_frees;
+static size_t journal_flushing_free_count;
+
+static void blocks_release(size_t start, size_t count);
+
+#define JOURNAL_RECORDS_START (sizeof(journal_header_t))
+#define JOURNAL_ALIGN(n) ROUND_UP((n), sizeof(uint64_t))
+
+/* Changes made by this thread since journal_begin. Once it logs its first
+ * change, a transaction is open: it is linked in journal_open_txns (under
+ * journal_lock) until it joins a batch. Its entries are added under lock,
+ * so that a checkpoint can see them */
+typedef struct journal_txn {
+    int depth;
+    bool overflow;
+    pthread_mutex_t lock;
+    char *buf;
+    size_t len;
+    size_t cap;
+    journal_free_t *frees;
+    size_t free_count;
+    size_t free_cap;
+    bool open;
+    struct journal_txn *prev;
+    struct journal_txn *next;
+} journal_txn_t;
+
+static _Thread_local journal_txn_t journal_txn = {
+    .lock = PTHREAD_MUTEX_INITIALIZER};
+static journal_txn_t *journal_open_txns;
+
+/* FNV-1a */
+static uint64_t journal_checksum(void const *data, size_t len) {
+    unsigned char const *p = data;
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/*
+ * Finds where the committed records of a log end.
+ * Input:
+ *  - log: the records
+ *  - len: size of the log
+ *  - sequence: sequence number of the first record
+ * Returns: the size of the valid prefix of the log
+ */
+static size_t journal_scan(char const *log, size_t len, uint64_t sequence) {
+    size_t pos = 0;
+    while (len - pos >= sizeof(journal_record_t)) {
+        journal_record_t const *r = (journal_record_t const *)(log + pos);
+        if (r->jr_magic != JOURNAL_RECORD_MAGIC ||
+            r->jr_sequence != sequence ||
+            r->jr_length > len - pos - sizeof(*r) ||
+            r->jr_checksum != journal_checksum(r + 1, r->jr_length)) {
+            break;
+        }
+        pos += sizeof(*r) + r->jr_length;
+        sequence++;
+    }
+    return pos;
+}
+
+typedef struct {
+    /* Entries of the log, in the order the changes were made */
+    journal_entry_t const *const *entries;
+    size_t count;
+    /* Per data block, the sequence number of its last revoke (0 if none),
+     * NULL when the log revokes nothing */
+    uint64_t const *revoked;
+    size_t part;
+    size_t parts;
+    int error;
+} journal_apply_arg_t;
+
+static int journal_entry_compare(void const *a, void const *b) {
+    uint64_t x = (*(journal_entry_t const *const *)a)->je_sequence;
+    uint64_t y = (*(journal_entry_t const *const *)b)->je_sequence;
+    return x < y ? -1 : x > y;
+}
+
+/* Orders entries by what they are about, the last change first */
+static int journal_entry_compare_last(void const *a, void const *b) {
+    journal_entry_t const *x = *(journal_entry_t const *const *)a;
+    journal_entry_t const *y = *(journal_entry_t const *const *)b;
+    if (x->je_offset != y->je_offset) {
+        return x->je_offset < y->je_offset ? -1 : 1;
+    }
+    if (x->je_length != y->je_length) {
+        return x->je_length < y->je_length ? -1 : 1;
+    }
+    return x->je_sequence > y->je_sequence ? -1 : 1;
+}
+
+/*
+ * Lists the entries of a log in the order the changes were made. Records
+ * are in commit order, which is not that order: a transaction logs a change
+ * under the lock protecting it but may commit after a later transaction
+ * that changed the same metadata once the lock was released.
+ * Input:
+ *  - log: the records
+ *  - len: size of the log
+ *  - count: filled with the number of entries
+ * Returns: the entries (to free), NULL if out of memory or there are none
+ */
+static journal_entry_t const **journal_entries(char const *log, size_t len,
+                                               size_t *count) {
+    *count = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        journal_entry_t const **entries = NULL;
+        if (pass == 1) {
+            if (*count == 0 ||
+                (entries = malloc(*count * sizeof(*entries))) == NULL) {
+                return NULL;
+            }
+        }
+        size_t n = 0;
+        size_t pos = 0;
+        while (pos < len) {
+            journal_record_t const *r = (journal_record_t const *)(log + pos);
+            char const *p = (char const *)(r + 1);
+            char const *end = p + r->jr_length;
+            while (p < end) {
+                journal_entry_t const *e = (journal_entry_t const *)p;
+                if (entries != NULL) {
+                    entries[n] = e;
+                }
+                n++;
+                p += sizeof(*e) + ((e->je_length & JOURNAL_REVOKE)
+                                       ? 0
+                                       : JOURNAL_ALIGN(e->je_length));
+            }
+            pos += sizeof(*r) + r->jr_length;
+        }
+        *count = n;
+        if (entries != NULL) {
+            qsort(entries, n, sizeof(*entries), journal_entry_compare);
+            return entries;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Finds the last revoke of each data block among the entries of a log.
+ * Input:
+ *  - entries: the entries
+ *  - count: their number
+ *  - error: set to -1 if out of memory
+ * Returns: the table of journal_apply_arg_t.revoked, NULL if the entries
+ * revoke nothing
+ */
+static uint64_t *journal_revokes(journal_entry_t const *const *entries,
+                                 size_t count, int *error) {
+    uint64_t block_size = fs_geometry.g_block_size;
+    uint64_t *revoked = NULL;
+    for (size_t i = 0; i < count; i++) {
+        journal_entry_t const *e = entries[i];
+        if ((e->je_length & JOURNAL_REVOKE) == 0) {
+            continue;
+        }
+        if (revoked == NULL) {
+            revoked = calloc(fs_geometry.g_data_blocks, sizeof(uint64_t));
+            if (revoked == NULL) {
+                *error = -1;
+                return NULL;
+            }
+        }
+        uint64_t first = (e->je_offset - journal_data_offset) / block_size;
+        uint64_t n = (e->je_length & ~JOURNAL_REVOKE) / block_size;
+        for (uint64_t b = first; b < first + n && b < fs_geometry.g_data_blocks;
+             b++) {
+            revoked[b] = e->je_sequence;
+        }
+    }
+    return revoked;
+}
+
+/*
+ * Tells whether an entry's contents for an image block are revoked by a
+ * later change.
+ * Input:
+ *  - a: the replay
+ *  - offset: an image offset the entry writes
+ *  - sequence: the entry's sequence number
+ */
+static bool journal_revoked(journal_apply_arg_t const *a, uint64_t offset,
+                            uint64_t sequence) {
+    if (a->revoked == NULL || offset < journal_data_offset) {
+        return false;
+    }
+    uint64_t b = (offset - journal_data_offset) / fs_geometry.g_block_size;
+    return b < fs_geometry.g_data_blocks && a->revoked[b] > sequence;
+}
+
+/*
+ * Writes the after-images of a log to their home locations, restricted to
+ * the image blocks of one partition (block number modulo the number of
+ * partitions). Each block belongs to a single partition, so partitions can
+ * be applied concurrently and still see the entries in order.
+ */
+static void *journal_apply_part(void *arg) {
+    journal_apply_arg_t *a = arg;
+    uint64_t block_size = fs_geometry.g_block_size;
+    for (size_t i = 0; i < a->count; i++) {
+        journal_entry_t const *e = a->entries[i];
+        if (e->je_length & JOURNAL_REVOKE) {
+            continue;
+        }
+        char const *bytes = (char const *)(e + 1);
+        uint64_t offset = e->je_offset;
+        uint64_t left = e->je_length;
+        if (offset + left > journal_offset &&
+            offset < journal_offset + journal_size) {
+            /* Only metadata outside the journal is ever logged */
+            left = 0;
+        }
+        while (left > 0) {
+            uint64_t chunk = block_size - offset % block_size;
+            if (chunk > left) {
+                chunk = left;
+            }
+            if ((offset / block_size) % a->parts == a->part &&
+                !journal_revoked(a, offset, e->je_sequence) &&
+                pwrite(image_fd, bytes, chunk, (off_t)offset) !=
+                    (ssize_t)chunk) {
+                a->error = -1;
+            }
+            offset += chunk;
+            bytes += chunk;
+            left -= chunk;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Applies the entries of a log of committed records to the image, in the
+ * order the changes were made, with one thread per partition and waits for
+ * it to be durable.
+ * Input:
+ *  - entries: the entries, as listed by journal_entries
+ *  - count: their number
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int journal_apply(journal_entry_t const *const *entries,
+                         size_t count) {
+    pthread_t threads[JOURNAL_REPLAY_THREADS];
+    bool started[JOURNAL_REPLAY_THREADS];
+    journal_apply_arg_t args[JOURNAL_REPLAY_THREADS];
+
+    int ret = 0;
+    uint64_t *revoked = journal_revokes(entries, count, &ret);
+    if (ret == -1) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < JOURNAL_REPLAY_THREADS; i++) {
+        args[i].entries = entries;
+        args[i].count = count;
+        args[i].revoked = revoked;
+        args[i].part = i;
+        args[i].parts = JOURNAL_REPLAY_THREADS;
+        args[i].error = 0;
+        started[i] =
+            pthread_create(&threads[i], NULL, journal_apply_part, &args[i]) ==
+            0;
+        if (!started[i]) {
+            journal_apply_part(&args[i]);
+        }
+    }
+
+    for (size_t i = 0; i < JOURNAL_REPLAY_THREADS; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        if (args[i].error == -1) {
+            ret = -1;
+        }
+    }
+    free(revoked);
+    if (fdatasync(image_fd) == -1) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * Opens a transaction, listing it in journal_open_txns.
+ */
+static void journal_txn_open(journal_txn_t *txn) {
+    pthread_mutex_lock(&journal_lock);
+    txn->open = true;
+    txn->prev = NULL;
+    txn->next = journal_open_txns;
+    if (journal_open_txns != NULL) {
+        journal_open_txns->prev = txn;
+    }
+    journal_open_txns = txn;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+/* Closes a transaction, with journal_lock held */
+static void journal_txn_close(journal_txn_t *txn) {
+    if (txn->prev != NULL) {
+        txn->prev->next = txn->next;
+    } else {
+        journal_open_txns = txn->next;
+    }
+    if (txn->next != NULL) {
+        txn->next->prev = txn->prev;
+    }
+    txn->open = false;
+}
+
+/* Bytes [js_start, js_end) of the image */
+typedef struct {
+    uint64_t js_start;
+    uint64_t js_end;
+} journal_span_t;
+
+typedef struct {
+    journal_span_t *spans;
+    size_t count;
+    size_t cap;
+    bool overflow;
+} journal_spans_t;
+
+/* Image bytes an entry is about: the ones it writes, or the blocks it
+ * revokes */
+static journal_span_t journal_entry_span(journal_entry_t const *e) {
+    journal_span_t span = {e->je_offset,
+                           e->je_offset + (e->je_length & ~JOURNAL_REVOKE)};
+    return span;
+}
+
+/* Adds the spans of a run of entries to a list */
+static void journal_spans_add(journal_spans_t *list, char const *entries,
+                              size_t len) {
+    for (char const *p = entries; p < entries + len;) {
+        journal_entry_t const *e = (journal_entry_t const *)p;
+        if (list->count == list->cap) {
+            size_t cap = list->cap == 0 ? 64 : 2 * list->cap;
+            journal_span_t *spans =
+                realloc(list->spans, cap * sizeof(*spans));
+            if (spans == NULL) {
+                list->overflow = true;
+                return;
+            }
+            list->spans = spans;
+            list->cap = cap;
+        }
+        list->spans[list->count++] = journal_entry_span(e);
+        p += sizeof(*e) + ((e->je_length & JOURNAL_REVOKE)
+                               ? 0
+                               : JOURNAL_ALIGN(e->je_length));
+    }
+}
+
+static int journal_span_compare(void const *a, void const *b) {
+    uint64_t x = ((journal_span_t const *)a)->js_start;
+    uint64_t y = ((journal_span_t const *)b)->js_start;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Lists the metadata changed by transactions that have not reached the
+ * journal: the batch being written, the pending one and the open ones. The
+ * spans come out sorted and disjoint.
+ * Input:
+ *  - batch: the batch being written
+ *  - len: its size
+ *  - list: filled with the spans
+ * Returns: 0 if successful, -1 if out of memory
+ */
+static int journal_spans_busy(char const *batch, size_t len,
+                              journal_spans_t *list) {
+    journal_spans_add(list, batch, len);
+    pthread_mutex_lock(&journal_lock);
+    journal_spans_add(list, journal_pending, journal_pending_len);
+    for (journal_txn_t *txn = journal_open_txns; txn != NULL;
+         txn = txn->next) {
+        pthread_mutex_lock(&txn->lock);
+        journal_spans_add(list, txn->buf, txn->len);
+        pthread_mutex_unlock(&txn->lock);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    if (list->overflow) {
+        return -1;
+    }
+
+    qsort(list->spans, list->count, sizeof(*list->spans),
+          journal_span_compare);
+    size_t merged = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        journal_span_t span = list->spans[i];
+        if (merged > 0 && span.js_start <= list->spans[merged - 1].js_end) {
+            if (span.js_end > list->spans[merged - 1].js_end) {
+                list->spans[merged - 1].js_end = span.js_end;
+            }
+        } else {
+            list->spans[merged++] = span;
+        }
+    }
+    list->count = merged;
+    return 0;
+}
+
+/* Finds the first span of a sorted, disjoint list ending past an offset */
+static size_t journal_spans_find(journal_spans_t const *list,
+                                 uint64_t offset) {
+    size_t lo = 0;
+    size_t hi = list->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (list->spans[mid].js_end <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Tells whether an entry is about bytes in a sorted, disjoint list */
+static bool journal_spans_overlap(journal_spans_t const *list,
+                                  journal_entry_t const *e) {
+    journal_span_t span = journal_entry_span(e);
+    size_t i = journal_spans_find(list, span.js_start);
+    return i < list->count && list->spans[i].js_start < span.js_end;
+}
+
+/* Adds an entry's span to a sorted, disjoint list, merging the spans it
+ * overlaps */
+static void journal_spans_insert(journal_spans_t *list,
+                                 journal_entry_t const *e) {
+    journal_span_t span = journal_entry_span(e);
+    size_t i = journal_spans_find(list, span.js_start);
+    size_t j = i;
+    while (j < list->count && list->spans[j].js_start <= span.js_end) {
+        if (list->spans[j].js_start < span.js_start) {
+            span.js_start = list->spans[j].js_start;
+        }
+        if (list->spans[j].js_end > span.js_end) {
+            span.js_end = list->spans[j].js_end;
+        }
+        j++;
+    }
+    if (i == j && list->count == list->cap) {
+        size_t cap = list->cap == 0 ? 64 : 2 * list->cap;
+        journal_span_t *spans = realloc(list->spans, cap * sizeof(*spans));
+        if (spans == NULL) {
+            list->overflow = true;
+            return;
+        }
+        list->spans = spans;
+        list->cap = cap;
+    }
+    /* Spans i to j - 1 become the one span */
+    memmove(&list->spans[i + 1], &list->spans[j],
+            (list->count - j) * sizeof(*list->spans));
+    list->count = list->count - (j - i) + 1;
+    list->spans[i] = span;
+}
+
+/*
+ * Applies the records in the journal and empties it. Bumping the sequence
+ * number in the header turns the old records stale.
+ * A transaction that has not reached the journal may hold entries older
+ * than ones applied here, for the same metadata. The entries applied for
+ * what such transactions changed are thus carried over into the emptied
+ * journal, as its first record, to be applied again after theirs.
+ * Input:
+ *  - busy: the metadata changed by those transactions (NULL if none)
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int journal_checkpoint(journal_spans_t *busy) {
+    size_t count;
+    journal_entry_t const **entries =
+        journal_entries(journal_log_copy + JOURNAL_RECORDS_START,
+                        journal_head - JOURNAL_RECORDS_START, &count);
+    if (count > 0 && (entries == NULL || journal_apply(entries, count) == -1)) {
+        free(entries);
+        return -1;
+    }
+
+    /* Gathers the entries carried over after the header and the record.
+     * An entry carried over must be followed by every later one for the
+     * same bytes, so that it does not undo them; for each piece of metadata,
+     * only the last one is needed */
+    size_t candidates = 0;
+    for (size_t i = 0; busy != NULL && i < count; i++) {
+        if (journal_spans_overlap(busy, entries[i])) {
+            journal_spans_insert(busy, entries[i]);
+            entries[candidates++] = entries[i];
+        }
+    }
+    if (busy != NULL && busy->overflow) {
+        free(entries);
+        return -1;
+    }
+    qsort(entries, candidates, sizeof(*entries), journal_entry_compare_last);
+    size_t carried = 0;
+    char *carry = NULL;
+    for (size_t i = 0; i < candidates; i++) {
+        journal_entry_t const *e = entries[i];
+        if (i > 0 && entries[i - 1]->je_offset == e->je_offset &&
+            entries[i - 1]->je_length == e->je_length) {
+            continue;
+        }
+        size_t size = sizeof(*e) + ((e->je_length & JOURNAL_REVOKE)
+                                        ? 0
+                                        : JOURNAL_ALIGN(e->je_length));
+        if (carry == NULL &&
+            (carry = malloc(journal_head - JOURNAL_RECORDS_START)) == NULL) {
+            free(entries);
+            return -1;
+        }
+        memcpy(carry + carried, e, size);
+        carried += size;
+    }
+    free(entries);
+
+    journal_header_t header = {JOURNAL_MAGIC, journal_sequence};
+    memcpy(journal_log_copy, &header, sizeof(header));
+    size_t head = JOURNAL_RECORDS_START;
+    if (carried > 0) {
+        journal_record_t record = {JOURNAL_RECORD_MAGIC, journal_sequence,
+                                   carried, journal_checksum(carry, carried)};
+        memcpy(journal_log_copy + head, &record, sizeof(record));
+        memcpy(journal_log_copy + head + sizeof(record), carry, carried);
+        head += sizeof(record) + carried;
+    }
+    free(carry);
+    if (pwrite(image_fd, journal_log_copy, head, (off_t)journal_offset) !=
+            (ssize_t)head ||
+        fdatasync(image_fd) == -1) {
+        return -1;
+    }
+    journal_head = head;
+    if (carried > 0) {
+        journal_sequence++;
+    }
+    return 0;
+}
+
+/*
+ * Appends a batch of transactions to the journal as one record.
+ * Called by the group commit leader only, without holding journal_lock.
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int journal_write(char const *batch, size_t len) {
+    journal_record_t record = {JOURNAL_RECORD_MAGIC, journal_sequence, len,
+                               journal_checksum(batch, len)};
+    size_t size = sizeof(record) + len;
+    if (journal_head + size > journal_size) {
+        journal_spans_t busy = {NULL, 0, 0, false};
+        int ret = journal_spans_busy(batch, len, &busy) == -1 ||
+                          journal_checkpoint(&busy) == -1 ||
+                          journal_head + size > journal_size
+                      ? -1
+                      : 0;
+        free(busy.spans);
+        if (ret == -1) {
+            return -1;
+        }
+        record.jr_sequence = journal_sequence;
+    }
+
+    /* File data written to the device must be durable before the record
+     * that makes it reachable; with write-back, the data of the batch may
+     * still be dirty, so every dirty block is written back first */
+    if (writeback_enabled &&
+        blocks_writeback(0, fs_geometry.g_data_blocks, 0, true) == -1) {
+        return -1;
+    }
+    if (device->bd_flush() == -1) {
+        return -1;
+    }
+    char *dest = journal_log_copy + journal_head;
+    memcpy(dest, &record, sizeof(record));
+    memcpy(dest + sizeof(record), batch, len);
+    if (pwrite(image_fd, dest, size, (off_t)(journal_offset + journal_head)) !=
+            (ssize_t)size ||
+        fdatasync(image_fd) == -1) {
+        return -1;
+    }
+    journal_head += size;
+    journal_sequence++;
+    return 0;
+}
+
+/*
+ * Sets up the journal of an image: writes an empty one on a new volume, or
+ * replays the committed records of an existing one.
+ * Input:
+ *  - layout: the volume layout
+ *  - format: whether the volume is being formatted
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int journal_open(superblock_t const *layout, int format) {
+    journal_offset = layout->s_journal_offset;
+    journal_size = (size_t)layout->s_journal_size;
+    journal_data_offset = layout->s_data_offset;
+    journal_max_batch =
+        journal_size - JOURNAL_RECORDS_START - sizeof(journal_record_t);
+    journal_log_copy = malloc(journal_size);
+    journal_pending = malloc(journal_max_batch);
+    journal_flushing_buf = malloc(journal_max_batch);
+    if (journal_log_copy == NULL || journal_pending == NULL ||
+        journal_flushing_buf == NULL) {
+        return -1;
+    }
+    journal_pending_len = 0;
+    journal_flushing = false;
+    journal_failed = false;
+    journal_pending_batch = 1;
+    journal_committed_batch = 0;
+    journal_pending_since = 0;
+    journal_head = JOURNAL_RECORDS_START;
+    journal_sequence = 1;
+    atomic_store(&journal_next_entry, 1);
+    journal_open_txns = NULL;
+
+    if (!format) {
+        if (pread(image_fd, journal_log_copy, journal_size,
+                  (off_t)journal_offset) != (ssize_t)journal_size) {
+            return -1;
+        }
+        journal_header_t const *header =
+            (journal_header_t const *)journal_log_copy;
+        if (header->jh_magic != JOURNAL_MAGIC) {
+            return -1;
+        }
+        /* Counts the committed records, which the checkpoint replays */
+        journal_sequence = header->jh_sequence;
+        char const *log = journal_log_copy + JOURNAL_RECORDS_START;
+        size_t len = journal_size - JOURNAL_RECORDS_START;
+        size_t valid = journal_scan(log, len, journal_sequence);
+        for (size_t pos = 0; pos < valid;) {
+            journal_record_t const *r = (journal_record_t const *)(log + pos);
+            pos += sizeof(*r) + r->jr_length;
+            journal_sequence++;
+        }
+        journal_head = JOURNAL_RECORDS_START + valid;
+    }
+
+    if (journal_checkpoint(NULL) == -1) {
+        return -1;
+    }
+
+    pthread_mutex_init(&journal_lock, NULL);
+    pthread_cond_init(&journal_cond, NULL);
+    journal_enabled = true;
+    return 0;
+}
+
+static void journal_close() {
+    if (journal_enabled) {
+        journal_checkpoint(NULL);
+        pthread_mutex_destroy(&journal_lock);
+        pthread_cond_destroy(&journal_cond);
+        journal_enabled = false;
+    }
+    free(journal_log_copy);
+    free(journal_pending);
+    free(journal_flushing_buf);
+    free(journal_pending_frees);
+    journal_log_copy = NULL;
+    journal_pending_frees = NULL;
+    journal_pending_free_count = 0;
+    journal_pending_free_cap = 0;
+    journal_pending = NULL;
+    journal_flushing_buf = NULL;
+}
+
+/*
+ * Starts (or nests into) a transaction of the calling thread. The metadata
+ * changes logged until the matching journal_commit are made durable
+ * atomically.
+ */
+void journal_begin() { journal_txn.depth++; }
+
+/*
+ * Tells whether the calling thread's transaction has grown past half of the
+ * largest batch the journal takes, so that a long run of changes gathered
+ * into one transaction should be committed before it adds more.
+ */
+bool journal_txn_large() {
+    return journal_enabled &&
+           (journal_txn.overflow || journal_txn.len > journal_max_batch / 2);
+}
+
+/*
+ * Adds an entry to the calling thread's transaction.
+ * Input:
+ *  - ptr: start of the metadata the entry is about
+ *  - len: number of bytes of it the entry carries
+ *  - length: the entry's je_length
+ */
+static void journal_add(void const *ptr, size_t len, uint64_t length) {
+    if (!journal_enabled) {
+        return;
+    }
+
+    journal_txn_t *txn = &journal_txn;
+    bool lone = txn->depth == 0;
+    if (lone) {
+        journal_begin();
+    }
+    if (!txn->open) {
+        journal_txn_open(txn);
+    }
+
+    size_t size = sizeof(journal_entry_t) + JOURNAL_ALIGN(len);
+    pthread_mutex_lock(&txn->lock);
+    if (txn->len + size > txn->cap) {
+        size_t cap = txn->cap == 0 ? fs_geometry.g_block_size : txn->cap;
+        while (cap < txn->len + size) {
+            cap *= 2;
+        }
+        char *buf = realloc(txn->buf, cap);
+        if (buf == NULL) {
+            txn->overflow = true;
+        } else {
+            txn->buf = buf;
+            txn->cap = cap;
+        }
+    }
+    if (!txn->overflow) {
+        journal_entry_t entry = {(uint64_t)((char const *)ptr - image),
+                                 length,
+                                 atomic_fetch_add(&journal_next_entry, 1)};
+        char *dest = txn->buf + txn->len;
+        memcpy(dest, &entry, sizeof(entry));
+        memcpy(dest + sizeof(entry), ptr, len);
+        memset(dest + sizeof(entry) + len, 0, JOURNAL_ALIGN(len) - len);
+        txn->len += size;
+    }
+    pthread_mutex_unlock(&txn->lock);
+
+    if (lone) {
+        journal_commit();
+    }
+}
+
+/*
+ * Logs the new contents of a piece of metadata, which must lie in the
+ * volume image. Called after the change, while still holding the lock that
+ * protects it. A change logged outside a transaction is committed on its own.
+ * Input:
+ *  - ptr: start of the changed metadata
+ *  - len: its size
+ */
+void journal_log(void const *ptr, size_t len) {
+    journal_add(ptr, len, len);
+}
+
+/*
+ * Logs that a run of data blocks was freed, so that no earlier entry for
+ * them (as directory blocks) is replayed over the file data they may hold
+ * next.
+ * Input:
+ *  - start: first block of the run
+ *  - count: number of blocks
+ */
+static void journal_revoke(size_t start, size_t count) {
+    size_t block_size = fs_geometry.g_block_size;
+    journal_add(fs_data + start * block_size, 0,
+                JOURNAL_REVOKE | (uint64_t)(count * block_size));
+}
+
+/*
+ * Appends a run of freed blocks to a list of them. On lack of memory the run
+ * is left out, and so never reused until the volume is attached again.
+ * Input:
+ *  - list, count, cap: the list
+ *  - start: first block of the run
+ *  - n: number of blocks
+ */
+static void journal_frees_add(journal_free_t **list, size_t *count,
+                              size_t *cap, size_t start, size_t n) {
+    if (*count == *cap) {
+        size_t new_cap = *cap == 0 ? 16 : *cap * 2;
+        journal_free_t *frees = realloc(*list, new_cap * sizeof(**list));
+        if (frees == NULL) {
+            return;
+        }
+        *list = frees;
+        *cap = new_cap;
+    }
+    (*list)[(*count)++] = (journal_free_t){start, n};
+}
+
+/*
+ * Hands a run of data blocks, just freed in the calling thread's
+ * transaction, back to the allocator once the transaction is durable.
+ * Input:
+ *  - start: first block of the run
+ *  - count: number of blocks
+ */
+static void journal_release(size_t start, size_t count) {
+    if (!journal_enabled) {
+        blocks_release(start, count);
+        return;
+    }
+    journal_txn_t *txn = &journal_txn;
+    journal_frees_add(&txn->frees, &txn->free_count, &txn->free_cap, start,
+                      count);
+}
+
+/*
+ * Becomes the group commit leader: takes the pending batch and writes it.
+ * Called with journal_lock held and no batch being written; returns with
+ * it held again.
+ */
+static void journal_lead() {
+    journal_flushing = true;
+    char *buf = journal_pending;
+    size_t len = journal_pending_len;
+    uint64_t flushed = journal_pending_batch++;
+    journal_pending = journal_flushing_buf;
+    journal_pending_len = 0;
+    journal_pending_since = 0;
+    journal_flushing_buf = buf;
+    journal_flushing_frees = journal_pending_frees;
+    journal_flushing_free_count = journal_pending_free_count;
+    journal_pending_frees = NULL;
+    journal_pending_free_count = 0;
+    journal_pending_free_cap = 0;
+    /* Once the journal failed, no batch is written: it could make part of a
+     * transaction that was lost durable */
+    bool failed = journal_failed;
+    pthread_cond_broadcast(&journal_cond);
+    pthread_mutex_unlock(&journal_lock);
+
+    int ret = failed ? -1 : journal_write(buf, len);
+
+    /* Without journal_lock, which comes after free_blocks_lock. Blocks freed
+     * by a batch that failed are not reused */
+    if (ret == 0) {
+        for (size_t i = 0; i < journal_flushing_free_count; i++) {
+            blocks_release(journal_flushing_frees[i].jf_start,
+                           journal_flushing_frees[i].jf_count);
+        }
+    }
+    free(journal_flushing_frees);
+
+    pthread_mutex_lock(&journal_lock);
+    journal_flushing_frees = NULL;
+    journal_flushing_free_count = 0;
+    if (ret == -1) {
+        /* The journal no longer matches memory; refuses further commits */
+        journal_failed = true;
+    }
+    journal_committed_batch = flushed;
+    journal_flushing = false;
+    pthread_cond_broadcast(&journal_cond);
+}
+
+/*
+ * Makes the transactions committed so far durable, when commits are
+ * deferred (see write-back): writes the pending batch, if it has waited
+ * long enough, and waits for the batch being written.
+ * Input:
+ *  - min_age: how long (in ms) the pending batch must have waited
+ * Returns: 0 if successful, -1 if the journal has failed
+ */
+static int journal_sync(uint64_t min_age) {
+    if (!journal_enabled) {
+        return 0;
+    }
+    pthread_mutex_lock(&journal_lock);
+    uint64_t batch = journal_pending_batch - 1;
+    if (journal_pending_len > 0 &&
+        monotonic_ms() - journal_pending_since >= min_age) {
+        batch = journal_pending_batch;
+    }
+    while (journal_committed_batch < batch && !journal_failed) {
+        if (journal_flushing) {
+            pthread_cond_wait(&journal_cond, &journal_lock);
+        } else {
+            journal_lead();
+        }
+    }
+    int ret = journal_failed ? -1 : 0;
+    pthread_mutex_unlock(&journal_lock);
+    return ret;
+}
+
+/*
+ * Makes durable the transactions that freed blocks not yet handed back to
+ * the allocator, for when it runs out of them (with write-back, they wait
+ * for the flusher otherwise).
+ * Returns: whether there were any
+ */
+static bool journal_sync_frees() {
+    if (!journal_enabled) {
+        return false;
+    }
+    pthread_mutex_lock(&journal_lock);
+    bool pending =
+        journal_pending_free_count > 0 || journal_flushing_free_count > 0;
+    pthread_mutex_unlock(&journal_lock);
+    if (pending) {
+        journal_sync(0);
+    }
+    return pending;
+}
+
+/*
+ * Ends a transaction of the calling thread. The outermost commit returns
+ * once the transaction is durable, possibly written by another thread
+ * together with other transactions; with write-back, as soon as it joins
+ * the pending batch.
+ * Returns: 0 if successful, -1 if the transaction could not be made durable
+ */
+int journal_commit() {
+    journal_txn_t *txn = &journal_txn;
+    if (txn->depth == 0 || --txn->depth > 0) {
+        return 0;
+    }
+    bool overflow = txn->overflow || txn->len > journal_max_batch;
+    txn->overflow = false;
+    if (overflow || !journal_enabled || txn->len == 0) {
+        if (txn->open || overflow) {
+            pthread_mutex_lock(&journal_lock);
+            if (txn->open) {
+                journal_txn_close(txn);
+            }
+            /* The changes of a transaction that overflowed are already made
+             * in memory: committing any later one could make part of them
+             * durable, so the journal takes no more */
+            if (overflow) {
+                journal_failed = true;
+                pthread_cond_broadcast(&journal_cond);
+            }
+            pthread_mutex_unlock(&journal_lock);
+        }
+        /* The blocks freed by a transaction that overflowed are not reused,
+         * as it may not be durable */
+        for (size_t i = 0; i < txn->free_count && !overflow; i++) {
+            blocks_release(txn->frees[i].jf_start, txn->frees[i].jf_count);
+        }
+        txn->free_count = 0;
+        txn->len = 0;
+        return overflow ? -1 : 0;
+    }
+
+    pthread_mutex_lock(&journal_lock);
+    if (!journal_group_commit) {
+        /* One transaction per record: waits for the journal to be idle and
+         * writes its own record right away */
+        while (journal_flushing) {
+            pthread_cond_wait(&journal_cond, &journal_lock);
+        }
+    }
+    while (journal_pending_len + txn->len > journal_max_batch) {
+        if (writeback_enabled && !journal_flushing) {
+            /* Nobody else writes a deferred batch that is full */
+            journal_lead();
+            continue;
+        }
+        pthread_cond_wait(&journal_cond, &journal_lock);
+    }
+    if (journal_pending_len == 0) {
+        journal_pending_since = monotonic_ms();
+    }
+    memcpy(journal_pending + journal_pending_len, txn->buf, txn->len);
+    journal_pending_len += txn->len;
+    txn->len = 0;
+    for (size_t i = 0; i < txn->free_count; i++) {
+        journal_frees_add(&journal_pending_frees, &journal_pending_free_count,
+                          &journal_pending_free_cap, txn->frees[i].jf_start,
+                          txn->frees[i].jf_count);
+    }
+    txn->free_count = 0;
+    journal_txn_close(txn);
+    uint64_t batch = journal_pending_batch;
+
+    while (!writeback_enabled && journal_committed_batch < batch &&
+           !journal_failed) {
+        if (journal_flushing) {
+            pthread_cond_wait(&journal_cond, &journal_lock);
+        } else {
+            journal_lead();
+        }
+    }
+    int ret = journal_failed ? -1 : 0;
+    pthread_mutex_unlock(&journal_lock);
+    return ret;
+}
+
+/*
+ * Chooses whether concurrent transactions share journal records and syncs
+ * (the default) or each one is written and synced on its own.
+ */
+void journal_set_group_commit(bool enabled) {
+    if (journal_enabled) {
+        pthread_mutex_lock(&journal_lock);
+        journal_group_commit = enabled;
+        pthread_mutex_unlock(&journal_lock);
+    } else {
+        journal_group_commit = enabled;
+    }
+}
+
+/* Writes back the dirty blocks of one flusher's range of blocks, and the
+ * pending journal batch, as they age or when kicked */
+static void *writeback_worker(void *arg) {
+    size_t part = (size_t)arg;
+    size_t first = fs_geometry.g_data_blocks * part / WRITEBACK_THREADS;
+    size_t end = fs_geometry.g_data_blocks * (part + 1) / WRITEBACK_THREADS;
+    uint64_t kicks = 0;
+    pthread_mutex_lock(&writeback_lock);
+    while (!writeback_stopping) {
+        if (writeback_kicks == kicks) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += WRITEBACK_INTERVAL_MS * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&writeback_cond, &writeback_lock,
+                                   &deadline);
+            if (writeback_stopping) {
+                break;
+            }
+        }
+        bool all = writeback_kicks != kicks ||
+                   atomic_load(&dirty_blocks) > dirty_soft_limit;
+        kicks = writeback_kicks;
+        pthread_mutex_unlock(&writeback_lock);
+
+        uint64_t min_age = all ? 0 : WRITEBACK_AGE_MS;
+        blocks_writeback(first, end, min_age, false);
+        if (part == 0) {
+            journal_sync(min_age);
+        }
+
+        pthread_mutex_lock(&writeback_lock);
+    }
+    pthread_mutex_unlock(&writeback_lock);
+    return NULL;
+}
+
+/*
+ * Wakes the flusher threads up to write back every dirty block, and
+ * returns at once. Does nothing without write-back.
+ */
+void writeback_kick() {
+    if (!writeback_enabled) {
+        return;
+    }
+    pthread_mutex_lock(&writeback_lock);
+    writeback_kicks++;
+    pthread_cond_broadcast(&writeback_cond);
+    pthread_mutex_unlock(&writeback_lock);
+}
+
+/*
+ * Syncs: state_sync requests so far and the last one covered by a finished
+ * sync, whether a sync is under way, and syncs carried out
+ */
+static pthread_mutex_t sync_lock;
+static pthread_cond_t sync_cond;
+static uint64_t sync_requested;
+static uint64_t sync_done;
+static bool sync_running;
+static bool sync_failed;
+static uint64_t sync_rounds;
+
+/* Writes back every dirty block, writes the pending journal batch and
+ * flushes the block device */
+static int state_sync_now() {
+    int ret = 0;
+    if (writeback_enabled &&
+        blocks_writeback(0, fs_geometry.g_data_blocks, 0, true) == -1) {
+        ret = -1;
+    }
+    if (journal_sync(0) == -1 || device->bd_flush() == -1 ||
+        atomic_load(&writeback_failed)) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * Makes everything written so far durable. Syncs requested together share
+ * one (group commit): while a sync is under way, the requests that arrive
+ * wait for it to end, and then one of them syncs for all of them. Without
+ * group commit (see journal_set_group_commit), each request syncs on its
+ * own. Once a sync fails, every later one fails too, as what it should
+ * have made durable may be lost.
+ * Returns: 0 if successful, -1 otherwise
+ */
+int state_sync() {
+    pthread_mutex_lock(&sync_lock);
+    uint64_t ticket = ++sync_requested;
+    bool synced = false;
+    while (journal_group_commit ? sync_done < ticket : !synced) {
+        if (sync_running) {
+            pthread_cond_wait(&sync_cond, &sync_lock);
+            continue;
+        }
+        /* Syncs for every request made so far */
+        sync_running = true;
+        sync_rounds++;
+        uint64_t covered = journal_group_commit ? sync_requested : ticket;
+        pthread_mutex_unlock(&sync_lock);
+
+        int ret = state_sync_now();
+
+        pthread_mutex_lock(&sync_lock);
+        if (ret == -1) {
+            sync_failed = true;
+        }
+        if (covered > sync_done) {
+            sync_done = covered;
+        }
+        sync_running = false;
+        synced = true;
+        pthread_cond_broadcast(&sync_cond);
+    }
+    int ret = sync_failed ? -1 : 0;
+    pthread_mutex_unlock(&sync_lock);
+    return ret;
+}
+
+/*
+ * Reads the sync counters
+ * Input:
+ *  - stats: where to store them
+ */
+void state_sync_stats(sync_stats_t *stats) {
+    pthread_mutex_lock(&sync_lock);
+    stats->ss_requests = sync_requested;
+    stats->ss_syncs = sync_rounds;
+    pthread_mutex_unlock(&sync_lock);
+}
+
+static void sync_init() {
+    pthread_mutex_init(&sync_lock, NULL);
+    pthread_cond_init(&sync_cond, NULL);
+    sync_requested = 0;
+    sync_done = 0;
+    sync_running = false;
+    sync_failed = false;
+    sync_rounds = 0;
+}
+
+static void sync_destroy() {
+    pthread_mutex_destroy(&sync_lock);
+    pthread_cond_destroy(&sync_cond);
+}
+
+/* Stops the flusher threads, once they are done, and writes back what
+ * is left */
+static void writeback_stop() {
+    if (!writeback_enabled) {
+        return;
+    }
+    pthread_mutex_lock(&writeback_lock);
+    writeback_stopping = true;
+    pthread_cond_broadcast(&writeback_cond);
+    pthread_mutex_unlock(&writeback_lock);
+    for (size_t i = 0; i < writeback_started; i++) {
+        pthread_join(writeback_threads[i], NULL);
+    }
+    state_sync();
+    writeback_enabled = false;
+    pthread_mutex_destroy(&writeback_lock);
+    pthread_cond_destroy(&writeback_cond);
+    pthread_rwlock_destroy(&writeback_barrier);
+}
+
+/*
+ * Starts the flusher threads, for write-back. Without all of them, data is
+ * written through instead.
+ * Input:
+ *  - enabled: whether to use write-back
+ */
+static void writeback_start(bool enabled) {
+    writeback_enabled = false;
+    atomic_store(&dirty_blocks, 0);
+    atomic_store(&written_back_blocks, 0);
+    atomic_store(&writeback_requests, 0);
+    atomic_store(&writeback_failed, false);
+    if (!enabled) {
+        return;
+    }
+    dirty_soft_limit =
+        fs_geometry.g_cache_blocks * WRITEBACK_DIRTY_PERCENT / 100;
+    dirty_hard_limit =
+        fs_geometry.g_cache_blocks * WRITEBACK_DIRTY_MAX_PERCENT / 100 + 1;
+    pthread_mutex_init(&writeback_lock, NULL);
+    pthread_cond_init(&writeback_cond, NULL);
+    pthread_rwlock_init(&writeback_barrier, NULL);
+    writeback_stopping = false;
+    writeback_kicks = 0;
+    writeback_enabled = true;
+    for (writeback_started = 0; writeback_started < WRITEBACK_THREADS;
+         writeback_started++) {
+        if (pthread_create(&writeback_threads[writeback_started], NULL,
+                           writeback_worker,
+                           (void *)writeback_started) != 0) {
+            writeback_stop();
+            return;
+        }
+    }
+}
+
+/*
+ * Writes file data, already copied to data blocks, to the block device, in
+ * whole blocks. The blocks must be pinned (see data_blocks_pin). The data
+ * becomes durable with the next journal commit, or, with write-back, with
+ * the next state_sync: it is only marked dirty here, and the caller writes
+ * dirty blocks back itself when too many are.
+ * Input:
+ *  - ptr: start of the data, inside a run of data blocks
+ *  - len: its size
+ * Returns: 0 if successful, -1 otherwise
+ */
+int data_blocks_persist(void const *ptr, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    size_t offset = (size_t)((char const *)ptr - fs_data);
+    size_t first = block_index(offset);
+    size_t count = blocks_for(offset + len) - first;
+    if (!writeback_enabled) {
+        block_request_t request = {(int)first, count,
+                                   &fs_data[first * fs_geometry.g_block_size],
+                                   true};
+        return device->bd_submit_batch(&request, 1);
+    }
+
+    uint64_t now = monotonic_ms();
+    for (int b = (int)first; b < (int)(first + count); b++) {
+        cache_shard_t *shard = cache_shard(b);
+        pthread_mutex_lock(&shard->cs_lock);
+        cache_entry_t *entry = &shard->cs_entries[cache_lookup(shard, b)];
+        if (!entry->ce_dirty) {
+            entry->ce_dirty = true;
+            entry->ce_dirtied = now;
+            atomic_fetch_add(&dirty_blocks, 1);
+        }
+        pthread_mutex_unlock(&shard->cs_lock);
+    }
+
+    size_t dirty = atomic_load(&dirty_blocks);
+    if (dirty > dirty_hard_limit) {
+        return blocks_writeback(0, fs_geometry.g_data_blocks, 0, false);
+    }
+    if (dirty > dirty_soft_limit) {
+        writeback_kick();
+    }
+    return 0;
+}
+
+/*
+ * Copies file data, in place in data blocks, to a file outside the FS
+ * straight from the image, in the kernel (copy_file_range), when the FS is
+ * backed by one.
+ * Input:
+ *  - ptr: start of the data, inside a run of data blocks
+ *  - len: its size
+ *  - fd: the file to copy to, at its offset (which moves past the data)
+ * Returns: the number of bytes copied, short of len (down to 0) when the FS
+ * only lives in memory or the kernel cannot copy between the two files, so
+ * the caller writes the rest itself; -1 on error
+ */
+ssize_t data_blocks_export(void const *ptr, size_t len, int fd) {
+    /* With write-back, the image may not hold the data yet */
+    if (image_fd == -1 || writeback_enabled) {
+        return 0;
+    }
+    off64_t offset = (off64_t)((char const *)ptr - image);
+    size_t copied = 0;
+    while (copied < len) {
+        ssize_t ret =
+            copy_file_range(image_fd, &offset, fd, NULL, len - copied, 0);
+        if (ret == -1) {
+            if (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                errno == EOPNOTSUPP || errno == EBADF) {
+                break;
+            }
+            return -1;
+        }
+        if (ret == 0) {
+            break;
+        }
+        copied += (size_t)ret;
+    }
+    return (ssize_t)copied;
+}
+
+/*
+ * Fills a parameters struct with the default geometry (see config.h), for a
+ * volume that only lives in memory
+ */
+void state_default_params(tfs_params_t *params) {
+    params->image_path = NULL;
+    params->block_size = BLOCK_SIZE;
+    params->data_blocks = DATA_BLOCKS;
+    params->inode_table_size = INODE_TABLE_SIZE;
+    params->max_open_files = MAX_OPEN_FILES;
+    params->journal_blocks = JOURNAL_BLOCKS;
+    params->read_ahead = true;
+    params->write_back = false;
+    params->cache_blocks = BLOCK_CACHE_SLOTS;
+    params->device = TFS_DEVICE_DEFAULT;
+}
+
+/*
+ * Allocates the volatile tables sized by the geometry: the directory of
+ * i-node chunks and the open file table.
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int state_tables_alloc() {
+    inode_chunks = calloc((fs_geometry.g_inode_table_size + INODE_CHUNK - 1) /
+                              INODE_CHUNK,
+                          sizeof(*inode_chunks));
+    open_file_segments_count =
+        (fs_geometry.g_max_open_files + OPEN_FILE_SEGMENT - 1) /
+        OPEN_FILE_SEGMENT;
+    open_file_segments =
+        calloc(open_file_segments_count, sizeof(*open_file_segments));
+    block_claims = malloc(BITMAP_WORDS(fs_geometry.g_data_blocks) *
+                          sizeof(uint64_t));
+    if (inode_chunks == NULL || open_file_segments == NULL ||
+        block_claims == NULL || block_cache_init() == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Tears down a chunk of i-nodes set up by inode_chunk_map */
+static void inode_chunk_unmap(size_t chunk) {
+    inode_chunk_t *c = inode_chunks[chunk];
+    for (size_t i = 0; i < INODE_CHUNK; i++) {
+        pthread_rwlock_destroy(&c->ic_locks[i]);
+        pthread_mutex_destroy(&c->ic_ranges[i].ir_lock);
+        pthread_cond_destroy(&c->ic_ranges[i].ir_cond);
+    }
+    free(c);
+    inode_chunks[chunk] = NULL;
+}
+
+static void state_tables_free() {
+    size_t chunks =
+        atomic_load_explicit(&inode_chunks_used, memory_order_relaxed);
+    for (size_t c = 0; inode_chunks != NULL && c < chunks; c++) {
+        inode_chunk_unmap(c);
+    }
+    atomic_store_explicit(&inode_chunks_used, 0, memory_order_relaxed);
+    free(inode_chunks);
+    free(free_inodes);
+    for (size_t s = 0; open_file_segments != NULL &&
+                       s < open_file_segments_count;
+         s++) {
+        open_file_segment_t *segment = atomic_load_explicit(
+            &open_file_segments[s], memory_order_relaxed);
+        if (segment != NULL) {
+            open_file_segment_free(segment);
+        }
+    }
+    free(open_file_segments);
+    free(block_claims);
+    block_cache_free();
+    inode_chunks = NULL;
+    free_inodes = NULL;
+    free_inodes_count = 0;
+    free_inodes_capacity = 0;
+    open_file_segments = NULL;
+    block_claims = NULL;
+}
+
+/*
+ * Sets up a chunk of i-nodes (their locks and generations) and pushes its
+ * free i-nodes on the free stack, the lowest number on top. The chunk only
+ * becomes valid once inode_chunks_used covers it.
+ * Input:
+ *  - chunk: index of the chunk
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int inode_chunk_map(size_t chunk) {
+    size_t first = chunk * INODE_CHUNK;
+    size_t end = first + INODE_CHUNK;
+    if (end > fs_geometry.g_inode_table_size) {
+        end = fs_geometry.g_inode_table_size;
+    }
+
+    /* The stack can hold every i-node up to the end of the chunk, so giving
+     * one back never needs to grow it */
+    if (end > free_inodes_capacity) {
+        size_t capacity = 2 * free_inodes_capacity;
+        if (capacity < end) {
+            capacity = end;
+        }
+        int *grown = realloc(free_inodes, capacity * sizeof(*free_inodes));
+        if (grown == NULL) {
+            return -1;
+        }
+        free_inodes = grown;
+        free_inodes_capacity = capacity;
+    }
+    inode_chunk_t *c = malloc(sizeof(*c));
+    if (c == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < INODE_CHUNK; i++) {
+        pthread_rwlock_init(&c->ic_locks[i], NULL);
+        pthread_mutex_init(&c->ic_ranges[i].ir_lock, NULL);
+        pthread_cond_init(&c->ic_ranges[i].ir_cond, NULL);
+        c->ic_ranges[i].ir_held = NULL;
+        c->ic_ranges[i].ir_waiters = 0;
+        atomic_init(&c->ic_ranges[i].ir_writers, 0);
+        atomic_init(&c->ic_ranges[i].ir_readers, 0);
+        atomic_init(&c->ic_generation[i], 0);
+    }
+    inode_chunks[chunk] = c;
+
+    for (size_t i = end; i-- > first;) {
+        if (freeinode_ts[i] == FREE) {
+            free_inodes[free_inodes_count++] = (int)i;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Takes the i-node chunks recorded in the superblock into use, the last one
+ * first, so that the lowest free numbers end up on top of the free stack.
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int inode_chunks_load() {
+    size_t chunks = (size_t)superblock->s_inode_chunks;
+    for (size_t c = chunks; c-- > 0;) {
+        if (inode_chunk_map(c) == -1) {
+            /* Only the chunks set up so far are torn down */
+            for (size_t d = c + 1; d < chunks; d++) {
+                inode_chunk_unmap(d);
+            }
+            return -1;
+        }
+    }
+    atomic_store_explicit(&inode_chunks_used, chunks, memory_order_release);
+    return 0;
+}
+
+/*
+ * Takes the next chunk of i-nodes into use, when the free stack runs out.
+ * Must be called with freeinode_ts_lock held.
+ * Returns: 0 if successful, -1 if the table is full or out of memory
+ */
+static int inode_chunk_add() {
+    size_t chunk =
+        atomic_load_explicit(&inode_chunks_used, memory_order_relaxed);
+    if (chunk * INODE_CHUNK >= fs_geometry.g_inode_table_size ||
+        inode_chunk_map(chunk) == -1) {
+        return -1;
+    }
+    superblock->s_inode_chunks = chunk + 1;
+    journal_log(&superblock->s_inode_chunks,
+                sizeof(superblock->s_inode_chunks));
+    atomic_store_explicit(&inode_chunks_used, chunk + 1, memory_order_release);
+    return 0;
+}
+
+/*
+ * Initializes FS state, backed by an image file or by memory
+ * Input:
+ *  - params: geometry and limits, or NULL for the defaults. When
+ *    params->image_path is NULL, the volume only lives in memory. Otherwise
+ *    an existing image is attached in constant time (plus the replay of its
+ *    journal), keeping the geometry it was formatted with; a missing or
+ *    empty one is created and formatted. params->device picks the block
+ *    device storing the data blocks (see device_open)
+ * Returns: 1 if a new volume was formatted, 0 if an existing one was
+ * attached, -1 otherwise
+ */
+int state_init(tfs_params_t const *params) {
+    tfs_params_t defaults;
+    if (params == NULL) {
+        state_default_params(&defaults);
+        params = &defaults;
+    }
+
+    superblock_t layout;
+    memset(&layout, 0, sizeof(layout));
+    layout.s_block_size = params->block_size;
+    layout.s_data_blocks = params->data_blocks;
+    layout.s_inode_table_size = params->inode_table_size;
+    layout.s_journal_size = (uint64_t)params->journal_blocks * params->block_size;
+    if (!geometry_valid(&layout) || params->max_open_files == 0 ||
+        params->cache_blocks == 0 ||
+        params->max_open_files > (size_t)1 << OPEN_FILE_INDEX_BITS) {
+        return -1;
+    }
+    layout_compute(&layout);
+
+    int format = 1;
+    if (params->image_path != NULL) {
+        format = image_open(params->image_path, &layout);
+        if (format == -1) {
+            image_close();
+            return -1;
+        }
+    }
+    image_size = (size_t)layout.s_image_size;
+    geometry_set(&layout, params->max_open_files, params->cache_blocks);
+
+    if (state_tables_alloc() == -1 || device_open(params, &layout) == -1 ||
+        (image_fd != -1 && journal_open(&layout, format) == -1) ||
+        image_map() == -1) {
+        state_tables_free();
+        journal_close();
+        image_close();
+        return -1;
+    }
+
+    superblock = (superblock_t *)image;
+    freeinode_ts = image + layout.s_inode_bitmap_offset;
+    inode_table = (inode_t *)(image + layout.s_inode_table_offset);
+    free_blocks = (uint64_t *)(image + layout.s_block_bitmap_offset);
+    fs_data = image + layout.s_data_offset;
+    block_cache_pages((size_t)layout.s_data_offset);
+
+    if (format) {
+        /* The i-node allocation table starts out zeroed, i.e. all FREE */
+        bitmap_init(free_blocks, fs_geometry.g_data_blocks);
+        *superblock = layout;
+        if (image_fd != -1 && image_format_persist() == -1) {
+            state_tables_free();
+            journal_close();
+            image_close();
+            return -1;
+        }
+    }
+    memcpy(block_claims, free_blocks,
+           BITMAP_WORDS(fs_geometry.g_data_blocks) * sizeof(uint64_t));
+    free_blocks_cursor = 0;
+
+    if (inode_chunks_load() == -1) {
+        state_tables_free();
+        journal_close();
+        image_close();
+        return -1;
+    }
+
+    atomic_store(&open_files_number, 0);
+
+    atomic_store(&state_closing, false);
+
+    pthread_mutex_init(&free_blocks_lock, NULL);
+    for (size_t i = 0; i < BLOCK_MAP_STRIPES; i++) {
+        pthread_mutex_init(&free_blocks_stripes[i], NULL);
+    }
+
+    pthread_mutex_init(&freeinode_ts_lock, NULL);
+
+    for (size_t i = 0; i < MAGAZINE_SLOTS; i++) {
+        pthread_mutex_init(&magazines[i].m_lock, NULL);
+        magazines[i].m_block_count = 0;
+        magazines[i].m_inode_count = 0;
+    }
+
+    for (size_t i = 0; i < DENTRY_CACHE_BUCKETS; i++) {
+        pthread_rwlock_init(&dentry_cache_locks[i], NULL);
+    }
+    dentry_cache_clear();
+
+    sync_init();
+    read_ahead_start(params->read_ahead);
+    writeback_start(params->write_back);
+
+    return format;
+}
+
+void state_destroy() {
+    read_ahead_stop();
+    writeback_stop();
+    sync_destroy();
+
+    pthread_mutex_destroy(&free_blocks_lock);
+    for (size_t i = 0; i < BLOCK_MAP_STRIPES; i++) {
+        pthread_mutex_destroy(&free_blocks_stripes[i]);
+    }
+
+    pthread_mutex_destroy(&freeinode_ts_lock);
+
+    /* Blocks and i-nodes held in magazines are free on the volume */
+    for (size_t i = 0; i < MAGAZINE_SLOTS; i++) {
+        pthread_mutex_destroy(&magazines[i].m_lock);
+    }
+
+    for (size_t i = 0; i < DENTRY_CACHE_BUCKETS; i++) {
+        pthread_rwlock_destroy(&dentry_cache_locks[i]);
+    }
+
+    state_tables_free();
+    journal_close();
+    image_close();
+}
+
+/*
+ * Directories use linear hashing over their blocks. Block i of a directory
+ * is the first block of bucket i, and a name goes to the bucket given by the
+ * low bits of its hash: i_dir_level bits, or one more for the buckets below
+ * i_dir_split, which have already been split in this round. Once the
+ * directory is loaded past DIR_MAX_LOAD percent, bucket i_dir_split is split
+ * in two by moving the names with the extra bit set to a new bucket at the
+ * end, so growing touches a single bucket. A full bucket chains overflow
+ * blocks until it is split.
+ *
+ * Each directory block is a hash table with open addressing. A name hashes to
+ * a home slot and is probed linearly from there. Each slot has a one-byte
+ * fingerprint, kept apart from the entries: it tells empty and deleted slots
+ * apart from used ones, and, for used ones, holds 8 bits of the name's hash,
+ * so probing a slot of another name almost never touches its entry.
+ */
+#define DIR_SLOT_EMPTY (0)
+#define DIR_SLOT_DELETED (1)
+
+/* Hashes a name as it is stored (at most MAX_FILE_NAME - 1 characters) */
+static uint32_t dir_name_hash(char const *name) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < MAX_FILE_NAME - 1 && name[i] != '\0'; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* Fingerprint of a used slot: never DIR_SLOT_EMPTY nor DIR_SLOT_DELETED */
+static uint8_t dir_fingerprint(uint32_t hash) {
+    return (uint8_t)(2 + (hash >> 24) % 254);
+}
+
+/* Home slot of a name in a block. The low bits of the hash pick the bucket,
+ * so they are mixed with the high ones first */
+static size_t dir_home_slot(uint32_t hash) {
+    uint32_t h = (hash ^ (hash >> 16)) * 0x85ebca6bu;
+    return (h ^ (h >> 13)) % fs_geometry.g_dir_entries;
+}
+
+static uint8_t *dir_block_fingerprints(void *block) {
+    return (uint8_t *)block + sizeof(dir_block_t);
+}
+
+static dir_entry_t *dir_block_entries(void *block) {
+    return (dir_entry_t *)((char *)block +
+                           ROUND_UP(sizeof(dir_block_t) +
+                                        fs_geometry.g_dir_entries,
+                                    sizeof(int)));
+}
+
+/*
+ * Empties a directory block, which ends its bucket's chain, and logs it.
+ * Input:
+ *  - block: the directory block
+ */
+static void dir_block_init(void *block) {
+    ((dir_block_t *)block)->db_overflow = -1;
+    memset(dir_block_fingerprints(block), DIR_SLOT_EMPTY,
+           fs_geometry.g_dir_entries);
+    /* The entries of empty slots are never read */
+    journal_log(block, sizeof(dir_block_t) + fs_geometry.g_dir_entries);
+}
+
+/*
+ * Looks for a name in a directory block.
+ * Input:
+ *  - block: the directory block
+ *  - name: name to search
+ *  - hash: its hash (dir_name_hash)
+ * Returns: the slot holding the name, -1 if not found
+ */
+static long dir_block_find(void *block, char const *name, uint32_t hash) {
+    uint8_t const *fp = dir_block_fingerprints(block);
+    dir_entry_t const *entries = dir_block_entries(block);
+    size_t slots = fs_geometry.g_dir_entries;
+    uint8_t want = dir_fingerprint(hash);
+    size_t slot = dir_home_slot(hash);
+
+    for (size_t n = 0; n < slots && fp[slot] != DIR_SLOT_EMPTY; n++) {
+        if (fp[slot] == want &&
+            strncmp(entries[slot].d_name, name, MAX_FILE_NAME) == 0) {
+            return (long)slot;
+        }
+        if (++slot == slots) {
+            slot = 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Adds a name to a directory block, in the first empty or deleted slot of
+ * its probe sequence.
+ * Input:
+ *  - block: the directory block
+ *  - name: name of the entry
+ *  - hash: its hash (dir_name_hash)
+ *  - sub_inumber: i-node the entry refers to
+ * Returns: the slot used, -1 if the block is full
+ */
+static long dir_block_insert(void *block, char const *name, uint32_t hash,
+                             int sub_inumber) {
+    uint8_t *fp = dir_block_fingerprints(block);
+    dir_entry_t *entries = dir_block_entries(block);
+    size_t slots = fs_geometry.g_dir_entries;
+    size_t slot = dir_home_slot(hash);
+
+    for (size_t n = 0; n < slots; n++) {
+        if (fp[slot] == DIR_SLOT_EMPTY || fp[slot] == DIR_SLOT_DELETED) {
+            fp[slot] = dir_fingerprint(hash);
+            entries[slot].d_inumber = sub_inumber;
+            strncpy(entries[slot].d_name, name, MAX_FILE_NAME - 1);
+            entries[slot].d_name[MAX_FILE_NAME - 1] = 0;
+            journal_log(&fp[slot], sizeof(fp[slot]));
+            journal_log(&entries[slot], sizeof(dir_entry_t));
+            return (long)slot;
+        }
+        if (++slot == slots) {
+            slot = 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Gets a directory's i-node.
+ * Input:
+ *  - inumber: identifier of the directory's i-node
+ * Returns: pointer to the i-node, NULL if it is not a directory
+ */
+static inode_t *dir_inode_get(int inumber) {
+    insert_delay(); // simulate storage access delay to i-node with inumber
+    if (!valid_inumber(inumber) ||
+        inode_table[inumber].i_node_type != T_DIRECTORY) {
+        return NULL;
+    }
+    return &inode_table[inumber];
+}
+
+/* Number of buckets of a directory */
+static size_t dir_buckets(inode_t const *dir) {
+    return ((size_t)1 << dir->i_dir_level) + dir->i_dir_split;
+}
+
+/* Bucket of a directory a name belongs to */
+static size_t dir_bucket_of(inode_t const *dir, uint32_t hash) {
+    size_t bucket = hash & (((size_t)1 << dir->i_dir_level) - 1);
+    if (bucket < dir->i_dir_split) {
+        bucket = hash & (((size_t)2 << dir->i_dir_level) - 1);
+    }
+    return bucket;
+}
+
+/* First block of a bucket, -1 if it is not mapped */
+static int dir_bucket_block(inode_t const *dir, size_t bucket) {
+    extent_t run;
+    if (inode_extent_lookup(dir, bucket, &run) == -1) {
+        return -1;
+    }
+    return run.e_start;
+}
+
+/*
+ * Looks for a name in a directory, along the chain of its bucket.
+ * Input:
+ *  - dir: the directory's i-node
+ *  - name: name to search
+ *  - hash: its hash (dir_name_hash)
+ *  - block: filled with the block holding the name
+ * Returns: the slot holding the name, -1 if not found
+ */
+static long dir_find(inode_t const *dir, char const *name, uint32_t hash,
+                     void **block) {
+    int b = dir_bucket_block(dir, dir_bucket_of(dir, hash));
+    while (b != -1) {
+        *block = meta_block_get(b);
+        if (*block == NULL) {
+            return -1;
+        }
+        long slot = dir_block_find(*block, name, hash);
+        if (slot != -1) {
+            return slot;
+        }
+        b = ((dir_block_t *)*block)->db_overflow;
+    }
+    return -1;
+}
+
+/*
+ * Adds a name to the chain of a bucket, chaining a new overflow block when
+ * every block of the chain is full.
+ * Input:
+ *  - b: first block of the bucket
+ *  - name: name of the entry
+ *  - hash: its hash (dir_name_hash)
+ *  - sub_inumber: i-node the entry refers to
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int dir_bucket_insert(int b, char const *name, uint32_t hash,
+                             int sub_inumber) {
+    for (;;) {
+        dir_block_t *block = meta_block_get(b);
+        if (block == NULL) {
+            return -1;
+        }
+        if (dir_block_insert(block, name, hash, sub_inumber) != -1) {
+            return 0;
+        }
+        if (block->db_overflow == -1) {
+            int overflow = data_block_alloc();
+            if (overflow == -1) {
+                return -1;
+            }
+            void *overflow_block = meta_block_get(overflow);
+            if (overflow_block == NULL) {
+                data_block_free(overflow);
+                return -1;
+            }
+            dir_block_init(overflow_block);
+            block->db_overflow = overflow;
+            journal_log(&block->db_overflow, sizeof(block->db_overflow));
+        }
+        b = block->db_overflow;
+    }
+}
+
+/*
+ * Frees the overflow blocks chained after a block.
+ * Input:
+ *  - block: the first block of the chain
+ */
+static void dir_chain_free(dir_block_t *block) {
+    int b = block->db_overflow;
+    while (b != -1) {
+        dir_block_t *overflow = meta_block_get(b);
+        if (overflow == NULL) {
+            break;
+        }
+        int next = overflow->db_overflow;
+        data_block_free(b);
+        b = next;
+    }
+}
+
+/* Overflow blocks chained to the first block of a bucket holding 'names' */
+static size_t dir_overflow_needed(size_t names) {
+    return names == 0 ? 0 : (names - 1) / fs_geometry.g_dir_entries;
+}
+
+/*
+ * Splits the next bucket of a directory in two: the bucket is emptied and
+ * its names are hashed again, with one more bit, between it and a new bucket
+ * at the end of the directory. The overflow blocks the two halves need are
+ * taken before the bucket is emptied, as the blocks of its chain only come
+ * back once the split is durable.
+ * Input:
+ *  - dir: the directory's i-node
+ * Returns: 0 if successful, -1 otherwise (in which case every name stays in
+ * the bucket it was in, though the directory may have mapped more blocks)
+ */
+static int dir_split(inode_t *dir) {
+    size_t bucket = dir->i_dir_split;
+    size_t new_bucket = dir_buckets(dir);
+
+    /* Directory blocks are mapped in chunks that double with the directory
+     * (up to DIR_GROW_MAX_BLOCKS), so they take few extents and finding a
+     * bucket's block stays cheap */
+    if (new_bucket >= dir->i_blocks) {
+        size_t grow = dir->i_blocks < DIR_GROW_MAX_BLOCKS ? dir->i_blocks
+                                                          : DIR_GROW_MAX_BLOCKS;
+        if (inode_grow(dir, dir->i_blocks + grow) == -1 &&
+            new_bucket >= dir->i_blocks) {
+            return -1;
+        }
+    }
+
+    /* Takes the bucket's names out */
+    size_t count = 0;
+    size_t capacity = 0;
+    dir_entry_t *names = NULL;
+    int b = dir_bucket_block(dir, bucket);
+    while (b != -1) {
+        void *block = meta_block_get(b);
+        if (block == NULL) {
+            free(names);
+            return -1;
+        }
+        uint8_t const *fp = dir_block_fingerprints(block);
+        dir_entry_t const *entries = dir_block_entries(block);
+        for (size_t i = 0; i < fs_geometry.g_dir_entries; i++) {
+            if (fp[i] == DIR_SLOT_EMPTY || fp[i] == DIR_SLOT_DELETED) {
+                continue;
+            }
+            if (count == capacity) {
+                capacity = capacity == 0 ? fs_geometry.g_dir_entries
+                                         : 2 * capacity;
+                dir_entry_t *grown = realloc(names, capacity * sizeof(*names));
+                if (grown == NULL) {
+                    free(names);
+                    return -1;
+                }
+                names = grown;
+            }
+            names[count++] = entries[i];
+        }
+        b = ((dir_block_t *)block)->db_overflow;
+    }
+
+    /* A name moves to the new bucket when the extra bit of its hash is set;
+     * each half needs an overflow block per block of names past its first */
+    size_t level = dir->i_dir_level;
+    size_t moved = 0;
+    for (size_t i = 0; i < count; i++) {
+        moved += dir_name_hash(names[i].d_name) >> level & 1;
+    }
+    size_t spares = dir_overflow_needed(count - moved) +
+                    dir_overflow_needed(moved);
+    int *spare = malloc((spares + 1) * sizeof(int));
+    dir_block_t **spare_block = malloc((spares + 1) * sizeof(dir_block_t *));
+    dir_block_t *old_block = meta_block_get(dir_bucket_block(dir, bucket));
+    dir_block_t *new_block = meta_block_get(dir_bucket_block(dir, new_bucket));
+    bool reserved = spare != NULL && spare_block != NULL &&
+                    old_block != NULL && new_block != NULL &&
+                    (spares == 0 || data_block_alloc_many(spares, spare) != -1);
+    for (size_t i = 0; reserved && i < spares; i++) {
+        spare_block[i] = meta_block_get(spare[i]);
+        if (spare_block[i] == NULL) {
+            for (size_t j = 0; j < spares; j++) {
+                data_block_free(spare[j]);
+            }
+            reserved = false;
+        }
+    }
+    if (!reserved) {
+        free(spare_block);
+        free(spare);
+        free(names);
+        return -1;
+    }
+
+    dir_chain_free(old_block);
+    dir_block_init(old_block);
+    dir_block_init(new_block);
+
+    if (++dir->i_dir_split == (size_t)1 << dir->i_dir_level) {
+        dir->i_dir_level++;
+        dir->i_dir_split = 0;
+    }
+    dir->i_size = dir_buckets(dir) * fs_geometry.g_block_size;
+
+    /* Fills each half block by block, chaining the reserved blocks */
+    dir_block_t *tail[2] = {old_block, new_block};
+    size_t used = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t hash = dir_name_hash(names[i].d_name);
+        size_t half = hash >> level & 1;
+        if (dir_block_insert(tail[half], names[i].d_name, hash,
+                             names[i].d_inumber) == -1) {
+            dir_block_init(spare_block[used]);
+            tail[half]->db_overflow = spare[used];
+            journal_log(&tail[half]->db_overflow,
+                        sizeof(tail[half]->db_overflow));
+            tail[half] = spare_block[used++];
+            dir_block_insert(tail[half], names[i].d_name, hash,
+                             names[i].d_inumber);
+        }
+    }
+    free(spare_block);
+    free(spare);
+    free(names);
+    journal_log(dir, sizeof(*dir));
+    return 0;
+}
+
+/*
+ * Frees the overflow blocks of every bucket of a directory, which are not
+ * part of its block map.
+ * Input:
+ *  - dir: the directory's i-node
+ */
+static void dir_overflow_free(inode_t const *dir) {
+    size_t buckets = dir_buckets(dir);
+    for (size_t bucket = 0; bucket < buckets; bucket++) {
+        dir_block_t *block = meta_block_get(dir_bucket_block(dir, bucket));
+        if (block != NULL) {
+            dir_chain_free(block);
+        }
+    }
+}
+
+/* Bucket of the dentry cache holding a (parent, name) pair */
+static size_t dentry_bucket(int parent, uint32_t hash) {
+    return (hash ^ (uint32_t)parent * 2654435761u) % DENTRY_CACHE_BUCKETS;
+}
+
+static dentry_t *dentry_find(size_t bucket, int parent, unsigned generation,
+                             char const *name, uint32_t hash) {
+    for (size_t i = 0; i < DENTRY_CACHE_WAYS; i++) {
+        dentry_t *d = &dentry_cache[bucket][i];
+        if (d->de_valid && d->de_hash == hash && d->de_parent == parent &&
+            d->de_generation == generation &&
+            strncmp(d->de_name, name, MAX_FILE_NAME) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Looks up a name in the dentry cache.
+ * Input:
+ *  - parent: directory's i-node number
+ *  - name: name to search
+ *  - hash: its hash (dir_name_hash)
+ *  - inumber: filled with the cached i-node number, -1 for a cached miss
+ * Returns: true if the pair is cached, false otherwise
+ */
+static bool dentry_cache_lookup(int parent, char const *name, uint32_t hash,
+                                int *inumber) {
+    size_t bucket = dentry_bucket(parent, hash);
+    unsigned generation = atomic_load_explicit(dir_generation(parent),
+                                               memory_order_relaxed);
+    pthread_rwlock_rdlock(&dentry_cache_locks[bucket]);
+    dentry_t *d = dentry_find(bucket, parent, generation, name, hash);
+    if (d != NULL) {
+        *inumber = d->de_inumber;
+    }
+    pthread_rwlock_unlock(&dentry_cache_locks[bucket]);
+    return d != NULL;
+}
+
+/*
+ * Caches what a name maps to in a directory: an i-node, or nothing (-1).
+ * Must be called with the directory's i-node lock held, so the cache
+ * follows the directory's changes in order.
+ * Input:
+ *  - parent: directory's i-node number
+ *  - name: the name
+ *  - hash: its hash (dir_name_hash)
+ *  - inumber: the i-node it maps to, -1 if none
+ */
+static void dentry_cache_insert(int parent, char const *name, uint32_t hash,
+                                int inumber) {
+    size_t bucket = dentry_bucket(parent, hash);
+    unsigned generation = atomic_load_explicit(dir_generation(parent),
+                                               memory_order_relaxed);
+    pthread_rwlock_wrlock(&dentry_cache_locks[bucket]);
+    dentry_t *d = dentry_find(bucket, parent, generation, name, hash);
+    if (d == NULL) {
+        /* Takes a free way, or else the next one round-robin */
+        for (size_t i = 0; i < DENTRY_CACHE_WAYS && d == NULL; i++) {
+            if (!dentry_cache[bucket][i].de_valid) {
+                d = &dentry_cache[bucket][i];
+            }
+        }
+        if (d == NULL) {
+            d = &dentry_cache[bucket][dentry_cache_hand[bucket]++ %
+                                      DENTRY_CACHE_WAYS];
+        }
+        d->de_valid = true;
+        d->de_parent = parent;
+        d->de_generation = generation;
+        d->de_hash = hash;
+        strncpy(d->de_name, name, MAX_FILE_NAME - 1);
+        d->de_name[MAX_FILE_NAME - 1] = 0;
+    }
+    d->de_inumber = inumber;
+    pthread_rwlock_unlock(&dentry_cache_locks[bucket]);
+}
+
+/*
+ * Empties the dentry cache
+ */
+void dentry_cache_clear() {
+    for (size_t b = 0; b < DENTRY_CACHE_BUCKETS; b++) {
+        pthread_rwlock_wrlock(&dentry_cache_locks[b]);
+        for (size_t i = 0; i < DENTRY_CACHE_WAYS; i++) {
+            dentry_cache[b][i].de_valid = false;
+        }
+        pthread_rwlock_unlock(&dentry_cache_locks[b]);
+    }
+}
+
+/*
+ * Moves the i-nodes held in every magazine back to the free stack, for when
+ * it runs out.
+ * Returns: the number of i-nodes moved
+ */
+static size_t magazines_drain_inodes() {
+    size_t drained = 0;
+    for (size_t i = 0; i < MAGAZINE_SLOTS; i++) {
+        magazine_t *m = &magazines[i];
+        pthread_mutex_lock(&m->m_lock);
+        pthread_mutex_lock(&freeinode_ts_lock);
+        while (m->m_inode_count > 0) {
+            free_inodes[free_inodes_count++] = m->m_inodes[--m->m_inode_count];
+            drained++;
+        }
+        pthread_mutex_unlock(&freeinode_ts_lock);
+        pthread_mutex_unlock(&m->m_lock);
+    }
+    return drained;
+}
+
+/*
+ * Takes a free i-node from the thread's magazine. An empty magazine is
+ * refilled from the top of the free stack, growing the table by a chunk when
+ * the stack is empty; a full table falls back to the i-nodes held in the
+ * other magazines.
+ * Returns: the i-node's number, -1 if there is no free i-node
+ */
+static int inode_take() {
+    magazine_t *m = magazine_get();
+    pthread_mutex_lock(&m->m_lock);
+    if (m->m_inode_count == 0) {
+        pthread_mutex_lock(&freeinode_ts_lock);
+        while (m->m_inode_count < MAGAZINE_SIZE / 2 &&
+               (free_inodes_count > 0 || inode_chunk_add() == 0)) {
+            m->m_inodes[m->m_inode_count++] = free_inodes[--free_inodes_count];
+        }
+        pthread_mutex_unlock(&freeinode_ts_lock);
+        /* Handed out in the order they came off the stack */
+        for (size_t i = 0; i < m->m_inode_count / 2; i++) {
+            int tmp = m->m_inodes[i];
+            m->m_inodes[i] = m->m_inodes[m->m_inode_count - 1 - i];
+            m->m_inodes[m->m_inode_count - 1 - i] = tmp;
+        }
+    }
+    int inumber = m->m_inode_count > 0 ? m->m_inodes[--m->m_inode_count] : -1;
+    pthread_mutex_unlock(&m->m_lock);
+
+    /* Another thread may take the drained i-nodes first, so draining goes on
+     * until it finds none; the free stack is still looked at after that, as
+     * another thread may have drained them just before */
+    bool drained = true;
+    while (inumber == -1 && drained) {
+        drained = magazines_drain_inodes() > 0;
+        pthread_mutex_lock(&freeinode_ts_lock);
+        if (free_inodes_count > 0) {
+            inumber = free_inodes[--free_inodes_count];
+        }
+        pthread_mutex_unlock(&freeinode_ts_lock);
+    }
+    return inumber;
+}
+
+/*
+ * Gives an i-node back: marks it free and keeps it in the thread's magazine.
+ * A full magazine moves its older half to the free stack first.
+ * Input:
+ *  - inumber: i-node's number
+ */
+static void inode_release(int inumber) {
+    freeinode_ts[inumber] = FREE;
+    journal_log(&freeinode_ts[inumber], sizeof(freeinode_ts[inumber]));
+
+    magazine_t *m = magazine_get();
+    pthread_mutex_lock(&m->m_lock);
+    if (m->m_inode_count == MAGAZINE_SIZE) {
+        size_t half = MAGAZINE_SIZE / 2;
+        pthread_mutex_lock(&freeinode_ts_lock);
+        for (size_t i = 0; i < half; i++) {
+            free_inodes[free_inodes_count++] = m->m_inodes[i];
+        }
+        pthread_mutex_unlock(&freeinode_ts_lock);
+        memmove(m->m_inodes, m->m_inodes + half,
+                (MAGAZINE_SIZE - half) * sizeof(int));
+        m->m_inode_count -= half;
+    }
+    m->m_inodes[m->m_inode_count++] = inumber;
+    pthread_mutex_unlock(&m->m_lock);
+}
+
+/*
+ * Creates a new i-node in the i-node table.
+ * Input:
+ *  - n_type: the type of the node (file or directory)
+ * Returns:
+ *  new i-node's number if successfully created, -1 otherwise
+ */
+int inode_create(inode_type n_type) {
+    int inumber = inode_take();
+    if (inumber == -1) {
+        return -1;
+    }
+    insert_delay(); // simulate storage access delay (to freeinode_ts)
+    freeinode_ts[inumber] = TAKEN;
+    journal_log(&freeinode_ts[inumber], sizeof(freeinode_ts[inumber]));
+
+    insert_delay(); // simulate storage access delay (to i-node)
+    inode_table[inumber].i_node_type = n_type;
+    inode_table[inumber].i_size = 0;
+    inode_table[inumber].i_blocks = 0;
+    inode_table[inumber].i_extent_count = 0;
+    inode_table[inumber].i_extent_block = -1;
+    inode_table[inumber].i_dir_level = 0;
+    inode_table[inumber].i_dir_split = 0;
+    inode_table[inumber].i_dir_entries = 0;
+    if (n_type == T_DIRECTORY) {
+        /* Entries cached for an earlier directory with this i-node number
+         * no longer match */
+        atomic_fetch_add(dir_generation(inumber), 1);
+        /* Initializes directory (a single, empty bucket) */
+        int b = data_block_alloc();
+        if (b == -1) {
+            inode_release(inumber);
+            return -1;
         }
-        pthread_mutex_unlock(&freeinode_ts_lock);
+        void *dir_block = meta_block_get(b);
+        if (dir_block == NULL ||
+            inode_extent_append(&inode_table[inumber], b, 1) == -1) {
+            data_block_free(b);
+            inode_release(inumber);
+            return -1;
+        }
+        inode_table[inumber].i_size = fs_geometry.g_block_size;
+        dir_block_init(dir_block);
     }
-    return -1;
+    journal_log(&inode_table[inumber], sizeof(inode_t));
+    /* A new file starts with no data blocks; they are mapped as the file
+     * grows */
+    return inumber;
 }
 
 /*
@@ -183,49 +4146,234 @@ int inode_delete(int inumber) {
     // simulate storage access delay (to i-node and freeinode_ts)
     insert_delay();
     insert_delay();
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
     pthread_rwlock_wrlock(inode_lock_get(inumber));
-    if (!valid_inumber(inumber) || freeinode_ts[inumber] == FREE) {
+    if (freeinode_ts[inumber] == FREE) {
         pthread_rwlock_unlock(inode_lock_get(inumber));        
         return -1;
     }
-    freeinode_ts[inumber] = FREE;
-    if (inode_datablocks_erase(inode_table[inumber]) != 0 || data_block_free(inode_get(inumber)->i_index_block) != 0){
-        pthread_rwlock_unlock(inode_lock_get(inumber));
-        return -1;
+    /* Drops the cached entries of the directory this may have been */
+    atomic_fetch_add(dir_generation(inumber), 1);
+    if (inode_table[inumber].i_node_type == T_DIRECTORY) {
+        dir_overflow_free(&inode_table[inumber]);
     }
+    int ret = inode_datablocks_erase(&inode_table[inumber]) == 0 ? 0 : -1;
+    /* Given back last, so it is not reused while its blocks are freed */
+    inode_release(inumber);
     pthread_rwlock_unlock(inode_lock_get(inumber));
-    return 0;
+    return ret;
 }
 
+/*
+ * Frees every data block of an i-node, one extent at a time, together with
+ * its extent blocks, and leaves the i-node empty.
+ * Input:
+ *  - inode: the i-node
+ * Returns: 0 if successful, -1 otherwise
+ */
+int inode_datablocks_erase(inode_t *inode) {
+    extent_t const *ext = inode->i_extents;
+    int remaining = inode->i_extent_count;
+    int n = remaining < INODE_EXTENTS ? remaining : INODE_EXTENTS;
+    int next = inode->i_extent_block;
+    int current = -1;
 
-
-int inode_datablocks_erase(inode_t i_node){
-    for(int i = 0; i < DIRECT_BLOCKS_QUANTITY; i++){
-        if(i_node.i_data_block[i] == -1){
-            continue;
+    for (;;) {
+        for (int i = 0; i < n; i++) {
+            if (data_blocks_free(ext[i].e_start, (size_t)ext[i].e_length) ==
+                -1) {
+                return -1;
+            }
+        }
+        remaining -= n;
+        /* The extent block just walked is no longer needed */
+        if (current != -1 && data_block_free(current) == -1) {
+            return -1;
         }
-        if (data_block_free(i_node.i_data_block[i]) == -1) {
+        if (remaining == 0) {
+            break;
+        }
+        extent_block_t *eb = meta_block_get(next);
+        if (eb == NULL) {
             return -1;
         }
+        current = next;
+        ext = eb->eb_extents;
+        n = remaining < (int)fs_geometry.g_extents_per_block
+                ? remaining
+                : (int)fs_geometry.g_extents_per_block;
+        next = eb->eb_next;
     }
-    int *index_block = data_block_get(i_node.i_index_block);
-    if (index_block == NULL) {
-        return -1;
+
+    inode->i_size = 0;
+    inode->i_blocks = 0;
+    inode->i_extent_count = 0;
+    inode->i_extent_block = -1;
+    journal_log(inode, sizeof(*inode));
+    return 0;
+}
+
+/*
+ * Maps a run of data blocks at the end of an i-node's block map. The run is
+ * merged with the last extent when it continues it on disk; otherwise it
+ * becomes a new extent, spilling to a new extent block if needed.
+ * Input:
+ *  - inode: the i-node
+ *  - start: first data block of the run
+ *  - length: number of blocks in the run
+ * Returns: 0 if successful, -1 otherwise
+ */
+int inode_extent_append(inode_t *inode, int start, int length) {
+    /* Locates the extent array holding the last extent */
+    extent_t *ext = inode->i_extents;
+    int remaining = inode->i_extent_count;
+    int used = remaining < INODE_EXTENTS ? remaining : INODE_EXTENTS;
+    int capacity = INODE_EXTENTS;
+    int *next = &inode->i_extent_block;
+    remaining -= used;
+    while (remaining > 0) {
+        extent_block_t *eb = meta_block_get(*next);
+        if (eb == NULL) {
+            return -1;
+        }
+        ext = eb->eb_extents;
+        capacity = (int)fs_geometry.g_extents_per_block;
+        used = remaining < capacity ? remaining : capacity;
+        next = &eb->eb_next;
+        remaining -= used;
     }
-    for(int i = 0; i < BLOCK_SIZE/sizeof(int); i++){
-        if(index_block[i] == -1){
-            continue;
+
+    if (used > 0 && ext[used - 1].e_start + ext[used - 1].e_length == start) {
+        ext[used - 1].e_length += length;
+        inode->i_blocks += (size_t)length;
+        journal_log(&ext[used - 1], sizeof(extent_t));
+        journal_log(inode, sizeof(*inode));
+        return 0;
+    }
+
+    if (used == capacity) {
+        /* Spills to a new extent block */
+        int b = data_block_alloc();
+        if (b == -1) {
+            return -1;
         }
-        if (data_block_free(index_block[i]) == -1) {
+        extent_block_t *eb = meta_block_get(b);
+        if (eb == NULL) {
+            data_block_free(b);
             return -1;
         }
-        index_block[i] = -1;
+        eb->eb_next = -1;
+        *next = b;
+        journal_log(&eb->eb_next, sizeof(eb->eb_next));
+        journal_log(next, sizeof(*next));
+        ext = eb->eb_extents;
+        used = 0;
     }
-    i_node.i_size = 0;
 
+    ext[used].e_start = start;
+    ext[used].e_length = length;
+    inode->i_extent_count++;
+    inode->i_blocks += (size_t)length;
+    journal_log(&ext[used], sizeof(extent_t));
+    journal_log(inode, sizeof(*inode));
     return 0;
 }
 
+/*
+ * Finds the data blocks backing a block of a file.
+ * Input:
+ *  - inode: the i-node
+ *  - block: index of the block within the file
+ *  - run: filled with the data block backing 'block' and the number of
+ *    contiguous data blocks from there to the end of its extent
+ * Returns: 0 if successful, -1 if the block is not mapped
+ */
+int inode_extent_lookup(inode_t const *inode, size_t block, extent_t *run) {
+    extent_t const *ext = inode->i_extents;
+    int remaining = inode->i_extent_count;
+    int n = remaining < INODE_EXTENTS ? remaining : INODE_EXTENTS;
+    int next = inode->i_extent_block;
+    size_t first = 0;
+
+    for (;;) {
+        for (int i = 0; i < n; i++) {
+            size_t length = (size_t)ext[i].e_length;
+            if (block < first + length) {
+                run->e_start = ext[i].e_start + (int)(block - first);
+                run->e_length = (int)(first + length - block);
+                return 0;
+            }
+            first += length;
+        }
+        remaining -= n;
+        if (remaining == 0) {
+            return -1;
+        }
+        extent_block_t const *eb = meta_block_get(next);
+        if (eb == NULL) {
+            return -1;
+        }
+        ext = eb->eb_extents;
+        n = remaining < (int)fs_geometry.g_extents_per_block
+                ? remaining
+                : (int)fs_geometry.g_extents_per_block;
+        next = eb->eb_next;
+    }
+}
+
+/*
+ * Makes sure an i-node has at least 'blocks' data blocks mapped, allocating
+ * all the missing ones in a single call and appending them as extents.
+ * A file's i-node is logged again with every extent, so a transaction that
+ * maps a long run of scattered blocks to a file is committed in pieces: the
+ * blocks mapped past the file's size are harmless if the rest never makes it.
+ * Returns 0 if successful, -1 otherwise (in which case the blocks that could
+ * be mapped remain mapped)
+ */
+int inode_grow(inode_t *inode, size_t blocks) {
+    if (blocks <= inode->i_blocks) {
+        return 0;
+    }
+    size_t missing = blocks - inode->i_blocks;
+    int *new_blocks = malloc(missing * sizeof(int));
+    if (new_blocks == NULL) {
+        return -1;
+    }
+    if (data_block_alloc_many(missing, new_blocks) == -1) {
+        free(new_blocks);
+        return -1;
+    }
+
+    /* Appending the new blocks, one contiguous run at a time */
+    size_t i = 0;
+    while (i < missing) {
+        size_t len = 1;
+        while (i + len < missing && new_blocks[i + len] == new_blocks[i] + (int)len) {
+            len++;
+        }
+        if (inode_extent_append(inode, new_blocks[i], (int)len) == -1) {
+            break;
+        }
+        i += len;
+        if (inode->i_node_type == T_FILE && i < missing &&
+            journal_txn_large()) {
+            int ret = journal_commit();
+            journal_begin();
+            if (ret == -1) {
+                break;
+            }
+        }
+    }
+    /* Giving back the blocks that could not be mapped */
+    for (size_t j = i; j < missing; j++) {
+        data_block_free(new_blocks[j]);
+    }
+    free(new_blocks);
+    return i == missing ? 0 : -1;
+}
+
 /*
  * Returns a pointer to an existing i-node.
  * Input:
@@ -247,7 +4395,116 @@ pthread_rwlock_t* inode_lock_get(int inumber){
         return NULL;
     }
 
-    return &inode_rwlock_table[inumber];
+    return &inode_chunk(inumber)->ic_locks[(size_t)inumber % INODE_CHUNK];
+}
+
+/* Whether two locked ranges cannot be held at once */
+static bool range_conflicts(range_lock_t const *a, range_lock_t const *b) {
+    return (a->rl_write || b->rl_write) && a->rl_start < b->rl_end &&
+           b->rl_start < a->rl_end;
+}
+
+/* Range lock state of an i-node */
+static inode_ranges_t *inode_ranges(int inumber) {
+    return &inode_chunk(inumber)->ic_ranges[(size_t)inumber % INODE_CHUNK];
+}
+
+/*
+ * Drops a shared range taken without ir_lock, waking up the exclusive
+ * ranges waiting for the last one.
+ * Must be called without ir_lock held.
+ */
+static void range_reader_leave(inode_ranges_t *ranges) {
+    if (atomic_fetch_sub(&ranges->ir_readers, 1) == 1 &&
+        atomic_load(&ranges->ir_writers) > 0) {
+        pthread_mutex_lock(&ranges->ir_lock);
+        pthread_cond_broadcast(&ranges->ir_cond);
+        pthread_mutex_unlock(&ranges->ir_lock);
+    }
+}
+
+/*
+ * Locks a range of an i-node's data, shared or exclusive, waiting until no
+ * conflicting range is held. Ranges are not a substitute for the i-node's
+ * lock: they are taken while holding it shared, by operations that change
+ * the data but not the size nor the block map, which need it exclusive.
+ * A shared range may outlive the i-node's lock to pin the blocks under it
+ * (see tfs_read_map), which is why freeing them takes the whole file
+ * exclusive.
+ * Shared ranges only touch two counters unless an exclusive range is held
+ * or wanted, so readers of a file do not contend.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - range: the range's record, owned by the caller until it unlocks
+ *  - start, end: the range, [start, end)
+ *  - write: true for an exclusive lock, false for a shared one
+ */
+void inode_range_lock(int inumber, range_lock_t *range, size_t start,
+                      size_t end, bool write) {
+    inode_ranges_t *ranges = inode_ranges(inumber);
+    range->rl_start = start;
+    range->rl_end = end;
+    range->rl_write = write;
+    range->rl_counted = false;
+
+    /* Either the reader sees the writer, or the writer sees the reader */
+    if (write) {
+        atomic_fetch_add(&ranges->ir_writers, 1);
+    } else {
+        atomic_fetch_add(&ranges->ir_readers, 1);
+        if (atomic_load(&ranges->ir_writers) == 0) {
+            range->rl_counted = true;
+            return;
+        }
+        range_reader_leave(ranges);
+    }
+
+    pthread_mutex_lock(&ranges->ir_lock);
+    for (;;) {
+        range_lock_t const *held = ranges->ir_held;
+        while (held != NULL && !range_conflicts(held, range)) {
+            held = held->rl_next;
+        }
+        /* Counted readers may read anywhere */
+        if (held == NULL &&
+            (!write || atomic_load(&ranges->ir_readers) == 0)) {
+            break;
+        }
+        ranges->ir_waiters++;
+        pthread_cond_wait(&ranges->ir_cond, &ranges->ir_lock);
+        ranges->ir_waiters--;
+    }
+    range->rl_next = ranges->ir_held;
+    ranges->ir_held = range;
+    pthread_mutex_unlock(&ranges->ir_lock);
+}
+
+/*
+ * Unlocks a range locked by inode_range_lock.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - range: the range's record
+ */
+void inode_range_unlock(int inumber, range_lock_t *range) {
+    inode_ranges_t *ranges = inode_ranges(inumber);
+    if (range->rl_counted) {
+        range_reader_leave(ranges);
+        return;
+    }
+
+    pthread_mutex_lock(&ranges->ir_lock);
+    range_lock_t **link = &ranges->ir_held;
+    while (*link != range) {
+        link = &(*link)->rl_next;
+    }
+    *link = range->rl_next;
+    if (range->rl_write) {
+        atomic_fetch_sub(&ranges->ir_writers, 1);
+    }
+    if (ranges->ir_waiters > 0) {
+        pthread_cond_broadcast(&ranges->ir_cond);
+    }
+    pthread_mutex_unlock(&ranges->ir_lock);
 }
 
 /*
@@ -259,39 +4516,64 @@ pthread_rwlock_t* inode_lock_get(int inumber){
  * Returns: SUCCESS or FAIL
  */
 int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
-    if (!valid_inumber(inumber) || !valid_inumber(sub_inumber)) {
+    if (!valid_inumber(inumber) || !valid_inumber(sub_inumber) ||
+        strlen(sub_name) == 0) {
         return -1;
     }
 
-    insert_delay(); // simulate storage access delay to i-node with inumber
-    if (inode_table[inumber].i_node_type != T_DIRECTORY) {
-        return -1;
+    uint32_t hash = dir_name_hash(sub_name);
+    pthread_rwlock_wrlock(inode_lock_get(inumber));
+    inode_t *dir = dir_inode_get(inumber);
+    int ret = -1;
+    if (dir != NULL) {
+        int b = dir_bucket_block(dir, dir_bucket_of(dir, hash));
+        ret = b == -1 ? -1 : dir_bucket_insert(b, sub_name, hash, sub_inumber);
     }
-
-    if (strlen(sub_name) == 0) {
-        return -1;
+    if (ret == 0) {
+        dentry_cache_insert(inumber, sub_name, hash, sub_inumber);
+        dir->i_dir_entries++;
+        journal_log(dir, sizeof(*dir));
+        /* Grows by one bucket once loaded past DIR_MAX_LOAD percent; a split
+         * that fails leaves every name where it was, and overflow blocks
+         * take the extra names, so the entry stays added either way */
+        if (dir->i_dir_entries * 100 >
+            dir_buckets(dir) * fs_geometry.g_dir_entries * DIR_MAX_LOAD) {
+            (void)dir_split(dir);
+        }
     }
-    pthread_rwlock_wrlock(inode_lock_get(inumber));
-    /* Locates the block containing the directory's entries */
-    dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(inode_table[inumber].i_data_block[0]);
-    if (dir_entry == NULL) {
-        pthread_rwlock_unlock(inode_lock_get(inumber));
+    pthread_rwlock_unlock(inode_lock_get(inumber));
+    return ret;
+}
+
+/*
+ * Removes an entry from the i-node directory data.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - sub_name: name of the sub i-node entry
+ * Returns: SUCCESS or FAIL
+ */
+int clear_dir_entry(int inumber, char const *sub_name) {
+    if (!valid_inumber(inumber)) {
         return -1;
     }
 
-    /* Finds and fills the first empty entry */
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_entry[i].d_inumber == -1) {
-            dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = 0;
-            pthread_rwlock_unlock(inode_lock_get(inumber));
-            return 0;
-        }
+    uint32_t hash = dir_name_hash(sub_name);
+    pthread_rwlock_wrlock(inode_lock_get(inumber));
+    inode_t *dir = dir_inode_get(inumber);
+    void *block = NULL;
+    long slot = dir == NULL ? -1 : dir_find(dir, sub_name, hash, &block);
+    if (slot != -1) {
+        dentry_cache_insert(inumber, sub_name, hash, -1);
+        /* The slot may sit in the probe sequence of other names, so it is
+         * marked deleted rather than empty */
+        uint8_t *fp = dir_block_fingerprints(block);
+        fp[slot] = DIR_SLOT_DELETED;
+        journal_log(&fp[slot], sizeof(fp[slot]));
+        dir->i_dir_entries--;
+        journal_log(dir, sizeof(*dir));
     }
     pthread_rwlock_unlock(inode_lock_get(inumber));
-    return -1;
+    return slot == -1 ? -1 : 0;
 }
 
 /* Looks for a given name inside a directory
@@ -301,29 +4583,92 @@ int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
  * 	Returns i-number linked to the target name, -1 if not found
  */
 int find_in_dir(int inumber, char const *sub_name) {
-    insert_delay(); // simulate storage access delay to i-node with inumber
-    if (!valid_inumber(inumber) ||
-        inode_table[inumber].i_node_type != T_DIRECTORY) {
+    if (!valid_inumber(inumber)) {
         return -1;
     }
-    pthread_rwlock_wrlock(inode_lock_get(inumber));
-    /* Locates the block containing the directory's entries */
-    dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(inode_table[inumber].i_data_block[0]);
-    if (dir_entry == NULL) {
-        return -1;
+
+    /* Hits, positive or negative, do not touch the directory at all */
+    uint32_t hash = dir_name_hash(sub_name);
+    int sub_inumber;
+    if (dentry_cache_lookup(inumber, sub_name, hash, &sub_inumber)) {
+        return sub_inumber;
     }
 
-    /* Iterates over the directory entries looking for one that has the target
-     * name */
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
-            pthread_rwlock_unlock(inode_lock_get(inumber));
-            return dir_entry[i].d_inumber;
+    pthread_rwlock_rdlock(inode_lock_get(inumber));
+    inode_t *dir = dir_inode_get(inumber);
+    sub_inumber = -1;
+    if (dir != NULL) {
+        void *block;
+        long slot = dir_find(dir, sub_name, hash, &block);
+        if (slot != -1) {
+            sub_inumber = dir_block_entries(block)[slot].d_inumber;
         }
+        dentry_cache_insert(inumber, sub_name, hash, sub_inumber);
+    }
     pthread_rwlock_unlock(inode_lock_get(inumber));
-    return -1;
+    return sub_inumber;
+}
+
+/*
+ * Marks a run of blocks taken or free in the free block map of the volume
+ * and logs the words changed, each under its stripe's lock, and the revoke
+ * of freed blocks.
+ * Input:
+ *  - start: first block of the run
+ *  - count: number of blocks
+ *  - taken: whether the blocks become taken or free
+ * Returns: the number of blocks whose state changed
+ */
+static size_t block_map_update(size_t start, size_t count, bool taken) {
+    size_t first = start;
+    size_t end = start + count;
+    size_t changed = 0;
+    while (start < end) {
+        size_t word = start / BITMAP_WORD_BITS;
+        size_t bit = start % BITMAP_WORD_BITS;
+        size_t n = BITMAP_WORD_BITS - bit;
+        if (n > end - start) {
+            n = end - start;
+        }
+        uint64_t mask = n == BITMAP_WORD_BITS
+                            ? ~(uint64_t)0
+                            : (((uint64_t)1 << n) - 1) << bit;
+
+        pthread_mutex_t *lock = &free_blocks_stripes[word % BLOCK_MAP_STRIPES];
+        pthread_mutex_lock(lock);
+        uint64_t old = free_blocks[word];
+        free_blocks[word] = taken ? old | mask : old & ~mask;
+        changed += (size_t)__builtin_popcountll(old ^ free_blocks[word]);
+        journal_log(&free_blocks[word], sizeof(uint64_t));
+        pthread_mutex_unlock(lock);
+        start += n;
+    }
+    if (!taken && changed > 0) {
+        journal_revoke(first, count);
+    }
+    return changed;
+}
+
+/*
+ * Moves the blocks held in every magazine back to the global allocator, for
+ * when it runs out.
+ * Returns: the number of blocks moved
+ */
+static size_t magazines_drain_blocks() {
+    size_t drained = 0;
+    for (size_t i = 0; i < MAGAZINE_SLOTS; i++) {
+        magazine_t *m = &magazines[i];
+        pthread_mutex_lock(&m->m_lock);
+        pthread_mutex_lock(&free_blocks_lock);
+        while (m->m_block_count > 0) {
+            bitmap_clear_run(block_claims,
+                             (size_t)m->m_blocks[--m->m_block_count], 1);
+            drained++;
+        }
+        pthread_mutex_unlock(&free_blocks_lock);
+        pthread_mutex_unlock(&m->m_lock);
+    }
+    return drained;
 }
 
 /*
@@ -331,34 +4676,141 @@ int find_in_dir(int inumber, char const *sub_name) {
  * Returns: block index if successful, -1 otherwise
  */
 int data_block_alloc() {
-    for (int i = 0; i < DATA_BLOCKS; i++) {
-        if (i * (int) sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // simulate storage access delay to free_blocks
-        }
+    size_t words = BITMAP_WORDS(fs_geometry.g_data_blocks);
+
+    /* An empty magazine is refilled with the next free blocks, handed out
+     * in ascending order */
+    magazine_t *m = magazine_get();
+    pthread_mutex_lock(&m->m_lock);
+    if (m->m_block_count == 0) {
+        int refill[MAGAZINE_SIZE / 2];
+        size_t n = 0;
         pthread_mutex_lock(&free_blocks_lock);
-        if (free_blocks[i] == FREE) {
-            free_blocks[i] = TAKEN;
-            pthread_mutex_unlock(&free_blocks_lock);
-            return i;
+        while (n < MAGAZINE_SIZE / 2) {
+            long b = bitmap_take_first(block_claims, words,
+                                       &free_blocks_cursor);
+            if (b == -1) {
+                break;
+            }
+            refill[n++] = (int)b;
         }
         pthread_mutex_unlock(&free_blocks_lock);
+        while (n > 0) {
+            m->m_blocks[m->m_block_count++] = refill[--n];
+        }
     }
-    return -1;
+    long b = m->m_block_count > 0 ? m->m_blocks[--m->m_block_count] : -1;
+    pthread_mutex_unlock(&m->m_lock);
+
+    /* Out of space: the blocks held by other threads, and those freed by
+     * transactions not yet durable, are the last ones. Another thread may
+     * take them first, so this goes on until it finds none; the global map
+     * is still looked at after that, as another thread may have drained them
+     * just before */
+    bool drained = true;
+    while (b == -1 && drained) {
+        drained = magazines_drain_blocks() > 0 || journal_sync_frees();
+        pthread_mutex_lock(&free_blocks_lock);
+        b = bitmap_take_first(block_claims, words, &free_blocks_cursor);
+        pthread_mutex_unlock(&free_blocks_lock);
+    }
+    if (b != -1) {
+        insert_delay(); // simulate storage access delay to free_blocks
+        block_map_update((size_t)b, 1, true);
+    }
+    return (int)b;
+}
+
+/*
+ * Allocates several data blocks at once, under a single hold of the global
+ * allocator. A single contiguous run is used when there is one; otherwise the
+ * longest free runs are taken first, so the blocks come in as few fragments
+ * as possible. Blocks are returned in ascending order within each run.
+ * Input:
+ *  - n: number of blocks to allocate
+ *  - out: array filled with the n block indexes
+ * Returns: 0 if successful, -1 if there are not n free blocks (in which case
+ * nothing is allocated)
+ */
+int data_block_alloc_many(size_t n, int out[]) {
+    size_t words = BITMAP_WORDS(fs_geometry.g_data_blocks);
+    if (n == 0) {
+        return 0;
+    }
+
+    insert_delay(); // simulate storage access delay to free_blocks
+
+    /* The blocks held in magazines, and those freed by transactions not yet
+     * durable, may make up the difference; as other threads may take them
+     * first, this goes on until it finds none */
+    bool drained = true;
+    pthread_mutex_lock(&free_blocks_lock);
+    while (bitmap_count_free(block_claims, words) < n) {
+        pthread_mutex_unlock(&free_blocks_lock);
+        if (!drained) {
+            return -1;
+        }
+        drained = magazines_drain_blocks() > 0 || journal_sync_frees();
+        pthread_mutex_lock(&free_blocks_lock);
+    }
+
+    size_t taken = 0;
+    size_t from = free_blocks_cursor * BITMAP_WORD_BITS;
+    while (taken < n) {
+        size_t len;
+        size_t start =
+            bitmap_find_run(block_claims, words, from, n - taken, &len);
+        if (len > n - taken) {
+            len = n - taken;
+        }
+        bitmap_set_run(block_claims, start, len);
+        block_map_update(start, len, true);
+        for (size_t i = 0; i < len; i++) {
+            out[taken++] = (int)(start + i);
+        }
+        from = start + len;
+    }
+    free_blocks_cursor = (from - 1) / BITMAP_WORD_BITS;
+    pthread_mutex_unlock(&free_blocks_lock);
+    return 0;
+}
+
+/* Gives a run of freed data blocks back to the global allocator */
+static void blocks_release(size_t start, size_t count) {
+    blocks_unkeep(start, count);
+    pthread_mutex_lock(&free_blocks_lock);
+    bitmap_clear_run(block_claims, start, count);
+    pthread_mutex_unlock(&free_blocks_lock);
 }
 
-/* Frees a data block
+/* Frees a data block. It is marked free at once, but only reused once the
+ * transaction that freed it is durable (see journal_release)
  * Input
  * 	- the block index
  * Returns: 0 if success, -1 otherwise
  */
 int data_block_free(int block_number) {
-    if (!valid_block_number(block_number)) {
+    return data_blocks_free(block_number, 1);
+}
+
+/* Frees a run of contiguous data blocks, like data_block_free
+ * Input
+ * 	- the index of the first block
+ * 	- the number of blocks
+ * Returns: 0 if success, -1 otherwise
+ */
+int data_blocks_free(int start, size_t count) {
+    if (!valid_block_number(start) ||
+        count > fs_geometry.g_data_blocks - (size_t)start) {
         return -1;
     }
 
     insert_delay(); // simulate storage access delay to free_blocks
-    free_blocks[block_number] = FREE;
-    return 0;
+    journal_begin();
+    if (block_map_update((size_t)start, count, false) > 0) {
+        journal_release((size_t)start, count);
+    }
+    return journal_commit();
 }
 
 /* Returns a pointer to the contents of a given block
@@ -367,61 +4819,253 @@ int data_block_free(int block_number) {
  * Returns: pointer to the first byte of the block, NULL otherwise
  */
 void *data_block_get(int block_number) {
-    if (!valid_block_number(block_number)) {
+    if (!valid_block_number(block_number) ||
+        blocks_fetch(block_number, 1, false, false, false) == -1) {
         return NULL;
     }
+    return &fs_data[(size_t)block_number * fs_geometry.g_block_size];
+}
 
-    insert_delay(); // simulate storage access delay to block
-    return &fs_data[block_number * BLOCK_SIZE];
+/* Returns a pointer to the contents of a run of contiguous blocks, which are
+ * laid out back to back
+ * Input:
+ * 	- index of the first block
+ * 	- number of blocks
+ * Returns: pointer to the first byte of the run, NULL otherwise
+ */
+void *data_blocks_get(int start, size_t count) {
+    if (!valid_block_number(start) ||
+        count > fs_geometry.g_data_blocks - (size_t)start ||
+        blocks_fetch(start, count, false, false, false) == -1) {
+        return NULL;
+    }
+    return &fs_data[(size_t)start * fs_geometry.g_block_size];
+}
+
+/* Returns a pointer to the contents of a run of contiguous blocks, like
+ * data_blocks_get, keeping them in the block cache until they are unpinned
+ * Input:
+ * 	- index of the first block
+ * 	- number of blocks
+ * Returns: pointer to the first byte of the run, NULL otherwise
+ */
+void *data_blocks_pin(int start, size_t count) {
+    if (!valid_block_number(start) ||
+        count > fs_geometry.g_data_blocks - (size_t)start ||
+        blocks_fetch(start, count, false, true, false) == -1) {
+        return NULL;
+    }
+    return &fs_data[(size_t)start * fs_geometry.g_block_size];
+}
+
+/*
+ * Unpins the blocks holding some data, pinned by data_blocks_pin
+ * Input:
+ *  - ptr: start of the data, inside a run of pinned blocks
+ *  - len: its size
+ */
+void data_blocks_unpin(void const *ptr, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    size_t offset = (size_t)((char const *)ptr - fs_data);
+    size_t first = block_index(offset);
+    blocks_unpin((int)first, blocks_for(offset + len) - first);
+}
+
+/*
+ * Finds a segment of the open file table.
+ * Input:
+ *  - s: index of the segment
+ * Returns: the segment, NULL if not installed yet
+ */
+static open_file_segment_t *open_file_segment_load(size_t s) {
+    open_file_segment_t *segment =
+        atomic_load_explicit(&open_file_segments[s], memory_order_acquire);
+    if (segment != NULL) {
+        sanitizer_acquire(&open_file_segments[s]);
+    }
+    return segment;
+}
+
+/*
+ * Installs a segment of the open file table, unless another thread has
+ * just done it.
+ * Input:
+ *  - s: index of the segment
+ * Returns: the segment in place, NULL if out of memory
+ */
+static open_file_segment_t *open_file_segment_install(size_t s) {
+    open_file_segment_t *segment = malloc(sizeof(*segment));
+    if (segment == NULL) {
+        return NULL;
+    }
+    /* Slots past the end of the table are never free */
+    size_t slots = fs_geometry.g_max_open_files - s * OPEN_FILE_SEGMENT;
+    atomic_init(&segment->os_taken, slots < OPEN_FILE_SEGMENT
+                                        ? ~(uint64_t)0 << slots
+                                        : 0);
+    for (size_t i = 0; i < OPEN_FILE_SEGMENT; i++) {
+        atomic_init(&segment->os_generation[i], 0);
+        pthread_mutex_init(&segment->os_entries[i].of_lock, NULL);
+    }
+
+    open_file_segment_t *installed = NULL;
+    sanitizer_release(&open_file_segments[s]);
+    if (!atomic_compare_exchange_strong(&open_file_segments[s], &installed,
+                                        segment)) {
+        sanitizer_acquire(&open_file_segments[s]);
+        open_file_segment_free(segment);
+        return installed;
+    }
+    return segment;
+}
+
+/*
+ * Claims a free slot of a segment of the open file table.
+ * Input:
+ *  - segment: the segment
+ * Returns: the slot claimed, -1 if the segment is full
+ */
+static int open_file_slot_claim(open_file_segment_t *segment) {
+    uint64_t taken = atomic_load(&segment->os_taken);
+    while (taken != ~(uint64_t)0) {
+        int slot = __builtin_ctzll(~taken);
+        if (atomic_compare_exchange_weak(&segment->os_taken, &taken,
+                                         taken | (uint64_t)1 << slot)) {
+            return slot;
+        }
+    }
+    return -1;
 }
 
-/* Add new entry to the open file table
+/* Add new entry to the open file table. The segment where the thread last
+ * found a slot is tried first, then every segment in place, and only then is
+ * a new one installed
  * Inputs:
  * 	- I-node number of the file to open
  * 	- Initial offset
  * Returns: file handle if successful, -1 otherwise
  */
 int add_to_open_file_table(int inumber, size_t offset, int append_flag) {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        pthread_mutex_lock(&open_file_table_lock);
-        if (free_open_file_entries[i] == FREE) {
-            free_open_file_entries[i] = TAKEN;
-            open_file_table[i].of_inumber = inumber;
-            open_file_table[i].of_offset = offset;
-            open_file_table[i].of_append_flag = append_flag;
-            pthread_mutex_unlock(&open_file_table_lock);
-            return i;
-        }
-        pthread_mutex_unlock(&open_file_table_lock);
+    /* Counted before checking for closing, so that closing either sees this
+     * file or is seen by it */
+    atomic_fetch_add(&open_files_number, 1);
+    if (atomic_load(&state_closing)) {
+        atomic_fetch_sub(&open_files_number, 1);
+        return -1;
+    }
+
+    size_t count = open_file_segments_count;
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t n = 0; n < count; n++) {
+            size_t s = pass == 0 ? (open_file_segment_hint + n) % count : n;
+            open_file_segment_t *segment = open_file_segment_load(s);
+            if (segment == NULL) {
+                if (pass == 0 ||
+                    (segment = open_file_segment_install(s)) == NULL) {
+                    continue;
+                }
+            }
+            int slot = open_file_slot_claim(segment);
+            if (slot == -1) {
+                continue;
+            }
+            open_file_segment_hint = s;
+            segment->os_entries[slot].of_inumber = inumber;
+            segment->os_entries[slot].of_offset = offset;
+            segment->os_entries[slot].of_append_flag = append_flag;
+            atomic_store(&segment->os_entries[slot].of_ra_next, offset);
+            atomic_store(&segment->os_entries[slot].of_ra_window, 0);
+            atomic_store(&segment->os_entries[slot].of_ra_end, 0);
+            unsigned generation = atomic_load(&segment->os_generation[slot]);
+            return (int)(((generation & HANDLE_GENERATION_MASK)
+                          << OPEN_FILE_INDEX_BITS) |
+                         (s * OPEN_FILE_SEGMENT + (size_t)slot));
+        }
     }
+    atomic_fetch_sub(&open_files_number, 1);
     return -1;
 }
 
+/*
+ * Finds the segment and slot of a file handle.
+ * Input:
+ *  - fhandle: the file handle
+ *  - slot: filled with the slot within the segment
+ * Returns: the segment, NULL if the handle does not refer to an open file
+ */
+static open_file_segment_t *open_file_slot_get(int fhandle, size_t *slot) {
+    if (!valid_file_handle(fhandle)) {
+        return NULL;
+    }
+    size_t index = (unsigned)fhandle & HANDLE_INDEX_MASK;
+    open_file_segment_t *segment =
+        open_file_segment_load(index / OPEN_FILE_SEGMENT);
+    *slot = index % OPEN_FILE_SEGMENT;
+    if (segment == NULL ||
+        (atomic_load(&segment->os_taken) & (uint64_t)1 << *slot) == 0) {
+        return NULL;
+    }
+    return segment;
+}
+
 /* Frees an entry from the open file table
  * Inputs:
  * 	- file handle to free/close
  * Returns 0 is success, -1 otherwise
  */
 int remove_from_open_file_table(int fhandle) {
-    pthread_mutex_lock(&open_file_table_lock);
-    if (!valid_file_handle(fhandle) ||
-        free_open_file_entries[fhandle] != TAKEN) {
-        pthread_mutex_unlock(&open_file_table_lock);
+    size_t slot;
+    open_file_segment_t *segment = open_file_slot_get(fhandle, &slot);
+    if (segment == NULL) {
         return -1;
     }
-    free_open_file_entries[fhandle] = FREE;
-    pthread_mutex_unlock(&open_file_table_lock);
+
+    /* Of several closes of a handle, only the one that bumps the generation
+     * frees the slot */
+    unsigned generation = (unsigned)fhandle >> OPEN_FILE_INDEX_BITS;
+    unsigned current = atomic_load(&segment->os_generation[slot]);
+    do {
+        if ((current & HANDLE_GENERATION_MASK) != generation) {
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak(&segment->os_generation[slot],
+                                           &current, current + 1));
+    atomic_fetch_and(&segment->os_taken, ~((uint64_t)1 << slot));
+    atomic_fetch_sub(&open_files_number, 1);
     return 0;
 }
 
 /* Returns pointer to a given entry in the open file table
  * Inputs:
  * 	 - file handle
- * Returns: pointer to the entry if sucessful, NULL otherwise
+ * Returns: pointer to the entry if sucessful, NULL otherwise (including for
+ * a handle that was closed)
  */
 open_file_entry_t *get_open_file_entry(int fhandle) {
-    if (!valid_file_handle(fhandle)) {
+    size_t slot;
+    open_file_segment_t *segment = open_file_slot_get(fhandle, &slot);
+    if (segment == NULL ||
+        (atomic_load(&segment->os_generation[slot]) &
+         HANDLE_GENERATION_MASK) !=
+            (unsigned)fhandle >> OPEN_FILE_INDEX_BITS) {
         return NULL;
     }
-    return &open_file_table[fhandle];
+    return &segment->os_entries[slot];
+}
+
+/* Returns the number of entries in use in the open file table */
+int get_open_files_number() {
+    return atomic_load(&open_files_number);
+}
+
+/* Returns whether the FS is closing, i.e. no more files can be opened */
+bool state_closing_status() {
+    return atomic_load(&state_closing);
+}
+
+/* Stops any more files from being opened */
+void set_state_closing() {
+    atomic_store(&state_closing, true);
 }
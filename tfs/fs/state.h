@@ -3,11 +3,81 @@
 
 #include "config.h"
 
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <pthread.h>
 
+#define ROUND_UP(x, n) (((x) + (n)-1) / (n) * (n))
+
+/* "TFS1" */
+#define TFS_MAGIC (0x31534654)
+#define TFS_VERSION (5)
+
+/*
+ * Superblock: first block of a volume image. Describes the geometry the
+ * volume was formatted with and where each region starts (byte offsets from
+ * the start of the image)
+ */
+typedef struct {
+    uint32_t s_magic;
+    uint32_t s_version;
+    uint64_t s_block_size;
+    uint64_t s_data_blocks;
+    uint64_t s_inode_table_size;
+    uint64_t s_inode_bitmap_offset;
+    uint64_t s_inode_table_offset;
+    uint64_t s_block_bitmap_offset;
+    uint64_t s_journal_offset;
+    uint64_t s_journal_size;
+    uint64_t s_data_offset;
+    uint64_t s_image_size;
+    /* I-node chunks in use (see INODE_CHUNK) */
+    uint64_t s_inode_chunks;
+} superblock_t;
+
+#define JOURNAL_MAGIC (0x4c4e524a53465431) // "1TFSJRNL"
+#define JOURNAL_RECORD_MAGIC (0x44524345524c4e4a) // "JNLRECRD"
+
+/*
+ * Journal header: start of the journal region. Records follow it, starting
+ * with sequence number jh_sequence
+ */
+typedef struct {
+    uint64_t jh_magic;
+    uint64_t jh_sequence;
+} journal_header_t;
+
+/*
+ * Journal record: one committed batch of transactions, made of jr_length
+ * bytes of entries
+ */
+typedef struct {
+    uint64_t jr_magic;
+    uint64_t jr_sequence;
+    uint64_t jr_length;
+    uint64_t jr_checksum;
+} journal_record_t;
+
+/*
+ * Journal entry: the new contents of je_length bytes at offset je_offset of
+ * the image, which follow it (padded to 8 bytes). With JOURNAL_REVOKE set in
+ * je_length, no contents follow: the data blocks in the range were freed,
+ * and the earlier entries for them must not be replayed over what they hold
+ * next. je_sequence numbers the entries in the order the changes were made,
+ * which replay follows
+ */
+typedef struct {
+    uint64_t je_offset;
+    uint64_t je_length;
+    uint64_t je_sequence;
+} journal_entry_t;
+
+#define JOURNAL_REVOKE ((uint64_t)1 << 63)
+
 /*
  * Directory entry
  */
@@ -16,51 +86,291 @@ typedef struct {
     int d_inumber;
 } dir_entry_t;
 
+/*
+ * Directory block header: the next block in the bucket's overflow chain, -1
+ * if none. The entries' fingerprints and the entries follow it.
+ */
+typedef struct {
+    int db_overflow;
+} dir_block_t;
+
 typedef enum { T_FILE, T_DIRECTORY } inode_type;
 
+/*
+ * Extent: a run of e_length contiguous data blocks starting at e_start
+ */
+typedef struct {
+    int e_start;
+    int e_length;
+} extent_t;
+
+/* Most bytes a file keeps in its i-node, in place of its extents */
+#define INODE_INLINE_SIZE (INODE_EXTENTS * sizeof(extent_t))
+
 /*
  * I-node
+ * The file's data blocks are mapped, in order, by i_extent_count extents.
+ * The first INODE_EXTENTS are kept in the i-node itself; the rest spill to a
+ * chain of extent blocks starting at i_extent_block.
+ * A file with no blocks keeps its bytes (INODE_INLINE_SIZE at most) in
+ * i_inline instead, so a tiny file takes no data block; it moves them to a
+ * block once it outgrows the i-node.
+ * A directory's blocks are the buckets of a linear hash table, with
+ * 2^i_dir_level + i_dir_split buckets holding i_dir_entries names.
  */
 typedef struct {
     inode_type i_node_type;
     size_t i_size;
-    int i_data_block[DIRECT_BLOCKS_QUANTITY];
-    int i_index_block;
+    size_t i_blocks;
+    int i_extent_count;
+    union {
+        extent_t i_extents[INODE_EXTENTS];
+        char i_inline[INODE_INLINE_SIZE];
+    };
+    int i_extent_block;
+    unsigned i_dir_level;
+    size_t i_dir_split;
+    size_t i_dir_entries;
     /* in a real FS, more fields would exist here */
 } inode_t;
 
+/*
+ * Extent block (spilled extents of an i-node)
+ */
+typedef struct {
+    int eb_next;
+    extent_t eb_extents[];
+} extent_block_t;
+
+
 typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
 
+/* Allocation bitmaps are packed in 64-bit words, one bit per entry */
+#define BITMAP_WORD_BITS (64)
+#define BITMAP_WORDS(bits) (((bits) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+
+/*
+ * Dentry cache entry: what a name maps to in a directory (de_inumber is -1
+ * for a name known not to be there)
+ */
+typedef struct {
+    bool de_valid;
+    int de_parent;
+    unsigned de_generation;
+    uint32_t de_hash;
+    int de_inumber;
+    char de_name[MAX_FILE_NAME];
+} dentry_t;
+
 /*
- * Open file entry (in open file table)
+ * Open file entry (in open file table). of_lock serializes the writes
+ * through the entry; reads move the offset with a compare-and-swap
  */
 typedef struct {
     int of_inumber;
-    size_t of_offset;
+    _Atomic size_t of_offset;
     int of_append_flag;
+    pthread_mutex_t of_lock;
+    /* Read-ahead: where a sequential read would start, the window (in
+     * blocks) and the end of the blocks asked for so far */
+    _Atomic size_t of_ra_next;
+    _Atomic size_t of_ra_window;
+    _Atomic size_t of_ra_end;
 } open_file_entry_t;
 
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
+/*
+ * Locked byte range of an i-node's data (see inode_range_lock)
+ */
+typedef struct range_lock {
+    size_t rl_start;
+    size_t rl_end;
+    bool rl_write;
+    bool rl_counted;
+    struct range_lock *rl_next;
+} range_lock_t;
+
+/*
+ * Storage behind the data blocks of a volume (see block_device_t)
+ */
+typedef enum {
+    /* RAM without an image, FILE with one */
+    TFS_DEVICE_DEFAULT,
+    /* Memory only, with the emulated storage delay (DELAY) */
+    TFS_DEVICE_RAM,
+    /* The image file, through the page cache */
+    TFS_DEVICE_FILE,
+    /* The image file, bypassing the page cache (O_DIRECT) */
+    TFS_DEVICE_DIRECT,
+    /* The image file, bypassing the page cache, through io_uring */
+    TFS_DEVICE_URING
+} tfs_device_t;
+
+/*
+ * Request to a block device: br_count data blocks from br_block on, read
+ * into or written from br_data
+ */
+typedef struct {
+    int br_block;
+    size_t br_count;
+    void *br_data;
+    bool br_write;
+} block_request_t;
+
+/*
+ * Block device: reads and writes data blocks. submit_batch carries out
+ * several requests, at once where the device can; flush makes the writes
+ * done so far durable. Each returns 0 if successful, -1 otherwise
+ */
+typedef struct {
+    int (*bd_read_block)(int block_number, void *data);
+    int (*bd_write_block)(int block_number, void const *data);
+    int (*bd_submit_batch)(block_request_t const *requests, size_t count);
+    int (*bd_flush)(void);
+} block_device_t;
+
+/*
+ * FS parameters, chosen when it is initialized
+ */
+typedef struct {
+    /* Volume image, or NULL for a volume that only lives in memory */
+    char const *image_path;
+    /* Geometry of a new volume (an existing image keeps its own) */
+    size_t block_size;
+    size_t data_blocks;
+    size_t inode_table_size;
+    size_t journal_blocks;
+    /* Size of the open file table */
+    size_t max_open_files;
+    /* Blocks the block cache holds */
+    size_t cache_blocks;
+    /* Whether blocks are fetched ahead of sequential reads */
+    bool read_ahead;
+    /* Whether written file data is left dirty in the block cache, for
+     * flusher threads to write back later, rather than written through */
+    bool write_back;
+    /* Block device storing the data blocks */
+    tfs_device_t device;
+} tfs_params_t;
 
-void state_init();
+/*
+ * Block cache counters: accesses to blocks found in the cache (or being
+ * fetched into it) and not found, blocks evicted, blocks held and dirty
+ * ones among them, and blocks written back with how many device requests
+ */
+typedef struct {
+    uint64_t bc_hits;
+    uint64_t bc_misses;
+    uint64_t bc_evictions;
+    size_t bc_resident;
+    size_t bc_dirty;
+    uint64_t bc_written_back;
+    uint64_t bc_writeback_requests;
+} block_cache_stats_t;
+
+/*
+ * Sync counters: state_sync requests, and syncs carried out for them (fewer
+ * when concurrent requests share one)
+ */
+typedef struct {
+    uint64_t ss_requests;
+    uint64_t ss_syncs;
+} sync_stats_t;
+
+/*
+ * Geometry of the volume in use
+ */
+typedef struct {
+    size_t g_block_size;
+    /* log2 of the block size and block size - 1 when the block size is a
+     * power of two, 0 otherwise */
+    unsigned g_block_shift;
+    size_t g_block_mask;
+    size_t g_data_blocks;
+    size_t g_inode_table_size;
+    size_t g_max_open_files;
+    size_t g_cache_blocks;
+    /* Directory slots in a block */
+    size_t g_dir_entries;
+    /* Extents in an extent block */
+    size_t g_extents_per_block;
+} geometry_t;
+
+extern geometry_t fs_geometry;
+
+/* Whether an i-node is a file keeping its bytes in i_inline */
+static inline bool inode_inline(inode_t const *inode) {
+    return inode->i_node_type == T_FILE && inode->i_blocks == 0;
+}
+
+/* Index of the block holding a byte offset */
+static inline size_t block_index(size_t offset) {
+    if (fs_geometry.g_block_shift != 0) {
+        return offset >> fs_geometry.g_block_shift;
+    }
+    return offset / fs_geometry.g_block_size;
+}
+
+/* Position of a byte offset within its block */
+static inline size_t block_offset(size_t offset) {
+    if (fs_geometry.g_block_shift != 0) {
+        return offset & fs_geometry.g_block_mask;
+    }
+    return offset % fs_geometry.g_block_size;
+}
+
+/* Number of blocks needed to hold a number of bytes */
+static inline size_t blocks_for(size_t bytes) {
+    return block_index(bytes + fs_geometry.g_block_size - 1);
+}
+
+void state_default_params(tfs_params_t *params);
+int state_init(tfs_params_t const *params);
 void state_destroy();
+int state_sync();
+void state_sync_stats(sync_stats_t *stats);
+void writeback_kick();
+
+void journal_begin();
+void journal_log(void const *ptr, size_t len);
+bool journal_txn_large();
+int journal_commit();
+void journal_set_group_commit(bool enabled);
 
 int inode_create(inode_type n_type);
 int inode_delete(int inumber);
-int inode_datablocks_erase(inode_t i_node);
+int inode_datablocks_erase(inode_t *inode);
+int inode_extent_append(inode_t *inode, int start, int length);
+int inode_extent_lookup(inode_t const *inode, size_t block, extent_t *run);
+void inode_read_ahead(int inumber, size_t first, size_t count);
+int inode_grow(inode_t *inode, size_t blocks);
 inode_t *inode_get(int inumber);
 pthread_rwlock_t *inode_lock_get(int inumber);
+void inode_range_lock(int inumber, range_lock_t *range, size_t start,
+                      size_t end, bool write);
+void inode_range_unlock(int inumber, range_lock_t *range);
 
-int clear_dir_entry(int inumber, int sub_inumber);
+int clear_dir_entry(int inumber, char const *sub_name);
 int add_dir_entry(int inumber, int sub_inumber, char const *sub_name);
 int find_in_dir(int inumber, char const *sub_name);
+void dentry_cache_clear();
+void block_cache_stats(block_cache_stats_t *stats);
 
 int data_block_alloc();
+int data_block_alloc_many(size_t n, int out[]);
 int data_block_free(int block_number);
+int data_blocks_free(int start, size_t count);
 void *data_block_get(int block_number);
+void *data_blocks_get(int start, size_t count);
+void *data_blocks_pin(int start, size_t count);
+void data_blocks_unpin(void const *ptr, size_t len);
+int data_blocks_persist(void const *ptr, size_t len);
+ssize_t data_blocks_export(void const *ptr, size_t len, int fd);
 
 int add_to_open_file_table(int inumber, size_t offset, int append_flag);
 int remove_from_open_file_table(int fhandle);
 open_file_entry_t *get_open_file_entry(int fhandle);
+int get_open_files_number();
+bool state_closing_status();
+void set_state_closing();
 
 #endif // STATE_H
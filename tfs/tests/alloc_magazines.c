@@ -0,0 +1,73 @@
+#include "../fs/state.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#define THREADS 8
+#define ROUNDS 200
+#define BATCH 40
+
+/**
+   This test has several threads take and give back blocks and i-nodes one
+   at a time, through their magazines, checking that no block or i-node is
+   ever handed to two threads at once, and then that every block and i-node
+   held in magazines can still be allocated once the global maps run out.
+ */
+
+static atomic_bool block_owned[DATA_BLOCKS];
+static atomic_bool inode_owned[INODE_TABLE_SIZE];
+
+static void *alloc_and_free(void *arg) {
+    (void)arg;
+    int blocks[BATCH];
+    for (int i = 0; i < ROUNDS; i++) {
+        for (int j = 0; j < BATCH; j++) {
+            blocks[j] = data_block_alloc();
+            assert(blocks[j] != -1);
+            assert(!atomic_exchange(&block_owned[blocks[j]], true));
+        }
+        int inumber = inode_create(T_FILE);
+        assert(inumber != -1);
+        assert(!atomic_exchange(&inode_owned[inumber], true));
+
+        for (int j = 0; j < BATCH; j++) {
+            atomic_store(&block_owned[blocks[j]], false);
+            assert(data_block_free(blocks[j]) == 0);
+        }
+        atomic_store(&inode_owned[inumber], false);
+        assert(inode_delete(inumber) == 0);
+    }
+    return NULL;
+}
+
+int main() {
+    static int blocks[DATA_BLOCKS];
+    pthread_t tid[THREADS];
+
+    assert(state_init(NULL) != -1);
+
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_create(&tid[i], NULL, alloc_and_free, NULL) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    /* The whole volume is free again, even the blocks left in magazines */
+    assert(data_block_alloc_many(DATA_BLOCKS, blocks) == 0);
+    assert(data_block_alloc() == -1);
+    assert(data_blocks_free(0, DATA_BLOCKS) == 0);
+
+    /* And so is every i-node */
+    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
+        assert(inode_create(T_FILE) != -1);
+    }
+    assert(inode_create(T_FILE) == -1);
+
+    state_destroy();
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include "../fs/state.h"
+#include <assert.h>
+#include <string.h>
+
+#define RUN 8
+
+/**
+   This test checks data_block_alloc_many: a request that fits in a free run
+   gets contiguous blocks, a request that does not fit in any run is served
+   from the fewest fragments, and a request larger than the free space
+   allocates nothing.
+ */
+
+
+int main() {
+    static int blocks[DATA_BLOCKS];
+    int out[3 * RUN];
+
+    assert(state_init(NULL) != -1);
+
+    /* Fill the volume */
+    assert(data_block_alloc_many(DATA_BLOCKS, blocks) == 0);
+    assert(data_block_alloc() == -1);
+
+    /* Free one hole of RUN blocks, one of 2*RUN blocks and a few singles */
+    for (int i = 100; i < 100 + RUN; i++) {
+        assert(data_block_free(i) == 0);
+    }
+    for (int i = 500; i < 500 + 2 * RUN; i++) {
+        assert(data_block_free(i) == 0);
+    }
+    for (int i = 700; i < 700 + 2 * RUN; i += 2) {
+        assert(data_block_free(i) == 0);
+    }
+
+    /* Does not fit in the free space: nothing is allocated */
+    assert(data_block_alloc_many(5 * RUN, out) == -1);
+
+    /* Fits in the larger hole: one contiguous run */
+    assert(data_block_alloc_many(2 * RUN - 1, out) == 0);
+    for (int i = 0; i < 2 * RUN - 1; i++) {
+        assert(out[i] == 500 + i);
+    }
+
+    /* Does not fit in any hole: the largest hole is used first */
+    assert(data_block_alloc_many(RUN + 2, out) == 0);
+    for (int i = 0; i < RUN; i++) {
+        assert(out[i] == 100 + i);
+    }
+    assert(out[RUN] == 500 + 2 * RUN - 1);
+
+    state_destroy();
+
+    printf("Successful test.\n");
+
+    return 0;
+}
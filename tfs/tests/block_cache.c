@@ -0,0 +1,108 @@
+#include "../fs/state.h"
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+
+#define CACHE_BLOCKS (256)
+#define WORKING_SET (32)
+#define SCAN_START (100)
+#define THREADS 8
+#define ROUNDS 200
+
+/**
+   This test checks the block cache: blocks used again survive scans much
+   larger than the cache, pinned blocks are never evicted (even past the
+   cache size) and are let go once unpinned, and the counters add up while
+   many threads access, pin and unpin blocks at once.
+ */
+
+static block_cache_stats_t stats_since(block_cache_stats_t const *before) {
+    block_cache_stats_t now;
+    block_cache_stats(&now);
+    now.bc_hits -= before->bc_hits;
+    now.bc_misses -= before->bc_misses;
+    now.bc_evictions -= before->bc_evictions;
+    return now;
+}
+
+static void access_run(int start, int count) {
+    for (int b = start; b < start + count; b++) {
+        assert(data_block_get(b) != NULL);
+    }
+}
+
+static void *access_and_pin(void *arg) {
+    int t = (int)(size_t)arg;
+    for (int i = 0; i < ROUNDS; i++) {
+        int start = (t * 37 + i * 11) % (DATA_BLOCKS - 8);
+        assert(data_block_get(start) != NULL);
+        char *data = data_blocks_pin(start, 8);
+        assert(data != NULL);
+        data_blocks_unpin(data, 8 * BLOCK_SIZE);
+    }
+    return NULL;
+}
+
+int main() {
+    pthread_t tid[THREADS];
+    block_cache_stats_t before, stats;
+
+    tfs_params_t params;
+    state_default_params(&params);
+    params.cache_blocks = CACHE_BLOCKS;
+    params.read_ahead = false;
+    assert(state_init(&params) != -1);
+
+    /* Used once, pushed out by a scan, and used again: the working set is
+     * then kept apart from scans */
+    access_run(0, WORKING_SET);
+    access_run(SCAN_START, CACHE_BLOCKS);
+    access_run(0, WORKING_SET);
+    int big_scan = SCAN_START + 2 * CACHE_BLOCKS;
+    for (int i = 0; i < 3; i++) {
+        access_run(big_scan, DATA_BLOCKS - big_scan);
+    }
+    block_cache_stats(&before);
+    access_run(0, WORKING_SET);
+    stats = stats_since(&before);
+    assert(stats.bc_hits == WORKING_SET && stats.bc_misses == 0);
+    assert(stats.bc_resident <= CACHE_BLOCKS);
+
+    /* Pinned blocks stay, even more of them than the cache holds */
+    int pinned = CACHE_BLOCKS + CACHE_BLOCKS / 2;
+    char *data = data_blocks_pin(SCAN_START, (size_t)pinned);
+    assert(data != NULL);
+    access_run(big_scan, DATA_BLOCKS - big_scan);
+    block_cache_stats(&before);
+    assert(before.bc_resident >= (size_t)pinned);
+    access_run(SCAN_START, pinned);
+    stats = stats_since(&before);
+    assert(stats.bc_hits == (uint64_t)pinned && stats.bc_misses == 0);
+
+    /* Once unpinned they can go, and the cache shrinks back */
+    data_blocks_unpin(data + 10, (size_t)pinned * BLOCK_SIZE - 10);
+    access_run(big_scan, DATA_BLOCKS - big_scan);
+    block_cache_stats(&stats);
+    assert(stats.bc_resident <= CACHE_BLOCKS);
+
+    /* A run that cannot be pinned is refused */
+    assert(data_blocks_pin(DATA_BLOCKS - 1, 2) == NULL);
+
+    block_cache_stats(&before);
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_create(&tid[i], NULL, access_and_pin,
+                              (void *)(size_t)i) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+    stats = stats_since(&before);
+    assert(stats.bc_hits + stats.bc_misses == THREADS * ROUNDS * 9);
+    assert(stats.bc_resident <= CACHE_BLOCKS);
+
+    state_destroy();
+
+    printf("Successful test.\n");
+
+    return 0;
+}
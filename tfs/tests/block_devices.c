@@ -0,0 +1,91 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+#define FILE_SIZE (200 * BLOCK_SIZE + 77)
+#define PATCH_OFFSET (50 * BLOCK_SIZE + 300)
+#define PATCH_SIZE (3 * BLOCK_SIZE)
+
+/**
+   This test writes a file through each block device backed by an image,
+   unmounts it and attaches the image again through another device, checking
+   that the data written through the first one reached the image. It then
+   checks that a device that cannot serve a volume is refused.
+ */
+
+static char data[FILE_SIZE];
+
+static void init(char const *image, tfs_device_t device) {
+    tfs_params_t params = tfs_default_params();
+    params.image_path = image;
+    params.device = device;
+    assert(tfs_init_params(&params) != -1);
+}
+
+static void check_file() {
+    static char buffer[FILE_SIZE];
+    int f = tfs_open("/f", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, FILE_SIZE + 1) == FILE_SIZE);
+    assert(memcmp(buffer, data, FILE_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    char const *image = "tfs_block_devices.img";
+    tfs_device_t devices[] = {TFS_DEVICE_FILE, TFS_DEVICE_DIRECT,
+                              TFS_DEVICE_URING};
+    size_t count = sizeof(devices) / sizeof(devices[0]);
+
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        data[i] = (char)(i * 7 + i / BLOCK_SIZE);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        unlink(image);
+        init(image, devices[i]);
+        int f = tfs_open("/f", TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, data, FILE_SIZE) == FILE_SIZE);
+        assert(tfs_close(f) != -1);
+
+        /* A write that starts and ends inside blocks */
+        memset(data + PATCH_OFFSET, 'a' + (int)i, PATCH_SIZE);
+        f = tfs_open("/f", 0);
+        assert(f != -1);
+        assert(tfs_pwrite(f, data + PATCH_OFFSET, PATCH_SIZE, PATCH_OFFSET) ==
+               PATCH_SIZE);
+        assert(tfs_close(f) != -1);
+        check_file();
+        assert(tfs_destroy() != -1);
+
+        init(image, devices[(i + 1) % count]);
+        check_file();
+        assert(tfs_destroy() != -1);
+    }
+    unlink(image);
+
+    /* RAM only serves volumes without an image, the others need one */
+    tfs_params_t params = tfs_default_params();
+    params.image_path = image;
+    params.device = TFS_DEVICE_RAM;
+    assert(tfs_init_params(&params) == -1);
+    params.image_path = NULL;
+    params.device = TFS_DEVICE_FILE;
+    assert(tfs_init_params(&params) == -1);
+    params.device = TFS_DEVICE_RAM;
+    assert(tfs_init_params(&params) != -1);
+    assert(tfs_destroy() != -1);
+
+    /* O_DIRECT needs blocks aligned to what the kernel transfers */
+    unlink(image);
+    params.image_path = image;
+    params.block_size = DIRECT_IO_ALIGN / 2;
+    params.device = TFS_DEVICE_DIRECT;
+    assert(tfs_init_params(&params) == -1);
+    unlink(image);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
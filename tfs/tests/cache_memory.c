@@ -0,0 +1,85 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define CACHE_BLOCKS 64
+#define FILE_BLOCKS 4096
+#define CHUNK (16 * BLOCK_SIZE)
+
+/**
+   This test checks that the memory the FS takes for file data is bounded
+   by the block cache: writing and reading back a file many times the size
+   of the cache, with an image, leaves the memory of the image mapping that
+   only the process holds (its private copies of the image's pages) about
+   where it was.
+ */
+
+static char const *image = "tfs_cache_memory.img";
+
+/* Memory held by the process's private copies of pages of the image, in
+ * bytes */
+static size_t private_memory() {
+    FILE *smaps = fopen("/proc/self/smaps", "r");
+    assert(smaps != NULL);
+    char line[512];
+    bool in_image = false;
+    size_t total = 0;
+    while (fgets(line, sizeof(line), smaps) != NULL) {
+        size_t kb;
+        char const *space = strchr(line, ' ');
+        if (space != NULL && space[-1] != ':') {
+            /* The header of a mapping, not one of its fields */
+            in_image = strstr(line, image) != NULL;
+        } else if (in_image && sscanf(line, "Anonymous: %zu kB", &kb) == 1) {
+            total += kb * 1024;
+        }
+    }
+    fclose(smaps);
+    return total;
+}
+
+int main() {
+    static char chunk[CHUNK];
+    static char buffer[CHUNK];
+
+    unlink(image);
+    tfs_params_t params = tfs_default_params();
+    params.image_path = image;
+    params.data_blocks = 2 * FILE_BLOCKS;
+    params.cache_blocks = CACHE_BLOCKS;
+    assert(tfs_init_params(&params) != -1);
+
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, chunk, CHUNK) == CHUNK);
+    assert(tfs_close(f) != -1);
+    size_t before = private_memory();
+
+    f = tfs_open("/f", TFS_O_TRUNC);
+    assert(f != -1);
+    for (size_t i = 0; i < FILE_BLOCKS * BLOCK_SIZE / CHUNK; i++) {
+        memset(chunk, 'a' + (int)(i % 26), CHUNK);
+        assert(tfs_write(f, chunk, CHUNK) == CHUNK);
+    }
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open("/f", 0);
+    assert(f != -1);
+    for (size_t i = 0; i < FILE_BLOCKS * BLOCK_SIZE / CHUNK; i++) {
+        memset(chunk, 'a' + (int)(i % 26), CHUNK);
+        assert(tfs_read(f, buffer, CHUNK) == CHUNK);
+        assert(memcmp(buffer, chunk, CHUNK) == 0);
+    }
+    assert(tfs_close(f) != -1);
+
+    size_t grown = private_memory() - before;
+    assert(grown < FILE_BLOCKS * BLOCK_SIZE / 4);
+
+    assert(tfs_destroy() != -1);
+    unlink(image);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
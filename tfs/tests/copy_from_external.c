@@ -0,0 +1,129 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+#define SIZE (3 * IMPORT_CHUNK + 777)
+#define DIRS 4
+#define FILES 150
+
+/**
+   This test imports a file spanning several import chunks (so filled by
+   several threads) and an empty one from the external fs, then a tree of
+   directories holding a few hundred files into a volume image, which is
+   attached again to check that every file survived.
+ */
+
+static char const *image = "tfs_copy_from_external.img";
+static char const *host_file = "copy_from_external.bin";
+static char const *host_tree = "copy_from_external_tree";
+
+static void host_write(char const *path, char const *data, size_t len) {
+    FILE *fp = fopen(path, "w");
+    assert(fp != NULL);
+    assert(fwrite(data, 1, len, fp) == len);
+    assert(fclose(fp) != -1);
+}
+
+static void check_file(char const *path, char const *data, size_t len) {
+    static char output[SIZE + 1];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, output, sizeof(output)) == (ssize_t)len);
+    assert(memcmp(output, data, len) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    static char data[SIZE];
+    char path[256];
+    char content[64];
+
+    for (size_t i = 0; i < SIZE; i++) {
+        data[i] = (char)('a' + (i * 7) % 26);
+    }
+
+    tfs_params_t params = tfs_default_params();
+    params.data_blocks = 4 * SIZE / BLOCK_SIZE;
+    params.inode_table_size = 2 * DIRS * FILES;
+    params.image_path = image;
+    unlink(image);
+    assert(tfs_init_params(&params) != -1);
+
+    /* A large file, over an older and longer one */
+    host_write(host_file, data, SIZE);
+    int f = tfs_open("/big", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, data, SIZE) == SIZE);
+    assert(tfs_write(f, "tail", 4) == 4);
+    assert(tfs_close(f) != -1);
+    assert(tfs_copy_from_external_fs(host_file, "/big") != -1);
+    check_file("/big", data, SIZE);
+
+    /* An empty one */
+    host_write(host_file, data, 0);
+    assert(tfs_copy_from_external_fs(host_file, "/empty") != -1);
+    check_file("/empty", data, 0);
+    unlink(host_file);
+
+    assert(tfs_copy_from_external_fs("no_such_file", "/none") == -1);
+    assert(tfs_lookup("/none") == -1);
+    assert(tfs_copy_from_external_fs(".", "/none") == -1);
+
+    /* A tree: files directly under the root and in subdirectories */
+    assert(mkdir(host_tree, 0700) == 0);
+    for (int d = 0; d <= DIRS; d++) {
+        if (d > 0) {
+            snprintf(path, sizeof(path), "%s/d%d", host_tree, d);
+            assert(mkdir(path, 0700) == 0);
+        }
+        for (int i = 0; i < FILES; i++) {
+            if (d == 0) {
+                snprintf(path, sizeof(path), "%s/f%d", host_tree, i);
+            } else {
+                snprintf(path, sizeof(path), "%s/d%d/f%d", host_tree, d, i);
+            }
+            int len = snprintf(content, sizeof(content), "file %d of %d", i, d);
+            host_write(path, content, (size_t)len);
+        }
+    }
+    assert(tfs_copy_tree_from_external_fs(host_tree, "/tree") != -1);
+    assert(tfs_destroy() != -1);
+
+    /* Everything is in the image */
+    assert(tfs_init_image(image) != -1);
+    check_file("/big", data, SIZE);
+    for (int d = 0; d <= DIRS; d++) {
+        for (int i = 0; i < FILES; i++) {
+            if (d == 0) {
+                snprintf(path, sizeof(path), "/tree/f%d", i);
+            } else {
+                snprintf(path, sizeof(path), "/tree/d%d/f%d", d, i);
+            }
+            int len = snprintf(content, sizeof(content), "file %d of %d", i, d);
+            check_file(path, content, (size_t)len);
+        }
+    }
+    assert(tfs_destroy() != -1);
+
+    /* Cleaning up the external fs */
+    for (int d = 0; d <= DIRS; d++) {
+        for (int i = 0; i < FILES; i++) {
+            if (d == 0) {
+                snprintf(path, sizeof(path), "%s/f%d", host_tree, i);
+            } else {
+                snprintf(path, sizeof(path), "%s/d%d/f%d", host_tree, d, i);
+            }
+            assert(unlink(path) == 0);
+        }
+        if (d > 0) {
+            snprintf(path, sizeof(path), "%s/d%d", host_tree, d);
+            assert(rmdir(path) == 0);
+        }
+    }
+    assert(rmdir(host_tree) == 0);
+    unlink(image);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
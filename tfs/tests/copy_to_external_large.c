@@ -0,0 +1,76 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+#define SIZE (3 * EXPORT_CHUNK + 777)
+
+/**
+   This test exports a file spanning several chunks, from a volume that
+   lives in memory and from one backed by an image (copied in the kernel),
+   checking that the external file ends up with exactly its contents, even
+   when it was longer before.
+ */
+
+static void export_and_check(char const *image, char const *data) {
+    static char output[SIZE + 1];
+    char const *external = "external_large.txt";
+
+    tfs_params_t params = tfs_default_params();
+    params.image_path = image;
+    params.data_blocks = 2 * SIZE / BLOCK_SIZE;
+    if (image != NULL) {
+        unlink(image);
+    }
+    assert(tfs_init_params(&params) != -1);
+
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, data, SIZE) == SIZE);
+    assert(tfs_close(f) != -1);
+
+    /* An older, longer external file is replaced */
+    FILE *fp = fopen(external, "w");
+    assert(fp != NULL);
+    assert(fwrite(data, 1, SIZE, fp) == SIZE);
+    assert(fwrite("tail", 1, 4, fp) == 4);
+    assert(fclose(fp) != -1);
+
+    assert(tfs_copy_to_external_fs("/f", external) != -1);
+
+    fp = fopen(external, "r");
+    assert(fp != NULL);
+    assert(fread(output, 1, SIZE + 1, fp) == SIZE);
+    assert(memcmp(output, data, SIZE) == 0);
+    assert(fclose(fp) != -1);
+    unlink(external);
+
+    /* An empty file exports as an empty file */
+    f = tfs_open("/empty", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_copy_to_external_fs("/empty", external) != -1);
+    fp = fopen(external, "r");
+    assert(fp != NULL);
+    assert(fread(output, 1, 1, fp) == 0);
+    assert(fclose(fp) != -1);
+    unlink(external);
+
+    assert(tfs_destroy() != -1);
+    if (image != NULL) {
+        unlink(image);
+    }
+}
+
+int main() {
+    static char data[SIZE];
+    for (size_t i = 0; i < SIZE; i++) {
+        data[i] = (char)('a' + (i * 7) % 26);
+    }
+
+    export_and_check(NULL, data);
+    export_and_check("tfs_copy_large.img", data);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,88 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+#define CHUNK 7000
+#define COUNT 400
+
+/**
+   This test runs the file system with geometries other than the default
+   one: a block size that is not a power of two, a bigger block size and
+   volume, a larger open file table, a geometry that is too small, and an
+   image attached with other parameters than it was formatted with.
+ */
+
+static void write_and_check(char const *path) {
+    static char input[CHUNK];
+    static char output[CHUNK];
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    for (int i = 0; i < COUNT; i++) {
+        memset(input, 'A' + i % 26, CHUNK);
+        assert(tfs_write(f, input, CHUNK) == CHUNK);
+    }
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    for (int i = 0; i < COUNT; i++) {
+        memset(input, 'A' + i % 26, CHUNK);
+        assert(tfs_read(f, output, CHUNK) == CHUNK);
+        assert(memcmp(input, output, CHUNK) == 0);
+    }
+    assert(tfs_read(f, output, CHUNK) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    char *image = "tfs_custom_geometry.img";
+
+    /* 2.8 MB file on 1000-byte blocks, 100 open files */
+    tfs_params_t params = tfs_default_params();
+    params.block_size = 1000;
+    params.data_blocks = 4000;
+    params.max_open_files = 100;
+    assert(tfs_init_params(&params) != -1);
+    write_and_check("/f1");
+    int f[100];
+    for (int i = 0; i < 100; i++) {
+        f[i] = tfs_open("/f1", 0);
+        assert(f[i] != -1);
+    }
+    assert(tfs_open("/f1", 0) == -1);
+    for (int i = 0; i < 100; i++) {
+        assert(tfs_close(f[i]) != -1);
+    }
+    assert(tfs_destroy() != -1);
+
+    /* Too small a block */
+    params = tfs_default_params();
+    params.block_size = 100;
+    assert(tfs_init_params(&params) == -1);
+
+    /* 4 KiB blocks on an image, attached again with the default
+     * parameters: the volume keeps its own geometry */
+    unlink(image);
+    params = tfs_default_params();
+    params.image_path = image;
+    params.block_size = 4096;
+    assert(tfs_init_params(&params) != -1);
+    write_and_check("/f2");
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_init_image(image) != -1);
+    assert(fs_geometry.g_block_size == 4096);
+    int fd = tfs_open("/f2", 0);
+    assert(fd != -1);
+    static char output[CHUNK];
+    assert(tfs_read(fd, output, CHUNK) == CHUNK);
+    assert(output[0] == 'A' && output[CHUNK - 1] == 'A');
+    assert(tfs_close(fd) != -1);
+    assert(tfs_destroy() != -1);
+    unlink(image);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
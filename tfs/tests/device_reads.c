@@ -0,0 +1,103 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CACHE_BLOCKS 64
+#define SCAN_BLOCKS (4 * CACHE_BLOCKS)
+
+/**
+   This test checks that a block the cache no longer holds is read from the
+   device: a file's block is pushed out by a scan, changed in the image
+   behind the FS's back, and reading the file must return the new bytes.
+   Blocks written must likewise reach the image through the device, and
+   only then. Both are checked with the buffered and the O_DIRECT device,
+   writing through and back.
+ */
+
+static char const *image = "tfs_device_reads.img";
+
+/* Writes a file of the given number of blocks, all of them filled with c */
+static void write_block(char const *path, char c, size_t blocks) {
+    static char block[SCAN_BLOCKS * BLOCK_SIZE];
+    memset(block, c, blocks * BLOCK_SIZE);
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, block, blocks * BLOCK_SIZE) ==
+           (ssize_t)(blocks * BLOCK_SIZE));
+    assert(tfs_close(f) != -1);
+}
+
+/* Offset in the image of the first block of a file */
+static off_t block_offset_of(char const *path, int fd) {
+    int inumber = tfs_lookup(path);
+    assert(inumber != -1);
+    extent_t run;
+    assert(inode_extent_lookup(inode_get(inumber), 0, &run) != -1);
+    superblock_t sb;
+    assert(pread(fd, &sb, sizeof(sb), 0) == sizeof(sb));
+    return (off_t)(sb.s_data_offset + (uint64_t)run.e_start * BLOCK_SIZE);
+}
+
+static void check_device(tfs_device_t device, bool write_back) {
+    static char block[BLOCK_SIZE];
+    static char buffer[BLOCK_SIZE];
+
+    unlink(image);
+    tfs_params_t params = tfs_default_params();
+    params.image_path = image;
+    params.cache_blocks = CACHE_BLOCKS;
+    params.read_ahead = false;
+    params.write_back = write_back;
+    params.device = device;
+    assert(tfs_init_params(&params) != -1);
+
+    write_block("/f", 'a', 1);
+    /* Pushes the file's block out of the cache */
+    write_block("/scan", 's', SCAN_BLOCKS);
+
+    int fd = open(image, O_RDWR);
+    assert(fd != -1);
+    off_t offset = block_offset_of("/f", fd);
+    assert(pread(fd, buffer, sizeof(buffer), offset) == sizeof(buffer));
+    memset(block, 'a', sizeof(block));
+    assert(memcmp(buffer, block, sizeof(block)) == 0);
+    memset(block, 'b', sizeof(block));
+    assert(pwrite(fd, block, sizeof(block), offset) == sizeof(block));
+    assert(fsync(fd) != -1);
+
+    int f = tfs_open("/f", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, block, sizeof(block)) == 0);
+
+    /* A block written back reaches the image only when the device writes
+     * it, not before */
+    memset(block, 'c', sizeof(block));
+    assert(tfs_pwrite(f, block, sizeof(block), 0) == sizeof(block));
+    if (write_back) {
+        assert(pread(fd, buffer, sizeof(buffer), offset) == sizeof(buffer));
+        assert(buffer[0] == 'b');
+    }
+    assert(tfs_fsync(f) != -1);
+    assert(pread(fd, buffer, sizeof(buffer), offset) == sizeof(buffer));
+    assert(memcmp(buffer, block, sizeof(block)) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+    assert(close(fd) != -1);
+    unlink(image);
+}
+
+int main() {
+    tfs_device_t devices[] = {TFS_DEVICE_FILE, TFS_DEVICE_DIRECT};
+    for (size_t i = 0; i < sizeof(devices) / sizeof(devices[0]); i++) {
+        check_device(devices[i], false);
+        check_device(devices[i], true);
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
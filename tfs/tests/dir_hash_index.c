@@ -0,0 +1,69 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+/**
+   This test fills the root directory past the slots of its first block,
+   which is a hash table, checks that every name is found, removes every other entry and checks that the
+   remaining ones are still found past the deleted slots and that the freed
+   slots can be used again.
+ */
+
+
+int main() {
+    char path[16];
+
+    assert(tfs_init() != -1);
+    size_t slots = fs_geometry.g_dir_entries;
+    int inum[64];
+    assert(slots <= 64);
+
+    for (size_t i = 0; i < slots; i++) {
+        snprintf(path, sizeof(path), "/f%zu", i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    /* The directory grows instead of filling up */
+    int fd = tfs_open("/one_more", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_lookup("/one_more") != -1);
+
+    for (size_t i = 0; i < slots; i++) {
+        snprintf(path, sizeof(path), "/f%zu", i);
+        inum[i] = tfs_lookup(path);
+        assert(inum[i] != -1);
+    }
+
+    for (size_t i = 0; i < slots; i += 2) {
+        snprintf(path, sizeof(path), "f%zu", i);
+        assert(clear_dir_entry(ROOT_DIR_INUM, path) != -1);
+        assert(clear_dir_entry(ROOT_DIR_INUM, path) == -1);
+        assert(inode_delete(inum[i]) != -1);
+    }
+
+    for (size_t i = 0; i < slots; i++) {
+        snprintf(path, sizeof(path), "/f%zu", i);
+        if (i % 2 == 0) {
+            assert(tfs_lookup(path) == -1);
+        } else {
+            assert(tfs_lookup(path) == inum[i]);
+        }
+    }
+
+    for (size_t i = 0; i < slots; i += 2) {
+        snprintf(path, sizeof(path), "/g%zu", i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+        assert(tfs_lookup(path) != -1);
+    }
+    assert(tfs_lookup("/one_more") != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,69 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+#define ENTRIES 100000
+
+/**
+   This test puts many more names in the root directory than fit in one
+   block, all linking to the same file, and checks that every name is found,
+   with the dentry cache emptied so that lookups go to the directory, that
+   removing half of them leaves the other half in place, and that the
+   directory can grow again afterwards.
+ */
+
+int main() {
+    char name[MAX_FILE_NAME];
+
+    tfs_params_t params = tfs_default_params();
+    params.block_size = 4096;
+    params.data_blocks = 8192;
+    assert(tfs_init_params(&params) != -1);
+
+    int target = inode_create(T_FILE);
+    assert(target != -1);
+
+    for (int i = 0; i < ENTRIES; i++) {
+        snprintf(name, sizeof(name), "entry_%d", i);
+        assert(add_dir_entry(ROOT_DIR_INUM, target, name) != -1);
+    }
+    inode_t *root = inode_get(ROOT_DIR_INUM);
+    assert(root->i_dir_entries == ENTRIES);
+    assert(root->i_size / fs_geometry.g_block_size * fs_geometry.g_dir_entries >=
+           ENTRIES);
+
+    dentry_cache_clear();
+    for (int i = 0; i < ENTRIES; i++) {
+        snprintf(name, sizeof(name), "entry_%d", i);
+        assert(find_in_dir(ROOT_DIR_INUM, name) == target);
+    }
+    assert(find_in_dir(ROOT_DIR_INUM, "entry_-1") == -1);
+
+    for (int i = 0; i < ENTRIES; i += 2) {
+        snprintf(name, sizeof(name), "entry_%d", i);
+        assert(clear_dir_entry(ROOT_DIR_INUM, name) != -1);
+    }
+    assert(root->i_dir_entries == ENTRIES / 2);
+
+    dentry_cache_clear();
+    for (int i = 0; i < ENTRIES; i++) {
+        snprintf(name, sizeof(name), "entry_%d", i);
+        assert(find_in_dir(ROOT_DIR_INUM, name) == (i % 2 ? target : -1));
+    }
+
+    for (int i = 0; i < ENTRIES; i++) {
+        snprintf(name, sizeof(name), "other_%d", i);
+        assert(add_dir_entry(ROOT_DIR_INUM, target, name) != -1);
+    }
+    dentry_cache_clear();
+    for (int i = 0; i < ENTRIES; i++) {
+        snprintf(name, sizeof(name), "other_%d", i);
+        assert(find_in_dir(ROOT_DIR_INUM, name) == target);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
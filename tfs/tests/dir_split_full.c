@@ -0,0 +1,87 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define ENTRIES 1000
+#define ENTRIES_BEFORE_FULL 40
+
+/**
+   This test adds names that all hash to the last bucket a directory splits
+   at each level, so that it chains overflow blocks, and keeps adding them
+   once the volume has no free block left. Splitting the bucket needs as many
+   overflow blocks as it had, and those of its old chain only come back once
+   the transaction that split it is durable (hence an image, with a
+   journal), so it cannot take place; every name added must still be found.
+ */
+
+/* The hash directories give names (32-bit FNV-1a) */
+static uint32_t name_hash(char const *name) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; name[i] != '\0'; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* Fills 'name' with the next name whose hash has its low 8 bits set, or
+ * not even its low 3 bits */
+static void next_name(char *name, int *seed, bool chained) {
+    uint32_t mask = chained ? 0xff : 0x7;
+    do {
+        snprintf(name, MAX_FILE_NAME, "entry_%d", (*seed)++);
+    } while (((name_hash(name) & mask) == mask) != chained);
+}
+
+int main() {
+    static char names[ENTRIES][MAX_FILE_NAME];
+    char const *image = "tfs_dir_split_full.img";
+
+    unlink(image);
+    tfs_params_t params = tfs_default_params();
+    params.image_path = image;
+    params.block_size = MIN_BLOCK_SIZE;
+    params.data_blocks = 256;
+    assert(tfs_init_params(&params) != -1);
+
+    int target = inode_create(T_FILE);
+    assert(target != -1);
+
+    int seed = 0;
+    int added = 0;
+    while (added < ENTRIES_BEFORE_FULL) {
+        next_name(names[added], &seed, true);
+        assert(add_dir_entry(ROOT_DIR_INUM, target, names[added]) != -1);
+        added++;
+    }
+
+    /* Takes every free block */
+    while (data_block_alloc() != -1) {
+    }
+
+    while (added < ENTRIES) {
+        next_name(names[added], &seed, false);
+        /* In a transaction, as when a file is created */
+        journal_begin();
+        int ret = add_dir_entry(ROOT_DIR_INUM, target, names[added]);
+        assert(journal_commit() != -1);
+        if (ret == -1) {
+            break;
+        }
+        added++;
+    }
+    assert(added < ENTRIES);
+    assert(inode_get(ROOT_DIR_INUM)->i_dir_entries == (size_t)added);
+
+    dentry_cache_clear();
+    for (int i = 0; i < added; i++) {
+        assert(find_in_dir(ROOT_DIR_INUM, names[i]) == target);
+    }
+
+    assert(tfs_destroy() != -1);
+    unlink(image);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,43 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+
+#define DATA_BLOCKS_USED 64
+
+/**
+   This test checks that a freed block is only reused once the transaction
+   that freed it is durable: with write-back, where commits are deferred, the
+   block is handed out again only after every other one, when running out of
+   space has the allocator make the commit durable.
+ */
+
+int main() {
+    char const *image = "tfs_free_after_commit.img";
+
+    unlink(image);
+    tfs_params_t params = tfs_default_params();
+    params.image_path = image;
+    params.data_blocks = DATA_BLOCKS_USED;
+    params.write_back = true;
+    assert(tfs_init_params(&params) != -1);
+
+    int freed = data_block_alloc();
+    assert(freed != -1);
+    assert(data_block_free(freed) != -1);
+
+    int b;
+    int last = -1;
+    int reused = 0;
+    while ((b = data_block_alloc()) != -1) {
+        reused += b == freed;
+        last = b;
+    }
+    assert(reused == 1 && last == freed);
+
+    assert(tfs_destroy() != -1);
+    unlink(image);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
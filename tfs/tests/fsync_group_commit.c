@@ -0,0 +1,93 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREADS 8
+#define ROUNDS 20
+#define RECORD 100
+
+/**
+   This test has several threads append to their own files on a volume
+   image, with write-back, calling tfs_fsync after each append, with and
+   without group commit. Every sync succeeds, concurrent ones share device
+   flushes only with group commit, and everything is in the image once it
+   is attached again.
+ */
+
+static void *append_and_sync(void *arg) {
+    int t = (int)(size_t)arg;
+    char path[16];
+    char record[RECORD];
+    snprintf(path, sizeof(path), "/f%d", t);
+    memset(record, 'a' + t, RECORD);
+
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_APPEND);
+    assert(f != -1);
+    for (int i = 0; i < ROUNDS; i++) {
+        assert(tfs_write(f, record, RECORD) == RECORD);
+        assert(tfs_fsync(f) == 0);
+    }
+    assert(tfs_close(f) != -1);
+    return NULL;
+}
+
+static void run_threads() {
+    pthread_t tid[THREADS];
+    for (int t = 0; t < THREADS; t++) {
+        assert(pthread_create(&tid[t], NULL, append_and_sync,
+                              (void *)(size_t)t) == 0);
+    }
+    for (int t = 0; t < THREADS; t++) {
+        assert(pthread_join(tid[t], NULL) == 0);
+    }
+}
+
+int main() {
+    char const *image = "tfs_fsync_group_commit.img";
+    tfs_params_t params = tfs_default_params();
+    params.image_path = image;
+    params.write_back = true;
+    unlink(image);
+    assert(tfs_init_params(&params) != -1);
+
+    sync_stats_t stats;
+    run_threads();
+    state_sync_stats(&stats);
+    assert(stats.ss_requests == THREADS * ROUNDS);
+    assert(stats.ss_syncs <= stats.ss_requests);
+
+    /* Each sync on its own */
+    journal_set_group_commit(false);
+    sync_stats_t before;
+    state_sync_stats(&before);
+    run_threads();
+    state_sync_stats(&stats);
+    assert(stats.ss_requests - before.ss_requests == THREADS * ROUNDS);
+    assert(stats.ss_syncs - before.ss_syncs == THREADS * ROUNDS);
+    journal_set_group_commit(true);
+    assert(tfs_syncfs() == 0);
+    assert(tfs_destroy() != -1);
+
+    /* Both runs appended to the same files */
+    assert(tfs_init_params(&params) != -1);
+    for (int t = 0; t < THREADS; t++) {
+        char path[16];
+        static char buffer[2 * ROUNDS * RECORD + 1];
+        snprintf(path, sizeof(path), "/f%d", t);
+        int f = tfs_open(path, 0);
+        assert(f != -1);
+        assert(tfs_read(f, buffer, sizeof(buffer)) == 2 * ROUNDS * RECORD);
+        for (size_t i = 0; i < 2 * ROUNDS * RECORD; i++) {
+            assert(buffer[i] == 'a' + t);
+        }
+        assert(tfs_close(f) != -1);
+    }
+    assert(tfs_destroy() != -1);
+    unlink(image);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
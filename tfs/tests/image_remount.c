@@ -0,0 +1,70 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+#define SIZE 5000
+
+/**
+   This test writes a file to a volume image, unmounts it and attaches the
+   image again, checking that the file (and the free block map) survived.
+   It then checks that an image with a bad superblock is refused.
+ */
+
+
+int main() {
+    char *image = "tfs_image_remount.img";
+    char *path1 = "/f1";
+    char *path2 = "/f2";
+
+    static char input[SIZE];
+    static char output[SIZE];
+    memset(input, 'A', SIZE);
+
+    unlink(image);
+    assert(tfs_init_image(image) != -1);
+
+    int f = tfs_open(path1, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, input, SIZE) == SIZE);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    /* Attach the same image: the file must still be there */
+    assert(tfs_init_image(image) != -1);
+
+    f = tfs_open(path1, 0);
+    assert(f != -1);
+    assert(tfs_read(f, output, SIZE) == SIZE);
+    assert(memcmp(input, output, SIZE) == 0);
+    assert(tfs_close(f) != -1);
+
+    /* The blocks of /f1 must still be taken */
+    memset(input, 'B', SIZE);
+    f = tfs_open(path2, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, input, SIZE) == SIZE);
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open(path1, 0);
+    assert(f != -1);
+    assert(tfs_read(f, output, SIZE) == SIZE);
+    memset(input, 'A', SIZE);
+    assert(memcmp(input, output, SIZE) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    /* Corrupt the magic number */
+    FILE *fp = fopen(image, "r+");
+    assert(fp != NULL);
+    assert(fwrite("XXXX", 1, 4, fp) == 4);
+    assert(fclose(fp) == 0);
+    assert(tfs_init_image(image) == -1);
+
+    unlink(image);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
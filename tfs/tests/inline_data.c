@@ -0,0 +1,145 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define DATA_BLOCKS_USED 32
+#define TINY_FILES 200
+#define TINY_SIZE 50
+
+/**
+   This test checks files that keep their bytes in the i-node: many more
+   tiny files than the volume has blocks fit, writes with gaps and reads
+   mappings see the same bytes, a file moves them to a block as it outgrows
+   the i-node, and they survive attaching the image again.
+ */
+
+static char const *image = "tfs_inline_data.img";
+
+static void init() {
+    tfs_params_t params = tfs_default_params();
+    params.image_path = image;
+    params.data_blocks = DATA_BLOCKS_USED;
+    params.inode_table_size = TINY_FILES + 8;
+    params.max_open_files = 4;
+    assert(tfs_init_params(&params) != -1);
+}
+
+static void tiny_contents(int i, char *data) {
+    snprintf(data, TINY_SIZE + 1, "%049d", i);
+}
+
+static void check(char const *path, char const *expected, size_t len) {
+    static char buffer[DATA_BLOCKS_USED * BLOCK_SIZE];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)len);
+    assert(memcmp(buffer, expected, len) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    char path[16];
+    char data[TINY_SIZE + 1];
+    char buffer[2 * BLOCK_SIZE];
+
+    unlink(image);
+    init();
+
+    /* Only the root directory's buckets take blocks, tiny files none */
+    for (int i = 0; i < TINY_FILES; i++) {
+        snprintf(path, sizeof(path), "/t%d", i);
+        tiny_contents(i, data);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, data, TINY_SIZE) == TINY_SIZE);
+        assert(tfs_close(f) != -1);
+    }
+
+    /* A write past the end leaves a gap of zeroes, still in the i-node */
+    int f = tfs_open("/gap", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "head", 4) == 4);
+    assert(tfs_pwrite(f, "tail", 4, 40) == 4);
+    assert(tfs_close(f) != -1);
+    char gap[44] = "head";
+    memcpy(gap + 40, "tail", 4);
+    check("/gap", gap, sizeof(gap));
+
+    /* A mapping holds a copy of the bytes */
+    f = tfs_open("/t7", 0);
+    assert(f != -1);
+    tfs_map_t map;
+    assert(tfs_read_map(f, 100, &map) == TINY_SIZE);
+    assert(map.tm_count == 1 && map.tm_segments[0].ts_len == TINY_SIZE);
+    tiny_contents(7, data);
+    assert(memcmp(map.tm_segments[0].ts_data, data, TINY_SIZE) == 0);
+    assert(tfs_read_unmap(&map) == 0);
+    assert(tfs_close(f) != -1);
+
+    /* Outgrowing the i-node moves the bytes to a block */
+    f = tfs_open("/t3", TFS_O_APPEND);
+    assert(f != -1);
+    memset(buffer, 'x', BLOCK_SIZE - TINY_SIZE);
+    assert(tfs_write(f, buffer, BLOCK_SIZE - TINY_SIZE) ==
+           BLOCK_SIZE - TINY_SIZE);
+    assert(tfs_close(f) != -1);
+    tiny_contents(3, buffer);
+    memset(buffer + TINY_SIZE, 'x', BLOCK_SIZE - TINY_SIZE);
+    check("/t3", buffer, BLOCK_SIZE);
+
+    /* Filling the volume */
+    static char big[DATA_BLOCKS_USED * BLOCK_SIZE];
+    memset(big, 'b', sizeof(big));
+    f = tfs_open("/big", TFS_O_CREAT);
+    assert(f != -1);
+    size_t big_size = 0;
+    ssize_t written;
+    while ((written = tfs_write(f, big, BLOCK_SIZE)) > 0) {
+        big_size += (size_t)written;
+    }
+    assert(big_size > 0 && big_size < sizeof(big));
+    assert(tfs_close(f) != -1);
+
+    /* With no block left, a tiny file that cannot grow keeps its bytes */
+    f = tfs_open("/t4", TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_write(f, buffer, BLOCK_SIZE) == -1);
+    assert(tfs_close(f) != -1);
+    tiny_contents(4, data);
+    check("/t4", data, TINY_SIZE);
+
+    /* Truncating gives the block back, and the file is inline again */
+    f = tfs_open("/t3", TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, "short", 5) == 5);
+    assert(tfs_close(f) != -1);
+    f = tfs_open("/t4", TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_write(f, "!", 1) == 1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    /* Everything was logged with the i-nodes */
+    init();
+    for (int i = 0; i < TINY_FILES; i++) {
+        if (i == 3 || i == 4) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/t%d", i);
+        tiny_contents(i, data);
+        check(path, data, TINY_SIZE);
+    }
+    check("/t3", "short", 5);
+    tiny_contents(4, buffer);
+    buffer[TINY_SIZE] = '!';
+    check("/t4", buffer, TINY_SIZE + 1);
+    check("/gap", gap, sizeof(gap));
+    check("/big", big, big_size);
+    assert(tfs_destroy() != -1);
+    unlink(image);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+#define INODES 50000
+
+/**
+   This test creates many i-nodes on a large i-node table, which is taken
+   into use a chunk at a time, checking that numbers are handed out lowest
+   first, that freed ones are reused before the table grows again, that a
+   small table fills up, and that the chunks in use survive a remount.
+ */
+
+
+int main() {
+    char *image = "tfs_inode_table_growth.img";
+    static bool seen[INODES + 1];
+
+    tfs_params_t params = tfs_default_params();
+    params.inode_table_size = 1 << 20;
+    assert(tfs_init_params(&params) != -1);
+
+    /* The root directory is i-node 0 */
+    for (int i = 1; i <= INODES; i++) {
+        assert(inode_create(T_FILE) == i);
+    }
+    assert(inode_get(INODES + INODE_CHUNK) == NULL);
+
+    for (int i = 1; i <= INODES; i += 2) {
+        assert(inode_delete(i) != -1);
+        assert(inode_delete(i) == -1);
+    }
+    for (int i = 1; i <= INODES; i += 2) {
+        int inumber = inode_create(T_FILE);
+        assert(inumber > 0 && inumber <= INODES);
+        assert(inumber % 2 == 1 && !seen[inumber]);
+        seen[inumber] = true;
+    }
+    assert(inode_create(T_FILE) == INODES + 1);
+    assert(tfs_destroy() != -1);
+
+    /* A table that is not a multiple of the chunk size fills up */
+    params = tfs_default_params();
+    params.inode_table_size = INODE_CHUNK + 10;
+    assert(tfs_init_params(&params) != -1);
+    for (int i = 1; i < INODE_CHUNK + 10; i++) {
+        assert(inode_create(T_FILE) == i);
+    }
+    assert(inode_create(T_FILE) == -1);
+    assert(tfs_destroy() != -1);
+
+    /* The chunks in use are recorded in the image */
+    unlink(image);
+    params = tfs_default_params();
+    params.image_path = image;
+    params.inode_table_size = 1000;
+    assert(tfs_init_params(&params) != -1);
+    journal_begin();
+    for (int i = 1; i < 3 * INODE_CHUNK; i++) {
+        assert(inode_create(T_FILE) == i);
+    }
+    assert(journal_commit() != -1);
+    assert(inode_delete(INODE_CHUNK) != -1);
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_init_image(image) != -1);
+    assert(inode_get(3 * INODE_CHUNK - 1) != NULL);
+    assert(inode_get(3 * INODE_CHUNK) == NULL);
+    assert(inode_create(T_FILE) == INODE_CHUNK);
+    assert(inode_create(T_FILE) == 3 * INODE_CHUNK);
+    assert(tfs_destroy() != -1);
+    unlink(image);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
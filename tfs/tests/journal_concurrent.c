@@ -0,0 +1,100 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREADS 16
+#define FILES 40
+#define SIZE 3000
+
+/**
+   This test has several threads create and write files in one directory on
+   an image with a small journal, so that transactions commit in another
+   order than they changed the directory and the allocation maps, and
+   checkpoints happen while some are still open. Attaching the image again
+   must find every file, and filling the volume must not overwrite them.
+ */
+
+static char const *image = "tfs_journal_concurrent.img";
+
+static void init() {
+    tfs_params_t params = tfs_default_params();
+    params.image_path = image;
+    params.data_blocks = 4 * THREADS * FILES;
+    params.inode_table_size = THREADS * FILES + 8;
+    params.journal_blocks = MIN_JOURNAL_BLOCKS;
+    params.max_open_files = 2 * THREADS;
+    assert(tfs_init_params(&params) != -1);
+}
+
+static void contents(int t, int i, char *data) {
+    memset(data, 'A' + (t * FILES + i) % 26, SIZE);
+    snprintf(data, SIZE, "%d/%d", t, i);
+}
+
+static void *create_files(void *arg) {
+    int t = (int)(size_t)arg;
+    char path[16];
+    char data[SIZE];
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "/f%d_%d", t, i);
+        contents(t, i, data);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, data, SIZE) == SIZE);
+        assert(tfs_close(f) != -1);
+    }
+    return NULL;
+}
+
+static void check_files() {
+    char path[16];
+    char expected[SIZE];
+    char data[SIZE + 1];
+    for (int t = 0; t < THREADS; t++) {
+        for (int i = 0; i < FILES; i++) {
+            snprintf(path, sizeof(path), "/f%d_%d", t, i);
+            contents(t, i, expected);
+            int f = tfs_open(path, 0);
+            assert(f != -1);
+            assert(tfs_read(f, data, sizeof(data)) == SIZE);
+            assert(memcmp(data, expected, SIZE) == 0);
+            assert(tfs_close(f) != -1);
+        }
+    }
+}
+
+int main() {
+    pthread_t tid[THREADS];
+
+    unlink(image);
+    init();
+    for (int t = 0; t < THREADS; t++) {
+        assert(pthread_create(&tid[t], NULL, create_files, (void *)(size_t)t) ==
+               0);
+    }
+    for (int t = 0; t < THREADS; t++) {
+        assert(pthread_join(tid[t], NULL) == 0);
+    }
+    assert(tfs_destroy() != -1);
+
+    init();
+    check_files();
+
+    /* Every block the maps show free really is */
+    static char fill[BLOCK_SIZE];
+    memset(fill, 'z', sizeof(fill));
+    int f = tfs_open("/fill", TFS_O_CREAT);
+    assert(f != -1);
+    while (tfs_write(f, fill, sizeof(fill)) > 0) {
+    }
+    assert(tfs_close(f) != -1);
+    check_files();
+    assert(tfs_destroy() != -1);
+    unlink(image);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
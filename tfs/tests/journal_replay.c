@@ -0,0 +1,61 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#define SIZE 3000
+#define FILES 5
+
+/**
+   This test creates and writes files in a child process that exits without
+   unmounting the volume, as if it had crashed: the changes are only in the
+   journal. Attaching the image again must replay them.
+ */
+
+
+int main() {
+    char *image = "tfs_journal_replay.img";
+    char path[] = "/f0";
+
+    static char input[SIZE];
+    static char output[SIZE];
+
+    unlink(image);
+
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        assert(tfs_init_image(image) != -1);
+        for (int i = 0; i < FILES; i++) {
+            path[2] = (char)('0' + i);
+            memset(input, 'A' + i, SIZE);
+            int f = tfs_open(path, TFS_O_CREAT);
+            assert(f != -1);
+            assert(tfs_write(f, input, SIZE) == SIZE);
+            assert(tfs_close(f) != -1);
+        }
+        /* Crash: no tfs_destroy, so no checkpoint */
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    assert(tfs_init_image(image) != -1);
+    for (int i = 0; i < FILES; i++) {
+        path[2] = (char)('0' + i);
+        memset(input, 'A' + i, SIZE);
+        int f = tfs_open(path, 0);
+        assert(f != -1);
+        assert(tfs_read(f, output, SIZE) == SIZE);
+        assert(memcmp(input, output, SIZE) == 0);
+        assert(tfs_close(f) != -1);
+    }
+    assert(tfs_destroy() != -1);
+
+    unlink(image);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
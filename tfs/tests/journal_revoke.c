@@ -0,0 +1,71 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define DATA_BLOCKS_USED 32
+#define FILES 200
+
+/**
+   This test checks that blocks a directory gives back are not overwritten
+   by its logged entries once they hold file data: a directory grows and
+   splits over most of a small volume, a file takes every block left, and
+   the file's bytes must be intact after attaching the image again.
+ */
+
+static char const *image = "tfs_journal_revoke.img";
+
+static void init() {
+    tfs_params_t params = tfs_default_params();
+    params.image_path = image;
+    params.data_blocks = DATA_BLOCKS_USED;
+    params.inode_table_size = FILES + 8;
+    assert(tfs_init_params(&params) != -1);
+}
+
+int main() {
+    char path[16];
+    static char big[DATA_BLOCKS_USED * BLOCK_SIZE];
+    static char buffer[DATA_BLOCKS_USED * BLOCK_SIZE];
+
+    unlink(image);
+    init();
+
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "/f%d", i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+
+    memset(big, 'b', sizeof(big));
+    int f = tfs_open("/big", TFS_O_CREAT);
+    assert(f != -1);
+    size_t big_size = 0;
+    ssize_t written;
+    while ((written = tfs_write(f, big, BLOCK_SIZE)) > 0) {
+        big_size += (size_t)written;
+    }
+    assert(big_size > 0 && big_size < sizeof(big));
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    init();
+    f = tfs_open("/big", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)big_size);
+    assert(memcmp(buffer, big, big_size) == 0);
+    assert(tfs_close(f) != -1);
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "/f%d", i);
+        f = tfs_open(path, 0);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    assert(tfs_destroy() != -1);
+    unlink(image);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,61 @@
+#include "../fs/config.h"
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define SCATTERED_BLOCKS 400
+
+/**
+   This test writes a file over hundreds of scattered blocks to a volume with
+   the smallest journal: mapping them takes more changes than one journal
+   batch holds, so the write must be committed in pieces rather than lost.
+   The file must then read back whole after attaching the image again.
+ */
+
+int main() {
+    char const *image = "tfs_journal_small_txn.img";
+    static char input[SCATTERED_BLOCKS * BLOCK_SIZE];
+    static char output[sizeof(input)];
+    static int taken[DATA_BLOCKS];
+
+    unlink(image);
+    tfs_params_t params = tfs_default_params();
+    params.image_path = image;
+    params.journal_blocks = MIN_JOURNAL_BLOCKS;
+    assert(tfs_init_params(&params) != -1);
+
+    /* Leaving every other block free */
+    size_t count = 0;
+    int b;
+    while ((b = data_block_alloc()) != -1) {
+        taken[count++] = b;
+    }
+    for (size_t i = 0; i < count; i += 2) {
+        assert(data_block_free(taken[i]) != -1);
+    }
+
+    for (size_t i = 0; i < sizeof(input); i++) {
+        input[i] = (char)('a' + i % 26);
+    }
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, input, sizeof(input)) == sizeof(input));
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    params = tfs_default_params();
+    params.image_path = image;
+    assert(tfs_init_params(&params) != -1);
+    f = tfs_open("/f", 0);
+    assert(f != -1);
+    assert(tfs_read(f, output, sizeof(output)) == sizeof(output));
+    assert(memcmp(input, output, sizeof(input)) == 0);
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+    unlink(image);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
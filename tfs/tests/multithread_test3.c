@@ -30,7 +30,7 @@ void *fnOpen(void *arg){
     
     size_t length = (size_t)((rand() % (UPPER - LOWER + 1)) + LOWER);
     char *input = randomstring(length);
-    char *path = malloc(sizeof(char)*(length + 1));
+    char *path = calloc(length + 2, sizeof(char));
     strcat(path, "/");
     strcat(path, input);
 
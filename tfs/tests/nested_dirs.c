@@ -0,0 +1,70 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+/**
+   This test builds a small directory tree and checks path resolution:
+   files in nested directories, missing and non-directory components,
+   names that are too long, and a name that is looked up (and cached as
+   missing) before it is created.
+ */
+
+
+int main() {
+    char *str = "nested!";
+    char buffer[16];
+
+    assert(tfs_init() != -1);
+
+    assert(tfs_mkdir("/a") != -1);
+    assert(tfs_mkdir("/a/b") != -1);
+    assert(tfs_mkdir("/a/b/c") != -1);
+    assert(tfs_mkdir("/a/b") == -1);
+    assert(tfs_mkdir("/x/y") == -1);
+
+    /* Cached as missing, then created */
+    assert(tfs_lookup("/a/b/c/f") == -1);
+    int f = tfs_open("/a/b/c/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, str, strlen(str)) == strlen(str));
+    assert(tfs_close(f) != -1);
+    assert(tfs_lookup("/a/b/c/f") != -1);
+
+    /* Same name in another directory is another file */
+    assert(tfs_lookup("/a/f") == -1);
+    f = tfs_open("/a/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_lookup("/a/f") != tfs_lookup("/a/b/c/f"));
+
+    f = tfs_open("/a/b/c/f", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == strlen(str));
+    assert(memcmp(buffer, str, strlen(str)) == 0);
+    assert(tfs_close(f) != -1);
+
+    /* Invalid paths */
+    assert(tfs_open("/a", 0) == -1);
+    assert(tfs_open("/a/f/g", TFS_O_CREAT) == -1);
+    assert(tfs_mkdir("/a/f/g") == -1);
+    assert(tfs_open("/a//f", 0) == -1);
+    assert(tfs_open("/a/b/", TFS_O_CREAT) == -1);
+    assert(tfs_open("/a/"
+                    "a_name_longer_than_what_fits_in_an_entry",
+                    TFS_O_CREAT) == -1);
+
+    /* Deleted directories do not leave stale cache entries behind */
+    int c = tfs_lookup("/a/b/c");
+    assert(c != -1);
+    assert(clear_dir_entry(tfs_lookup("/a/b"), "c") != -1);
+    assert(inode_delete(c) != -1);
+    assert(tfs_lookup("/a/b/c") == -1);
+    assert(tfs_mkdir("/a/b/d") != -1);
+    assert(tfs_lookup("/a/b/d/f") == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
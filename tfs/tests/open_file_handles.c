@@ -0,0 +1,79 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#define MAX_FILES 200
+#define THREADS 8
+#define ROUNDS 500
+
+/**
+   This test checks the open file table: a closed handle is rejected even
+   after its slot is reused, the table grows across segments up to its size,
+   and many threads opening and closing at once never share a handle.
+ */
+
+static atomic_bool handle_owned[MAX_FILES];
+
+static void *open_and_close(void *arg) {
+    (void)arg;
+    for (int i = 0; i < ROUNDS; i++) {
+        int f = tfs_open("/f", 0);
+        assert(f != -1);
+        int slot = f & ((1 << OPEN_FILE_INDEX_BITS) - 1);
+        assert(slot < MAX_FILES);
+        assert(!atomic_exchange(&handle_owned[slot], true));
+        atomic_store(&handle_owned[slot], false);
+        assert(tfs_close(f) != -1);
+        assert(tfs_close(f) == -1);
+    }
+    return NULL;
+}
+
+int main() {
+    static int f[MAX_FILES];
+    char buffer[4];
+    pthread_t tid[THREADS];
+
+    tfs_params_t params = tfs_default_params();
+    params.max_open_files = MAX_FILES;
+    assert(tfs_init_params(&params) != -1);
+
+    int old = tfs_open("/f", TFS_O_CREAT);
+    assert(old != -1);
+    assert(tfs_write(old, "abc", 3) == 3);
+    assert(tfs_close(old) != -1);
+    assert(tfs_close(old) == -1);
+
+    /* The slot is reused, but the old handle stays stale */
+    int reused = tfs_open("/f", 0);
+    assert(reused != -1 && reused != old);
+    assert(tfs_read(old, buffer, 3) == -1);
+    assert(tfs_write(old, buffer, 3) == -1);
+    assert(tfs_close(old) == -1);
+    assert(tfs_read(reused, buffer, 3) == 3);
+    assert(tfs_close(reused) != -1);
+
+    for (int i = 0; i < MAX_FILES; i++) {
+        f[i] = tfs_open("/f", 0);
+        assert(f[i] != -1);
+    }
+    assert(tfs_open("/f", 0) == -1);
+    for (int i = 0; i < MAX_FILES; i++) {
+        assert(tfs_close(f[i]) != -1);
+    }
+
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_create(&tid[i], NULL, open_and_close, NULL) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    assert(tfs_destroy_after_all_closed() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
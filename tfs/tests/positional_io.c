@@ -0,0 +1,117 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+
+#define THREADS 8
+#define RECORD 64
+#define RECORDS 256
+
+/**
+   This test checks positional reads and writes and seeking: pread and
+   pwrite leave the handle's offset alone, lseek moves it from the start,
+   the current offset or the end, a write past the end leaves a gap of
+   zeroes, and threads sharing one handle can each update their own records
+   at once.
+ */
+
+static int shared;
+
+static void *update_records(void *arg) {
+    int t = (int)(size_t)arg;
+    char record[RECORD], check[RECORD];
+
+    for (int r = t; r < RECORDS; r += THREADS) {
+        memset(record, 'a' + t, RECORD);
+        off_t at = (off_t)r * RECORD;
+        assert(tfs_pwrite(shared, record, RECORD, at) == RECORD);
+        assert(tfs_pread(shared, check, RECORD, at) == RECORD);
+        assert(memcmp(record, check, RECORD) == 0);
+    }
+    return NULL;
+}
+
+int main() {
+    char buffer[16];
+    static char data[RECORDS * RECORD];
+    pthread_t tid[THREADS];
+
+    assert(tfs_init() != -1);
+
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "0123456789", 10) == 10);
+
+    /* Positional calls do not move the offset */
+    assert(tfs_pread(f, buffer, 4, 2) == 4);
+    assert(memcmp(buffer, "2345", 4) == 0);
+    assert(tfs_pwrite(f, "xy", 2, 0) == 2);
+    assert(tfs_lseek(f, 0, SEEK_CUR) == 10);
+    assert(tfs_pread(f, buffer, sizeof(buffer), 8) == 2);
+    assert(tfs_pread(f, buffer, sizeof(buffer), 10) == 0);
+    assert(tfs_pread(f, buffer, sizeof(buffer), 100) == 0);
+    assert(tfs_pread(f, buffer, 1, -1) == -1);
+    assert(tfs_pwrite(f, buffer, 1, -1) == -1);
+
+    /* Seeking from each origin */
+    assert(tfs_lseek(f, 3, SEEK_SET) == 3);
+    assert(tfs_read(f, buffer, 2) == 2);
+    assert(memcmp(buffer, "34", 2) == 0);
+    assert(tfs_lseek(f, -4, SEEK_CUR) == 1);
+    assert(tfs_read(f, buffer, 1) == 1 && buffer[0] == 'y');
+    assert(tfs_lseek(f, -1, SEEK_END) == 9);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 1 && buffer[0] == '9');
+    assert(tfs_lseek(f, -11, SEEK_END) == -1);
+    assert(tfs_lseek(f, INT64_MIN, SEEK_CUR) == -1);
+    assert(tfs_lseek(f, 0, 42) == -1);
+    assert(tfs_lseek(f, 0, SEEK_CUR) == 10);
+
+    /* Past the end, a gap of zeroes, whether by seeking or by offset */
+    assert(tfs_lseek(f, 2000, SEEK_SET) == 2000);
+    assert(tfs_write(f, "z", 1) == 1);
+    assert(tfs_pwrite(f, "w", 1, 3000) == 1);
+    assert(tfs_lseek(f, 0, SEEK_END) == 3001);
+    for (off_t at = 10; at < 3000; at++) {
+        assert(tfs_pread(f, buffer, 1, at) == 1);
+        assert(buffer[0] == (at == 2000 ? 'z' : '\0'));
+    }
+
+    /* A positional write ignores append mode */
+    assert(tfs_close(f) != -1);
+    f = tfs_open("/f", TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_pwrite(f, "Q", 1, 0) == 1);
+    assert(tfs_pread(f, buffer, 1, 0) == 1 && buffer[0] == 'Q');
+    assert(tfs_write(f, "E", 1) == 1);
+    assert(tfs_pread(f, buffer, 2, 3000) == 2);
+    assert(memcmp(buffer, "wE", 2) == 0);
+    assert(tfs_close(f) != -1);
+    assert(tfs_pread(f, buffer, 1, 0) == -1);
+    assert(tfs_lseek(f, 0, SEEK_SET) == -1);
+
+    /* Threads updating their own records through one handle */
+    shared = tfs_open("/records", TFS_O_CREAT);
+    assert(shared != -1);
+    assert(tfs_write(shared, data, sizeof(data)) == sizeof(data));
+    for (int t = 0; t < THREADS; t++) {
+        assert(pthread_create(&tid[t], NULL, update_records,
+                              (void *)(size_t)t) == 0);
+    }
+    for (int t = 0; t < THREADS; t++) {
+        assert(pthread_join(tid[t], NULL) == 0);
+    }
+    assert(tfs_lseek(shared, 0, SEEK_CUR) == sizeof(data));
+    assert(tfs_pread(shared, data, sizeof(data), 0) == sizeof(data));
+    for (int r = 0; r < RECORDS; r++) {
+        for (int i = 0; i < RECORD; i++) {
+            assert(data[r * RECORD + i] == 'a' + r % THREADS);
+        }
+    }
+    assert(tfs_close(shared) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+#define THREADS 8
+#define REGION 4096
+#define ROUNDS 50
+
+/**
+   This test checks the range locks of a file: an exclusive range holds off
+   overlapping ranges but not disjoint ones, and threads writing disjoint
+   regions of one file through their own handles, while the file keeps its
+   size, all end up with their data in place.
+ */
+
+static int inumber;
+static atomic_bool locked;
+
+static void *lock_overlapping(void *arg) {
+    (void)arg;
+    range_lock_t range;
+    inode_range_lock(inumber, &range, 50, 60, false);
+    atomic_store(&locked, true);
+    inode_range_unlock(inumber, &range);
+    return NULL;
+}
+
+static void *write_region(void *arg) {
+    int t = (int)(size_t)arg;
+    char skip[THREADS * REGION];
+    char input[REGION];
+
+    for (int i = 0; i < ROUNDS; i++) {
+        int f = tfs_open("/big", 0);
+        assert(f != -1);
+        /* Moves the offset to the start of the thread's region */
+        assert(tfs_read(f, skip, (size_t)t * REGION) == (ssize_t)t * REGION);
+        memset(input, 'A' + (t + i) % 26, REGION);
+        assert(tfs_write(f, input, REGION) == REGION);
+        assert(tfs_close(f) != -1);
+    }
+    return NULL;
+}
+
+int main() {
+    static char data[THREADS * REGION];
+    char expected[REGION];
+    pthread_t tid[THREADS];
+
+    tfs_params_t params = tfs_default_params();
+    params.max_open_files = 64;
+    assert(tfs_init_params(&params) != -1);
+
+    int f = tfs_open("/big", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, data, sizeof(data)) == sizeof(data));
+    assert(tfs_close(f) != -1);
+    inumber = tfs_lookup("/big");
+    assert(inumber != -1);
+
+    /* An overlapping range waits, a disjoint one does not */
+    range_lock_t range, other;
+    inode_range_lock(inumber, &range, 0, 100, true);
+    inode_range_lock(inumber, &other, 100, 200, true);
+    assert(pthread_create(&tid[0], NULL, lock_overlapping, NULL) == 0);
+    struct timespec pause = {0, 20 * 1000 * 1000};
+    nanosleep(&pause, NULL);
+    assert(!atomic_load(&locked));
+    inode_range_unlock(inumber, &range);
+    assert(pthread_join(tid[0], NULL) == 0);
+    assert(atomic_load(&locked));
+    inode_range_unlock(inumber, &other);
+
+    for (int t = 0; t < THREADS; t++) {
+        assert(pthread_create(&tid[t], NULL, write_region, (void *)(size_t)t) ==
+               0);
+    }
+    for (int t = 0; t < THREADS; t++) {
+        assert(pthread_join(tid[t], NULL) == 0);
+    }
+
+    f = tfs_open("/big", 0);
+    assert(f != -1);
+    assert(tfs_read(f, data, sizeof(data) + 1) == sizeof(data));
+    assert(tfs_close(f) != -1);
+    for (int t = 0; t < THREADS; t++) {
+        memset(expected, 'A' + (t + ROUNDS - 1) % 26, REGION);
+        assert(memcmp(data + t * REGION, expected, REGION) == 0);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
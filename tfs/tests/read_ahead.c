@@ -0,0 +1,119 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FILE_SIZE (300 * BLOCK_SIZE + 123)
+#define THREADS 4
+
+/**
+   This test checks that read-ahead never changes what is read: a file is
+   read sequentially in chunks of several sizes, then at scattered offsets,
+   by several threads at once while another rewrites and truncates a second
+   file, with read-ahead on and off.
+ */
+
+static char data[FILE_SIZE];
+
+static void check_sequential(size_t chunk) {
+    char *buffer = malloc(FILE_SIZE);
+    assert(buffer != NULL);
+    int f = tfs_open("/f", 0);
+    assert(f != -1);
+    size_t done = 0;
+    ssize_t r;
+    while ((r = tfs_read(f, buffer + done, chunk)) > 0) {
+        done += (size_t)r;
+    }
+    assert(r == 0);
+    assert(done == FILE_SIZE);
+    assert(memcmp(buffer, data, FILE_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+    free(buffer);
+}
+
+static void check_scattered() {
+    char buffer[3 * BLOCK_SIZE];
+    int f = tfs_open("/f", 0);
+    assert(f != -1);
+    for (size_t i = 0; i < 200; i++) {
+        size_t offset = (i * 7919 * BLOCK_SIZE / 3) % FILE_SIZE;
+        size_t len = FILE_SIZE - offset < sizeof(buffer) ? FILE_SIZE - offset
+                                                          : sizeof(buffer);
+        assert(tfs_pread(f, buffer, sizeof(buffer), (off_t)offset) ==
+               (ssize_t)len);
+        assert(memcmp(buffer, data + offset, len) == 0);
+    }
+    assert(tfs_close(f) != -1);
+}
+
+static void *read_all(void *arg) {
+    check_sequential((size_t)arg);
+    return NULL;
+}
+
+static void *rewrite_other(void *arg) {
+    (void)arg;
+    char buffer[BLOCK_SIZE];
+    for (int i = 0; i < 20; i++) {
+        int f = tfs_open("/g", TFS_O_CREAT | TFS_O_TRUNC);
+        assert(f != -1);
+        memset(buffer, 'a' + i % 26, sizeof(buffer));
+        for (int j = 0; j < 16; j++) {
+            assert(tfs_write(f, buffer, sizeof(buffer)) == sizeof(buffer));
+        }
+        /* Reads it back sequentially, so read-ahead runs behind truncates */
+        assert(tfs_lseek(f, 0, SEEK_SET) == 0);
+        for (int j = 0; j < 16; j++) {
+            char got[BLOCK_SIZE];
+            assert(tfs_read(f, got, sizeof(got)) == sizeof(got));
+            assert(memcmp(got, buffer, sizeof(got)) == 0);
+        }
+        assert(tfs_close(f) != -1);
+    }
+    return NULL;
+}
+
+static void run(bool read_ahead) {
+    pthread_t tid[THREADS + 1];
+    tfs_params_t params = tfs_default_params();
+    params.read_ahead = read_ahead;
+    assert(tfs_init_params(&params) != -1);
+
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, data, FILE_SIZE) == FILE_SIZE);
+    assert(tfs_close(f) != -1);
+
+    size_t chunks[] = {1, 100, BLOCK_SIZE, 3 * BLOCK_SIZE + 5,
+                       64 * BLOCK_SIZE};
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+        check_sequential(chunks[i]);
+    }
+    check_scattered();
+
+    for (size_t i = 0; i < THREADS; i++) {
+        assert(pthread_create(&tid[i], NULL, read_all,
+                              (void *)(BLOCK_SIZE / 2 + i * 1000)) == 0);
+    }
+    assert(pthread_create(&tid[THREADS], NULL, rewrite_other, NULL) == 0);
+    for (size_t i = 0; i <= THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    assert(tfs_destroy() != -1);
+}
+
+int main() {
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        data[i] = (char)(i * 31 + i / BLOCK_SIZE);
+    }
+
+    run(true);
+    run(false);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
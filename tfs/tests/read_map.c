@@ -0,0 +1,90 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+#define FILE_SIZE (5 * BLOCK_SIZE + 123)
+
+/**
+   This test checks read mappings: the segments hold the file's bytes in
+   order and move the offset like a read, and the blocks they pin are not
+   freed by a truncation until the mapping is given back.
+ */
+
+static atomic_bool truncated;
+
+static void *truncate_file(void *arg) {
+    (void)arg;
+    int f = tfs_open("/f", TFS_O_TRUNC);
+    assert(f != -1);
+    atomic_store(&truncated, true);
+    assert(tfs_close(f) != -1);
+    return NULL;
+}
+
+int main() {
+    static char data[FILE_SIZE];
+    static char mapped[FILE_SIZE];
+    char buffer[10];
+    pthread_t tid;
+
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        data[i] = (char)('a' + i % 26);
+    }
+
+    assert(tfs_init() != -1);
+
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, data, FILE_SIZE) == FILE_SIZE);
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open("/f", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, 10) == 10);
+
+    /* The segments cover the rest of the file, in order */
+    tfs_map_t map;
+    assert(tfs_read_map(f, 2 * FILE_SIZE, &map) == FILE_SIZE - 10);
+    assert(map.tm_count >= 1);
+    size_t len = 0;
+    for (size_t i = 0; i < map.tm_count; i++) {
+        memcpy(mapped + len, map.tm_segments[i].ts_data,
+               map.tm_segments[i].ts_len);
+        len += map.tm_segments[i].ts_len;
+    }
+    assert(len == FILE_SIZE - 10);
+    assert(memcmp(mapped, data + 10, len) == 0);
+    assert(tfs_lseek(f, 0, SEEK_CUR) == FILE_SIZE);
+
+    /* Reading (and mapping) alongside the mapping is fine */
+    assert(tfs_pread(f, buffer, 10, 100) == 10);
+    tfs_map_t end;
+    assert(tfs_read_map(f, 10, &end) == 0);
+    assert(end.tm_count == 0);
+    assert(tfs_read_unmap(&end) == 0);
+    assert(tfs_read_unmap(&end) == -1);
+
+    /* A truncation waits for the mapping to go */
+    assert(pthread_create(&tid, NULL, truncate_file, NULL) == 0);
+    struct timespec pause = {0, 20 * 1000 * 1000};
+    nanosleep(&pause, NULL);
+    assert(!atomic_load(&truncated));
+    assert(memcmp(map.tm_segments[0].ts_data, data + 10,
+                  map.tm_segments[0].ts_len) == 0);
+    assert(tfs_read_unmap(&map) == 0);
+    assert(pthread_join(tid, NULL) == 0);
+    assert(atomic_load(&truncated));
+    assert(tfs_lseek(f, 0, SEEK_END) == 0);
+
+    assert(tfs_close(f) != -1);
+    assert(tfs_read_map(f, 10, &map) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#define THREADS 8
+#define CHUNKS 512
+#define CHUNK 256
+
+/**
+   This test has several threads read one file through a single shared
+   handle, one chunk at a time, while others read it through handles of
+   their own. Reads through the shared handle must split the file between
+   them: each chunk is read exactly once, and whole.
+ */
+
+static int shared;
+static atomic_bool seen[CHUNKS];
+
+static void *read_shared(void *arg) {
+    (void)arg;
+    int chunk[CHUNK / sizeof(int)];
+    ssize_t r;
+    while ((r = tfs_read(shared, chunk, CHUNK)) > 0) {
+        assert(r == CHUNK);
+        int k = chunk[0];
+        assert(k >= 0 && k < CHUNKS);
+        for (size_t i = 0; i < CHUNK / sizeof(int); i++) {
+            assert(chunk[i] == k);
+        }
+        assert(!atomic_exchange(&seen[k], true));
+    }
+    assert(r == 0);
+    return NULL;
+}
+
+static void *read_own(void *arg) {
+    (void)arg;
+    int chunk[CHUNK / sizeof(int)];
+    int f = tfs_open("/f", 0);
+    assert(f != -1);
+    for (int k = 0; k < CHUNKS; k++) {
+        assert(tfs_read(f, chunk, CHUNK) == CHUNK);
+        assert(chunk[0] == k && chunk[CHUNK / sizeof(int) - 1] == k);
+    }
+    assert(tfs_read(f, chunk, CHUNK) == 0);
+    assert(tfs_close(f) != -1);
+    return NULL;
+}
+
+int main() {
+    int chunk[CHUNK / sizeof(int)];
+    pthread_t tid[2 * THREADS];
+
+    tfs_params_t params = tfs_default_params();
+    params.max_open_files = 64;
+    assert(tfs_init_params(&params) != -1);
+
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    for (int k = 0; k < CHUNKS; k++) {
+        for (size_t i = 0; i < CHUNK / sizeof(int); i++) {
+            chunk[i] = k;
+        }
+        assert(tfs_write(f, chunk, CHUNK) == CHUNK);
+    }
+    assert(tfs_close(f) != -1);
+
+    shared = tfs_open("/f", 0);
+    assert(shared != -1);
+    for (int t = 0; t < THREADS; t++) {
+        assert(pthread_create(&tid[t], NULL, read_shared, NULL) == 0);
+        assert(pthread_create(&tid[THREADS + t], NULL, read_own, NULL) == 0);
+    }
+    for (int t = 0; t < 2 * THREADS; t++) {
+        assert(pthread_join(tid[t], NULL) == 0);
+    }
+    for (int k = 0; k < CHUNKS; k++) {
+        assert(atomic_load(&seen[k]));
+    }
+    assert(tfs_close(shared) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
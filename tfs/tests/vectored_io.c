@@ -0,0 +1,87 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <limits.h>
+#include <string.h>
+
+#define PAYLOAD (3 * BLOCK_SIZE + 100)
+
+/**
+   This test checks vectored reads and writes: a header and a payload
+   written with one tfs_writev land one after the other (empty buffers
+   included), and tfs_readv scatters the file across buffers that straddle
+   block boundaries, filling each before the next.
+ */
+
+int main() {
+    char header[] = "HDR:";
+    static char payload[PAYLOAD];
+    static char read_back[sizeof(header) + PAYLOAD];
+    static char part1[BLOCK_SIZE + 7];
+    static char part2[2 * BLOCK_SIZE - 3];
+    static char part3[BLOCK_SIZE];
+
+    for (size_t i = 0; i < PAYLOAD; i++) {
+        payload[i] = (char)('a' + i % 26);
+    }
+
+    assert(tfs_init() != -1);
+
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+
+    struct iovec out[] = {
+        {.iov_base = header, .iov_len = sizeof(header)},
+        {.iov_base = NULL, .iov_len = 0},
+        {.iov_base = payload, .iov_len = PAYLOAD},
+    };
+    assert(tfs_writev(f, out, 3) == sizeof(header) + PAYLOAD);
+    assert(tfs_writev(f, out, 0) == 0);
+    assert(tfs_writev(f, out, -1) == -1);
+    struct iovec too_long[] = {
+        {.iov_base = header, .iov_len = SSIZE_MAX},
+        {.iov_base = header, .iov_len = 1},
+    };
+    assert(tfs_writev(f, too_long, 2) == -1);
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open("/f", 0);
+    assert(f != -1);
+    struct iovec in[] = {
+        {.iov_base = part1, .iov_len = sizeof(part1)},
+        {.iov_base = NULL, .iov_len = 0},
+        {.iov_base = part2, .iov_len = sizeof(part2)},
+        {.iov_base = part3, .iov_len = sizeof(part3)},
+    };
+    /* The file ends inside the last buffer */
+    ssize_t r = tfs_readv(f, in, 4);
+    assert(r == sizeof(header) + PAYLOAD);
+    size_t rest = (size_t)r - sizeof(part1) - sizeof(part2);
+    memcpy(read_back, part1, sizeof(part1));
+    memcpy(read_back + sizeof(part1), part2, sizeof(part2));
+    memcpy(read_back + sizeof(part1) + sizeof(part2), part3, rest);
+    assert(memcmp(read_back, header, sizeof(header)) == 0);
+    assert(memcmp(read_back + sizeof(header), payload, PAYLOAD) == 0);
+    assert(tfs_readv(f, in, 4) == 0);
+    assert(tfs_close(f) != -1);
+
+    /* A vectored write in place, over the middle of the file */
+    f = tfs_open("/f", 0);
+    assert(f != -1);
+    assert(tfs_lseek(f, BLOCK_SIZE - 2, SEEK_SET) == BLOCK_SIZE - 2);
+    struct iovec patch[] = {
+        {.iov_base = "12", .iov_len = 2},
+        {.iov_base = "345", .iov_len = 3},
+    };
+    assert(tfs_writev(f, patch, 2) == 5);
+    char check[5];
+    assert(tfs_pread(f, check, 5, BLOCK_SIZE - 2) == 5);
+    assert(memcmp(check, "12345", 5) == 0);
+    assert(tfs_lseek(f, 0, SEEK_END) == sizeof(header) + PAYLOAD);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
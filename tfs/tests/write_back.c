@@ -0,0 +1,124 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define APPENDS 64
+#define SMALL_CACHE 64
+#define DIRTY_MAX (SMALL_CACHE * WRITEBACK_DIRTY_MAX_PERCENT / 100 + 1)
+#define BIG_BLOCKS 600
+
+/**
+   This test writes with write-back: small appends are left dirty in the
+   block cache, tfs_fsync writes them back in few requests, as they are
+   adjacent, and makes them durable (a process that stops right after it
+   leaves them in the image), tfs_close has them written back in the
+   background, and writers keep the dirty blocks of a small cache under its
+   limit.
+ */
+
+static char const *image = "tfs_write_back.img";
+static char block[BLOCK_SIZE];
+
+static void init(size_t cache_blocks) {
+    tfs_params_t params = tfs_default_params();
+    params.image_path = image;
+    params.write_back = true;
+    params.cache_blocks = cache_blocks;
+    assert(tfs_init_params(&params) != -1);
+}
+
+static void fill(int i) { memset(block, 'a' + i % 26, BLOCK_SIZE); }
+
+static void check_file(char const *path, int blocks) {
+    static char buffer[BLOCK_SIZE];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    for (int i = 0; i < blocks; i++) {
+        fill(i);
+        assert(tfs_read(f, buffer, BLOCK_SIZE) == BLOCK_SIZE);
+        assert(memcmp(buffer, block, BLOCK_SIZE) == 0);
+    }
+    assert(tfs_read(f, buffer, 1) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+static block_cache_stats_t stats() {
+    block_cache_stats_t s;
+    block_cache_stats(&s);
+    return s;
+}
+
+int main() {
+    unlink(image);
+
+    /* Appends, synced and then left behind by a process that just stops */
+    pid_t child = fork();
+    assert(child != -1);
+    if (child == 0) {
+        init(BLOCK_CACHE_SLOTS);
+        int f = tfs_open("/appended", TFS_O_CREAT);
+        assert(f != -1);
+        for (int i = 0; i < APPENDS; i++) {
+            fill(i);
+            assert(tfs_write(f, block, BLOCK_SIZE) == BLOCK_SIZE);
+        }
+        block_cache_stats_t before = stats();
+        assert(before.bc_dirty > 0);
+        assert(tfs_fsync(f) != -1);
+        block_cache_stats_t after = stats();
+        assert(after.bc_dirty == 0);
+        assert(after.bc_written_back >= APPENDS);
+        assert(after.bc_writeback_requests - before.bc_writeback_requests <=
+               4);
+        assert(tfs_fsync(-1) == -1);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(child, &status, 0) == child);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    init(BLOCK_CACHE_SLOTS);
+    check_file("/appended", APPENDS);
+
+    /* Closing a file has its blocks written back without waiting */
+    int f = tfs_open("/closed", TFS_O_CREAT);
+    assert(f != -1);
+    for (int i = 0; i < APPENDS; i++) {
+        fill(i);
+        assert(tfs_write(f, block, BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    assert(tfs_close(f) != -1);
+    struct timespec pause = {0, 10 * 1000 * 1000};
+    for (int i = 0; i < 500 && stats().bc_dirty > 0; i++) {
+        nanosleep(&pause, NULL);
+    }
+    assert(stats().bc_dirty == 0);
+    check_file("/closed", APPENDS);
+    assert(tfs_destroy() != -1);
+
+    /* Dirty blocks stay bounded, however much is written */
+    init(SMALL_CACHE);
+    f = tfs_open("/big", TFS_O_CREAT);
+    assert(f != -1);
+    for (int i = 0; i < BIG_BLOCKS; i++) {
+        fill(i);
+        assert(tfs_write(f, block, BLOCK_SIZE) == BLOCK_SIZE);
+        assert(stats().bc_dirty <= DIRTY_MAX);
+    }
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    /* And everything reached the image */
+    init(SMALL_CACHE);
+    check_file("/appended", APPENDS);
+    check_file("/closed", APPENDS);
+    check_file("/big", BIG_BLOCKS);
+    assert(tfs_destroy() != -1);
+    unlink(image);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
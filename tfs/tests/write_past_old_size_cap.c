@@ -0,0 +1,64 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+#define CHUNK 3000
+#define COUNT 200
+
+/**
+   This test writes a file of 600000 bytes (586 blocks, well past the 266
+   blocks that 10 direct references plus one index block could hold),
+   while another file grows in between so that the first one ends up split
+   in several extents. It then checks the contents, truncates the file and
+   checks that its blocks can be used again.
+ */
+
+
+int main() {
+    char *path1 = "/f1";
+    char *path2 = "/f2";
+
+    static char input[CHUNK];
+    static char output[CHUNK];
+
+    assert(tfs_init() != -1);
+
+    int f1 = tfs_open(path1, TFS_O_CREAT);
+    assert(f1 != -1);
+    int f2 = tfs_open(path2, TFS_O_CREAT);
+    assert(f2 != -1);
+
+    for (int i = 0; i < COUNT; i++) {
+        memset(input, 'a' + i % 26, CHUNK);
+        assert(tfs_write(f1, input, CHUNK) == CHUNK);
+        if (i % 10 == 0) {
+            assert(tfs_write(f2, input, BLOCK_SIZE) == BLOCK_SIZE);
+        }
+    }
+    assert(tfs_close(f1) != -1);
+    assert(tfs_close(f2) != -1);
+
+    f1 = tfs_open(path1, 0);
+    assert(f1 != -1);
+    for (int i = 0; i < COUNT; i++) {
+        memset(input, 'a' + i % 26, CHUNK);
+        assert(tfs_read(f1, output, CHUNK) == CHUNK);
+        assert(memcmp(input, output, CHUNK) == 0);
+    }
+    assert(tfs_read(f1, output, CHUNK) == 0);
+    assert(tfs_close(f1) != -1);
+
+    /* Truncating gives the blocks back, so the file can be rewritten */
+    for (int round = 0; round < 2; round++) {
+        f1 = tfs_open(path1, TFS_O_TRUNC);
+        assert(f1 != -1);
+        for (int i = 0; i < COUNT; i++) {
+            assert(tfs_write(f1, input, CHUNK) == CHUNK);
+        }
+        assert(tfs_close(f1) != -1);
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -7,6 +7,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 
 static int fserver, fclient;
 static const char *client_path;
@@ -204,6 +205,292 @@ ssize_t tfs_read(int fhandle, void *read_buffer, size_t len) {
 }
 
 
+
+
+/*
+ * Total length of a list of buffers, or -1 if the list or the total are
+ * invalid
+ */
+static ssize_t iovec_total(struct iovec const *iov, int iovcnt) {
+    if (iovcnt < 0 || (iovcnt > 0 && iov == NULL))
+        return -1;
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > SSIZE_MAX - total)
+            return -1;
+        total += iov[i].iov_len;
+    }
+    return (ssize_t)total;
+}
+
+
+/*
+ * Writes a list of buffers on the server pipe, or reads one from the client
+ * pipe, as many buffers per system call as allowed and resuming after short
+ * transfers. The list is used up in the process.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int transfer_iovec(struct iovec *iov, int iovcnt, int to_server) {
+    long iov_max = sysconf(_SC_IOV_MAX);
+    while (iovcnt > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+        int batch = iov_max > 0 && iovcnt > iov_max ? (int)iov_max : iovcnt;
+        ssize_t ret = to_server ? writev(fserver, iov, batch) : readv(fclient, iov, batch);
+        if (ret <= 0) {
+            fprintf(stderr, "[ERR]: %s failed: %s\n", to_server ? "writev" : "readv",
+                    ret == 0 ? "end of file" : strerror(errno));
+            return -1;
+        }
+        // Skip what was transferred
+        size_t done = (size_t)ret;
+        while (done > 0) {
+            if (done >= iov->iov_len) {
+                done -= iov->iov_len;
+                iov++;
+                iovcnt--;
+            } else {
+                iov->iov_base = (char *)iov->iov_base + done;
+                iov->iov_len -= done;
+                done = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+
+ssize_t tfs_writev(int fhandle, struct iovec const *write_iov, int iovcnt) {
+    ssize_t total = iovec_total(write_iov, iovcnt);
+    if (total == -1)
+        return -1;
+    size_t len = (size_t)total;
+
+    // The request header goes first, then the buffers as they are
+    struct iovec *iov = malloc(sizeof(*iov) * ((size_t)iovcnt + 1));
+    char header[TFS_WRITE_SIZE];
+    size_t header_size = 0;
+
+    char opcode = TFS_OP_CODE_WRITE;
+    ssize_t write_size;
+
+    // Create header
+    memcpy(header + header_size, &opcode, TFS_OPCODE_SIZE);
+    header_size += TFS_OPCODE_SIZE;
+    memcpy(header + header_size, &session_id, TFS_SESSIONID_SIZE);
+    header_size += TFS_SESSIONID_SIZE;
+    memcpy(header + header_size, &fhandle, TFS_FHANDLE_SIZE);
+    header_size += TFS_FHANDLE_SIZE;
+    memcpy(header + header_size, &len, TFS_LEN_SIZE);
+    header_size += TFS_LEN_SIZE;
+    iov[0].iov_base = header;
+    iov[0].iov_len = header_size;
+    memcpy(iov + 1, write_iov, sizeof(*iov) * (size_t)iovcnt);
+
+    // Write and read the pipe
+    int ret = transfer_iovec(iov, iovcnt + 1, 1);
+    free(iov);
+    if (ret == -1)
+        return -1;
+    if (read(fclient, &write_size, TFS_WRITE_RETURN_SIZE) == -1)
+        return -1;
+
+    return write_size;
+}
+
+
+ssize_t tfs_readv(int fhandle, struct iovec const *read_iov, int iovcnt) {
+    ssize_t total = iovec_total(read_iov, iovcnt);
+    if (total == -1)
+        return -1;
+    size_t len = (size_t)total;
+
+    char buffer[TFS_READ_SIZE];
+    size_t buffer_size = 0;
+
+    char opcode = TFS_OP_CODE_READ;
+    ssize_t read_size;
+
+    // Create buffer
+    memcpy(buffer + buffer_size, &opcode, TFS_OPCODE_SIZE);
+    buffer_size += TFS_OPCODE_SIZE;
+    memcpy(buffer + buffer_size, &session_id, TFS_SESSIONID_SIZE);
+    buffer_size += TFS_SESSIONID_SIZE;
+    memcpy(buffer + buffer_size, &fhandle, TFS_FHANDLE_SIZE);
+    buffer_size += TFS_FHANDLE_SIZE;
+    memcpy(buffer + buffer_size, &len, TFS_LEN_SIZE);
+    buffer_size += TFS_LEN_SIZE;
+
+    // Write and read the pipe
+    if (write_on_pipe(buffer, buffer_size) == -1)
+        return -1;
+    if (read(fclient, &read_size, TFS_READ_RETURN_SIZE) == -1)
+        return -1;
+    if (read_size <= 0)
+        return read_size;
+
+    // Scatter the contents straight from the pipe, up to the bytes sent back
+    struct iovec *iov = malloc(sizeof(*iov) * (size_t)iovcnt);
+    int count = 0;
+    for (size_t left = (size_t)read_size; left > 0; count++) {
+        iov[count] = read_iov[count];
+        if (iov[count].iov_len > left)
+            iov[count].iov_len = left;
+        left -= iov[count].iov_len;
+    }
+    int ret = transfer_iovec(iov, count, 0);
+    free(iov);
+    if (ret == -1)
+        return -1;
+
+    return read_size;
+}
+
+ssize_t tfs_pwrite(int fhandle, void const *write_buffer, size_t len, off_t offset) {
+    void *buffer = malloc(TFS_PWRITE_SIZE + sizeof(char[len]));
+    size_t buffer_size = 0;
+
+    char opcode = TFS_OP_CODE_PWRITE;
+    ssize_t write_size;
+
+    // Create buffer
+    memcpy(buffer + buffer_size, &opcode, TFS_OPCODE_SIZE);
+    buffer_size += TFS_OPCODE_SIZE;
+    memcpy(buffer + buffer_size, &session_id, TFS_SESSIONID_SIZE);
+    buffer_size += TFS_SESSIONID_SIZE;
+    memcpy(buffer + buffer_size, &fhandle, TFS_FHANDLE_SIZE);
+    buffer_size += TFS_FHANDLE_SIZE;
+    memcpy(buffer + buffer_size, &offset, TFS_OFFSET_SIZE);
+    buffer_size += TFS_OFFSET_SIZE;
+    memcpy(buffer + buffer_size, &len, TFS_LEN_SIZE);
+    buffer_size += TFS_LEN_SIZE;
+    memcpy(buffer + buffer_size, write_buffer, sizeof(char[len]));
+    buffer_size += sizeof(char[len]);
+
+    // Write and read the pipe
+    if (write_on_pipe(buffer, buffer_size) == -1)
+        return -1;
+    free(buffer);
+    if (read(fclient, &write_size, TFS_PWRITE_RETURN_SIZE) == -1)
+        return -1;
+
+    return write_size;
+}
+
+
+ssize_t tfs_pread(int fhandle, void *read_buffer, size_t len, off_t offset) {
+    void *buffer = malloc(TFS_PREAD_SIZE);
+    size_t buffer_size = 0;
+
+    char opcode = TFS_OP_CODE_PREAD;
+    ssize_t read_size;
+
+    // Create buffer
+    memcpy(buffer + buffer_size, &opcode, TFS_OPCODE_SIZE);
+    buffer_size += TFS_OPCODE_SIZE;
+    memcpy(buffer + buffer_size, &session_id, TFS_SESSIONID_SIZE);
+    buffer_size += TFS_SESSIONID_SIZE;
+    memcpy(buffer + buffer_size, &fhandle, TFS_FHANDLE_SIZE);
+    buffer_size += TFS_FHANDLE_SIZE;
+    memcpy(buffer + buffer_size, &offset, TFS_OFFSET_SIZE);
+    buffer_size += TFS_OFFSET_SIZE;
+    memcpy(buffer + buffer_size, &len, TFS_LEN_SIZE);
+    buffer_size += TFS_LEN_SIZE;
+
+    // Write and read the pipe
+    if (write_on_pipe(buffer, buffer_size) == -1)
+        return -1;
+    free(buffer);
+    if (read(fclient, &read_size, TFS_PREAD_RETURN_SIZE) == -1)
+        return -1;
+    // Only the size comes back on error
+    if (read_size > 0 && read(fclient, read_buffer, sizeof(char[read_size])) == -1)
+        return -1;
+
+    return read_size;
+}
+
+
+off_t tfs_lseek(int fhandle, off_t offset, int whence) {
+    void *buffer = malloc(TFS_LSEEK_SIZE);
+    size_t buffer_size = 0;
+
+    char opcode = TFS_OP_CODE_LSEEK;
+    off_t return_offset;
+
+    // Create buffer
+    memcpy(buffer + buffer_size, &opcode, TFS_OPCODE_SIZE);
+    buffer_size += TFS_OPCODE_SIZE;
+    memcpy(buffer + buffer_size, &session_id, TFS_SESSIONID_SIZE);
+    buffer_size += TFS_SESSIONID_SIZE;
+    memcpy(buffer + buffer_size, &fhandle, TFS_FHANDLE_SIZE);
+    buffer_size += TFS_FHANDLE_SIZE;
+    memcpy(buffer + buffer_size, &offset, TFS_OFFSET_SIZE);
+    buffer_size += TFS_OFFSET_SIZE;
+    memcpy(buffer + buffer_size, &whence, TFS_WHENCE_SIZE);
+    buffer_size += TFS_WHENCE_SIZE;
+
+    // Write and read the pipe
+    if (write_on_pipe(buffer, buffer_size) == -1)
+        return -1;
+    free(buffer);
+    if (read(fclient, &return_offset, TFS_LSEEK_RETURN_SIZE) == -1)
+        return -1;
+
+    return return_offset;
+}
+
+int tfs_fsync(int fhandle) {
+    void *buffer = malloc(TFS_FSYNC_SIZE);
+    size_t buffer_size = 0;
+
+    char opcode = TFS_OP_CODE_FSYNC;
+    int return_value;
+
+    // Create buffer
+    memcpy(buffer + buffer_size, &opcode, TFS_OPCODE_SIZE);
+    buffer_size += TFS_OPCODE_SIZE;
+    memcpy(buffer + buffer_size, &session_id, TFS_SESSIONID_SIZE);
+    buffer_size += TFS_SESSIONID_SIZE;
+    memcpy(buffer + buffer_size, &fhandle, TFS_FHANDLE_SIZE);
+    buffer_size += TFS_FHANDLE_SIZE;
+
+    // Write and read the pipe
+    if (write_on_pipe(buffer, buffer_size) == -1)
+        return -1;
+    free(buffer);
+    if (read(fclient, &return_value, TFS_FSYNC_RETURN_SIZE) == -1)
+        return -1;
+
+    return return_value;
+}
+
+int tfs_syncfs() {
+    void *buffer = malloc(TFS_SYNCFS_SIZE);
+    size_t buffer_size = 0;
+
+    char opcode = TFS_OP_CODE_SYNCFS;
+    int return_value;
+
+    // Create buffer
+    memcpy(buffer + buffer_size, &opcode, TFS_OPCODE_SIZE);
+    buffer_size += TFS_OPCODE_SIZE;
+    memcpy(buffer + buffer_size, &session_id, TFS_SESSIONID_SIZE);
+    buffer_size += TFS_SESSIONID_SIZE;
+
+    // Write and read the pipe
+    if (write_on_pipe(buffer, buffer_size) == -1)
+        return -1;
+    free(buffer);
+    if (read(fclient, &return_value, TFS_SYNCFS_RETURN_SIZE) == -1)
+        return -1;
+
+    return return_value;
+}
+
 int tfs_shutdown_after_all_closed() {
     void *buffer = malloc(TFS_SHUTDOWN_SIZE);
     size_t buffer_size = 0;
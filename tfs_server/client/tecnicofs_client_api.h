@@ -3,6 +3,7 @@
 
 #include "common/common.h"
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /* data size (for request's buffer allocation ) */
 enum {
@@ -12,7 +13,12 @@ enum {
     TFS_CLOSE_SIZE = TFS_OPCODE_SIZE + TFS_SESSIONID_SIZE + TFS_FHANDLE_SIZE,
     TFS_WRITE_SIZE = TFS_OPCODE_SIZE + TFS_SESSIONID_SIZE + TFS_FHANDLE_SIZE + TFS_LEN_SIZE,
     TFS_READ_SIZE = TFS_OPCODE_SIZE + TFS_SESSIONID_SIZE + TFS_FHANDLE_SIZE + TFS_LEN_SIZE,
-    TFS_SHUTDOWN_SIZE = TFS_OPCODE_SIZE + TFS_SESSIONID_SIZE
+    TFS_SHUTDOWN_SIZE = TFS_OPCODE_SIZE + TFS_SESSIONID_SIZE,
+    TFS_PWRITE_SIZE = TFS_WRITE_SIZE + TFS_OFFSET_SIZE,
+    TFS_PREAD_SIZE = TFS_READ_SIZE + TFS_OFFSET_SIZE,
+    TFS_LSEEK_SIZE = TFS_OPCODE_SIZE + TFS_SESSIONID_SIZE + TFS_FHANDLE_SIZE + TFS_OFFSET_SIZE + TFS_WHENCE_SIZE,
+    TFS_FSYNC_SIZE = TFS_OPCODE_SIZE + TFS_SESSIONID_SIZE + TFS_FHANDLE_SIZE,
+    TFS_SYNCFS_SIZE = TFS_OPCODE_SIZE + TFS_SESSIONID_SIZE
 };
 
 /*
@@ -83,6 +89,80 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/* Writes the contents of several buffers, in order, to an open file, as a
+ * single tfs_write (one request) of their concatenation
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- iov: the buffers (each a base address and a length)
+ * 	- iovcnt: the number of buffers
+ *
+ * Returns the number of bytes that were written, or -1 in case of error.
+ */
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt);
+
+/* Reads from an open file into several buffers, filling each in order
+ * before the next, as a single tfs_read (one request) of their total length
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- iov: the buffers (each a base address and a length)
+ * 	- iovcnt: the number of buffers
+ *
+ * Returns the number of bytes that were copied from the file to the buffers,
+ * or -1 in case of error.
+ */
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt);
+
+/* Writes to an open file at the given offset, neither using nor moving the
+ * file's offset
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- buffer containing the contents to write
+ * 	- length of the contents (in bytes)
+ * 	- offset in the file where the write starts
+ *
+ * Returns the number of bytes that were written, or -1 in case of error.
+ */
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, off_t offset);
+
+/* Reads from an open file at the given offset, neither using nor moving the
+ * file's offset
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- destination buffer
+ * 	- length of the buffer
+ * 	- offset in the file where the read starts
+ *
+ * Returns the number of bytes that were copied from the file to the buffer
+ * (0 at or past the end of the file), or -1 in case of error.
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, off_t offset);
+
+/* Moves the offset of an open file
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- offset, relative to where whence says
+ * 	- whence: SEEK_SET, SEEK_CUR or SEEK_END
+ *
+ * Returns the new offset, or -1 in case of error.
+ */
+off_t tfs_lseek(int fhandle, off_t offset, int whence);
+
+/* Makes the data and metadata of an open file durable on the server, along
+ * with every other change made so far. Syncs from several sessions at once
+ * share one device flush
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fsync(int fhandle);
+
+/* Makes every change made so far to the server's file system durable
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_syncfs();
+
 /*
  * Orders TecnicoFS server to wait until no file is open and then shutdown
  * Returns 0 if successful, -1 otherwise.
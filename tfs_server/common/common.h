@@ -20,7 +20,12 @@ enum {
     TFS_OP_CODE_CLOSE = 4,
     TFS_OP_CODE_WRITE = 5,
     TFS_OP_CODE_READ = 6,
-    TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED = 7
+    TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED = 7,
+    TFS_OP_CODE_PWRITE = 8,
+    TFS_OP_CODE_PREAD = 9,
+    TFS_OP_CODE_LSEEK = 10,
+    TFS_OP_CODE_FSYNC = 11,
+    TFS_OP_CODE_SYNCFS = 12
 };
 
 /* data size (for client-server requests) */
@@ -31,7 +36,9 @@ enum {
     TFS_NAME_SIZE = sizeof(char[40]),
     TFS_FLAGS_SIZE = sizeof(int),
     TFS_FHANDLE_SIZE = sizeof(int),
-    TFS_LEN_SIZE = sizeof(size_t)
+    TFS_LEN_SIZE = sizeof(size_t),
+    TFS_OFFSET_SIZE = sizeof(off_t),
+    TFS_WHENCE_SIZE = sizeof(int)
 };
 
 /* return requests size */
@@ -42,7 +49,12 @@ enum {
     TFS_CLOSE_RETURN_SIZE = sizeof(int),
     TFS_WRITE_RETURN_SIZE = sizeof(ssize_t),
     TFS_READ_RETURN_SIZE = sizeof(ssize_t),
-    TFS_SHUTDOWN_RETURN_SIZE = sizeof(int)
+    TFS_SHUTDOWN_RETURN_SIZE = sizeof(int),
+    TFS_PWRITE_RETURN_SIZE = sizeof(ssize_t),
+    TFS_PREAD_RETURN_SIZE = sizeof(ssize_t),
+    TFS_LSEEK_RETURN_SIZE = sizeof(off_t),
+    TFS_FSYNC_RETURN_SIZE = sizeof(int),
+    TFS_SYNCFS_RETURN_SIZE = sizeof(int)
 };
 
 #endif /* COMMON_H */
\ No newline at end of file
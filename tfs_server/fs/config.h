@@ -4,12 +4,95 @@
 /* FS root inode number */
 #define ROOT_DIR_INUM (0)
 
+/* Default volume geometry and limits (see tfs_params_t) */
 #define BLOCK_SIZE (1024)
 #define DATA_BLOCKS (1024)
 #define INODE_TABLE_SIZE (50)
 #define MAX_OPEN_FILES (20)
+
+/* Part of the directory entry layout and of the client protocol, so it
+ * stays fixed */
 #define MAX_FILE_NAME (40)
 
 #define DELAY (5000)
 
+/* Extents kept inside the i-node before spilling to extent blocks */
+#define INODE_EXTENTS (8)
+
+/* I-nodes taken into use at a time, as the i-node table fills */
+#define INODE_CHUNK (64)
+
+/* Per-thread allocation magazines: slots, and blocks or i-nodes each one
+ * holds at most */
+#define MAGAZINE_SLOTS (64)
+#define MAGAZINE_SIZE (32)
+
+/* Locks guarding the words of the free block map */
+#define BLOCK_MAP_STRIPES (64)
+
+/* Bits of a file handle that index the open file table (the rest carry
+ * the slot's generation), which bounds the number of open files */
+#define OPEN_FILE_INDEX_BITS (20)
+
+/* Size of the metadata journal kept in a volume image */
+#define JOURNAL_BLOCKS (128)
+/* Threads replaying the journal when an image is attached */
+#define JOURNAL_REPLAY_THREADS (4)
+
+/* Dentry cache: buckets of (directory, name) pairs, and pairs per bucket */
+#define DENTRY_CACHE_BUCKETS (1024)
+#define DENTRY_CACHE_WAYS (4)
+
+/* Directories: load (percent of slots used) past which a bucket is split,
+ * and most blocks mapped at once as they grow */
+#define DIR_MAX_LOAD (75)
+#define DIR_GROW_MAX_BLOCKS (1024)
+
+/* Most bytes of a file tfs_copy_to_external_fs maps at a time */
+#define EXPORT_CHUNK (1 << 20)
+
+/* Imports: threads filling the blocks of a file, least bytes each one
+ * fills, and most files whose metadata is committed together */
+#define IMPORT_THREADS (4)
+#define IMPORT_CHUNK (1 << 20)
+#define IMPORT_BATCH (64)
+
+/* Block cache: blocks held in memory by default, shards, and share (in
+ * percent) of each shard's blocks that first-time blocks take at most and
+ * that evicted ones are remembered for */
+#define BLOCK_CACHE_SLOTS (4096)
+#define BLOCK_CACHE_SHARDS (16)
+#define BLOCK_CACHE_IN_PERCENT (25)
+#define BLOCK_CACHE_GHOST_PERCENT (50)
+
+/* Read-ahead: window (in blocks) opened by a sequential read, largest it
+ * grows to, requests waiting at most and threads serving them */
+#define READ_AHEAD_MIN (4)
+#define READ_AHEAD_MAX (64)
+#define READ_AHEAD_QUEUE (256)
+#define READ_AHEAD_THREADS (4)
+
+/* Block devices: most blocks fetched with one batch of reads, alignment of
+ * O_DIRECT transfers, and io_uring rings (shared by all threads) and entries
+ * in each */
+#define DEVICE_BATCH (64)
+#define DIRECT_IO_ALIGN (512)
+#define URING_RINGS (4)
+#define URING_ENTRIES (64)
+
+/* Write-back: flusher threads (each one covering a share of the data
+ * blocks), how often they wake up (ms), age (ms) past which a dirty block is
+ * written back, share (percent) of the block cache dirty past which the
+ * flushers write back every dirty block and past which writers write them
+ * back themselves, and most blocks written with one request */
+#define WRITEBACK_THREADS (2)
+#define WRITEBACK_INTERVAL_MS (50)
+#define WRITEBACK_AGE_MS (500)
+#define WRITEBACK_DIRTY_PERCENT (10)
+#define WRITEBACK_DIRTY_MAX_PERCENT (40)
+#define WRITEBACK_MAX_RUN (256)
+
+/* Smallest geometry accepted */
+#define MIN_BLOCK_SIZE (256)
+#define MIN_JOURNAL_BLOCKS (16)
 #endif // CONFIG_H
@@ -4,7 +4,34 @@
 #include "common/common.h"
 #include "config.h"
 #include "state.h"
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+
+/*
+ * Part of a file mapped by tfs_read_map: its bytes, in place in the file's
+ * blocks
+ */
+typedef struct {
+    void const *ts_data;
+    size_t ts_len;
+} tfs_segment_t;
+
+/*
+ * Read mapping of part of a file (see tfs_read_map)
+ */
+typedef struct {
+    tfs_segment_t *tm_segments;
+    size_t tm_count;
+    int tm_inumber;
+    range_lock_t tm_pin;
+    /* Whether the segment is a copy of bytes kept in the i-node, rather
+     * than pinned blocks */
+    bool tm_inline;
+} tfs_map_t;
 
 /*
  * Initializes tecnicofs
@@ -12,6 +39,34 @@
  */
 int tfs_init();
 
+/*
+ * Initializes tecnicofs backed by a volume image file, which is mapped into
+ * memory. An existing image is attached as is (its files are kept); a missing
+ * or empty one is created and formatted
+ * Input:
+ *  - image_path: path of the image file, or NULL for a volume that only
+ *    lives in memory (as tfs_init)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_init_image(char const *image_path);
+
+/*
+ * Returns the default parameters: the geometry in config.h, in memory
+ */
+tfs_params_t tfs_default_params();
+
+/*
+ * Initializes tecnicofs with the given parameters
+ * Input:
+ *  - params: volume image, geometry of a new volume (block size, number of
+ *    data blocks, i-nodes and journal blocks) and size of the open file
+ *    table; NULL for the defaults. An existing image keeps the geometry it
+ *    was formatted with
+ * Returns 0 if successful, -1 otherwise (including a geometry below
+ * MIN_BLOCK_SIZE or MIN_JOURNAL_BLOCKS).
+ */
+int tfs_init_params(tfs_params_t const *params);
+
 /*
  * Destroy tecnicofs
  * Returns 0 if successful, -1 otherwise.
@@ -19,20 +74,29 @@ int tfs_init();
 int tfs_destroy();
 
 /*
- * Waits until no file is open and then destroy tecnicofs
+ * Waits until no file is open and then destroy tecnicofs 
  * Returns 0 if successful, -1 otherwise.
  */
 int tfs_destroy_after_all_closed();
 
+
 /*
- * Looks for a file
- * Note: as a simplification, only a plain directory space (root directory only)
- * is supported Input:
- *  - name: absolute path name
+ * Looks for a file or directory
+ * Input:
+ *  - name: absolute path name, whose components are separated by '/' and
+ *    have at most MAX_FILE_NAME - 1 characters each
  * Returns the inumber of the file, -1 if unsuccessful
  */
 int tfs_lookup(char const *name);
 
+/*
+ * Creates a directory
+ * Input:
+ *  - path: absolute path name of the new directory, whose parent must exist
+ * Returns 0 if successful, -1 otherwise (including when the name is taken).
+ */
+int tfs_mkdir(char const *path);
+
 /*
  * Opens a file
  * Input:
@@ -51,35 +115,157 @@ int tfs_open(char const *name, int flags);
  */
 int tfs_close(int fhandle);
 
+/* Makes the data and metadata of an open file durable, along with every
+ * other change made so far (with write-back, those are left in memory and
+ * written back later). Concurrent calls share one device flush
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fsync(int fhandle);
+
+/* Makes every change made so far to the file system durable, as tfs_fsync
+ * does
+ * 	Returns 0 if successful, -1 otherwise.
+ */
+int tfs_syncfs();
+
 /* Writes to an open file, starting at the current offset
  * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
  * 	- buffer containing the contents to write
  * 	- length of the contents (in bytes)
- * Returns the number of bytes that were written (can be lower than
- * 'len' if the maximum file size is exceeded), or -1 in case of error
+ * 	Returns the number of bytes that were written (can be lower than
+ * 	'len' if the maximum file size is exceeded), or -1 in case of error
  */
 ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
 
 /* Reads from an open file, starting at the current offset
- * Input:
+ * * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
  * 	- destination buffer
  * 	- length of the buffer
- * Returns the number of bytes that were copied from the file to the buffer
- * (can be lower than 'len' if the file size was reached), or -1 in case of
+ * 	Returns the number of bytes that were copied from the file to the buffer
+ * 	(can be lower than 'len' if the file size was reached), or -1 in case of
  * error
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/* Writes the contents of several buffers, in order, to an open file, as a
+ * single tfs_write of their concatenation
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- iov: the buffers (each a base address and a length)
+ * 	- iovcnt: the number of buffers
+ * 	Returns the number of bytes that were written, or -1 in case of error
+ * 	(including buffers whose total length exceeds SSIZE_MAX)
+ */
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt);
+
+/* Reads from an open file into several buffers, filling each in order
+ * before the next, as a single tfs_read of their total length
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- iov: the buffers (each a base address and a length)
+ * 	- iovcnt: the number of buffers
+ * 	Returns the number of bytes that were copied from the file to the
+ * 	buffers, or -1 in case of error
+ */
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt);
+
+/* Reads from an open file, starting at the current offset, without copying:
+ * the bytes are handed out where they are, as segments of block memory in
+ * file order. The blocks are pinned until tfs_read_unmap, which holds off
+ * truncating the file and writing in place to them (so the thread holding
+ * the mapping must not do either); writes that grow the file do not wait
+ * for the pins, and change the mapped bytes they cover.
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- len: how many bytes to map
+ * 	- map: where to store the mapping, which must stay in place until it
+ * 	  is unmapped
+ * 	Returns the number of bytes mapped (can be lower than 'len' if the file
+ * 	size was reached), or -1 in case of error. Unless -1, the mapping must
+ * 	be given back with tfs_read_unmap, even if empty
+ */
+ssize_t tfs_read_map(int fhandle, size_t len, tfs_map_t *map);
+
+/* Gives back a mapping made by tfs_read_map, unpinning its blocks
+ * Input:
+ * 	- map: the mapping
+ * 	Returns 0 if successful, -1 otherwise (the mapping was not held)
+ */
+int tfs_read_unmap(tfs_map_t *map);
+
+/* Writes to an open file at the given offset, neither using nor moving the
+ * handle's offset (nor its append mode)
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- buffer containing the contents to write
+ * 	- length of the contents (in bytes)
+ * 	- offset in the file where the write starts (past the end of the file
+ * 	  leaves a gap)
+ * 	Returns the number of bytes that were written, or -1 in case of error
+ */
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, off_t offset);
+
+/* Reads from an open file at the given offset, neither using nor moving the
+ * handle's offset
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- destination buffer
+ * 	- length of the buffer
+ * 	- offset in the file where the read starts
+ * 	Returns the number of bytes that were copied from the file to the buffer
+ * 	(0 at or past the end of the file), or -1 in case of error
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, off_t offset);
+
+/* Moves the offset of an open file
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- offset, relative to where whence says
+ * 	- whence: SEEK_SET (the start of the file), SEEK_CUR (the current
+ * 	  offset) or SEEK_END (the end of the file)
+ * 	Returns the new offset, or -1 in case of error (including an offset
+ * 	before the start of the file)
+ */
+off_t tfs_lseek(int fhandle, off_t offset, int whence);
+
 /* Copies the contents of a file that exists in TecnicoFS to the contents
  * of another file in the OS' file system tree (outside TecnicoFS).
- * Input:
+ * Devolve 0 em caso de sucesso, -1 em caso de erro.
+ * * Input:
  *      - path name of the source file (from TecnicoFS)
- *      - path name of the destination file (in the main file system), which
- *        is created it needed, and overwritten if it already exists
- * Returns 0 if successful, -1 otherwise.
- */
+ *      - path name of the destination file (in the main file system), which 
+ *.       is created it needed, and overwritten if it already exists
+ *.     Returns 0 if successful, -1 otherwise.
+*/ 
 int tfs_copy_to_external_fs(char const *source_path, char const *dest_path);
 
+/* Copies the contents of a file in the OS' file system tree (outside
+ * TecnicoFS) to a file in TecnicoFS, all of whose blocks are allocated at
+ * once and filled by several threads
+ * Input:
+ *      - path name of the source file (in the main file system)
+ *      - path name of the destination file (in TecnicoFS), which is created
+ *        if needed, and overwritten if it already exists
+ *      Returns 0 if successful, -1 otherwise.
+ */
+int tfs_copy_from_external_fs(char const *source_path, char const *dest_path);
+
+/* Copies a directory tree of the OS' file system (outside TecnicoFS) into
+ * TecnicoFS: its regular files (see tfs_copy_from_external_fs) and its
+ * subdirectories, recursively. The metadata of many files is made durable
+ * at once, so the tree loads in few journal commits
+ * Input:
+ *      - path name of the source directory (in the main file system)
+ *      - path name of the destination directory (in TecnicoFS), created if
+ *        needed; files already in it are overwritten
+ *      Returns 0 if successful, -1 otherwise (when the copy may have been
+ *      left halfway).
+ */
+int tfs_copy_tree_from_external_fs(char const *source_dir,
+                                   char const *dest_dir);
+
 #endif // OPERATIONS_H
@@ -39,9 +39,11 @@ int main(int argc, char **argv) {
 
     // Starting tfs_server
     char *pipename = argv[1];
+    // Optional volume image, kept across restarts
+    char *image_path = argc > 2 ? argv[2] : NULL;
     printf("Starting TecnicoFS server with pipe called %s\n", pipename);
 
-    server_init(&receiver_thread, worker_thread, pipename);
+    server_init(&receiver_thread, worker_thread, pipename, image_path);
 
     // Wait for signal to shutdown the server
     lock_mutex(&server_lock);
@@ -106,6 +108,21 @@ void *serverPipeReader(void* arg){
             case TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED:
                 read_shutdown(fserver);
             break;
+            case TFS_OP_CODE_PWRITE:
+                read_pwrite(fserver);
+            break;
+            case TFS_OP_CODE_PREAD:
+                read_pread(fserver);
+            break;
+            case TFS_OP_CODE_LSEEK:
+                read_lseek(fserver);
+            break;
+            case TFS_OP_CODE_FSYNC:
+                read_fsync(fserver);
+            break;
+            case TFS_OP_CODE_SYNCFS:
+                read_syncfs(fserver);
+            break;
             // Bad opcode
             default:
                 exit(EXIT_FAILURE);
@@ -160,6 +177,21 @@ void *requestHandler(void* arg){
             case TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED:
                 write_shutdown(fclient);
             break;
+            case TFS_OP_CODE_PWRITE:
+                write_pwrite(fclient, buffer);
+            break;
+            case TFS_OP_CODE_PREAD:
+                write_pread(fclient, buffer);
+            break;
+            case TFS_OP_CODE_LSEEK:
+                write_lseek(fclient, buffer);
+            break;
+            case TFS_OP_CODE_FSYNC:
+                write_fsync(fclient, buffer);
+            break;
+            case TFS_OP_CODE_SYNCFS:
+                write_syncfs(fclient);
+            break;
             default:
                 //
             break;
@@ -178,7 +210,7 @@ void *requestHandler(void* arg){
 }
 
 
-void server_init(pthread_t *receiver_thread, pthread_t worker_thread[MAX_SESSIONS_AMOUNT], char *pipename){
+void server_init(pthread_t *receiver_thread, pthread_t worker_thread[MAX_SESSIONS_AMOUNT], char *pipename, char *image_path){
     // Initialize global mutexes and cond
     if(pthread_mutex_init(&client_session_table_lock, NULL) == -1)
         exit(EXIT_FAILURE);
@@ -200,7 +232,7 @@ void server_init(pthread_t *receiver_thread, pthread_t worker_thread[MAX_SESSION
     }
 
     // Start file system
-    if (tfs_init() == -1)
+    if (tfs_init_image(image_path) == -1)
         exit(EXIT_FAILURE);
 
     // Initialize client_pipe_table
@@ -485,6 +517,169 @@ void write_read(int fd, buffer_entry *buffer){
 }
 
 
+
+void read_pwrite(int fd){
+    int session_id;
+    // Read Server pipe
+    read_from_pipe(fd, &session_id, TFS_SESSIONID_SIZE);
+    // Lock Buffer
+    lock_mutex(&buffer_lock_table[session_id]);
+    // Get buffer
+    buffer_entry *buffer = &buffer_entry_table[session_id][buffers_counter[session_id]];
+    // Store data in buffer
+    buffer->opcode = TFS_OP_CODE_PWRITE;
+    read_from_pipe(fd, &buffer->fhandle, TFS_FHANDLE_SIZE);
+    read_from_pipe(fd, &buffer->offset, TFS_OFFSET_SIZE);
+    read_from_pipe(fd, &buffer->len, TFS_LEN_SIZE);
+    buffer->buffer = malloc(sizeof(char[buffer->len]));
+    read_from_pipe(fd, buffer->buffer, sizeof(char[buffer->len]));
+    increment_buffer_counter(session_id);
+    // Signal thread
+    signal_cond(&buffer_cond_table[session_id]);
+    // Unlock buffer
+    unlock_mutex(&buffer_lock_table[session_id]);
+    return;
+}
+
+
+void write_pwrite(int fd, buffer_entry *buffer){
+    // Write on tfs, at the given offset
+    ssize_t return_len = tfs_pwrite(buffer->fhandle, buffer->buffer, buffer->len, buffer->offset);
+    free(buffer->buffer);
+    // Write return on pipe
+    write_on_pipe(fd, &return_len, TFS_PWRITE_RETURN_SIZE);
+    return;
+}
+
+
+void read_pread(int fd){
+    int session_id;
+    // Read Server pipe
+    read_from_pipe(fd, &session_id, TFS_SESSIONID_SIZE);
+    // Lock Buffer
+    lock_mutex(&buffer_lock_table[session_id]);
+    // Get buffer
+    buffer_entry *buffer = &buffer_entry_table[session_id][buffers_counter[session_id]];
+    // Store data in buffer
+    buffer->opcode = TFS_OP_CODE_PREAD;
+    read_from_pipe(fd, &buffer->fhandle, TFS_FHANDLE_SIZE);
+    read_from_pipe(fd, &buffer->offset, TFS_OFFSET_SIZE);
+    read_from_pipe(fd, &buffer->len, TFS_LEN_SIZE);
+    increment_buffer_counter(session_id);
+    // Signal thread
+    signal_cond(&buffer_cond_table[session_id]);
+    // Unlock buffer
+    unlock_mutex(&buffer_lock_table[session_id]);
+    return;
+}
+
+
+void write_pread(int fd, buffer_entry *buffer){
+    //Buffer to store read
+    char *read_buffer = malloc(sizeof(char[buffer->len]));
+    ssize_t return_len = tfs_pread(buffer->fhandle, read_buffer, buffer->len, buffer->offset);
+    // Only the size goes back on error
+    size_t data_len = return_len > 0 ? (size_t)return_len : 0;
+    // Buffer to store message for pipe
+    void *return_buffer = malloc(TFS_PREAD_RETURN_SIZE + data_len);
+    // Storing message in buffer
+    memcpy(return_buffer, &return_len, TFS_PREAD_RETURN_SIZE);
+    memcpy(return_buffer + TFS_PREAD_RETURN_SIZE, read_buffer, data_len);
+    // Write on pipe
+    write_on_pipe(fd, return_buffer, TFS_PREAD_RETURN_SIZE + data_len);
+    free(read_buffer);
+    free(return_buffer);
+    return;
+}
+
+
+void read_lseek(int fd){
+    int session_id;
+    // Read Server pipe
+    read_from_pipe(fd, &session_id, TFS_SESSIONID_SIZE);
+    // Lock Buffer
+    lock_mutex(&buffer_lock_table[session_id]);
+    // Get buffer
+    buffer_entry *buffer = &buffer_entry_table[session_id][buffers_counter[session_id]];
+    // Store data in buffer
+    buffer->opcode = TFS_OP_CODE_LSEEK;
+    read_from_pipe(fd, &buffer->fhandle, TFS_FHANDLE_SIZE);
+    read_from_pipe(fd, &buffer->offset, TFS_OFFSET_SIZE);
+    read_from_pipe(fd, &buffer->whence, TFS_WHENCE_SIZE);
+    increment_buffer_counter(session_id);
+    // Signal thread
+    signal_cond(&buffer_cond_table[session_id]);
+    // Unlock buffer
+    unlock_mutex(&buffer_lock_table[session_id]);
+    return;
+}
+
+
+void write_lseek(int fd, buffer_entry *buffer){
+    // Move the file's offset
+    off_t return_offset = tfs_lseek(buffer->fhandle, buffer->offset, buffer->whence);
+    // Write return on pipe
+    write_on_pipe(fd, &return_offset, TFS_LSEEK_RETURN_SIZE);
+    return;
+}
+
+
+void read_fsync(int fd){
+    int session_id;
+    // Read Server pipe
+    read_from_pipe(fd, &session_id, TFS_SESSIONID_SIZE);
+    // Lock Buffer
+    lock_mutex(&buffer_lock_table[session_id]);
+    // Get buffer
+    buffer_entry *buffer = &buffer_entry_table[session_id][buffers_counter[session_id]];
+    // Store data in buffer
+    buffer->opcode = TFS_OP_CODE_FSYNC;
+    read_from_pipe(fd, &buffer->fhandle, TFS_FHANDLE_SIZE);
+    increment_buffer_counter(session_id);
+    // Signal thread
+    signal_cond(&buffer_cond_table[session_id]);
+    // Unlock buffer
+    unlock_mutex(&buffer_lock_table[session_id]);
+    return;
+}
+
+
+void write_fsync(int fd, buffer_entry *buffer){
+    // Make the file durable, sharing the flush with other sessions' syncs
+    int return_value = tfs_fsync(buffer->fhandle);
+    // Write return on pipe
+    write_on_pipe(fd, &return_value, TFS_FSYNC_RETURN_SIZE);
+    return;
+}
+
+
+void read_syncfs(int fd){
+    int session_id;
+    // Read Server pipe
+    read_from_pipe(fd, &session_id, TFS_SESSIONID_SIZE);
+    // Lock Buffer
+    lock_mutex(&buffer_lock_table[session_id]);
+    // Get buffer
+    buffer_entry *buffer = &buffer_entry_table[session_id][buffers_counter[session_id]];
+    // Store data in buffer
+    buffer->opcode = TFS_OP_CODE_SYNCFS;
+    increment_buffer_counter(session_id);
+    // Signal thread
+    signal_cond(&buffer_cond_table[session_id]);
+    // Unlock buffer
+    unlock_mutex(&buffer_lock_table[session_id]);
+    return;
+}
+
+
+void write_syncfs(int fd){
+    // Make the whole file system durable
+    int return_value = tfs_syncfs();
+    // Write return on pipe
+    write_on_pipe(fd, &return_value, TFS_SYNCFS_RETURN_SIZE);
+    return;
+}
+
 void read_shutdown(int fd){
     int session_id;
     // Read Server pipe
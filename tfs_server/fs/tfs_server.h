@@ -22,6 +22,8 @@ typedef struct {
     int fhandle;
     int flags;
     size_t len;
+    off_t offset;
+    int whence;
     char *buffer;
 } buffer_entry;
 
@@ -36,8 +38,9 @@ void *requestHandler(void* arg);
  *      - receiver_thread
  *      - array with worker threads
  *      - server pipename
+ *      - path of the volume image (NULL to keep the file system in memory)
  */
-void server_init(pthread_t *receiver_thread, pthread_t worker_thread[MAX_SESSIONS_AMOUNT], char *pipename);
+void server_init(pthread_t *receiver_thread, pthread_t worker_thread[MAX_SESSIONS_AMOUNT], char *pipename, char *image_path);
 
 /* Wait for all threads to finish and then destroys server
  * Input:
@@ -126,6 +129,70 @@ void read_read(int fd);
  */
 void write_read(int fd, buffer_entry *buffer);
 
+/* Reads pwrite instruction from pipe
+ * Input:
+ *      - pipe file handle
+ */
+void read_pwrite(int fd);
+
+/* Performs tfs_pwrite and writes return value of pwrite instruction to pipe
+ * Input:
+ *      - file handle
+ *      - buffer
+ */
+void write_pwrite(int fd, buffer_entry *buffer);
+
+/* Reads pread instruction from pipe
+ * Input:
+ *      - pipe file handle
+ */
+void read_pread(int fd);
+
+/* Performs tfs_pread and writes return value of pread instruction to pipe
+ * Input:
+ *      - file handle
+ *      - buffer
+ */
+void write_pread(int fd, buffer_entry *buffer);
+
+/* Reads lseek instruction from pipe
+ * Input:
+ *      - pipe file handle
+ */
+void read_lseek(int fd);
+
+/* Performs tfs_lseek and writes return value of lseek instruction to pipe
+ * Input:
+ *      - file handle
+ *      - buffer
+ */
+void write_lseek(int fd, buffer_entry *buffer);
+
+/* Reads fsync instruction from pipe
+ * Input:
+ *      - pipe file handle
+ */
+void read_fsync(int fd);
+
+/* Performs tfs_fsync and writes return value of fsync instruction to pipe
+ * Input:
+ *      - file handle
+ *      - buffer
+ */
+void write_fsync(int fd, buffer_entry *buffer);
+
+/* Reads syncfs instruction from pipe
+ * Input:
+ *      - pipe file handle
+ */
+void read_syncfs(int fd);
+
+/* Performs tfs_syncfs and writes return value of syncfs instruction to pipe
+ * Input:
+ *      - client pipe file descriptor
+ */
+void write_syncfs(int fd);
+
 /* Reads shutdown instruction from pipe
  * Input:
  *      - pipe file handle
@@ -0,0 +1,49 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  This test checks positional reads and writes and seeking through the
+    server: pread and pwrite leave the file's offset alone, and lseek
+    moves it. */
+
+int main(int argc, char **argv) {
+
+    char *path = "/positional";
+    char buffer[40];
+
+    int f;
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+
+    assert(tfs_mount(argv[1], argv[2]) == 0);
+
+    f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+
+    assert(tfs_write(f, "0123456789", 10) == 10);
+    assert(tfs_pwrite(f, "ab", 2, 4) == 2);
+    assert(tfs_pread(f, buffer, 4, 3) == 4);
+    assert(memcmp(buffer, "3ab6", 4) == 0);
+    assert(tfs_pread(f, buffer, sizeof(buffer), 10) == 0);
+    assert(tfs_pread(f, buffer, 1, -1) == -1);
+
+    assert(tfs_lseek(f, 0, SEEK_CUR) == 10);
+    assert(tfs_lseek(f, -2, SEEK_END) == 8);
+    assert(tfs_read(f, buffer, sizeof(buffer) - 1) == 2);
+    assert(memcmp(buffer, "89", 2) == 0);
+    assert(tfs_lseek(f, -1, SEEK_SET) == -1);
+
+    assert(tfs_close(f) != -1);
+    assert(tfs_lseek(f, 0, SEEK_SET) == -1);
+
+    assert(tfs_unmount() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
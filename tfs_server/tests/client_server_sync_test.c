@@ -0,0 +1,44 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  This test checks syncing through the server: tfs_fsync makes an open
+    file durable and refuses a closed handle, and tfs_syncfs makes the
+    whole file system durable. */
+
+int main(int argc, char **argv) {
+
+    char *path = "/synced";
+    char buffer[40];
+
+    int f;
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+
+    assert(tfs_mount(argv[1], argv[2]) == 0);
+
+    f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+
+    assert(tfs_write(f, "durable", 7) == 7);
+    assert(tfs_fsync(f) == 0);
+    assert(tfs_write(f, " data", 5) == 5);
+    assert(tfs_syncfs() == 0);
+    assert(tfs_pread(f, buffer, sizeof(buffer), 0) == 12);
+    assert(memcmp(buffer, "durable data", 12) == 0);
+
+    assert(tfs_close(f) != -1);
+    assert(tfs_fsync(f) == -1);
+    assert(tfs_syncfs() == 0);
+
+    assert(tfs_unmount() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
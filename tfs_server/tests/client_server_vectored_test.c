@@ -0,0 +1,67 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  This test checks vectored reads and writes through the server: a
+    header and a payload go in one request, and a read is scattered
+    across several buffers. */
+
+int main(int argc, char **argv) {
+
+    char *path = "/vectored";
+    char header[] = "HDR:";
+    char payload[100];
+    char part1[3], part2[50], part3[100];
+
+    int f;
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(payload); i++) {
+        payload[i] = (char)('a' + i % 26);
+    }
+
+    assert(tfs_mount(argv[1], argv[2]) == 0);
+
+    f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+
+    struct iovec out[] = {
+        {.iov_base = header, .iov_len = strlen(header)},
+        {.iov_base = NULL, .iov_len = 0},
+        {.iov_base = payload, .iov_len = sizeof(payload)},
+    };
+    assert(tfs_writev(f, out, 3) == strlen(header) + sizeof(payload));
+    assert(tfs_writev(f, out, -1) == -1);
+
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open(path, 0);
+    assert(f != -1);
+
+    struct iovec in[] = {
+        {.iov_base = part1, .iov_len = sizeof(part1)},
+        {.iov_base = part2, .iov_len = sizeof(part2)},
+        {.iov_base = part3, .iov_len = sizeof(part3)},
+    };
+    assert(tfs_readv(f, in, 3) == strlen(header) + sizeof(payload));
+    assert(memcmp(part1, "HDR", 3) == 0);
+    assert(part2[0] == ':');
+    assert(memcmp(part2 + 1, payload, sizeof(part2) - 1) == 0);
+    assert(memcmp(part3, payload + sizeof(part2) - 1,
+                  sizeof(payload) - sizeof(part2) + 1) == 0);
+    assert(tfs_readv(f, in, 3) == 0);
+
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_unmount() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}